@@ -0,0 +1,39 @@
+#include "bundle.h"
+
+size_t bundleHeaderSize(size_t size)
+{
+    size_t result = 1;
+    for (; size > 127; size >>= 7)
+        ++result;
+
+    return result;
+}
+
+char *encodeBundleHeader(char *header, size_t size)
+{
+    for (; size > 127; size >>= 7)
+        *header++ = char((size & 127) | 128);
+
+    *header++ = char(size);
+    return header;
+}
+
+int decodeBundleHeader(size_t& size, const char *&next, const char *end)
+{
+    size_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (next == end || size_t(shift) >= sizeof value * 8)
+            return 1;
+
+        const unsigned char byte = *next++;
+        value |= size_t(byte & 127) << shift;
+        if (!(byte & 128))
+            break;
+    }
+
+    if (size_t(end - next) < value)
+        return 2;
+
+    size = value;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDED_BUNDLE
+#define INCLUDED_BUNDLE
+
+// Standard C
+#include <stddef.h>  // size_t
+
+// With '--bundle-usec', every message in a queue is a bundle of one or more
+// messages having the bundle's priority, each preceded by a header that is
+// its size as a varint (seven bits per byte, least significant first, the
+// high bit meaning "more").  A queue then holds several small messages in
+// each of its slots, and sending or receiving them takes one system call.
+
+// The largest header that 'encodeBundleHeader' writes.
+const size_t MAX_BUNDLE_HEADER_SIZE = (sizeof(size_t) * 8 + 6) / 7;
+
+size_t bundleHeaderSize(size_t size);
+    // Return the size of the header of a message of the specified 'size'
+    // bytes in a bundle.
+
+char *encodeBundleHeader(char *header, size_t size);
+    // Write at the specified 'header' the header of a message of the
+    // specified 'size' bytes in a bundle, and return the end of it.
+
+int decodeBundleHeader(size_t& size, const char *&next, const char *end);
+    // Load into the specified 'size' the size of the message whose header is
+    // at the specified 'next' in a bundle, and advance 'next' past the
+    // header.  Return zero on success, or a nonzero value if the header or
+    // the message after it runs past the specified 'end'.
+
+#endif
@@ -0,0 +1,123 @@
+
+#include "codec.h"
+
+// Standard C++
+#include <limits>
+
+namespace {
+
+// "00", "01", ..., "99", so that two digits are formatted at a time
+const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+const unsigned long long POWERS_OF_TEN[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+// Any number of at most this many digits fits in an 'unsigned long long'.
+const int SAFE_DIGITS = std::numeric_limits<unsigned long long>::digits10;
+
+}  // close unnamed namespace
+
+int decimalSize(unsigned long long value)
+{
+    // 1233 / 4096 is just over log10(2), so 'guess' is either the number of
+    // digits or one fewer, and the table says which.  "| 1" makes zero count
+    // as one digit, and changes no other number's digit count.
+    const unsigned long long nonzero = value | 1;
+    const int                bits    = 64 - __builtin_clzll(nonzero);
+    const int                guess   = bits * 1233 >> 12;
+
+    return guess + (nonzero >= POWERS_OF_TEN[guess]);
+}
+
+char *formatDecimal(char *end, unsigned long long value)
+{
+    while (value >= 100) {
+        const char *const pair = DIGIT_PAIRS + value % 100 * 2;
+        value /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+
+    if (value >= 10) {
+        const char *const pair = DIGIT_PAIRS + value * 2;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    else
+        *--end = char('0' + value);
+
+    return end;
+}
+
+char *appendDecimal(char *begin, unsigned long long value)
+{
+    char *const end = begin + decimalSize(value);
+    formatDecimal(end, value);
+    return end;
+}
+
+size_t parseDecimal(unsigned long long& value,
+                    const char         *begin,
+                    const char         *end)
+{
+    typedef unsigned long long Number;
+
+    // No overflow is possible in the first 'SAFE_DIGITS' digits.
+    const char *const safeEnd =
+        end - begin > SAFE_DIGITS ? begin + SAFE_DIGITS : end;
+
+    Number      result = 0;
+    const char *next   = begin;
+    for (; next != safeEnd; ++next) {
+        const unsigned digit = unsigned(*next - '0');
+        if (digit > 9)
+            break;
+
+        result = result * 10 + digit;
+    }
+
+    // Any more digits might overflow.
+    for (; next != end; ++next) {
+        const unsigned digit = unsigned(*next - '0');
+        if (digit > 9)
+            break;
+
+        if (result > (std::numeric_limits<Number>::max() - digit) / 10)
+            return 0;
+
+        result = result * 10 + digit;
+    }
+
+    value = result;
+    return next - begin;
+}
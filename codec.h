@@ -0,0 +1,37 @@
+#ifndef INCLUDED_CODEC
+#define INCLUDED_CODEC
+
+// Standard C
+#include <stddef.h>  // size_t
+
+// The integers of the text protocol (priorities, lengths, handles, and so on)
+// are unsigned and in decimal.  These functions format and parse them without
+// 'snprintf' or 'strtoull', which would consult the locale and parse a format
+// string for every message: digits are formatted two at a time from a table,
+// counted from a table of powers of ten, and parsed without checking for
+// overflow until there are enough digits that it is possible.
+
+int decimalSize(unsigned long long value);
+    // Return the number of decimal digits in the specified 'value', which is
+    // one for zero.
+
+char *formatDecimal(char *end, unsigned long long value);
+    // Write the specified 'value' in decimal into the bytes that end just
+    // before the specified 'end', and return a pointer to its first digit.
+    // The behavior is undefined unless there is room for
+    // 'decimalSize(value)' bytes before 'end'.
+
+char *appendDecimal(char *begin, unsigned long long value);
+    // Write the specified 'value' in decimal starting at the specified
+    // 'begin', and return a pointer one past its last digit.  The behavior is
+    // undefined unless there is room for 'decimalSize(value)' bytes.
+
+size_t parseDecimal(unsigned long long& value,
+                    const char         *begin,
+                    const char         *end);
+    // Load into the specified 'value' the number whose decimal digits begin
+    // at the specified 'begin', and return how many digits it has, reading no
+    // further than the specified 'end'.  Return zero if 'begin' is not a
+    // digit, or if the number does not fit in 'value'.
+
+#endif
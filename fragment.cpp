@@ -0,0 +1,176 @@
+#include "fragment.h"
+
+// POSIX
+#include <time.h>    // clock_gettime
+#include <unistd.h>  // getpid
+
+// Standard C
+#include <string.h>  // memcpy
+
+// Standard C++
+#include <utility>   // std::make_pair
+
+namespace {
+
+class MutexGuard {
+    pthread_mutex_t& mutex;
+
+    MutexGuard(const MutexGuard&);             // not copyable
+    MutexGuard& operator=(const MutexGuard&);  // not assignable
+
+  public:
+    explicit MutexGuard(pthread_mutex_t& mutex)
+    : mutex(mutex)
+    {
+        pthread_mutex_lock(&mutex);
+    }
+
+    ~MutexGuard()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+unsigned       messageCount;  // of 'newMessageId' calls, from a random start
+pthread_once_t messageCountOnce = PTHREAD_ONCE_INIT;
+
+extern "C" void startMessageCount()
+    // Start 'messageCount' at a value that differs from one process to the
+    // next, even one that reuses the process ID of another.
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // Mix the bits, so that nearby times start far apart.
+    unsigned long long seed =
+        (unsigned long long)(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+    seed ^= unsigned(getpid());
+    seed *= 0x9E3779B97F4A7C15ULL;
+    messageCount = unsigned(seed >> 32);
+}
+
+void encodeLittleEndian(char *bytes, unsigned long long value, int size)
+{
+    for (int i = 0; i < size; ++i)
+        bytes[i] = char(value >> (8 * i));
+}
+
+unsigned long long decodeLittleEndian(const char *bytes, int size)
+{
+    const unsigned char *const unsignedBytes =
+        reinterpret_cast<const unsigned char*>(bytes);
+
+    unsigned long long value = 0;
+    for (int i = 0; i < size; ++i)
+        value |= (unsigned long long)(unsignedBytes[i]) << (8 * i);
+
+    return value;
+}
+
+}  // close unnamed namespace
+
+unsigned long long newMessageId()
+{
+    pthread_once(&messageCountOnce, &startMessageCount);
+
+    const unsigned count = __atomic_fetch_add(&messageCount,
+                                              1,
+                                              __ATOMIC_RELAXED);
+    return (unsigned long long)(unsigned(getpid())) << 32 | count;
+}
+
+void encodeFragmentHeader(char               *header,
+                          unsigned long long  id,
+                          size_t              offset,
+                          size_t              total)
+{
+    encodeLittleEndian(header,      id,     8);
+    encodeLittleEndian(header + 8,  offset, 4);
+    encodeLittleEndian(header + 12, total,  4);
+}
+
+void decodeFragmentHeader(unsigned long long&  id,
+                          size_t&              offset,
+                          size_t&              total,
+                          const char          *header)
+{
+    id     = decodeLittleEndian(header,      8);
+    offset = decodeLittleEndian(header + 8,  4);
+    total  = decodeLittleEndian(header + 12, 4);
+}
+
+Reassembler::Reassembler(size_t headroom,
+                         size_t tailroom,
+                         size_t maxMessageSize,
+                         size_t maxPartial)
+: headroom(headroom)
+, tailroom(tailroom)
+, maxMessageSize(maxMessageSize)
+, maxPartial(maxPartial)
+, nextSequence(0)
+{
+    pthread_mutex_init(&mutex, 0);
+}
+
+Reassembler::~Reassembler()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+int Reassembler::add(const char         *fragment,
+                     size_t              size,
+                     std::vector<char>&  message)
+{
+    if (size < FRAGMENT_HEADER_SIZE)
+        return REASSEMBLY_INVALID;
+
+    unsigned long long id;
+    size_t             offset;
+    size_t             total;
+    decodeFragmentHeader(id, offset, total, fragment);
+
+    const size_t partSize = size - FRAGMENT_HEADER_SIZE;
+    if (total > maxMessageSize || offset > total || partSize > total - offset)
+        return REASSEMBLY_INVALID;
+
+    MutexGuard guard(mutex);
+
+    int                  rc      = REASSEMBLY_PARTIAL;
+    PartialMap::iterator partial = partials.find(id);
+    if (partial == partials.end()) {
+        // Make room by dropping the message that has waited longest.
+        if (partials.size() >= maxPartial) {
+            PartialMap::iterator oldest = partials.begin();
+            for (PartialMap::iterator it = partials.begin();
+                 it != partials.end();
+                 ++it)
+            {
+                if (it->second.sequence < oldest->second.sequence)
+                    oldest = it;
+            }
+
+            partials.erase(oldest);
+            rc = REASSEMBLY_DROPPED;
+        }
+
+        partial = partials.insert(std::make_pair(id, Partial())).first;
+        partial->second.buffer.resize(headroom + total + tailroom);
+        partial->second.received = 0;
+        partial->second.sequence = nextSequence++;
+    }
+    else if (partial->second.buffer.size() != headroom + total + tailroom)
+        return REASSEMBLY_INVALID;
+
+    Partial& assembling = partial->second;
+    memcpy(&assembling.buffer[headroom + offset],
+           fragment + FRAGMENT_HEADER_SIZE,
+           partSize);
+    assembling.received += partSize;
+
+    if (assembling.received < total)
+        return rc;
+
+    message.swap(assembling.buffer);
+    partials.erase(partial);
+    return REASSEMBLY_COMPLETE;
+}
@@ -0,0 +1,114 @@
+#ifndef INCLUDED_FRAGMENT
+#define INCLUDED_FRAGMENT
+
+// POSIX
+#include <pthread.h>  // pthread_mutex_t
+
+// Standard C
+#include <stddef.h>   // size_t
+
+// Standard C++
+#include <map>
+#include <vector>
+
+// With '--fragment', every message in a queue begins with a fragment header,
+// and a message larger than the queue's maximum message size is sent as
+// several, each having part of the message after its header.  The header is
+// the message's identifier (8 bytes), the offset of the part in the message
+// (4 bytes), and the size of the whole message (4 bytes), each little-endian.
+// A message that fits is one fragment, having offset zero.  Identifiers are
+// the sender's process ID followed by a count, so that fragments of messages
+// from different senders can be told apart however they are interleaved.
+// The count starts from a value that is random enough that a process that
+// reuses the ID of one that died doesn't reuse the identifiers of the
+// fragments that it might have left in the queue.  Only a receiver that gets
+// all of a message's fragments can put it back together.
+
+const size_t FRAGMENT_HEADER_SIZE = 16;
+
+// The largest message that the header can describe.
+const unsigned long long MAX_FRAGMENTED_SIZE = 0xFFFFFFFFULL;
+
+unsigned long long newMessageId();
+    // Return an identifier for a message that no other message sent by this
+    // process has, nor (very likely) any sent by another process, whether
+    // running or not.  This function is thread-safe.
+
+void encodeFragmentHeader(char               *header,
+                          unsigned long long  id,
+                          size_t              offset,
+                          size_t              total);
+    // Write to the specified 'header' the fragment header of the part at the
+    // specified 'offset' of the message of the specified 'total' bytes having
+    // the specified 'id'.  The behavior is undefined unless 'header' has room
+    // for 'FRAGMENT_HEADER_SIZE' bytes and 'total <= MAX_FRAGMENTED_SIZE'.
+
+void decodeFragmentHeader(unsigned long long&  id,
+                          size_t&              offset,
+                          size_t&              total,
+                          const char          *header);
+    // Load into the specified 'id', 'offset', and 'total' the values encoded
+    // in the specified fragment 'header'.  The behavior is undefined unless
+    // 'header' has 'FRAGMENT_HEADER_SIZE' bytes.
+
+class Reassembler {
+    // 'Reassembler' puts messages back together from their fragments, which
+    // may come interleaved with fragments of other messages.  Each message
+    // is assembled in a buffer of its own, with room before it and after it
+    // for the user to format the message in place.  Only so many messages
+    // can be incomplete at once; when another begins, the one that began
+    // earliest is discarded, since its sender is likely gone.  All member
+    // functions are thread-safe.
+
+    struct Partial {
+        std::vector<char>  buffer;
+        size_t             received;  // bytes of the message
+        unsigned long long sequence;  // when the message began
+    };
+
+    typedef std::map<unsigned long long, Partial> PartialMap;  // by ID
+
+    pthread_mutex_t    mutex;
+    size_t             headroom;
+    size_t             tailroom;
+    size_t             maxMessageSize;
+    size_t             maxPartial;
+    PartialMap         partials;
+    unsigned long long nextSequence;
+
+    Reassembler(const Reassembler&);             // not copyable
+    Reassembler& operator=(const Reassembler&);  // not assignable
+
+  public:
+    // Return values of 'add'.  Note that 'REASSEMBLY_COMPLETE' is zero.
+    enum {
+        REASSEMBLY_COMPLETE,
+        REASSEMBLY_PARTIAL,  // the message needs more fragments
+        REASSEMBLY_DROPPED,  // as 'PARTIAL', but another message was dropped
+        REASSEMBLY_INVALID   // the fragment's header makes no sense
+    };
+
+    Reassembler(size_t headroom,
+                size_t tailroom,
+                size_t maxMessageSize,
+                size_t maxPartial);
+        // Create a 'Reassembler' that assembles messages of up to the
+        // specified 'maxMessageSize' bytes in buffers having the specified
+        // 'headroom' bytes before the message and 'tailroom' bytes after it,
+        // and that keeps up to the specified 'maxPartial' incomplete
+        // messages.
+
+    ~Reassembler();
+
+    int add(const char         *fragment,
+            size_t              size,
+            std::vector<char>&  message);
+        // Add the specified 'size' bytes of the specified 'fragment',
+        // including its header.  If that completes its message, load the
+        // message's buffer into the specified 'message' (whose size is then
+        // the message's size plus the headroom and tailroom) and return
+        // 'REASSEMBLY_COMPLETE'.  Otherwise, return one of the other values
+        // described above.
+};
+
+#endif
@@ -0,0 +1,267 @@
+
+#include "input.h"
+
+// POSIX
+#include <errno.h>   // errno, EINTR
+#include <unistd.h>  // read
+
+// Standard C
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy, memmove
+
+// Standard C++
+#include <cassert>
+#include <limits>
+#include <new>       // std::bad_alloc
+
+#include "codec.h"
+
+namespace {
+
+bool isWhitespace(char ch)
+    // Return whether the specified 'ch' is whitespace in the wire protocol.
+{
+    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+}
+
+}  // close unnamed namespace
+
+Input::Input(int fileDescriptor, size_t initialCapacity)
+: fd(fileDescriptor)
+, buffer(static_cast<char*>(malloc(initialCapacity)))
+, capacity(initialCapacity)
+, begin(0)
+, end(0)
+, mark(0)
+, marked(false)
+, lastError(0)
+, readHook(0)
+, readHookArgument(0)
+{
+    if (!buffer)
+        throw std::bad_alloc();
+}
+
+Input::~Input()
+{
+    free(buffer);
+}
+
+int Input::fill(size_t needed)
+{
+    if (end - begin >= needed)
+        return INPUT_OK;
+
+    // 'keep' is where the bytes that must stay in the buffer begin.
+    const size_t keep = marked ? mark : begin;
+
+    if (keep == end || capacity - keep < (begin - keep) + needed) {
+        // There isn't room after the kept bytes, or there are none, and so
+        // the whole buffer can be read into.  Move them to the front of the
+        // buffer, or into a larger buffer if that's still not enough.
+        // Note that the buffer is not initialized (as a 'std::string' would
+        // be), since 'read' is about to overwrite it anyway.
+        const size_t kept = (begin - keep) + needed;
+        if (kept > capacity) {
+            size_t newCapacity = capacity * 2;
+            while (newCapacity < kept)
+                newCapacity *= 2;
+
+            char *const grown = static_cast<char*>(malloc(newCapacity));
+            if (!grown)
+                throw std::bad_alloc();
+
+            memcpy(grown, buffer + keep, end - keep);
+            free(buffer);
+            buffer   = grown;
+            capacity = newCapacity;
+        }
+        else {
+            memmove(buffer, buffer + keep, end - keep);
+        }
+
+        end   -= keep;
+        begin -= keep;
+        if (marked)
+            mark -= keep;
+    }
+
+    while (end - begin < needed) {
+        if (readHook)
+            readHook(readHookArgument);
+
+        const ssize_t rc = read(fd, buffer + end, capacity - end);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;  // interrupted by signal before reading. Retry.
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return INPUT_AGAIN;
+
+            lastError = errno;
+            return INPUT_FAILED;
+        }
+
+        if (rc == 0)
+            return INPUT_END;
+
+        end += rc;
+    }
+
+    return INPUT_OK;
+}
+
+int Input::skipWhitespace()
+{
+    for (;;) {
+        if (begin == end) {
+            if (const int rc = fill(1))
+                return rc;
+        }
+
+        if (!isWhitespace(buffer[begin]))
+            return INPUT_OK;
+
+        ++begin;
+    }
+}
+
+int Input::token(const char*& tokenBegin, size_t& tokenSize)
+{
+    if (const int rc = skipWhitespace())
+        return rc;
+
+    // The token stays unconsumed while we look for its end, so that 'fill'
+    // keeps it contiguous.  Offsets (rather than pointers) are used because
+    // 'fill' might move it.
+    size_t size = 1;
+    for (;;) {
+        if (begin + size == end) {
+            const int rc = fill(size + 1);
+            if (rc == INPUT_END)
+                break;  // the token is at the end of the input
+            if (rc)
+                return rc;
+        }
+
+        if (isWhitespace(buffer[begin + size]))
+            break;
+
+        ++size;
+    }
+
+    tokenBegin = buffer + begin;
+    tokenSize  = size;
+    begin     += size;
+    return INPUT_OK;
+}
+
+int Input::number(unsigned long long& value)
+{
+    typedef unsigned long long Number;
+
+    if (const int rc = skipWhitespace())
+        return rc;
+
+    if (unsigned(buffer[begin] - '0') > 9)
+        return INPUT_INVALID;
+
+    // Usually the whole number, and what follows it, is buffered already.
+    Number        parsed;
+    const size_t  digits = parseDecimal(parsed, buffer + begin, buffer + end);
+    if (begin + digits < end) {
+        if (!digits)
+            return INPUT_INVALID;  // too big
+
+        value  = parsed;
+        begin += digits;
+        return INPUT_OK;
+    }
+
+    // Otherwise, read one digit at a time, reading more input as necessary.
+    value = 0;
+    for (;;) {
+        if (begin == end) {
+            const int rc = fill(1);
+            if (rc == INPUT_END)
+                break;  // the number is at the end of the input
+            if (rc)
+                return rc;
+        }
+
+        const unsigned digit = unsigned(buffer[begin] - '0');
+        if (digit > 9)
+            break;
+
+        if (value > (std::numeric_limits<Number>::max() - digit) / 10)
+            return INPUT_INVALID;
+
+        value = value * 10 + digit;
+        ++begin;
+    }
+
+    return INPUT_OK;
+}
+
+int Input::ignore()
+{
+    if (const int rc = fill(1))
+        return rc;
+
+    ++begin;
+    return INPUT_OK;
+}
+
+int Input::peek(char& next)
+{
+    if (const int rc = fill(1))
+        return rc;
+
+    next = buffer[begin];
+    return INPUT_OK;
+}
+
+int Input::bytes(const char*& data, size_t size)
+{
+    if (const int rc = fill(size))
+        return rc;
+
+    data   = buffer + begin;
+    begin += size;
+    return INPUT_OK;
+}
+
+void Input::setMark()
+{
+    mark   = begin;
+    marked = true;
+}
+
+void Input::resetToMark()
+{
+    assert(marked);
+
+    begin  = mark;
+    marked = false;
+}
+
+void Input::clearMark()
+{
+    marked = false;
+}
+
+void Input::setReadHook(void (*hook)(void *argument), void *argument)
+{
+    readHook         = hook;
+    readHookArgument = argument;
+}
+
+size_t Input::buffered() const
+{
+    return end - begin;
+}
+
+int Input::error() const
+{
+    return lastError;
+}
@@ -0,0 +1,120 @@
+#ifndef INCLUDED_INPUT
+#define INCLUDED_INPUT
+
+#include <stddef.h>  // size_t
+
+class Input {
+    // 'Input' reads from a file descriptor in large chunks into a buffer that
+    // it reuses, and hands out the tokens, numbers, and payloads of mq's wire
+    // protocols in place, as pointers into that buffer.  A pointer returned
+    // by a member function is valid only until the next call to a non-const
+    // member function.
+    //
+    // If the file descriptor is nonblocking, then any reading function might
+    // return 'INPUT_AGAIN' after consuming only part of what was requested.
+    // To parse something all-or-nothing, first 'setMark', and then
+    // 'resetToMark' if the input turns out to be incomplete.
+
+    int     fd;
+    char   *buffer;
+    size_t  capacity;
+    size_t  begin;     // offset of the first unconsumed byte
+    size_t  end;       // offset one past the last byte read
+    size_t  mark;      // offset that 'fill' keeps, if 'marked'
+    bool    marked;
+    int     lastError; // 'errno' of the most recent failed 'read'
+    void  (*readHook)(void *argument);
+    void   *readHookArgument;
+
+    Input(const Input&);             // not copyable
+    Input& operator=(const Input&);  // not assignable
+
+    int fill(size_t needed);
+        // Make at least the specified 'needed' unconsumed bytes available in
+        // the buffer, reading from the file descriptor as necessary and moving
+        // any unconsumed (or marked) bytes to the front of the buffer (or
+        // growing the buffer) if there is not room after them.  Return
+        // 'INPUT_OK' on success, 'INPUT_END' if the input ends first,
+        // 'INPUT_AGAIN' if the file descriptor is nonblocking and has nothing
+        // to read, or 'INPUT_FAILED' if 'read' fails.
+
+    int skipWhitespace();
+        // Consume bytes up to the next non-whitespace byte.  Return 'INPUT_OK'
+        // on success or a nonzero value (as for 'fill') otherwise.
+
+  public:
+    // Return values of the reading functions.  Note that 'INPUT_OK' is zero.
+    enum {
+        INPUT_OK,
+        INPUT_END,      // the input ended before what was requested
+        INPUT_INVALID,  // the input is not of the requested form
+        INPUT_FAILED,   // a 'read' failed; see 'error()'
+        INPUT_AGAIN     // nothing to read yet from a nonblocking descriptor
+    };
+
+    explicit Input(int fileDescriptor, size_t initialCapacity = 65536);
+        // Create an 'Input' that reads from the specified 'fileDescriptor'
+        // using a buffer having the optionally specified 'initialCapacity'.
+        // Throw 'std::bad_alloc' if the buffer cannot be allocated.
+
+    ~Input();
+
+    int token(const char*& tokenBegin, size_t& tokenSize);
+        // Skip any whitespace and then load into the specified 'tokenBegin'
+        // and 'tokenSize' the bytes up to (but not including) the next
+        // whitespace or the end of input.  Return 'INPUT_OK' on success,
+        // 'INPUT_END' if there is no token, or another nonzero value if an
+        // error occurs.
+
+    int number(unsigned long long& value);
+        // Skip any whitespace and then load into the specified 'value' the
+        // nonnegative decimal integer that follows.  The byte after the
+        // integer is not consumed.  Return 'INPUT_OK' on success,
+        // 'INPUT_INVALID' if there are no digits or the integer is too large,
+        // or another nonzero value if an error occurs.
+
+    int ignore();
+        // Consume one byte, e.g. the separator between a message's size and
+        // its payload.  Return 'INPUT_OK' on success or a nonzero value
+        // otherwise.
+
+    int peek(char& next);
+        // Load into the specified 'next' the next byte without consuming it,
+        // e.g. to see whether an optional argument follows on the same line.
+        // Return 'INPUT_OK' on success or a nonzero value otherwise.
+
+    int bytes(const char*& data, size_t size);
+        // Load into the specified 'data' a pointer to the next specified
+        // 'size' bytes, which are contiguous in the buffer, and consume them.
+        // Return 'INPUT_OK' on success or a nonzero value otherwise.  If the
+        // input ends first, then the bytes that were available can be
+        // counted by 'buffered()'.
+
+    void setMark();
+        // Remember the current position in the input, so that 'resetToMark'
+        // can return to it.  The bytes from the mark on are kept in the
+        // buffer until the mark is reset or cleared.
+
+    void resetToMark();
+        // Return to the position saved by the most recent 'setMark', so that
+        // the bytes consumed since then will be read again, and clear the
+        // mark.  The behavior is undefined unless there is a mark.
+
+    void clearMark();
+        // Forget the position saved by 'setMark', if any.
+
+    void setReadHook(void (*hook)(void *argument), void *argument);
+        // Arrange for the specified 'hook' to be called with the specified
+        // 'argument' before each 'read' of the file descriptor, i.e. whenever
+        // this object might be about to block.
+
+    size_t buffered() const;
+        // Return the number of bytes that have been read but not consumed,
+        // i.e. that are available without reading again.
+
+    int error() const;
+        // Return the 'errno' value of the most recent failed 'read', or zero
+        // if none has failed.
+};
+
+#endif
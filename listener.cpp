@@ -0,0 +1,124 @@
+#include "listener.h"
+
+// POSIX
+#include <errno.h>       // errno, EINTR, ECONNABORTED, ECONNREFUSED, ...
+#include <sys/socket.h>  // socket, bind, listen, accept4, connect
+#include <sys/stat.h>    // lstat, S_ISSOCK
+#include <sys/un.h>      // sockaddr_un
+#include <unistd.h>      // close, unlink, getpid
+
+// Standard C
+#include <string.h>      // memcpy, strerror
+
+// Standard C++
+#include <sstream>
+#include <stdexcept>     // std::runtime_error
+
+#include "repr.h"
+
+namespace {
+
+int addressOf(sockaddr_un& address, const std::string& path)
+    // Load into the specified 'address' the specified 'path'.  Return zero
+    // on success or an 'errno' value otherwise.
+{
+    address = sockaddr_un();
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof address.sun_path)
+        return ENAMETOOLONG;
+
+    memcpy(address.sun_path, path.data(), path.size());
+    return 0;
+}
+
+bool isAbandoned(const sockaddr_un& address)
+    // Return whether a socket is at the specified 'address' but nobody is
+    // listening on it.
+{
+    struct stat status;
+    if (lstat(address.sun_path, &status) || !S_ISSOCK(status.st_mode))
+        return false;
+
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1)
+        return false;
+
+    const int rc =
+        connect(probe, reinterpret_cast<const sockaddr*>(&address),
+                sizeof address);
+    const int error = errno;
+    ::close(probe);
+    return rc == -1 && error == ECONNREFUSED;
+}
+
+}  // close unnamed namespace
+
+Listener::Listener(const std::string& path)
+: fd(-1)
+, path(path)
+, owner(0)
+{
+    sockaddr_un address;
+    int         error = addressOf(address, path);
+
+    if (!error) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            error = errno;
+    }
+
+    if (!error && isAbandoned(address))
+        unlink(path.c_str());
+
+    if (!error &&
+        bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof address))
+    {
+        error = errno;
+    }
+
+    if (!error) {
+        owner = getpid();
+        if (listen(fd, SOMAXCONN))
+            error = errno;
+    }
+
+    if (error) {
+        close();
+        if (owner)
+            unlink(path.c_str());
+
+        std::ostringstream message;
+        message << "Unable to listen on " << repr(path) << ": "
+                << strerror(error);
+        throw std::runtime_error(message.str());
+    }
+}
+
+Listener::~Listener()
+{
+    if (owner == getpid())
+        unlink(path.c_str());
+
+    close();
+}
+
+int Listener::accept(int& connection)
+{
+    for (;;) {
+        connection = accept4(fd, 0, 0, SOCK_CLOEXEC);
+        if (connection != -1)
+            return 0;
+
+        // A client that gave up before it was accepted is no error.
+        if (errno != EINTR && errno != ECONNABORTED)
+            return errno;
+    }
+}
+
+void Listener::close()
+{
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef INCLUDED_LISTENER
+#define INCLUDED_LISTENER
+
+// POSIX
+#include <sys/types.h>  // pid_t
+
+// Standard C++
+#include <string>
+
+class Listener {
+    // 'Listener' is a Unix domain stream socket bound to a path, on which it
+    // accepts connections.  A socket already at the path that nobody is
+    // listening on (e.g. one left by a process that was killed) is replaced,
+    // but one that somebody is listening on, or a file that isn't a socket,
+    // is an error.  The path is unlinked when the 'Listener' is destroyed by
+    // the process that created it, but not in a child process that has a
+    // copy of it (see 'close').
+
+    int          fd;
+    std::string  path;
+    pid_t        owner;  // the process that bound 'path'
+
+    Listener(const Listener&);             // not copyable
+    Listener& operator=(const Listener&);  // not assignable
+
+  public:
+    explicit Listener(const std::string& path);
+        // Create a 'Listener' on a socket bound to the specified 'path'.
+        // Throw 'std::runtime_error' if the socket cannot be created, bound,
+        // or listened on.
+
+    ~Listener();
+
+    int accept(int& connection);
+        // Wait for a client to connect, and load into the specified
+        // 'connection' a file descriptor for the connection, which is closed
+        // on 'exec'.  Return zero on success or an 'errno' value otherwise.
+
+    void close();
+        // Close the socket, but leave its path, e.g. in a child process that
+        // serves a connection.  After this, 'accept' fails.
+};
+
+#endif
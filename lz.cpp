@@ -0,0 +1,250 @@
+#include "lz.h"
+
+// Standard C
+#include <string.h>  // memcpy
+
+// Standard C++
+#include <limits>
+
+namespace {
+
+const size_t MIN_MATCH  = 4;
+const size_t MAX_OFFSET = 65535;
+
+// Four bytes are hashed into this many bits to find where they last were.
+const int HASH_BITS = 12;
+
+unsigned readFour(const char *bytes)
+{
+    unsigned value;
+    memcpy(&value, bytes, sizeof value);
+    return value;
+}
+
+unsigned hashOf(unsigned four)
+{
+    return four * 2654435761U >> (32 - HASH_BITS);
+}
+
+bool putLength(char *&next, const char *end, size_t length)
+    // Write the continuation bytes of a field whose total is the specified
+    // 'length', of which fifteen is already in the token, at the specified
+    // 'next', and advance it.  Return 'false' if that would pass the
+    // specified 'end'.
+{
+    length -= 15;
+    for (;;) {
+        if (next == end)
+            return false;
+
+        if (length < 255) {
+            *next++ = char(length);
+            return true;
+        }
+
+        *next++ = char(255);
+        length -= 255;
+    }
+}
+
+bool getLength(size_t& length, const char *&next, const char *end)
+    // Add to the specified 'length' the continuation bytes at the specified
+    // 'next', and advance it.  Return 'false' if they run past the specified
+    // 'end'.
+{
+    for (;;) {
+        if (next == end)
+            return false;
+
+        const unsigned char byte = *next++;
+        length += byte;
+        if (byte != 255)
+            return true;
+    }
+}
+
+bool putSequence(char       *&next,
+                 const char  *end,
+                 const char  *literals,
+                 size_t       literalSize,
+                 size_t       offset,
+                 size_t       matchSize)
+    // Write at the specified 'next' the sequence of the specified
+    // 'literalSize' bytes at the specified 'literals' followed by a match of
+    // the specified 'matchSize' bytes the specified 'offset' back, or by
+    // nothing if 'matchSize' is zero, and advance 'next'.  Return 'false' if
+    // that would pass the specified 'end'.
+{
+    if (next == end)
+        return false;
+
+    const size_t matchField = matchSize ? matchSize - MIN_MATCH : 0;
+    char *const  token      = next++;
+    *token = char((literalSize < 15 ? literalSize : 15) << 4 |
+                  (matchField  < 15 ? matchField  : 15));
+
+    if (literalSize >= 15 && !putLength(next, end, literalSize))
+        return false;
+
+    if (size_t(end - next) < literalSize)
+        return false;
+
+    memcpy(next, literals, literalSize);
+    next += literalSize;
+
+    if (!matchSize)
+        return true;
+
+    if (end - next < 2)
+        return false;
+
+    *next++ = char(offset);
+    *next++ = char(offset >> 8);
+
+    return matchField < 15 || putLength(next, end, matchField);
+}
+
+}  // close unnamed namespace
+
+size_t lzCompress(char *output, size_t limit, const char *input, size_t size)
+{
+    char       *next = output;
+    const char *end  = output + limit;
+
+    for (size_t rest = size; ; rest >>= 7) {
+        if (next == end)
+            return 0;
+
+        *next++ = char((rest & 127) | (rest > 127 ? 128 : 0));
+        if (rest <= 127)
+            break;
+    }
+
+    // Positions of the last four bytes having each hash.  A stale or zero
+    // entry is harmless, since the bytes there are compared before use.
+    unsigned table[1 << HASH_BITS] = {};
+
+    size_t anchor = 0;  // where the literals not yet written begin
+    size_t i      = 0;
+    while (i + MIN_MATCH <= size) {
+        const unsigned four      = readFour(input + i);
+        const unsigned hash      = hashOf(four);
+        const size_t   candidate = table[hash];
+        table[hash] = i;
+
+        if (candidate >= i || i - candidate > MAX_OFFSET ||
+            readFour(input + candidate) != four)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t matchSize = MIN_MATCH;
+        while (i + matchSize < size &&
+               input[candidate + matchSize] == input[i + matchSize])
+        {
+            ++matchSize;
+        }
+
+        if (!putSequence(next,
+                         end,
+                         input + anchor,
+                         i - anchor,
+                         i - candidate,
+                         matchSize))
+        {
+            return 0;
+        }
+
+        i     += matchSize;
+        anchor = i;
+    }
+
+    if (!putSequence(next, end, input + anchor, size - anchor, 0, 0))
+        return 0;
+
+    return next - output;
+}
+
+size_t lzDecompressedSize(const char *input, size_t size)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < size && i * 7 < 64; ++i) {
+        const unsigned char byte = input[i];
+        result |= size_t(byte & 127) << (i * 7);
+        if (!(byte & 128))
+            return result;
+    }
+
+    return std::numeric_limits<size_t>::max();
+}
+
+int lzDecompress(char       *output,
+                 size_t      outputSize,
+                 const char *input,
+                 size_t      size)
+{
+    const char *next = input;
+    const char *end  = input + size;
+
+    while (next != end && (*next & 128))  // skip the uncompressed size
+        ++next;
+    if (next == end)
+        return 1;
+    ++next;
+
+    size_t written = 0;
+    for (;;) {
+        if (next == end)
+            return 2;
+
+        const unsigned char token       = *next++;
+        size_t              literalSize = token >> 4;
+        if (literalSize == 15 && !getLength(literalSize, next, end))
+            return 3;
+
+        if (size_t(end - next) < literalSize ||
+            outputSize - written < literalSize)
+        {
+            return 4;
+        }
+
+        memcpy(output + written, next, literalSize);
+        next    += literalSize;
+        written += literalSize;
+
+        if (next == end)
+            return written == outputSize ? 0 : 5;  // the last sequence
+
+        if (end - next < 2)
+            return 6;
+
+        const size_t offset = (unsigned char)(next[0]) |
+                              size_t((unsigned char)(next[1])) << 8;
+        next += 2;
+
+        size_t matchSize = token & 15;
+        if (matchSize == 15 && !getLength(matchSize, next, end))
+            return 7;
+        matchSize += MIN_MATCH;
+
+        if (offset == 0 || offset > written ||
+            outputSize - written < matchSize)
+        {
+            return 8;
+        }
+
+        // The match may overlap what it's copied to, e.g. a run of one byte
+        // is a match one back, and so it's copied a byte at a time.
+        const char *from = output + written - offset;
+        char       *to   = output + written;
+        if (offset >= matchSize)
+            memcpy(to, from, matchSize);
+        else {
+            for (size_t j = 0; j < matchSize; ++j)
+                to[j] = from[j];
+        }
+
+        written += matchSize;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef INCLUDED_LZ
+#define INCLUDED_LZ
+
+// Standard C
+#include <stddef.h>  // size_t
+
+// A small LZ77 codec in the manner of LZ4, for '--compress': it favors speed
+// over ratio, needs no memory but a 16 KiB table on the stack, and has no
+// dependencies.  A compressed block is the uncompressed size (as a varint:
+// seven bits per byte, least significant first, the high bit meaning "more")
+// followed by sequences.  Each sequence is a token byte, whose high four bits
+// are the number of literal bytes that follow and whose low four bits are the
+// length of the match after them, less four.  A field of fifteen is continued
+// by bytes that are added to it, until one that isn't 255.  The literal
+// length's continuation comes before the literals, and the match length's
+// after the match's two byte (little-endian) offset back into the output.
+// The last sequence has literals only, and ends the block.
+
+size_t lzCompress(char *output, size_t limit, const char *input, size_t size);
+    // Compress the specified 'size' bytes at the specified 'input' into the
+    // specified 'output', and return the size of the result, or return zero
+    // if it would be larger than the specified 'limit' bytes, in which case
+    // 'output' has been written to but is of no use.  The behavior is
+    // undefined unless 'output' has room for 'limit' bytes, and 'size' is
+    // less than 4 GiB.
+
+size_t lzDecompressedSize(const char *input, size_t size);
+    // Return the uncompressed size of the specified 'size' byte compressed
+    // block at the specified 'input', or the largest 'size_t' if 'input'
+    // doesn't begin with one.
+
+int lzDecompress(char       *output,
+                 size_t      outputSize,
+                 const char *input,
+                 size_t      size);
+    // Decompress the specified 'size' byte compressed block at the specified
+    // 'input' into the specified 'outputSize' bytes at the specified
+    // 'output'.  Return zero on success, or a nonzero value if the block is
+    // invalid, or doesn't decompress to exactly 'outputSize' bytes.
+
+#endif
@@ -0,0 +1,65 @@
+
+#include "mpsc.h"
+
+// This is Dmitry Vyukov's intrusive multiple-producer, single-consumer queue.
+// The nodes are linked from the oldest ('tail') to the newest ('head').  The
+// consumer keeps one node in the queue at all times, so that a producer never
+// has to touch 'tail': when the last real node would otherwise be popped, the
+// 'stub' is pushed behind it first.
+
+MpscQueue::MpscQueue()
+: head(&stub)
+, tail(&stub)
+{
+    stub.next = 0;
+}
+
+void MpscQueue::push(MpscNode *node)
+{
+    __atomic_store_n(&node->next, (MpscNode*)0, __ATOMIC_RELAXED);
+
+    // Once 'head' is exchanged, 'node' is in the queue, though not reachable
+    // from 'tail' until 'previous' is linked to it.
+    MpscNode *const previous =
+        __atomic_exchange_n(&head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+MpscNode *MpscQueue::pop()
+{
+    MpscNode *first = tail;
+    MpscNode *next  = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+
+    // Skip over the stub, if it's at the front.
+    if (first == &stub) {
+        if (!next)
+            return 0;  // empty
+
+        tail  = next;
+        first = next;
+        next  = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        tail = next;
+        return first;
+    }
+
+    // 'first' is the last node linked.  If it isn't the last pushed, then a
+    // push is in progress, and 'first' can't be popped until it finishes
+    // linking the node after it.
+    if (first != __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+        return 0;
+
+    // Put the stub behind 'first', so that the queue won't be left without a
+    // node when 'first' is popped.
+    push(&stub);
+
+    next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        tail = next;
+        return first;
+    }
+
+    return 0;  // another push got between 'first' and the stub
+}
@@ -0,0 +1,46 @@
+#ifndef INCLUDED_MPSC
+#define INCLUDED_MPSC
+
+struct MpscNode {
+    // The link by which an object is kept in an 'MpscQueue'.  An object to be
+    // queued embeds an 'MpscNode' (typically as its first member).
+
+    MpscNode *next;
+};
+
+class MpscQueue {
+    // 'MpscQueue' is an intrusive first-in, first-out queue of nodes that any
+    // number of threads may 'push' onto without locking, and that one thread
+    // at a time may 'pop' from.  A 'push' is a single atomic exchange, so a
+    // producer never waits for another producer or for the consumer.  The
+    // price is that, while a 'push' is between its exchange and its linking
+    // of the node, the nodes after it can't be popped yet, so 'pop' may
+    // return null even though nodes have been (or are being) pushed.  The
+    // user must tell that case from emptiness some other way, e.g. with a
+    // count of what was pushed, and try again.  The queue doesn't own its
+    // nodes.
+
+    MpscNode *head;  // the most recently pushed node
+    MpscNode *tail;  // the next node to pop, or 'stub'
+    MpscNode  stub;  // keeps the queue from ever having no node
+
+    MpscQueue(const MpscQueue&);             // not copyable
+    MpscQueue& operator=(const MpscQueue&);  // not assignable
+
+  public:
+    MpscQueue();
+        // Create an empty 'MpscQueue'.
+
+    void push(MpscNode *node);
+        // Put the specified 'node' at the back of this queue.  This function
+        // is thread-safe.  The behavior is undefined if 'node' is already in
+        // a queue.
+
+    MpscNode *pop();
+        // Remove the node at the front of this queue and return it, or return
+        // null if there is none, or if the one there is still being pushed.
+        // The behavior is undefined if another thread is in 'pop' at the same
+        // time.
+};
+
+#endif
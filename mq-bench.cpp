@@ -0,0 +1,840 @@
+// POSIX
+#include <errno.h>     // errno
+#include <pthread.h>   // pthread_*
+#include <signal.h>    // kill, signal, SIGPIPE
+#include <string.h>    // strerror, memcpy, memcmp
+#include <sys/wait.h>  // waitpid
+#include <time.h>      // clock_gettime
+#include <unistd.h>    // fork, execvp, pipe, dup2, close, getpid
+
+// Standard C
+#include <stdio.h>     // snprintf
+#include <stdlib.h>    // rand_r
+
+// Standard C++
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>   // std::runtime_error, std::exception
+#include <string>
+#include <vector>
+
+#include "input.h"
+#include "output.h"
+#include "repr.h"
+
+// --------------------
+// command line parsing
+// --------------------
+
+void usage(const char *argv0, std::ostream& out)
+{
+    out << "usage: " << argv0 << "  <options ...>  [-- <mq options ...>]\n"
+        << "       " << argv0 << " --help\n";
+}
+
+void help(const char *argv0, std::ostream& out)
+{
+    out << argv0 <<
+"  <Options ...>  [-- <mq Options ...>]\n"
+"\n"
+"Measure the throughput and latency of mq by running producer and consumer\n"
+"mq processes on a scratch queue, and driving them through their standard\n"
+"input and output as any user would.  The queue is unlinked afterward.\n"
+"\n"
+"Options:\n"
+"--help              print this prompt to standard output\n"
+"--mq <path>         the mq executable to run (default ./mq)\n"
+"--queue <name>      the scratch queue (default /mq-bench-<pid>)\n"
+"--messages <n>      how many messages to send in all (default 100000)\n"
+"--size <bytes>      the size of each message (default 64, at least 8)\n"
+"--max-size <bytes>  if more than --size, then message sizes are uniformly\n"
+"                    distributed from --size through this\n"
+"--priorities <n>    priorities are uniformly distributed from 0 through\n"
+"                    n-1 (default 1)\n"
+"--producers <n>     how many mq processes send (default 1)\n"
+"--consumers <n>     how many mq processes receive (default 1)\n"
+"--receive           consumers issue \"receive\" for each message, rather\n"
+"                    than one \"consume\"\n"
+"--window <n>        how many commands each process may have outstanding\n"
+"                    (default 256)\n"
+"--binary            use mq's binary protocol\n"
+"--seed <n>          seed for the sizes and priorities (default 1)\n"
+"\n"
+"mq Options:\n"
+"Options after \"--\" are passed to every mq process, e.g. --reactor, or\n"
+"--msgsize and --maxmsg (which then apply if the queue is created).\n"
+"\n"
+"Each message begins with the time at which it was sent, and latency is\n"
+"measured from then until the message is read from a consumer.\n";
+}
+
+struct Options {
+    std::string               mq;
+    std::string               queueName;
+    long                      messages;
+    size_t                    minSize;
+    size_t                    maxSize;
+    unsigned                  priorities;
+    int                       producers;
+    int                       consumers;
+    bool                      receive;
+    long                      window;
+    bool                      binary;
+    unsigned                  seed;
+    std::vector<std::string>  mqArguments;
+
+    Options()
+    : mq("./mq")
+    , messages(100000)
+    , minSize(64)
+    , maxSize(0)
+    , priorities(1)
+    , producers(1)
+    , consumers(1)
+    , receive(false)
+    , window(256)
+    , binary(false)
+    , seed(1)
+    {}
+};
+
+template <typename OUTPUT>
+void parseArgument(OUTPUT&            output,
+                   const std::string& name,
+                   const char        *input)
+    // Read one object of type 'OUTPUT' into the specified 'output' from the
+    // specified 'input', the value of the option having the specified
+    // 'name'.  Throw 'std::runtime_error' if 'input' is null or isn't
+    // entirely such an object.
+{
+    std::istringstream in(input ? input : "");
+    in >> output;
+    if (!input || !in || in.peek() != std::char_traits<char>::eof())
+        throw std::runtime_error("Invalid " + name + ": " +
+                                 repr(input ? input : ""));
+}
+
+Options parseOptions(int argc, const char *const argv[])
+    // Return the options specified by the specified 'argc' command line
+    // arguments 'argv'.  Throw 'std::runtime_error' if they are invalid.
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        const char *const value = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (arg == "--") {
+            options.mqArguments.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (arg == "--receive")
+            options.receive = true;
+        else if (arg == "--binary")
+            options.binary = true;
+        else if (arg == "--mq" && value)
+            options.mq = argv[++i];
+        else if (arg == "--queue" && value)
+            options.queueName = argv[++i];
+        else if (arg == "--messages")
+            parseArgument(options.messages, arg, argv[++i]);
+        else if (arg == "--size")
+            parseArgument(options.minSize, arg, argv[++i]);
+        else if (arg == "--max-size")
+            parseArgument(options.maxSize, arg, argv[++i]);
+        else if (arg == "--priorities")
+            parseArgument(options.priorities, arg, argv[++i]);
+        else if (arg == "--producers")
+            parseArgument(options.producers, arg, argv[++i]);
+        else if (arg == "--consumers")
+            parseArgument(options.consumers, arg, argv[++i]);
+        else if (arg == "--window")
+            parseArgument(options.window, arg, argv[++i]);
+        else if (arg == "--seed")
+            parseArgument(options.seed, arg, argv[++i]);
+        else
+            throw std::runtime_error("Unrecognized option " + repr(arg));
+    }
+
+    if (options.messages < 1 || options.producers < 1 ||
+        options.consumers < 1 || options.window < 1 ||
+        options.priorities < 1)
+    {
+        throw std::runtime_error("The numbers of messages, producers, "
+                                 "consumers, priorities, and the window "
+                                 "must be positive.");
+    }
+
+    // Each message begins with its time of sending.
+    if (options.minSize < sizeof(long long))
+        throw std::runtime_error("Messages must be at least 8 bytes.");
+
+    if (options.maxSize < options.minSize)
+        options.maxSize = options.minSize;
+
+    if (options.queueName.empty()) {
+        std::ostringstream name;
+        name << "/mq-bench-" << getpid();
+        options.queueName = name.str();
+    }
+
+    return options;
+}
+
+// ---------------
+// child processes
+// ---------------
+
+struct Child {
+    // An 'mq' process, and the pipes to its standard input and output.
+
+    pid_t pid;
+    int   input;   // write end of the child's standard input
+    int   output;  // read end of the child's standard output
+
+    Child()
+    : pid(-1)
+    , input(-1)
+    , output(-1)
+    {}
+};
+
+int spawn(Child&                          child,
+          const Options&                  options,
+          const std::vector<std::string>& arguments)
+    // Run the 'mq' executable named by the specified 'options' with the
+    // specified 'arguments', followed by the options after "--" and then the
+    // queue name, and load the process and its pipes into the specified
+    // 'child'.  Return zero on success or a nonzero value otherwise.
+{
+    std::vector<std::string> all(1, options.mq);
+    all.insert(all.end(), arguments.begin(), arguments.end());
+    all.insert(all.end(),
+               options.mqArguments.begin(),
+               options.mqArguments.end());
+    all.push_back(options.queueName);
+
+    std::vector<char*> argv;
+    for (size_t i = 0; i < all.size(); ++i)
+        argv.push_back(const_cast<char*>(all[i].c_str()));
+    argv.push_back(0);
+
+    int toChild[2], fromChild[2];
+    if (pipe(toChild)) {
+        std::cerr << "Unable to create pipe: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+    if (pipe(fromChild)) {
+        std::cerr << "Unable to create pipe: " << strerror(errno)
+                  << std::endl;
+        close(toChild[0]);
+        close(toChild[1]);
+        return 1;
+    }
+
+    child.pid = fork();
+    if (child.pid == -1) {
+        std::cerr << "Unable to fork: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    if (child.pid == 0) {
+        dup2(toChild[0], 0);
+        dup2(fromChild[1], 1);
+        close(toChild[0]);
+        close(toChild[1]);
+        close(fromChild[0]);
+        close(fromChild[1]);
+        execvp(argv[0], &argv[0]);
+        std::cerr << "Unable to run " << repr(options.mq) << ": "
+                  << strerror(errno) << std::endl;
+        _exit(127);
+    }
+
+    close(toChild[0]);
+    close(fromChild[1]);
+    child.input  = toChild[1];
+    child.output = fromChild[0];
+    return 0;
+}
+
+int finish(Child& child)
+    // Close the specified 'child's pipes and wait for it to exit.  Return
+    // zero if it exited successfully or a nonzero value otherwise.
+{
+    if (child.pid == -1)
+        return 0;
+
+    close(child.input);
+    close(child.output);
+
+    int status;
+    while (waitpid(child.pid, &status, 0) == -1 && errno == EINTR)
+        ;
+
+    child.pid = -1;
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+// -------------
+// wire protocol
+// -------------
+
+// A subset of the binary protocol that 'mq' speaks with '--binary' (see its
+// '--readme').
+const int HEADER_SIZE = 16;
+
+enum Opcode {
+    OP_SEND    = 1,
+    OP_RECEIVE = 2,
+    OP_CONSUME = 3,
+    OP_CLOSE   = 7,
+    OP_ACK     = 0x81,
+    OP_MSG     = 0x82,
+    OP_NOTICE  = 0xC0  // 'busy' and 'ready', with '--pending'
+};
+
+void encodeHeader(char               *header,
+                  int                 opcode,
+                  unsigned            priority,
+                  unsigned long long  length)
+    // Write to the specified 'header' the binary protocol encoding of the
+    // specified 'opcode', 'priority', and 'length', with queue handle zero.
+{
+    memset(header, 0, HEADER_SIZE);
+    header[0] = char(opcode);
+
+    for (int i = 0; i < 4; ++i)
+        header[4 + i] = char(priority >> (8 * i));
+
+    for (int i = 0; i < 8; ++i)
+        header[8 + i] = char(length >> (8 * i));
+}
+
+void decodeHeader(int&                opcode,
+                  unsigned long long& length,
+                  const char         *header)
+    // Load into the specified 'opcode' and 'length' the values encoded in the
+    // specified binary protocol 'header'.
+{
+    const unsigned char *const bytes =
+        reinterpret_cast<const unsigned char*>(header);
+
+    opcode = bytes[0];
+
+    length = 0;
+    for (int i = 0; i < 8; ++i)
+        length |= (unsigned long long)(bytes[8 + i]) << (8 * i);
+}
+
+int writeCommand(Output&             output,
+                 int                 opcode,
+                 const char         *text,
+                 unsigned            priority = 0,
+                 const char         *payload = 0,
+                 unsigned long long  length = 0)
+    // Write to the specified 'output' the command having the specified
+    // 'opcode' in the binary protocol, or the specified 'text' in the text
+    // protocol.  For "send", the text protocol's priority and length are
+    // written after 'text', and the optionally specified 'payload' of
+    // 'length' bytes and 'priority' follows.  Return zero on success or a
+    // nonzero value otherwise.
+{
+    char   prefix[64];
+    size_t prefixSize;
+    if (text) {
+        prefixSize = opcode == OP_SEND
+            ? snprintf(prefix, sizeof prefix, "%s %u %llu ",
+                       text, priority, length)
+            : snprintf(prefix, sizeof prefix, "%s\n", text);
+    }
+    else {
+        encodeHeader(prefix, opcode, priority, length);
+        prefixSize = HEADER_SIZE;
+    }
+
+    iovec parts[3];
+    parts[0].iov_base = prefix;
+    parts[0].iov_len  = prefixSize;
+    parts[1].iov_base = const_cast<char*>(payload);
+    parts[1].iov_len  = payload ? length : 0;
+    parts[2].iov_base = const_cast<char*>("\n");
+    parts[2].iov_len  = text && opcode == OP_SEND ? 1 : 0;
+
+    if (output.write(parts, 3)) {
+        std::cerr << "Unable to write to mq: " << strerror(output.error())
+                  << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+int readResponse(Input&              input,
+                 bool                binary,
+                 int&                opcode,
+                 const char*&        payload,
+                 unsigned long long& length)
+    // Read the next response from the specified 'input', loading into the
+    // specified 'opcode' its binary protocol opcode (even if it's in the
+    // text protocol, per the specified 'binary'), and, if it's a message,
+    // into the specified 'payload' and 'length' the message.  Return zero on
+    // success, 'Input::INPUT_END' if the input ends first, or another
+    // nonzero value otherwise.
+{
+    payload = 0;
+    length  = 0;
+
+    if (binary) {
+        const char *header;
+        if (const int rc = input.bytes(header, HEADER_SIZE))
+            return rc == Input::INPUT_END && !input.buffered() ? rc : 1;
+
+        decodeHeader(opcode, length, header);
+        if (opcode != OP_MSG)
+            return 0;
+
+        return input.bytes(payload, length) ? 1 : 0;
+    }
+
+    // A message begins with its priority, and every other response with
+    // its name.
+    const char *token;
+    size_t      tokenSize;
+    if (const int rc = input.token(token, tokenSize))
+        return rc;
+
+    unsigned long long number;
+    if (token[0] >= '0' && token[0] <= '9') {
+        opcode = OP_MSG;
+        if (input.number(length) || input.ignore() ||
+            input.bytes(payload, length))
+        {
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (tokenSize == 3 && !memcmp(token, "ack", 3))
+        opcode = OP_ACK;
+    else if ((tokenSize == 4 && !memcmp(token, "busy", 4)) ||
+             (tokenSize == 5 && !memcmp(token, "ready", 5)))
+    {
+        opcode = OP_NOTICE;
+        return tokenSize == 4 && input.number(number);
+    }
+    else {
+        std::cerr << "Unexpected response from mq: "
+                  << repr(std::string(token, tokenSize)) << std::endl;
+        return 1;
+    }
+
+    return input.number(number) ? 1 : 0;
+}
+
+// -------
+// drivers
+// -------
+
+long long nanosecondsNow()
+    // Return the current 'CLOCK_MONOTONIC' time in nanoseconds.
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+extern "C" void flushBeforeRead(void *data)
+    // Flush the 'Output' at the specified 'data'.  This is installed as the
+    // read hook of each 'Input', so that commands aren't left buffered while
+    // waiting for their responses.
+{
+    static_cast<Output*>(data)->flush();  // a failure shows up later
+}
+
+struct Driver {
+    // The state of a thread that drives one 'mq' process, either a producer
+    // or a consumer, which sends or receives 'quota' messages, respectively.
+    // A consumer that uses "consume" has no quota; it reads messages until
+    // its output ends, and 'received' says how many it was, of 'total'
+    // received by all consumers (guarded by 'mutex').
+
+    const Options&          options;
+    Child                   child;
+    Output                 *commands;
+    long                    quota;
+    unsigned                seed;
+    int                     result;
+    long                    received;
+    unsigned long long      bytes;
+    long long               lastReceived;  // time, in nanoseconds
+    std::vector<long long>  latencies;     // in nanoseconds
+
+    static pthread_mutex_t  mutex;
+    static pthread_cond_t   changed;
+    static long             total;
+
+    explicit Driver(const Options& benchOptions)
+    : options(benchOptions)
+    , commands(0)
+    , quota(0)
+    , seed(0)
+    , result(0)
+    , received(0)
+    , bytes(0)
+    , lastReceived(0)
+    {}
+
+    ~Driver()
+    {
+        delete commands;
+    }
+};
+
+pthread_mutex_t Driver::mutex   = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  Driver::changed = PTHREAD_COND_INITIALIZER;
+long            Driver::total   = 0;
+
+extern "C" void *produce(void *data)
+    // Send 'quota' messages of random sizes and priorities through the
+    // 'Driver' at the specified 'data', keeping no more than a window of
+    // them unacknowledged, and then "close".
+{
+    Driver&        driver  = *static_cast<Driver*>(data);
+    const Options& options = driver.options;
+    Input          acks(driver.child.output);
+    acks.setReadHook(&flushBeforeRead, driver.commands);
+
+    std::string payload(options.maxSize, 'x');
+    long        sent         = 0;
+    long        acknowledged = 0;
+    while (acknowledged < driver.quota) {
+        while (sent < driver.quota && sent - acknowledged < options.window) {
+            const size_t size = options.minSize +
+                rand_r(&driver.seed) % (options.maxSize - options.minSize + 1);
+            const unsigned priority =
+                rand_r(&driver.seed) % options.priorities;
+
+            const long long now = nanosecondsNow();
+            memcpy(&payload[0], &now, sizeof now);
+            if ((driver.result = writeCommand(*driver.commands,
+                                              OP_SEND,
+                                              options.binary ? 0 : "send",
+                                              priority,
+                                              payload.data(),
+                                              size)))
+            {
+                return data;
+            }
+
+            ++sent;
+        }
+
+        int                opcode;
+        const char        *ignored;
+        unsigned long long length;
+        if ((driver.result =
+                 readResponse(acks, options.binary, opcode, ignored, length)))
+        {
+            std::cerr << "Producer did not get all of its acknowledgements."
+                      << std::endl;
+            return data;
+        }
+
+        if (opcode == OP_ACK)
+            ++acknowledged;
+    }
+
+    driver.result = writeCommand(*driver.commands,
+                                 OP_CLOSE,
+                                 options.binary ? 0 : "close") ||
+                    driver.commands->flush();
+    return driver.result ? data : 0;
+}
+
+extern "C" void *consume(void *data)
+    // Receive messages through the 'Driver' at the specified 'data', noting
+    // the latency of each, until its output ends.  With '--receive', issue a
+    // "receive" for each of 'quota' messages, keeping no more than a window
+    // of them outstanding, and then "close"; otherwise, issue "consume" once.
+{
+    Driver&        driver  = *static_cast<Driver*>(data);
+    const Options& options = driver.options;
+    Input          messages(driver.child.output);
+    messages.setReadHook(&flushBeforeRead, driver.commands);
+
+    const char *const receive = options.binary ? 0 : "receive";
+    long              requested = 0;
+    if (!options.receive) {
+        driver.result = writeCommand(*driver.commands,
+                                     OP_CONSUME,
+                                     options.binary ? 0 : "consume");
+    }
+
+    for (;;) {
+        while (options.receive && !driver.result &&
+               requested < driver.quota &&
+               requested - driver.received < options.window)
+        {
+            driver.result =
+                writeCommand(*driver.commands, OP_RECEIVE, receive);
+            if (!driver.result && ++requested == driver.quota) {
+                driver.result = writeCommand(*driver.commands,
+                                             OP_CLOSE,
+                                             options.binary ? 0 : "close");
+            }
+        }
+        if (driver.result)
+            return data;
+
+        int                opcode;
+        const char        *payload;
+        unsigned long long length;
+        const int          rc =
+            readResponse(messages, options.binary, opcode, payload, length);
+        if (rc == Input::INPUT_END)
+            return 0;  // we're done
+        if (rc) {
+            driver.result = rc;
+            std::cerr << "Consumer could not read a message." << std::endl;
+            return data;
+        }
+
+        if (opcode != OP_MSG || length < sizeof(long long))
+            continue;
+
+        long long sentAt;
+        memcpy(&sentAt, payload, sizeof sentAt);
+        driver.lastReceived = nanosecondsNow();
+        driver.latencies.push_back(driver.lastReceived - sentAt);
+        driver.bytes += length;
+        ++driver.received;
+
+        pthread_mutex_lock(&Driver::mutex);
+        ++Driver::total;
+        pthread_cond_broadcast(&Driver::changed);
+        pthread_mutex_unlock(&Driver::mutex);
+    }
+}
+
+// ---------
+// reporting
+// ---------
+
+double percentile(const std::vector<long long>& sorted, double fraction)
+    // Return the specified 'fraction' percentile, in microseconds, of the
+    // specified 'sorted' nanoseconds.  The behavior is undefined if 'sorted'
+    // is empty.
+{
+    size_t index = size_t(fraction * sorted.size());
+    if (index >= sorted.size())
+        index = sorted.size() - 1;
+
+    return sorted[index] / 1000.0;
+}
+
+void report(const std::vector<Driver*>& consumers,
+            long long                   startedAt,
+            std::ostream&               out)
+    // Print to the specified 'out' the throughput and latency of the messages
+    // received by the specified 'consumers' since the specified 'startedAt'.
+{
+    std::vector<long long> latencies;
+    unsigned long long     bytes        = 0;
+    long long              lastReceived = startedAt;
+    for (size_t i = 0; i < consumers.size(); ++i) {
+        const Driver& consumer = *consumers[i];
+        latencies.insert(latencies.end(),
+                         consumer.latencies.begin(),
+                         consumer.latencies.end());
+        bytes += consumer.bytes;
+        lastReceived = std::max(lastReceived, consumer.lastReceived);
+    }
+
+    if (latencies.empty()) {
+        out << "No messages were received.\n";
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    const double seconds = (lastReceived - startedAt) / 1e9;
+    char         line[256];
+    snprintf(line, sizeof line,
+             "messages: %lu  bytes: %llu  seconds: %.3f\n"
+             "throughput: %.0f msgs/s  %.2f MB/s\n"
+             "latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+             (unsigned long)(latencies.size()),
+             bytes,
+             seconds,
+             latencies.size() / seconds,
+             bytes / seconds / 1e6,
+             percentile(latencies, 0.5),
+             percentile(latencies, 0.99),
+             percentile(latencies, 0.999),
+             latencies.back() / 1000.0);
+    out << line;
+}
+
+// ----
+// main
+// ----
+
+int unlinkQueue(const Options& options)
+    // Unlink the scratch queue by running "mq --unlink".  Return zero on
+    // success or a nonzero value otherwise.
+{
+    Options unlinkOptions(options);
+    unlinkOptions.mqArguments.clear();
+
+    Child child;
+    if (const int rc = spawn(child,
+                             unlinkOptions,
+                             std::vector<std::string>(1, "--unlink")))
+    {
+        return rc;
+    }
+
+    return finish(child);
+}
+
+int bench(const Options& options)
+    // Run the benchmark described by the specified 'options', and report the
+    // results to standard output.  Return zero on success or a nonzero value
+    // otherwise.
+{
+    std::vector<Driver*> producers, consumers;
+    for (int i = 0; i < options.producers; ++i)
+        producers.push_back(new Driver(options));
+    for (int i = 0; i < options.consumers; ++i)
+        consumers.push_back(new Driver(options));
+
+    std::vector<Driver*> drivers(producers);
+    drivers.insert(drivers.end(), consumers.begin(), consumers.end());
+
+    // Split the messages as evenly as possible.
+    for (int i = 0; i < options.producers; ++i) {
+        producers[i]->quota = options.messages / options.producers +
+                              (i < options.messages % options.producers);
+        producers[i]->seed  = options.seed + i;
+    }
+    for (int i = 0; i < options.consumers; ++i) {
+        consumers[i]->quota = options.messages / options.consumers +
+                              (i < options.messages % options.consumers);
+    }
+
+    std::vector<std::string> writeArguments, readArguments;
+    writeArguments.push_back("--open");
+    writeArguments.push_back("--create");
+    writeArguments.push_back("--write");
+    readArguments = writeArguments;
+    readArguments.back() = "--read";
+    if (options.binary) {
+        writeArguments.push_back("--binary");
+        readArguments.push_back("--binary");
+    }
+
+    int result = 0;
+    for (size_t i = 0; !result && i < drivers.size(); ++i) {
+        Driver& driver = *drivers[i];
+        if (!(result = spawn(driver.child,
+                             options,
+                             i < producers.size() ? writeArguments
+                                                  : readArguments)))
+        {
+            driver.commands = new Output(driver.child.input, 65536, 0);
+        }
+    }
+
+    // Start the consumers first, so that they're waiting when the first
+    // message is sent.
+    std::vector<pthread_t> threads(drivers.size());
+    std::vector<bool>      started(drivers.size());
+    const long long        startedAt = nanosecondsNow();
+    for (size_t i = drivers.size(); !result && i-- > 0;) {
+        const bool isProducer = i < producers.size();
+        if ((result = pthread_create(&threads[i],
+                                     0,
+                                     isProducer ? &produce : &consume,
+                                     drivers[i])))
+        {
+            std::cerr << "Unable to create thread: " << strerror(result)
+                      << std::endl;
+        }
+        started[i] = !result;
+    }
+
+    for (size_t i = 0; i < producers.size(); ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], 0);
+            result = result ? result : producers[i]->result;
+        }
+    }
+
+    // Consumers that "consume" are closed once everything has been received
+    // (or once it's clear that it won't be).
+    if (!options.receive) {
+        pthread_mutex_lock(&Driver::mutex);
+        while (!result && Driver::total < options.messages)
+            pthread_cond_wait(&Driver::changed, &Driver::mutex);
+        pthread_mutex_unlock(&Driver::mutex);
+
+        for (size_t i = 0; i < consumers.size(); ++i) {
+            if (consumers[i]->commands) {
+                writeCommand(*consumers[i]->commands,
+                             OP_CLOSE,
+                             options.binary ? 0 : "close");
+                consumers[i]->commands->flush();
+            }
+        }
+    }
+
+    for (size_t i = producers.size(); i < drivers.size(); ++i) {
+        if (result && drivers[i]->child.pid != -1)
+            kill(drivers[i]->child.pid, SIGTERM);
+        if (started[i]) {
+            pthread_join(threads[i], 0);
+            result = result ? result : drivers[i]->result;
+        }
+    }
+
+    for (size_t i = 0; i < drivers.size(); ++i) {
+        const int rc = finish(drivers[i]->child);
+        result = result ? result : rc;
+    }
+
+    if (!result)
+        report(consumers, startedAt, std::cout);
+
+    for (size_t i = 0; i < drivers.size(); ++i)
+        delete drivers[i];
+
+    const int unlinkResult = unlinkQueue(options);
+    return result ? result : unlinkResult;
+}
+
+int main(int argc, char *argv[]) try {
+    const std::vector<std::string> arguments(argv + 1, argv + argc);
+    if (std::find(arguments.begin(), arguments.end(), "--help") !=
+        arguments.end())
+    {
+        help(argv[0], std::cout);
+        return 0;
+    }
+
+    const Options options = parseOptions(argc, argv);
+
+    // A child that dies is reported by 'waitpid', not by a signal.
+    signal(SIGPIPE, SIG_IGN);
+
+    return bench(options);
+}
+catch (const std::exception& error) {
+    std::cerr << error.what() << std::endl;
+    usage(argv[0], std::cerr);
+    return 1;
+}
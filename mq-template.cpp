@@ -3,22 +3,28 @@
 #include <errno.h>     // error codes
 #include <fcntl.h>     // file open constants
 #include <mqueue.h>    // mq_*
+#include <poll.h>      // poll
 #include <pthread.h>   // pthread_*
-#include <signal.h>    // SIGUSR1
-#include <string.h>    // strerror
+#include <sched.h>     // sched_*, cpu_set_t, CPU_*
+#include <signal.h>    // SIGUSR1, SIGCHLD
+#include <string.h>    // strerror, memcmp, stpcpy
+#include <sys/epoll.h> // epoll_*
+#include <sys/mman.h>  // mlockall
 #include <sys/stat.h>  // file mode constants 
-#include <unistd.h>    // write
+#include <time.h>      // nanosleep
+#include <unistd.h>    // close, dup2, fork
 
 // Standard C
-#include <stdio.h>     // snprintf, fileno
+#include <limits.h>    // NAME_MAX
+#include <stdio.h>     // fileno, snprintf
 
 // Standard C++
 #include <algorithm>
 #include <cassert>
 #include <cctype>
-#include <cmath>
 #include <cstddef>
 #include <cstdlib>     // std::exit
+#include <deque>
 #include <ios>         // std::dec, std::oct
 #include <iostream>
 #include <limits>
@@ -26,8 +32,21 @@
 #include <sstream>
 #include <stdexcept>   // std::runtime_error, std::exception
 #include <string>
-
+#include <vector>
+
+#include "bundle.h"
+#include "codec.h"
+#include "fragment.h"
+#include "input.h"
+#include "listener.h"
+#include "lz.h"
+#include "output.h"
+#include "pending.h"
+#include "pool.h"
 #include "repr.h"
+#include "shm.h"
+#include "spool.h"
+#include "stats.h"
 
 // --------------------
 // command line parsing
@@ -56,6 +75,64 @@ void help(const char *argv0, std::ostream& out)
 "--msgsize   maximum size of any message in the queue, if possible\n"
 "--unlink    unlink the specified message queue (see MQ_UNLINK(3))\n"
 "--debug     print to stderr trace useful when debugging\n"
+"--binary    use the binary protocol on stdin and stdout (see --readme)\n"
+"--flush-bytes <n>    buffer up to n bytes of output between writes \n"
+"                     (default 65536, or 0 to write each response at once)\n"
+"--flush-usec <n>     write buffered output once it is n microseconds old\n"
+"                     (default 0, i.e. only before mq would otherwise wait)\n"
+"--reactor            serve from a single epoll event loop instead of from\n"
+"                     threads (Linux only)\n"
+"--batch <n>          after \"consume\" waits for a message, take up to n-1\n"
+"                     more already in the queue before writing them out\n"
+"                     (default 64)\n"
+"--pending <bytes>    rather than wait for room in a full queue, keep up to\n"
+"                     this many bytes of messages pending, and say \"busy\"\n"
+"                     when half full and \"ready\" once empty (see --readme)\n"
+"--spool <dir>        rather than wait for room in a full queue, keep\n"
+"                     messages in files in this directory until there's\n"
+"                     room, sending them in priority order (the limit is\n"
+"                     --pending, if specified; see --readme)\n"
+"--multi              prefix commands and responses with a queue handle, so\n"
+"                     that one mq can serve many queues (see --readme)\n"
+"--queue <name>       also open the named queue, as the next handle after\n"
+"                     the final argument's handle 0 (implies --multi, and\n"
+"                     may be repeated)\n"
+"--fragment <bytes>   send and receive messages of up to this many bytes,\n"
+"                     splitting those larger than the queue's msgsize into\n"
+"                     fragments (every sender and receiver must use it; see\n"
+"                     --readme)\n"
+"--compress           compress messages sent when that makes them smaller,\n"
+"                     and decompress messages received (every sender and\n"
+"                     receiver must use it; see --readme)\n"
+"--bundle-usec <n>    send consecutive messages of the same priority to a\n"
+"                     queue together as one, once there are enough to fill\n"
+"                     it or the first is n microseconds old (every sender\n"
+"                     and receiver must use it; see --readme)\n"
+"--shm <fd>           pass message payloads through the shared memory file\n"
+"                     open as file descriptor fd (e.g. a memfd) instead of\n"
+"                     through stdin and stdout (see --readme)\n"
+"--splice <bytes>     if stdout is a pipe, give it received messages of at\n"
+"                     least this many bytes with vmsplice instead of\n"
+"                     copying them (default 0, i.e. never)\n"
+"--hugepages          allocate the buffers into which messages are received\n"
+"                     from huge pages, if the system has any reserved\n"
+"--output-fd <fds>    write messages received for \"consume\" to the\n"
+"                     comma-separated inherited file descriptors instead of\n"
+"                     to stdout, one message to one of them (see --readme)\n"
+"--fan-out <policy>   how --output-fd chooses: round-robin (the default) or\n"
+"                     least-backlog\n"
+"--listen <path>      open the queues once, and then serve each client that\n"
+"                     connects to a Unix domain socket at this path as if\n"
+"                     it were stdin and stdout (see --readme)\n"
+"--busy-poll <n>      have \"consume\" poll the queue without waiting for\n"
+"                     messages, sleeping n microseconds between polls (or\n"
+"                     with 0, only yielding the CPU; see --readme)\n"
+"--cpu <n>            run on CPU n (see --readme)\n"
+"--consumer-cpu <n>   run the threads of \"consume\" on CPU n instead\n"
+"--realtime <prio>    run with the SCHED_FIFO scheduling policy at this\n"
+"                     priority, if permitted\n"
+"--mlock              lock mq's memory, such as its receive buffers, once\n"
+"                     its queues are open, if permitted\n"
 "\n"
 "If --unlink is specified, the only other option that may be specified is\n"
 "--debug.\n"
@@ -67,6 +144,7 @@ void help(const char *argv0, std::ostream& out)
 "\n"
 "Message Queue:\n"
 "The name of the POSIX local message queue to open (and possibly create).\n"
+"With --multi, this is the queue having handle 0.\n"
 "Note that on many systems, message queue names are required to begin with a\n"
 "forward slash.  Also note that message queues are not necessarily visible\n"
 "on the file system.\n";
@@ -148,7 +226,11 @@ int checkArgs(int argc, const char *const argv[])
     // --chicken-dinner
     const char *const flags[] = { 
         "read", "write", "open", "create", "msgsize", "maxmsg", "readme",
-        "debug", "permissions"
+        "debug", "permissions", "binary", "flush-bytes", "flush-usec",
+        "batch", "reactor", "multi", "queue", "pending", "shm", "splice",
+        "hugepages", "output-fd", "fan-out", "spool", "fragment", "compress",
+        "bundle-usec", "listen", "busy-poll", "cpu", "consumer-cpu",
+        "realtime", "mlock"
     };
     const char *const *const endFlags =
         flags + sizeof(flags) / sizeof(flags[0]);
@@ -179,7 +261,32 @@ struct Options {
     ssize_t                                      msgsize;                  
     bool                                         unlink;
     bool                                         debug;
+    bool                                         binary;
+    size_t                                       flushBytes;
+    long                                         flushMicroseconds;
+    long                                         batch;
+    size_t                                       pendingBytes;
+    std::string                                  spoolDirectory;
+    size_t                                       fragmentBytes;
+    bool                                         compress;
+    bool                                         bundle;
+    long                                         bundleMicroseconds;
+    int                                          sharedMemoryFd;
+    size_t                                       spliceBytes;
+    bool                                         reactor;
+    bool                                         hugePages;
+    std::vector<int>                             outputFds;
+    enum { ROUND_ROBIN, LEAST_BACKLOG }          fanOut;
+    bool                                         multi;
     std::string                                  queueName;
+    std::vector<std::string>                     moreQueueNames;
+    std::string                                  listenPath;
+    bool                                         busyPoll;
+    long                                         busyPollMicroseconds;
+    int                                          cpu;
+    int                                          consumerCpu;
+    int                                          realtimePriority;
+    bool                                         lockMemory;
 
     Options()
     : operation(READ_WRITE)
@@ -190,6 +297,27 @@ struct Options {
     , msgsize(-1)  // arbitrarily chosen
     , unlink(false)
     , debug(false)
+    , binary(false)
+    , flushBytes(65536)
+    , flushMicroseconds(0)
+    , batch(64)
+    , pendingBytes(0)
+    , fragmentBytes(0)
+    , compress(false)
+    , bundle(false)
+    , bundleMicroseconds(0)
+    , sharedMemoryFd(-1)
+    , spliceBytes(0)
+    , reactor(false)
+    , hugePages(false)
+    , fanOut(ROUND_ROBIN)
+    , multi(false)
+    , busyPoll(false)
+    , busyPollMicroseconds(0)
+    , cpu(-1)
+    , consumerCpu(-1)
+    , realtimePriority(0)
+    , lockMemory(false)
     {}
 };
 
@@ -225,6 +353,18 @@ Options parseOptions(int argc, const char *const argv[])
         return options;  // the rest can be ignored.
     }
 
+    options.binary  = find("--binary");
+    options.reactor = find("--reactor");
+    options.hugePages = find("--hugepages");
+    options.compress  = find("--compress");
+    options.lockMemory = find("--mlock");
+
+    for (const char *const *it = argv + 1; it != argv + argc - 1; ++it) {
+        if (std::string(*it) == "--queue")
+            options.moreQueueNames.push_back(*(it + 1));
+    }
+    options.multi = find("--multi") || !options.moreQueueNames.empty();
+
     const bool read  = find("--read"),
                write = find("--write");
     options.operation = read && write ? Options::READ_WRITE
@@ -256,7 +396,7 @@ Options parseOptions(int argc, const char *const argv[])
 
     const char *const *const msgsizeOption = find("--msgsize");
     if (msgsizeOption) {
-        const char *const msgsizeString = *(maxmsgOption + 1);
+        const char *const msgsizeString = *(msgsizeOption + 1);
         if (parse(options.msgsize, msgsizeString)) {
             throw std::runtime_error("Invalid msgsize: " +
                                      repr(msgsizeString));
@@ -265,6 +405,243 @@ Options parseOptions(int argc, const char *const argv[])
 
     options.maxesSpecified = maxmsgOption || msgsizeOption;
 
+    const char *const *const flushBytesOption = find("--flush-bytes");
+    if (flushBytesOption) {
+        const char *const flushBytesString = *(flushBytesOption + 1);
+        if (parse(options.flushBytes, flushBytesString)) {
+            throw std::runtime_error("Invalid flush-bytes: " +
+                                     repr(flushBytesString));
+        }
+    }
+
+    const char *const *const flushUsecOption = find("--flush-usec");
+    if (flushUsecOption) {
+        const char *const flushUsecString = *(flushUsecOption + 1);
+        if (parse(options.flushMicroseconds, flushUsecString) ||
+            options.flushMicroseconds < 0)
+        {
+            throw std::runtime_error("Invalid flush-usec: " +
+                                     repr(flushUsecString));
+        }
+    }
+
+    const char *const *const batchOption = find("--batch");
+    if (batchOption) {
+        const char *const batchString = *(batchOption + 1);
+        if (parse(options.batch, batchString) || options.batch < 1) {
+            throw std::runtime_error("Invalid batch: " + repr(batchString));
+        }
+    }
+
+    const char *const *const pendingOption = find("--pending");
+    if (pendingOption) {
+        const char *const pendingString = *(pendingOption + 1);
+        if (parse(options.pendingBytes, pendingString)) {
+            throw std::runtime_error("Invalid pending: " +
+                                     repr(pendingString));
+        }
+    }
+
+    const char *const *const spoolOption = find("--spool");
+    if (spoolOption) {
+        options.spoolDirectory = *(spoolOption + 1);
+        struct stat status;
+        if (stat(options.spoolDirectory.c_str(), &status) ||
+            !S_ISDIR(status.st_mode))
+        {
+            throw std::runtime_error("Invalid spool: " +
+                                     repr(options.spoolDirectory) +
+                                     " is not a directory.");
+        }
+    }
+
+    const char *const *const shmOption = find("--shm");
+    if (shmOption) {
+        const char *const shmString = *(shmOption + 1);
+        if (parse(options.sharedMemoryFd, shmString) ||
+            options.sharedMemoryFd < 0)
+        {
+            throw std::runtime_error("Invalid shm: " + repr(shmString));
+        }
+    }
+
+    const char *const *const fragmentOption = find("--fragment");
+    if (fragmentOption) {
+        const char *const fragmentString = *(fragmentOption + 1);
+        if (parse(options.fragmentBytes, fragmentString) ||
+            options.fragmentBytes == 0 ||
+            options.fragmentBytes > MAX_FRAGMENTED_SIZE)
+        {
+            throw std::runtime_error("Invalid fragment: " +
+                                     repr(fragmentString));
+        }
+
+        if (options.sharedMemoryFd != -1) {
+            throw std::runtime_error(
+                                "--fragment cannot be combined with --shm.");
+        }
+    }
+
+    const char *const *const bundleUsecOption = find("--bundle-usec");
+    if (bundleUsecOption) {
+        const char *const bundleUsecString = *(bundleUsecOption + 1);
+        if (parse(options.bundleMicroseconds, bundleUsecString) ||
+            options.bundleMicroseconds < 0)
+        {
+            throw std::runtime_error("Invalid bundle-usec: " +
+                                     repr(bundleUsecString));
+        }
+
+        options.bundle = true;
+    }
+
+    const char *const *const spliceOption = find("--splice");
+    if (spliceOption) {
+        const char *const spliceString = *(spliceOption + 1);
+        if (parse(options.spliceBytes, spliceString)) {
+            throw std::runtime_error("Invalid splice: " +
+                                     repr(spliceString));
+        }
+    }
+
+    const char *const *const outputFdOption = find("--output-fd");
+    if (outputFdOption) {
+        const std::string outputFdString = *(outputFdOption + 1);
+        std::string::size_type begin = 0;
+        for (;;) {
+            const std::string::size_type end = outputFdString.find(',', begin);
+            const std::string fdString = outputFdString.substr(begin,
+                                                                end - begin);
+            int fd;
+            if (fdString.empty() ||
+                fdString.find_first_not_of("0123456789") != fdString.npos ||
+                parse(fd, fdString.c_str()))
+            {
+                throw std::runtime_error("Invalid output-fd: " +
+                                         repr(outputFdString));
+            }
+
+            if (std::find(options.outputFds.begin(),
+                          options.outputFds.end(),
+                          fd) != options.outputFds.end())
+            {
+                throw std::runtime_error("Repeated output-fd: " +
+                                         repr(fdString));
+            }
+
+            options.outputFds.push_back(fd);
+            if (end == std::string::npos)
+                break;
+
+            begin = end + 1;
+        }
+
+        if (options.sharedMemoryFd != -1) {
+            throw std::runtime_error(
+                               "--output-fd cannot be combined with --shm.");
+        }
+    }
+
+    const char *const *const fanOutOption = find("--fan-out");
+    if (fanOutOption) {
+        const std::string fanOutString = *(fanOutOption + 1);
+        if (fanOutString == "round-robin")
+            options.fanOut = Options::ROUND_ROBIN;
+        else if (fanOutString == "least-backlog")
+            options.fanOut = Options::LEAST_BACKLOG;
+        else {
+            throw std::runtime_error("Invalid fan-out: " +
+                                     repr(fanOutString));
+        }
+    }
+
+    const char *const *const listenOption = find("--listen");
+    if (listenOption) {
+        options.listenPath = *(listenOption + 1);
+        if (options.listenPath.empty() || options.listenPath[0] == '-') {
+            throw std::runtime_error("Invalid listen: " +
+                                     repr(options.listenPath));
+        }
+
+        // Each client has a connection of its own, but these belong to
+        // whoever started 'mq'.
+        if (options.sharedMemoryFd != -1) {
+            throw std::runtime_error(
+                                  "--listen cannot be combined with --shm.");
+        }
+
+        if (!options.outputFds.empty()) {
+            throw std::runtime_error(
+                            "--listen cannot be combined with --output-fd.");
+        }
+
+        // A message's fragments would be received by different clients,
+        // none of which could put it back together.
+        if (options.fragmentBytes) {
+            throw std::runtime_error(
+                             "--listen cannot be combined with --fragment.");
+        }
+    }
+
+    const char *const *const busyPollOption = find("--busy-poll");
+    if (busyPollOption) {
+        const char *const busyPollString = *(busyPollOption + 1);
+        if (parse(options.busyPollMicroseconds, busyPollString) ||
+            options.busyPollMicroseconds < 0)
+        {
+            throw std::runtime_error("Invalid busy-poll: " +
+                                     repr(busyPollString));
+        }
+
+        // The reactor has no thread to spare for polling.
+        if (options.reactor) {
+            throw std::runtime_error(
+                             "--busy-poll cannot be combined with --reactor.");
+        }
+
+        options.busyPoll = true;
+    }
+
+    const char *const *const cpuOption = find("--cpu");
+    if (cpuOption) {
+        const char *const cpuString = *(cpuOption + 1);
+        if (parse(options.cpu, cpuString) ||
+            options.cpu < 0 ||
+            options.cpu >= CPU_SETSIZE)
+        {
+            throw std::runtime_error("Invalid cpu: " + repr(cpuString));
+        }
+    }
+
+    const char *const *const consumerCpuOption = find("--consumer-cpu");
+    if (consumerCpuOption) {
+        const char *const consumerCpuString = *(consumerCpuOption + 1);
+        if (parse(options.consumerCpu, consumerCpuString) ||
+            options.consumerCpu < 0 ||
+            options.consumerCpu >= CPU_SETSIZE)
+        {
+            throw std::runtime_error("Invalid consumer-cpu: " +
+                                     repr(consumerCpuString));
+        }
+
+        if (options.reactor) {
+            throw std::runtime_error(
+                          "--consumer-cpu cannot be combined with --reactor.");
+        }
+    }
+
+    const char *const *const realtimeOption = find("--realtime");
+    if (realtimeOption) {
+        const char *const realtimeString = *(realtimeOption + 1);
+        if (parse(options.realtimePriority, realtimeString) ||
+            options.realtimePriority < sched_get_priority_min(SCHED_FIFO) ||
+            options.realtimePriority > sched_get_priority_max(SCHED_FIFO))
+        {
+            throw std::runtime_error("Invalid realtime: " +
+                                     repr(realtimeString));
+        }
+    }
+
     return options;
 }
 
@@ -310,44 +687,265 @@ mqd_t openQueue(const Options& options)
                    attributesPtr);
 }
 
+struct OpenedQueue {
+    // A message queue opened before it's served, e.g. by '--listen' for all
+    // of its clients, and its attributes as they were then.
+
+    mqd_t   descriptor;
+    mq_attr attributes;
+};
+
+struct Shared;
+
+struct Unbundling {
+    // The rest of a bundle received with '--bundle-usec': the messages in it
+    // that are yet to be taken, the first of which has its header at
+    // 'offset' in 'messages'.  A message that "probe" passed over is kept as
+    // a bundle of one.
+
+    unsigned          priority;
+    std::vector<char> messages;
+    size_t            offset;
+};
+
+struct Queue {
+    // A message queue being served, known in the protocol by its 'handle'
+    // (always zero unless '--multi'), and the state of consuming from it and
+    // sending to it.  A "consume" having a "timeout" stops once no message has
+    // arrived for 'consumeMilliseconds', and then a consumer thread sets
+    // 'consumerIdle' (guarded by 'Shared::stoppedMutex').  'pending' holds the
+    // messages that are waiting for room in the queue, and is null unless
+    // '--pending' or '--spool' was specified and the queue is open for
+    // writing.  In the threaded engine, pending messages are sent by a sender
+    // thread, which waits for room only until 'drainDeadline' once
+    // 'drainTimed' is set (atomically) by a "close" having a "timeout".
+    // 'openForWriting' is whether the queue is open for writing.
+    // 'receivePool' holds the buffers into which messages are received, and is
+    // null unless the queue is open for reading.  If "consume" was given
+    // credits, then 'credited' is set, and 'credits' is how many more messages
+    // it may take from the queue (both guarded by 'Shared::stoppedMutex' in
+    // the threaded engine).  With '--fragment', messages of up to
+    // 'maxMessageSize' bytes are sent in fragments of up to 'msgsize' bytes
+    // built in 'fragment', and received ones are put back together by
+    // 'reassembler' (null unless the queue is open for reading); see
+    // 'sendToQueue'.  With '--compress', messages are compressed into 'packed'
+    // (see 'pack'), and 'payloadBytes' and 'packedBytes' count the bytes of
+    // the messages sent and received before and after compression.  With
+    // '--bundle-usec', messages of up to 'maxPayloadSize' bytes are sent in
+    // bundles of up to 'maxMessageSize' bytes built in 'bundle', which is sent
+    // once it has no room for the next message (counting up to 'bundleLimit'
+    // bytes, so that it fits in one fragment), or at 'bundleDeadline'; see
+    // 'bundleMessage'.  The messages after the first of each bundle received,
+    // and those that "probe" passed over, are kept in 'unbundling' (guarded by
+    // 'unbundlingMutex') until they are taken, or until 'putBackUnbundled'
+    // puts them back, for which it replaces 'descriptor' for a while.
+    // 'probeMarkers' counts the markers that "probe" has sent, and
+    // 'strayMarkers' those that it gave up on and that haven't been received
+    // since (see 'isStrayMarker').  The 'Reactor' fields are unused by the
+    // threaded engine.
+
+    const unsigned     handle;
+    const std::string  name;
+    mqd_t              descriptor;
+    const ssize_t      msgsize;
+    const size_t       maxMessageSize;  // 'msgsize' or '--fragment', less
+                                        // a byte if '--compress'
+    const size_t       maxPayloadSize;  // less a bundle header if bundling
+    const size_t       bundleLimit;
+    const bool         openForWriting;
+    Shared&            shared;
+    bool               consumerThreadExists;
+    pthread_t          consumerThread;
+    bool               consumerIdle;         // the thread stopped (and why)
+    bool               consumeTimed;         // "consume" had a "timeout"
+    unsigned           consumeMilliseconds;  // idle timeout if 'consumeTimed'
+    bool               credited;
+    unsigned long long credits;
+    Pending *const     pending;      // owned
+    BufferPool *const  receivePool;  // owned
+    bool               senderThreadExists;
+    pthread_t          senderThread;
+    bool               drainTimed;
+    timespec           drainDeadline;
+    Reassembler *const reassembler;     // owned
+    std::vector<char>  fragment;
+    bool               partlySent;      // some of a message's fragments
+    unsigned long long fragmentId;      // of the message partly sent
+    size_t             fragmentOffset;  // of its next fragment
+    std::vector<char>  packed;
+    unsigned long long payloadBytes;
+    unsigned long long packedBytes;
+    std::vector<char>  bundle;
+    size_t             bundleSize;      // bytes of 'bundle' used
+    unsigned           bundlePriority;  // of the messages in it
+    timespec           bundleDeadline;
+    std::deque<Unbundling> unbundling;
+    pthread_mutex_t        unbundlingMutex;
+    unsigned long long probeMarkers;
+    unsigned long long strayMarkers;
+
+    // 'Reactor' state: whether "consume" was issued (and, if it had a
+    // "timeout", when it will stop being idle), whether the queue is readable
+    // and writable as far as we know, and the events registered with 'epoll'
+    // for 'descriptor'.
+    bool               consuming;
+    timespec           consumeDeadline;
+    bool               readable;
+    bool               writable;
+    int                registered;
+
+    Queue(unsigned           queueHandle,
+          const std::string& queueName,
+          mqd_t              queueDescriptor,
+          ssize_t            messageSize,
+          size_t             fragmentBytes,  // or zero
+          bool               compressing,
+          bool               bundling,
+          bool               writing,
+          Pending           *pendingMessages,
+          BufferPool        *receiveBuffers,
+          Reassembler       *reassembledMessages,
+          Shared&            sharedData)
+    : handle(queueHandle)
+    , name(queueName)
+    , descriptor(queueDescriptor)
+    , msgsize(messageSize)
+    , maxMessageSize((fragmentBytes ? fragmentBytes : messageSize) -
+                     compressing)
+    , maxPayloadSize(bundling
+                         ? maxMessageSize - bundleHeaderSize(maxMessageSize)
+                         : maxMessageSize)
+    , bundleLimit(fragmentBytes
+                      ? std::min(maxMessageSize,
+                                 messageSize - FRAGMENT_HEADER_SIZE -
+                                     compressing)
+                      : maxMessageSize)
+    , openForWriting(writing)
+    , shared(sharedData)
+    , consumerThreadExists(false)
+    , consumerIdle(false)
+    , consumeTimed(false)
+    , consumeMilliseconds(0)
+    , credited(false)
+    , credits(0)
+    , pending(pendingMessages)
+    , receivePool(receiveBuffers)
+    , senderThreadExists(false)
+    , drainTimed(false)
+    , drainDeadline()
+    , reassembler(reassembledMessages)
+    , fragment(fragmentBytes ? messageSize : 0)
+    , partlySent(false)
+    , fragmentId(0)
+    , fragmentOffset(0)
+    , packed(compressing ? maxMessageSize + 1 : 0)
+    , payloadBytes(0)
+    , packedBytes(0)
+    , bundle(bundling ? maxMessageSize : 0)
+    , bundleSize(0)
+    , bundlePriority(0)
+    , bundleDeadline()
+    , probeMarkers(0)
+    , strayMarkers(0)
+    , consuming(false)
+    , consumeDeadline()
+    , readable(true)
+    , writable(true)
+    , registered(0)
+    {
+        pthread_mutex_init(&unbundlingMutex, 0);
+    }
+
+    ~Queue()
+    {
+        delete pending;
+        delete receivePool;
+        delete reassembler;
+        pthread_mutex_destroy(&unbundlingMutex);
+    }
+};
+
+// Handles fit in the two bytes that the binary protocol has for them.
+const unsigned MAX_HANDLE = 65535;
+
 struct Shared {
-    // Data shared between threads: mutexes, the message queue descriptor, and
-    // some other misc.
-
-    pthread_mutex_t stoppedMutex;
-    bool            stopped;
-    pthread_mutex_t stdoutMutex;
-    const mqd_t     queue;
-    pthread_mutex_t stderrMutex;
-    const ssize_t   msgsize;
-    bool            consumerThreadExists;
-    pthread_t       consumerThread;
-    const Options&  options;
-
-    explicit Shared(mqd_t          messageQueue,
-                    ssize_t        messageSize,
-                    const Options& commandLineOptions)
+    // Data shared between threads: mutexes, the message queues, and some
+    // other misc.  'queues' is indexed by handle, and is null where no queue
+    // has that handle.  Only the main thread modifies 'queues'; a consumer
+    // thread refers only to its own 'Queue'.  'consumerThreadExists' is
+    // whether any queue has a consumer thread, i.e. whether locking is
+    // necessary.  It includes sender threads.  'sharedMemory' is null unless
+    // '--shm', and 'sharedMemoryMutex' guards its ring.  'splicePool' is null
+    // unless '--splice' and standard output is a pipe.  A consumer thread
+    // that is out of credits waits on 'creditCondition' with 'stoppedMutex'.
+    // 'stats' is updated by every thread without locking, and is reported
+    // by "stats".  'workers' has an output for each '--output-fd', in order,
+    // to which messages received for "consume" go instead of to 'output',
+    // and 'nextWorker' counts the choices among them (see 'chooseWorker').
+
+    pthread_mutex_t      stoppedMutex;
+    pthread_cond_t       creditCondition;
+    bool                 stopped;
+    Output&              output;
+    std::vector<Queue*>  queues;
+    pthread_mutex_t      stderrMutex;
+    bool                 consumerThreadExists;
+    const Options&       options;
+    SharedMemory        *sharedMemory;  // owned
+    pthread_mutex_t      sharedMemoryMutex;
+    BufferPool          *splicePool;    // owned
+    Stats                stats;
+    std::vector<Output*> workers;       // owned
+    unsigned             nextWorker;
+
+    explicit Shared(Output& standardOutput, const Options& commandLineOptions)
     : stopped(false)
-    , queue(messageQueue)
-    , msgsize(messageSize)
+    , output(standardOutput)
     , consumerThreadExists(false)
     , options(commandLineOptions)
+    , sharedMemory(0)
+    , splicePool(0)
+    , nextWorker(0)
     {
         const pthread_mutexattr_t *const defaultAttributes = 0;
 
-        pthread_mutex_init(&stoppedMutex, defaultAttributes);
-        pthread_mutex_init(&stdoutMutex,  defaultAttributes);
-        pthread_mutex_init(&stderrMutex,  defaultAttributes);
+        pthread_mutex_init(&stoppedMutex,      defaultAttributes);
+        pthread_mutex_init(&stderrMutex,       defaultAttributes);
+        pthread_mutex_init(&sharedMemoryMutex, defaultAttributes);
+        pthread_cond_init(&creditCondition, 0);
+
+        output.setStats(&stats);
     }
 
     ~Shared()
     {
+        // A writer thread might still be counting in 'stats'.
+        output.stopWriter();
+        output.setStats(0);
+
+        for (size_t i = 0; i < queues.size(); ++i)
+            delete queues[i];
+
+        for (size_t i = 0; i < workers.size(); ++i)
+            delete workers[i];  // which stops its writer thread first
+
+        delete sharedMemory;
+        delete splicePool;
+
         pthread_mutex_destroy(&stoppedMutex);
-        pthread_mutex_destroy(&stdoutMutex);
         pthread_mutex_destroy(&stderrMutex);
+        pthread_mutex_destroy(&sharedMemoryMutex);
+        pthread_cond_destroy(&creditCondition);
     }
 };
 
+Queue *findQueue(const Shared& shared, unsigned handle)
+    // Return the queue having the specified 'handle' in the specified
+    // 'shared', or null if there is none.
+{
+    return handle < shared.queues.size() ? shared.queues[handle] : 0;
+}
+
 class Lock {
     pthread_mutex_t& mutex;
     bool             holding;
@@ -385,482 +983,4724 @@ class Lock {
 };
 
 
-// -----------------
-// handling commands
-// -----------------
+// -------------
+// wire protocol
+// -------------
+
+// With the '--binary' option, commands and responses are not text.  Instead,
+// each begins with a 'HEADER_SIZE' byte header consisting of, in order: a one
+// byte opcode, a reserved byte (zero), a two byte unsigned queue handle (see
+// '--multi'), a four byte unsigned priority, and an eight byte unsigned
+// length, where the integers are little-endian.  What the priority and length
+// mean depends on the opcode.  A header may be followed by a payload, e.g. the
+// message in a "send" command.
+
+// Every command of the protocol is described once, here, as
+// 'X(name, OPCODE, opcode, response, handle)': its name in the text protocol,
+// the suffix of its 'Opcode' enumerator, its opcode in the binary protocol,
+// the name in the text protocol of the response that 'respond' writes for it
+// (or null if there is none, e.g. for messages), and which queue handle it
+// has (see 'HandleKind').  The opcodes and the tables by which commands are
+// looked up are generated from this list.
+#define MQ_COMMANDS(X)                                                     \
+    X("send",    SEND,    1,  "ack",     HANDLE_OPEN)                      \
+    X("receive", RECEIVE, 2,  0,         HANDLE_OPEN)                      \
+    X("consume", CONSUME, 3,  0,         HANDLE_OPEN)                      \
+    X("count",   COUNT,   4,  "count",   HANDLE_OPEN)                      \
+    X("msgsize", MSGSIZE, 5,  "msgsize", HANDLE_OPEN)                      \
+    X("maxmsg",  MAXMSG,  6,  "maxmsg",  HANDLE_OPEN)                      \
+    X("close",   CLOSE,   7,  0,         HANDLE_NONE)                      \
+    X("sendv",   SENDV,   8,  "ackv",    HANDLE_OPEN)                      \
+    X("open",    OPEN,    9,  "open",    HANDLE_NEW)                       \
+    X("timeout", TIMEOUT, 10, "timeout", HANDLE_NONE)                      \
+    X("stats",   STATS,   11, "stats",   HANDLE_NONE)                      \
+    X("credit",  CREDIT,  12, 0,         HANDLE_OPEN)                      \
+    X("probe",   PROBE,   13, "probe",   HANDLE_OPEN)
+
+enum HandleKind {
+    // With '--multi', whether a command in the text protocol is followed by
+    // a queue handle, and if so, whether it must be that of an open queue.
+    // In the binary protocol, every command has a handle, but it's ignored
+    // unless the command's kind isn't 'HANDLE_NONE'.
+    HANDLE_NONE,  // e.g. "close" and the "timeout" prefix
+    HANDLE_NEW,   // "open"
+    HANDLE_OPEN
+};
 
-int sendHandler(std::string& chunk, Shared& shared)
-{
-    unsigned priority;
-    std::cin >> priority;
-    if (!std::cin) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Unable to read message priority from \"send\" command."
-                  << std::endl;
-        return 1;
-    }
+enum Opcode {
+    // commands, e.g. 'OP_SEND'.  Note that "timeout" is a prefix to another
+    // command, bounding its wait.
+#define MQ_OPCODE(NAME, SUFFIX, OPCODE, RESPONSE, HANDLE) \
+    OP_ ## SUFFIX = OPCODE,
+    MQ_COMMANDS(MQ_OPCODE)
+#undef MQ_OPCODE
+
+    // A response has the opcode of its command with the high bit set.
+    // Messages have 'OP_MSG' whether they are from "receive" or "consume".
+    OP_RESPONSE = 0x80,
+    OP_ACK      = OP_RESPONSE | OP_SEND,
+    OP_MSG      = OP_RESPONSE | OP_RECEIVE,
+    OP_COUNTED  = OP_RESPONSE | OP_COUNT,
+    OP_MSGSIZED = OP_RESPONSE | OP_MSGSIZE,
+    OP_MAXMSGED = OP_RESPONSE | OP_MAXMSG,
+    OP_ACKV     = OP_RESPONSE | OP_SENDV,
+    OP_OPENED   = OP_RESPONSE | OP_OPEN,
+    OP_TIMEDOUT = OP_RESPONSE | OP_TIMEOUT,
+    OP_STATSED  = OP_RESPONSE | OP_STATS,
+    OP_PROBED   = OP_RESPONSE | OP_PROBE,
+
+    // Notifications are responses that aren't to any particular command.
+    // "busy" and "ready" are about a queue's pending messages ('--pending').
+    OP_NOTICE = 0xC0,
+    OP_BUSY   = OP_NOTICE | 1,
+    OP_READY  = OP_NOTICE | 2
+};
 
-    ssize_t size;
-    std::cin >> size;
-    if (!std::cin) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Unable to read message size from \"send\" command." 
-                  << std::endl;
-        return 2;
-    }
-    if (size < 0) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Messages must have a non-negative size. Size " << size
-                  << " is not permitted." << std::endl;
-        return 4;
-    } 
+const int HEADER_SIZE = 16;
 
-    std::cin.ignore();  // Discard space character between size and payload.
+// With '--shm', a message's payload is replaced by its offset in the shared
+// memory, which in the binary protocol is this many little-endian bytes.
+const int OFFSET_SIZE = 8;
 
-    if (size) {
-        chunk.resize(size);
-        std::cin.read(&chunk[0], size);
-        if (!std::cin || std::cin.gcount() != size) {
-            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-            std::cerr << "Unable to read from input all of the supposed "
-                      << size << " byte message. " << std::cin.gcount()
-                      << " were read instead." << std::endl;
-            return 5;
-        }
-    }
+struct CommandName {
+    int         opcode;
+    const char *name;
+    size_t      nameSize;
+    const char *responseName;
+    HandleKind  handle;
+};
 
-    // looping for retry on signal interruption
-    for (;;) {
-        const ssize_t rc = mq_send(shared.queue, 
-                                   chunk.data(), 
-                                   size, 
-                                   priority);
-        if (rc == -1) {
-            // failed to send
-            const int error = errno;
-            if (error != EINTR) {
-                Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-                std::cerr << "Unable to send message for \"send\" command: "
-                          << strerror(error) << std::endl;
-                return 3;
-            }
-        }
-        else {
-            // send succeeded
-            break;
-        }
-    }
+// the commands, in the order of 'MQ_COMMANDS'
+const CommandName COMMAND_NAMES[] = {
+#define MQ_COMMAND_NAME(NAME, SUFFIX, OPCODE, RESPONSE, HANDLE) \
+    { OPCODE, NAME, sizeof NAME - 1, RESPONSE, HANDLE },
+    MQ_COMMANDS(MQ_COMMAND_NAME)
+#undef MQ_COMMAND_NAME
+};
 
-    Lock lock(shared.stdoutMutex, shared.consumerThreadExists);
-    std::cout << "ack " << size << std::endl;
+const CommandName *const COMMAND_NAMES_END =
+    COMMAND_NAMES + sizeof COMMAND_NAMES / sizeof COMMAND_NAMES[0];
 
-    return 0;
-}
+class CommandIndex {
+    // Find a command by its opcode or by its name in constant time, rather
+    // than by comparing against each command in turn.  Names are hashed by
+    // their length and their first and last characters, which distinguishes
+    // nearly all of the commands; a collision costs only another probe.
 
-const int FAIL_RECEIVE               = 1,
-          FAIL_WRITE                 = 2,
-          FAIL_ALLOC                 = 3,
-          FAIL_INTERRUPTED_OR_CLOSED = 4;
+    enum { NUM_OPCODES = 256, NUM_SLOTS = 32 };  // 'NUM_SLOTS' a power of 2
 
-int doReceive(std::string& buffer, Shared& shared)
-    // Receive a message from a POSIX message queue and print the message to
-    // standard output, prefixed by its priority and length.  'doReceive' is
-    // used by both 'receiveHandler' and 'consume'.
-{
-    // Note on the implementation: This code goes out of its way to arrange the
-    // output contiguously in memory before calling 'write'.  In part this
-    // makes the 'write' call simpler, but also it's a (perhaps unnecessary)
-    // optimization that minimizes the number of syscalls ('write' is called
-    // only once per message in the common case).
-    //
-    // The message, once received, will be printed to stdout prefixed with its
-    // priority and size, e.g. a priority-2 message containing "hello" would
-    // be written to stdout as "2 5 hello\n" (without the null terminator).
-    // 'numbersMaxSize' is the maximum possible number of characters that could
-    // be necessary for the "2 5 " prefix.
-    //
-    const int numbersMaxSize =
-        std::numeric_limits<unsigned>::digits10 +  // priority
-        1 +  // separating whitespace
-        1 +  // minus sign for the ssize_t, even though it won't happen
-        std::numeric_limits<ssize_t>::digits10  +  // message size
-        1;   // null terminator, which will be converted into a space
+    const CommandName *byOpcode[NUM_OPCODES];
+    const CommandName *byName[NUM_SLOTS];  // open addressing
 
-    try {
-        buffer.resize(numbersMaxSize +  // <priority> <space> <size> <space>
-                      shared.msgsize +  // the payload received from the queue
-                      1);               // a trailing newline
-    }
-    catch (const std::bad_alloc&) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Failed to allocate memory for consuming messages."
-                  << std::endl;
-        return FAIL_ALLOC;
+    static unsigned hash(const char *name, size_t nameSize)
+    {
+        return nameSize + (unsigned char)(name[0]) +
+               5 * (unsigned char)(name[nameSize - 1]);
     }
 
-    assert(!buffer.empty());
-    char *const bufferBegin = &buffer[0];
-    char *const msgBegin    = bufferBegin + numbersMaxSize;
+  public:
+    CommandIndex()
+    {
+        std::fill(byOpcode, byOpcode + NUM_OPCODES, (CommandName*)(0));
+        std::fill(byName, byName + NUM_SLOTS, (CommandName*)(0));
 
-    assert(buffer.size() >= numbersMaxSize);
-    // The room available for the message itself is the full size of the buffer
-    // minus the space reserved for the prefix and for the trailing newline.
-    const size_t msgBufferSize = size_t(buffer.size() - numbersMaxSize - 1);
+        for (const CommandName *entry = COMMAND_NAMES;
+             entry != COMMAND_NAMES_END;
+             ++entry)
+        {
+            byOpcode[entry->opcode] = entry;
 
-    if (shared.options.debug) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "About to receive with"
-                     " buffer.size()=" << buffer.size()
-                  << " numbersMaxSize=" << numbersMaxSize
-                  << " msgBufferSize=" << msgBufferSize
-                  << " shared.msgsize=" << shared.msgsize << std::endl;     
+            unsigned slot = hash(entry->name, entry->nameSize);
+            while (byName[slot % NUM_SLOTS])
+                ++slot;
+            byName[slot % NUM_SLOTS] = entry;
+        }
     }
 
-    unsigned priority;
-    const ssize_t msgSize = mq_receive(shared.queue, 
-                                       msgBegin, 
-                                       msgBufferSize, 
-                                       &priority);
-    // Handle mq_receive failure.
-    if (msgSize == -1) {
-        const int error = errno;
-        if (error == EINTR || error == EBADF) {
-            return FAIL_INTERRUPTED_OR_CLOSED;
-        }
+    const CommandName *find(int opcode) const
+        // Return the command having the specified 'opcode', or null if there
+        // is none.
+    {
+        return unsigned(opcode) < NUM_OPCODES ? byOpcode[opcode] : 0;
+    }
 
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Failed to receive message: " << strerror(error)
-                  << std::endl;
-        return FAIL_RECEIVE;
+    const CommandName *find(const char *name, size_t nameSize) const
+        // Return the command having the specified 'nameSize' byte 'name', or
+        // null if there is none.
+    {
+        if (!nameSize)
+            return 0;
+
+        for (unsigned slot = hash(name, nameSize);; ++slot) {
+            const CommandName *const entry = byName[slot % NUM_SLOTS];
+            if (!entry)
+                return 0;
+
+            if (entry->nameSize == nameSize &&
+                !memcmp(entry->name, name, nameSize))
+            {
+                return entry;
+            }
+        }
     }
+};
 
-    if (shared.options.debug) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "received a priority " << priority << " message of size "
-                  << msgSize << std::endl;
-    } 
+const CommandIndex COMMANDS;
 
-    assert(msgSize >= 0);
+const char *commandName(int opcode)
+    // Return the name in the text protocol of the command having the
+    // specified 'opcode'.  The behavior is undefined unless there is one.
+{
+    const CommandName *const entry = COMMANDS.find(opcode);
+    assert(entry);
+    return entry->name;
+}
 
-    // Put a newline character after the retrieved message.
-    msgBegin[msgSize] = '\n';
+void encodeHeader(char               *header,
+                  int                 opcode,
+                  unsigned            handle,
+                  unsigned            priority,
+                  unsigned long long  length)
+    // Write to the specified 'header' the binary protocol encoding of the
+    // specified 'opcode', 'handle', 'priority', and 'length'.  The behavior is
+    // undefined unless 'header' has room for at least 'HEADER_SIZE' bytes,
+    // and unless 'handle <= MAX_HANDLE'.
+{
+    header[0] = char(opcode);
+    header[1] = 0;
+    header[2] = char(handle);
+    header[3] = char(handle >> 8);
 
-    // Now calculate how much space is needed before the message to write
-    // <priority> <size> 
-    struct SizeBase10 {
-        int operator()(double number) const {
-            if (number == 0)
-                return 1;
+    for (int i = 0; i < 4; ++i)
+        header[4 + i] = char(priority >> (8 * i));
 
-            return std::floor(1 + std::log10(number)) + // number of digits
-                   int(number < 0);  // minus sign
-       }
-    } const sizeBase10;
+    for (int i = 0; i < 8; ++i)
+        header[8 + i] = char(length >> (8 * i));
+}
 
-    const int numbersExpectedSize =
-        sizeBase10(priority) +
-        1 +  // separating whitespace
-        sizeBase10(msgSize) +
-        1;   // null terminator, which will be converted into a space
+void decodeHeader(int&                opcode,
+                  unsigned&           handle,
+                  unsigned&           priority,
+                  unsigned long long& length,
+                  const char         *header)
+    // Load into the specified 'opcode', 'handle', 'priority', and 'length' the
+    // values encoded in the specified binary protocol 'header'.  The behavior
+    // is undefined unless 'header' has at least 'HEADER_SIZE' bytes.
+{
+    const unsigned char *const bytes =
+        reinterpret_cast<const unsigned char*>(header);
 
-    if (shared.options.debug) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "calculated numbersExpectedSize=" << numbersExpectedSize
-                  << std::endl;
-    } 
+    opcode = bytes[0];
+    handle = bytes[2] | unsigned(bytes[3]) << 8;
+
+    priority = 0;
+    for (int i = 0; i < 4; ++i)
+        priority |= unsigned(bytes[4 + i]) << (8 * i);
 
-    // Format the numeric prefixes to the message payload starting at a
-    // position in the buffer such that the end of the prefixes will be
-    // just before the payload.
-    char *const numbersBegin =
-        bufferBegin + (numbersMaxSize - numbersExpectedSize);                 
+    length = 0;
+    for (int i = 0; i < 8; ++i)
+        length |= (unsigned long long)(bytes[8 + i]) << (8 * i);
+}
+
+void encodeOffset(char *encoded, unsigned long long offset)
+    // Write to the specified 'encoded' the binary protocol encoding of the
+    // specified shared memory 'offset'.  The behavior is undefined unless
+    // 'encoded' has room for at least 'OFFSET_SIZE' bytes.
+{
+    for (int i = 0; i < OFFSET_SIZE; ++i)
+        encoded[i] = char(offset >> (8 * i));
+}
 
-    const std::ptrdiff_t spaceRemaining =
-        bufferBegin + buffer.size() - numbersBegin;
+unsigned long long decodeOffset(const char *encoded)
+    // Return the shared memory offset encoded in the specified binary
+    // protocol 'encoded'.  The behavior is undefined unless 'encoded' has at
+    // least 'OFFSET_SIZE' bytes.
+{
+    const unsigned char *const bytes =
+        reinterpret_cast<const unsigned char*>(encoded);
 
-    // The "+ 1" is to account for the null terminator written (snprinf
-    // does not account for the null terminator in its return value).
-    const int numbersSize = snprintf(numbersBegin,
-                                     spaceRemaining, 
-                                     "%u %lld",
-                                     priority,
-                                     static_cast<long long>(msgSize)) + 1;
+    unsigned long long offset = 0;
+    for (int i = 0; i < OFFSET_SIZE; ++i)
+        offset |= (unsigned long long)(bytes[i]) << (8 * i);
 
-    if (shared.options.debug) {
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "measured numbersSize=" << numbersSize << std::endl;
-    } 
+    return offset;
+}
+
+struct Command {
+    // A command read from standard input, and the means to read the rest of
+    // it.  'name' is the command as it was spelled in the text protocol, and
+    // 'payload' is the most recently read message payload; both point into
+    // 'input's buffer, and so are valid only until the next read.  'priority'
+    // and 'length' are set by whichever function read the most recent header,
+    // which for the binary protocol includes the command itself.  'queue' is
+    // the queue having the command's 'handle', or null for commands that
+    // don't refer to an open queue.  'timed' is whether the command had a
+    // "timeout" prefix, and if so, 'milliseconds' is the timeout.
+
+    Input&             input;
+    const char        *name;
+    size_t             nameSize;
+    int                opcode;
+    unsigned           handle;
+    Queue             *queue;
+    bool               timed;
+    unsigned           milliseconds;
+    unsigned           priority;
+    unsigned long long length;
+    const char        *payload;
+
+    explicit Command(Input& standardInput)
+    : input(standardInput)
+    , name(0)
+    , nameSize(0)
+    , opcode(0)
+    , handle(0)
+    , queue(0)
+    , timed(false)
+    , milliseconds(0)
+    , priority(0)
+    , length(0)
+    , payload(0)
+    {}
+};
 
-    assert(numbersSize == numbersExpectedSize);
+const int READ_OK    = 0,
+          READ_EOF   = 1,
+          READ_ERROR = 2;
 
-    // Overwrite the prefix's trailing null character with a space.
-    numbersBegin[numbersSize - 1] = ' ';
+// 'INCOMPLETE' is returned by the functions that read commands when standard
+// input is nonblocking (see '--reactor') and has run out in the middle of a
+// command.  It is not an error, and is never reported.
+const int INCOMPLETE = -1;
 
-    const int stdoutFd = fileno(stdout);  // always equal to one
+int readBareCommand(Command& command, Shared& shared)
+    // Read the next command from standard input into the specified 'command',
+    // except that a "timeout" prefix is read as if it were a command.  Return
+    // as for 'readCommand'.
+{
+    if (!shared.options.binary) {
+        switch (command.input.token(command.name, command.nameSize)) {
+          case Input::INPUT_OK: break;
+          case Input::INPUT_END: return READ_EOF;
+          case Input::INPUT_AGAIN: return INCOMPLETE;
+          default: {
+              Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+              std::cerr << "Unable to read command: "
+                        << strerror(command.input.error()) << std::endl;
+              return READ_ERROR;
+          }
+        }
 
-    const char *const outputBegin = numbersBegin;
-    const size_t      outputSize  = numbersSize +  // the prefix
-                                    msgSize +  // the payload
-                                    1;  // newline character
+        const CommandName *const entry =
+            COMMANDS.find(command.name, command.nameSize);
 
-    // Write the message priority, size, and contents to stdout.
-    Lock stdoutLock(shared.stdoutMutex, shared.consumerThreadExists);
+        command.opcode = entry ? entry->opcode : 0;
+        command.handle = 0;
 
-    for (ssize_t written = 0; written != ssize_t(outputSize);) {
-        const ssize_t rc = write(stdoutFd, outputBegin, outputSize);
-        if (rc == -1) {
-            const int error = errno;
-            if (error == EINTR) {
-                continue;  // interrupted by signal before writing. Retry.
+        // With '--multi', most commands are followed by the handle of the
+        // queue to which they refer.
+        if (shared.options.multi && entry && entry->handle != HANDLE_NONE) {
+            unsigned long long handle;
+            const int          rc = command.input.number(handle);
+            if (rc == Input::INPUT_AGAIN)
+                return INCOMPLETE;
+
+            if (rc || handle > MAX_HANDLE) {
+                Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+                std::cerr << "Unable to read a valid queue handle from \""
+                          << entry->name << "\" command." << std::endl;
+                return READ_ERROR;
             }
 
-            stdoutLock.release();  // no need to hold stdout during error
+            command.handle = handle;
+        }
+    }
+    else {
+        const char *header;
+        const int   rc = command.input.bytes(header, HEADER_SIZE);
+        if (rc == Input::INPUT_END && command.input.buffered() == 0)
+            return READ_EOF;
+
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+
+        if (rc) {
             Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-            std::cerr << "Failed to return message: " << strerror(error)
+            std::cerr << "Unable to read a complete command header. Only "
+                      << command.input.buffered() << " bytes were read."
                       << std::endl;
-            return FAIL_WRITE;
+            return READ_ERROR;
         }
 
-        written += rc;
+        decodeHeader(command.opcode,
+                     command.handle,
+                     command.priority,
+                     command.length,
+                     header);
+
+        if (!shared.options.multi)
+            command.handle = 0;
+    }
+
+    // Only some commands refer to an open queue, and an unrecognized command
+    // is reported by the caller.
+    const CommandName *const entry = COMMANDS.find(command.opcode);
+    command.queue = findQueue(shared, command.handle);
+    if (!command.queue && entry && entry->handle == HANDLE_OPEN) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "No queue is open having handle " << command.handle
+                  << '.' << std::endl;
+        return READ_ERROR;
     }
 
-    return 0;  
+    return READ_OK;
 }
 
-int receiveHandler(std::string& buffer, Shared& shared)
+int readCommand(Command& command, Shared& shared)
+    // Read the next command from standard input into the specified 'command'.
+    // Return 'READ_OK' on success, 'READ_EOF' if the input is exhausted,
+    // 'INCOMPLETE' if more input is not available yet, or 'READ_ERROR' if a
+    // partial command was read or its handle is not that of an open queue
+    // (this is reported to stderr).  If the command is not recognized,
+    // 'command.opcode' will be zero.  If the command has a "timeout" prefix,
+    // then 'command.timed' is set, and 'command.milliseconds' is the timeout.
 {
-    // Assume that if receive fails, it won't be due to the queue having been
-    // closed, because only a 'close' handler would close the queue.
-    // That means that if we get 'FAIL_INTERRUPTED_OR_CLOSED', then it was due
-    // to a signal interruption, and so we should retry.
-    for (;;) {
-        const int rc = doReceive(buffer, shared);
+    command.timed = false;
 
-        if (rc != FAIL_INTERRUPTED_OR_CLOSED)
-            return rc;
+    int rc = readBareCommand(command, shared);
+    if (rc || command.opcode != OP_TIMEOUT)
+        return rc;
+
+    // In the text protocol, the timeout follows "timeout"; in the binary
+    // protocol, it's the prefix header's length.
+    unsigned long long milliseconds = command.length;
+    if (!shared.options.binary) {
+        rc = command.input.number(milliseconds);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
     }
-}
 
-// Signal handler for 'SIGUSR1', installed in 'consumeHandler'.
-extern "C" void noOpSignalHandler(int) {
-    // TODO: Would it be sufficient to set the 'sigaction' to ignore rather
-    //       than call this no-op function?
+    if (rc || milliseconds > std::numeric_limits<unsigned>::max()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read a valid number of milliseconds from "
+                     "\"timeout\" prefix." << std::endl;
+        return READ_ERROR;
+    }
+
+    rc = readBareCommand(command, shared);
+    if (rc == READ_OK &&
+        command.opcode != OP_SEND    &&
+        command.opcode != OP_RECEIVE &&
+        command.opcode != OP_CONSUME &&
+        command.opcode != OP_CLOSE)
+    {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The \"timeout\" prefix applies only to \"send\", "
+                     "\"receive\", \"consume\", and \"close\"."
+                  << std::endl;
+        return READ_ERROR;
+    }
+
+    if (rc == READ_EOF) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The input ended after a \"timeout\" prefix."
+                  << std::endl;
+        return READ_ERROR;
+    }
+
+    command.timed        = true;
+    command.milliseconds = milliseconds;
+    return rc;
+}
+
+// -----------------
+// handling commands
+// -----------------
+
+int readMessageHeader(Command&    command,
+                      const char *commandName,
+                      Shared&     shared)
+    // Read from standard input the priority and size of a message to send,
+    // loading them into the specified 'command'.  In the text protocol, these
+    // are of the form "<priority> <size> "; in the binary protocol, they are
+    // an 'OP_SEND' header.  Return zero on success, 'INCOMPLETE' if more
+    // input is not available yet, or another nonzero value otherwise.  Use
+    // the specified 'commandName' in diagnostics.
+{
+    if (shared.options.binary) {
+        const char *header;
+        if (const int rc = command.input.bytes(header, HEADER_SIZE)) {
+            if (rc == Input::INPUT_AGAIN)
+                return INCOMPLETE;
+
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read message header from \""
+                      << commandName << "\" command." << std::endl;
+            return 1;
+        }
+
+        // The handle in a message header is ignored, since the message goes
+        // to the queue of the command that it's part of.
+        int      opcode;
+        unsigned handle;
+        decodeHeader(opcode, handle, command.priority, command.length, header);
+        if (opcode != OP_SEND) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Message header in \"" << commandName
+                      << "\" command has opcode " << opcode << " instead of "
+                      << int(OP_SEND) << '.' << std::endl;
+            return 6;
+        }
+
+        return 0;
+    }
+
+    unsigned long long priority;
+    int                rc = command.input.number(priority);
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc || priority > std::numeric_limits<unsigned>::max()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read message priority from \"" << commandName
+                  << "\" command." << std::endl;
+        return 1;
+    }
+
+    rc = command.input.number(command.length);
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read message size from \"" << commandName
+                  << "\" command." << std::endl;
+        return 2;
+    }
+
+    // Discard space character between size and payload.
+    rc = command.input.ignore();
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read the separator after the message size in "
+                     "\"" << commandName << "\" command." << std::endl;
+        return 4;
+    }
+
+    command.priority = priority;
+    return 0;
+}
+
+int readSharedPayload(Command& command, Shared& shared)
+    // Read from standard input the shared memory offset of the
+    // 'command.length' byte payload of a message, and point
+    // 'command.payload' at the payload in the shared memory.  Return as for
+    // 'readPayload'.
+{
+    unsigned long long offset;
+    int                rc;
+    if (shared.options.binary) {
+        const char *encoded;
+        rc = command.input.bytes(encoded, OFFSET_SIZE);
+        if (rc == Input::INPUT_OK)
+            offset = decodeOffset(encoded);
+    }
+    else
+        rc = command.input.number(offset);
+
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read the shared memory offset of a "
+                  << command.length << " byte message." << std::endl;
+        return 5;
+    }
+
+    command.payload = shared.sharedMemory->userBytes(offset, command.length);
+    if (!command.payload) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The " << command.length << " byte message at offset "
+                  << offset << " is not within the user's part of the shared "
+                     "memory." << std::endl;
+        return 8;
+    }
+
+    return 0;
+}
+
+int readPayload(Command& command, Shared& shared)
+    // Read from standard input the 'command.length' byte payload of a message
+    // and point 'command.payload' at it.  With '--shm', the payload is in the
+    // shared memory, and only its offset is read.  Return zero on success,
+    // 'INCOMPLETE' if more input is not available yet, or another nonzero
+    // value otherwise.
+{
+    const size_t maxSize = command.queue->maxPayloadSize;
+    if (command.length > maxSize) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "A " << command.length << " byte message is larger than "
+                     "the queue's maximum message size of " << maxSize
+                  << " bytes." << std::endl;
+        return 7;
+    }
+
+    if (shared.sharedMemory)
+        return readSharedPayload(command, shared);
+
+    if (const int rc = command.input.bytes(command.payload, command.length)) {
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read from input all of the supposed "
+                  << command.length << " byte message. "
+                  << command.input.buffered() << " were read instead."
+                  << std::endl;
+        return 5;
+    }
+
+    return 0;
+}
+
+const int FAIL_RECEIVE               = 1,
+          FAIL_WRITE                 = 2,
+          FAIL_ALLOC                 = 3,
+          FAIL_INTERRUPTED_OR_CLOSED = 4,
+          FAIL_TIMEOUT               = 5;
+
+// A zero absolute deadline has always passed, so it means "don't wait."
+const timespec DONT_WAIT = {};
+
+// The user releases room in the shared memory ring ('--shm') without telling
+// 'mq', so when a message doesn't fit, 'mq' looks again this often.
+const long ROOM_POLL_MILLISECONDS = 1;
+
+bool isBefore(const timespec& left, const timespec& right)
+    // Return whether the specified 'left' time is before the specified 'right'
+    // time.
+{
+    return left.tv_sec < right.tv_sec ||
+           (left.tv_sec == right.tv_sec && left.tv_nsec < right.tv_nsec);
+}
+
+timespec deadlineAfter(unsigned milliseconds)
+    // Return the 'CLOCK_REALTIME' time that is the specified 'milliseconds'
+    // from now.
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec  += milliseconds / 1000;
+    deadline.tv_nsec += long(milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+
+    return deadline;
+}
+
+timespec deadlineAfterMicroseconds(long microseconds)
+    // Return the 'CLOCK_REALTIME' time that is the specified 'microseconds'
+    // from now.
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec  += microseconds / 1000000;
+    deadline.tv_nsec += microseconds % 1000000 * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+
+    return deadline;
+}
+
+int millisecondsUntil(const timespec& deadline)
+    // Return the number of milliseconds from now until the specified
+    // 'deadline' ('CLOCK_REALTIME'), rounded up, or zero if it has passed,
+    // for 'poll' and the like.
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    const long long milliseconds =
+        (deadline.tv_sec - now.tv_sec) * 1000LL +
+        (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return milliseconds < 0 ? 0
+         : milliseconds > std::numeric_limits<int>::max()
+             ? std::numeric_limits<int>::max()
+             : int(milliseconds);
+}
+
+int flushOutput(Output& output, Shared& shared)
+    // Write any output pending in the specified 'output'.  Return zero on
+    // success or 'FAIL_WRITE' otherwise.
+{
+    if (output.flush()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to write output: "
+                  << strerror(output.error()) << std::endl;
+        return FAIL_WRITE;
+    }
+
+    return 0;
+}
+
+int flushOutput(Shared& shared)
+    // Write any output pending in 'shared.output' and in each of
+    // 'shared.workers'.  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    int rc = flushOutput(shared.output, shared);
+    for (size_t i = 0; i < shared.workers.size(); ++i) {
+        if (flushOutput(*shared.workers[i], shared))
+            rc = FAIL_WRITE;
+    }
+
+    return rc;
+}
+
+int stopWriters(Shared& shared)
+    // Stop the writer threads of 'shared.output' and of each of
+    // 'shared.workers', once they have written everything queued for them.
+    // Return zero if every write to them succeeded, or the 'errno' value of
+    // a failed write otherwise.  The behavior is undefined if any other
+    // thread is writing output.
+{
+    shared.output.stopWriter();
+    int error = shared.output.error();
+    for (size_t i = 0; i < shared.workers.size(); ++i) {
+        shared.workers[i]->stopWriter();
+        if (!error)
+            error = shared.workers[i]->error();
+    }
+
+    return error;
+}
+
+bool nextOutputDeadline(Shared& shared, timespec& when)
+    // If 'shared.output' or any of 'shared.workers' has pending output, load
+    // into the specified 'when' the earliest time by which it should be
+    // written, and return 'true'.  Otherwise, return 'false'.
+{
+    bool found = shared.output.deadline(when);
+    for (size_t i = 0; i < shared.workers.size(); ++i) {
+        timespec workerWhen;
+        if (shared.workers[i]->deadline(workerWhen) &&
+            (!found || isBefore(workerWhen, when)))
+        {
+            when  = workerWhen;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+Output& chooseWorker(Shared& shared)
+    // Return the one of 'shared.workers' that is to get the next message
+    // received for "consume": the next in turn with '--fan-out round-robin',
+    // or the one with the fewest bytes not yet read by its reader (whether
+    // still pending in the 'Output' or already in the pipe) with
+    // '--fan-out least-backlog', ties going to the next in turn.  The
+    // behavior is undefined unless 'shared.workers' is not empty.
+{
+    assert(!shared.workers.empty());
+
+    const size_t count = shared.workers.size();
+    const size_t turn  =
+        __atomic_fetch_add(&shared.nextWorker, 1, __ATOMIC_RELAXED) % count;
+    if (shared.options.fanOut == Options::ROUND_ROBIN)
+        return *shared.workers[turn];
+
+    size_t chosen = turn;
+    size_t least  = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < count && least; ++i) {
+        const size_t  index   = (turn + i) % count;
+        Output&       worker  = *shared.workers[index];
+        const size_t  backlog = worker.backlog() + worker.unread();
+        if (backlog < least) {
+            chosen = index;
+            least  = backlog;
+        }
+    }
+
+    return *shared.workers[chosen];
+}
+
+int writeOutput(const char *outputBegin,
+                size_t      outputSize,
+                Output&     output,
+                Shared&     shared)
+    // Write the specified 'outputSize' bytes starting at the specified
+    // 'outputBegin' to the specified 'output' (possibly later, along with
+    // other output).  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    if (output.write(outputBegin, outputSize)) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to return message: "
+                  << strerror(output.error()) << std::endl;
+        return FAIL_WRITE;
+    }
+
+    return 0;
+}
+
+int writeOutput(const char *outputBegin, size_t outputSize, Shared& shared)
+    // Write the specified 'outputSize' bytes starting at the specified
+    // 'outputBegin' to standard output (possibly later, along with other
+    // output).  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    return writeOutput(outputBegin, outputSize, shared.output, shared);
+}
+
+int sendToQueue(mqd_t           queue,
+                const char     *data,
+                size_t          size,
+                unsigned        priority,
+                const timespec *timeout,
+                Stats&          stats)
+    // Send to the specified 'queue' the message of the specified 'size' bytes
+    // at the specified 'data' having the specified 'priority', as 'mq_send'
+    // does, or as 'mq_timedsend' does if the specified 'timeout' is not null.
+    // Time the call and count its outcome in the specified 'stats'.  Return
+    // zero on success or -1 with 'errno' set otherwise.
+{
+    const long long startedAt = Stats::now();
+    const int       rc        = timeout
+                              ? mq_timedsend(queue, data, size, priority,
+                                             timeout)
+                              : mq_send(queue, data, size, priority);
+    const int       error     = errno;
+    stats.record(Stats::SEND, startedAt);
+
+    if (rc == 0) {
+        stats.add(Stats::SENT);
+        stats.add(Stats::SENT_BYTES, size);
+    }
+    else if (error == EINTR)
+        stats.add(Stats::INTERRUPTED);
+    else if (error == ETIMEDOUT || error == EAGAIN)
+        stats.add(Stats::STALLED);
+
+    errno = error;
+    return rc;
+}
+
+// With '--compress', every message in a queue begins with one of these bytes.
+const char PACKED_RAW = 0,  // the rest is the message
+           PACKED_LZ  = 1;  // the rest is the message compressed (see "lz.h")
+
+// Messages shorter than this aren't worth compressing.
+const size_t MIN_COMPRESSED_SIZE = 64;
+
+size_t pack(char *packed, const char *data, size_t size)
+    // Write to the specified 'packed' the message of the specified 'size'
+    // bytes at the specified 'data' as it is sent with '--compress', and
+    // return the size of that.  The message is compressed only if that
+    // makes it at least an eighth smaller, since otherwise the receiver's
+    // work to decompress it would buy little room in the queue.  The
+    // behavior is undefined unless 'packed' has room for 'size + 1' bytes.
+{
+    if (size >= MIN_COMPRESSED_SIZE) {
+        const size_t compressedSize =
+            lzCompress(packed + 1, size - size / 8, data, size);
+        if (compressedSize) {
+            packed[0] = PACKED_LZ;
+            return compressedSize + 1;
+        }
+    }
+
+    packed[0] = PACKED_RAW;
+    memcpy(packed + 1, data, size);
+    return size + 1;
+}
+
+int sendFragments(Queue&          queue,
+                  const char     *data,
+                  size_t          size,
+                  unsigned        priority,
+                  const timespec *timeout)
+    // Send to the specified 'queue' the message of the specified 'size' bytes
+    // at the specified 'data' having the specified 'priority' as fragments
+    // (see "fragment.h").  The specified 'timeout' applies only until the
+    // first fragment is sent, and then the threaded engine waits as long as
+    // it takes to send the rest.  The reactor can't wait, and so it gives up
+    // at 'timeout' as before, but then 'queue.partlySent' is set, and it must
+    // send the same message again to finish it, before any other.  Return
+    // zero on success or -1 with 'errno' set otherwise.
+{
+    if (!queue.partlySent) {
+        queue.fragmentId     = newMessageId();
+        queue.fragmentOffset = 0;
+    }
+
+    const size_t  maxPartSize = queue.msgsize - FRAGMENT_HEADER_SIZE;
+    char *const   fragment    = &queue.fragment[0];
+    do {
+        const size_t partSize =
+            std::min(maxPartSize, size - queue.fragmentOffset);
+        encodeFragmentHeader(fragment,
+                             queue.fragmentId,
+                             queue.fragmentOffset,
+                             size);
+        memcpy(fragment + FRAGMENT_HEADER_SIZE,
+               data + queue.fragmentOffset,
+               partSize);
+
+        if (sendToQueue(queue.descriptor,
+                        fragment,
+                        FRAGMENT_HEADER_SIZE + partSize,
+                        priority,
+                        timeout,
+                        queue.shared.stats))
+        {
+            // A message that can't be sent at all is abandoned.
+            if (errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR)
+                queue.partlySent = false;
+
+            return -1;
+        }
+
+        queue.fragmentOffset += partSize;
+        queue.partlySent      = true;
+        if (!queue.shared.options.reactor)
+            timeout = 0;
+    } while (queue.fragmentOffset < size);
+
+    queue.partlySent = false;
+    return 0;
+}
+
+int sendToQueue(Queue&          queue,
+                const char     *data,
+                size_t          size,
+                unsigned        priority,
+                const timespec *timeout)
+    // Send to the specified 'queue' the message of the specified 'size' bytes
+    // at the specified 'data' having the specified 'priority', as the other
+    // 'sendToQueue' does, except that with '--compress' the message is sent
+    // as 'pack' makes it, and with '--fragment' it's sent by 'sendFragments'
+    // (which see about 'timeout').  Return zero on success or -1 with 'errno'
+    // set otherwise.
+{
+    const Options& options     = queue.shared.options;
+    const size_t   payloadSize = size;
+    if (options.compress) {
+        size = pack(&queue.packed[0], data, size);
+        data = &queue.packed[0];
+    }
+
+    const int rc = options.fragmentBytes
+                 ? sendFragments(queue, data, size, priority, timeout)
+                 : sendToQueue(queue.descriptor,
+                               data,
+                               size,
+                               priority,
+                               timeout,
+                               queue.shared.stats);
+
+    if (!rc && options.compress) {
+        __atomic_fetch_add(&queue.payloadBytes, payloadSize, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&queue.packedBytes, size, __ATOMIC_RELAXED);
+    }
+
+    return rc;
+}
+
+ssize_t receiveFromQueue(mqd_t           queue,
+                         char           *data,
+                         size_t          size,
+                         unsigned&       priority,
+                         const timespec *timeout,
+                         Stats&          stats)
+    // Receive from the specified 'queue' into the specified 'size' bytes at
+    // the specified 'data' a message, loading its priority into the specified
+    // 'priority', as 'mq_receive' does, or as 'mq_timedreceive' does if the
+    // specified 'timeout' is not null.  Time the call and count its outcome
+    // in the specified 'stats'.  Return the size of the message on success or
+    // -1 with 'errno' set otherwise.
+{
+    const long long startedAt = Stats::now();
+    const ssize_t   rc        = timeout
+                              ? mq_timedreceive(queue, data, size, &priority,
+                                                timeout)
+                              : mq_receive(queue, data, size, &priority);
+    const int       error     = errno;
+    stats.record(Stats::RECEIVE, startedAt);
+
+    if (rc != -1) {
+        stats.add(Stats::RECEIVED);
+        stats.add(Stats::RECEIVED_BYTES, rc);
+    }
+    else if (error == EINTR)
+        stats.add(Stats::INTERRUPTED);
+
+    errno = error;
+    return rc;
+}
+
+int sendMessage(const Command&  command,
+                const char     *commandName,
+                Shared&         shared,
+                const timespec *deadline = 0)
+    // Send the payload in the specified 'command' to the command's queue with
+    // the command's priority, retrying if interrupted by a signal.  Return
+    // zero on success, 'FAIL_TIMEOUT' if the optionally specified 'deadline'
+    // ('CLOCK_REALTIME') is not null and passes while the queue is full, or
+    // another nonzero value otherwise.  Note that a 'deadline' in the past
+    // means "don't wait."  Use the specified 'commandName' in diagnostics.
+{
+    // looping for retry on signal interruption
+    for (;;) {
+        // If output is pending and due before 'deadline', then block only
+        // until the output is due, write it, and then go around again.
+        timespec        outputDeadline;
+        const bool      outputPending = nextOutputDeadline(shared,
+                                                           outputDeadline);
+        const bool      outputFirst   =
+            outputPending &&
+            (!deadline || isBefore(outputDeadline, *deadline));
+        const timespec *timeout = outputFirst ? &outputDeadline : deadline;
+
+        const int rc = sendToQueue(*command.queue,
+                                   command.payload,
+                                   command.length,
+                                   command.priority,
+                                   timeout);
+        if (rc == -1) {
+            // failed to send
+            const int error = errno;
+            if (error == ETIMEDOUT) {
+                if (!outputFirst)
+                    return FAIL_TIMEOUT;
+
+                if (const int rc = flushOutput(shared))
+                    return rc;
+            }
+            else if (error != EINTR) {
+                Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+                std::cerr << "Unable to send message for \"" << commandName
+                          << "\" command: " << strerror(error) << std::endl;
+                return 3;
+            }
+        }
+        else {
+            // send succeeded
+            return 0;
+        }
+    }
+}
+
+int respond(int                 opcode,
+            unsigned            handle,
+            unsigned            priority,
+            unsigned long long  length,
+            Shared&             shared)
+    // Write to standard output a response having no payload, i.e. anything
+    // other than a message.  In the text protocol, the response consists of
+    // its name, then the specified 'handle' if '--multi', and then the
+    // number(s) relevant to it; in the binary protocol, it is the header
+    // having the specified 'opcode', 'handle', 'priority', and 'length'.
+    // Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    if (shared.options.binary) {
+        char header[HEADER_SIZE];
+        encodeHeader(header, opcode, handle, priority, length);
+        return writeOutput(header, sizeof header, shared);
+    }
+
+    const char *name;
+    switch (opcode) {
+      case OP_BUSY:  name = "busy";  break;
+      case OP_READY: name = "ready"; break;
+      default: {
+          const CommandName *const entry =
+              COMMANDS.find(opcode & ~OP_RESPONSE);
+          assert(entry && entry->responseName);
+          name = entry->responseName;
+      }
+    }
+
+    char  buffer[80];
+    char *end = stpcpy(buffer, name);
+    if (shared.options.multi) {
+        *end++ = ' ';
+        end    = appendDecimal(end, handle);
+    }
+    if (opcode == OP_ACKV) {
+        *end++ = ' ';
+        end    = appendDecimal(end, priority);
+    }
+    if (opcode == OP_TIMEDOUT) {
+        // The priority is the opcode of the command that timed out.
+        *end++ = ' ';
+        end    = stpcpy(end, commandName(priority));
+    }
+    else if (opcode != OP_OPENED && opcode != OP_READY) {
+        *end++ = ' ';
+        end    = appendDecimal(end, length);
+    }
+    *end++ = '\n';
+
+    assert(end <= buffer + sizeof buffer);
+    return writeOutput(buffer, end - buffer, shared);
+}
+
+int keepPending(const Command&  command,
+                Shared&         shared,
+                const timespec *deadline = 0)
+    // Add the message in the specified 'command' to its queue's pending
+    // messages, waiting while they are full, and writing out "busy" if they
+    // become busy.  Return zero on success, 'FAIL_TIMEOUT' if the optionally
+    // specified 'deadline' ('CLOCK_REALTIME') is not null and passes while
+    // the pending messages are full, or another nonzero value otherwise.  As
+    // in 'sendMessage', pending output is written before waiting too long.
+    // The behavior is undefined unless the queue has pending messages.
+{
+    Queue& queue = *command.queue;
+    assert(queue.pending);
+
+    for (;;) {
+        timespec        outputDeadline;
+        const bool      outputPending = nextOutputDeadline(shared,
+                                                           outputDeadline);
+        const bool      outputFirst   =
+            outputPending &&
+            (!deadline || isBefore(outputDeadline, *deadline));
+        const timespec *timeout = outputFirst ? &outputDeadline : deadline;
+
+        switch (queue.pending->push(command.priority,
+                                    command.payload,
+                                    command.length,
+                                    timeout)) {
+          case Pending::PENDING_OK:
+            return 0;
+          case Pending::PENDING_BUSY:
+            return respond(OP_BUSY,
+                           queue.handle,
+                           0,
+                           queue.pending->bytes(),
+                           shared);
+          case Pending::PENDING_TIMEOUT:
+            if (!outputFirst)
+                return FAIL_TIMEOUT;
+
+            if (const int rc = flushOutput(shared))
+                return rc;
+            break;
+          case Pending::PENDING_ERROR: {
+              const int error = errno;
+              Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+              std::cerr << "Unable to spool a message for queue "
+                        << repr(queue.name) << ": " << strerror(error)
+                        << std::endl;
+              return error;
+          }
+          default: {
+              Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+              std::cerr << "Unable to keep a message pending for queue "
+                        << repr(queue.name) << ", because its pending "
+                           "messages can no longer be sent." << std::endl;
+              return 3;
+          }
+        }
+    }
+}
+
+void reportUnsent(const Queue& queue, Shared& shared)
+    // Say on standard error that the messages pending for the specified
+    // 'queue' are discarded, since "close" timed out waiting for room.
+{
+    Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+    std::cerr << "Discarded the messages pending for queue "
+              << repr(queue.name) << " (" << queue.pending->bytes()
+              << " bytes, counting bookkeeping), since \"close\" timed out"
+                 " waiting for room in the queue." << std::endl;
+}
+
+extern "C" void *sendPending(void *data);  // defined further below
+
+int startSender(Queue& queue, Shared& shared)
+    // Create the thread that sends the specified 'queue's pending messages.
+    // Return zero on success or a nonzero value otherwise.
+{
+    // As in 'consumeHandler', set the flags before creating the thread.
+    const bool hadThread        = shared.consumerThreadExists;
+    shared.consumerThreadExists = true;
+    queue.senderThreadExists    = true;
+
+    const int rc = pthread_create(&queue.senderThread,
+                                  0,             // default attributes
+                                  &sendPending,  // start routine
+                                  &queue);       // argument to start routine
+    if (rc) {
+        queue.senderThreadExists = false;
+        Lock lock(shared.stderrMutex, hadThread);
+        std::cerr << "Unable to create sender thread: " << strerror(rc)
+                  << std::endl;
+    }
+
+    return rc;
+}
+
+int sendOrKeep(const Command&  command,
+               const char     *commandName,
+               Shared&         shared,
+               const timespec *deadline = 0)
+    // Send the message in the specified 'command' as 'sendMessage' does,
+    // unless its queue can keep messages pending ('--pending' or
+    // '--spool').  In that case, send it only if nothing is pending already
+    // and the queue has room, and otherwise keep it pending for the queue's
+    // sender thread, which is started if necessary.  Return zero on success,
+    // 'FAIL_TIMEOUT' if the optionally specified 'deadline' is not null and
+    // passes first, or another nonzero value otherwise.  Use the specified
+    // 'commandName' in diagnostics.
+{
+    Queue& queue = *command.queue;
+    if (!queue.pending)
+        return sendMessage(command, commandName, shared, deadline);
+
+    // A message can't skip ahead of those already pending.  The sender
+    // thread removes a message only after sending it, so this is not a race.
+    if (queue.pending->bytes() == 0) {
+        const int rc = sendMessage(command, commandName, shared, &DONT_WAIT);
+        if (rc != FAIL_TIMEOUT)
+            return rc;
+    }
+
+    if (!queue.senderThreadExists) {
+        if (const int rc = startSender(queue, shared))
+            return rc;
+    }
+
+    return keepPending(command, shared, deadline);
+}
+
+bool fitsBundle(const Queue& queue, const Command& command)
+    // Return whether the message in the specified 'command' can be added to
+    // the bundle of the specified 'queue' without sending the bundle first,
+    // i.e. whether the bundle is empty, or has the message's priority and
+    // room for it and isn't partly sent already (see 'sendToQueue').
+{
+    return queue.bundleSize == 0 ||
+           (command.priority == queue.bundlePriority && !queue.partlySent &&
+            queue.bundleSize + bundleHeaderSize(command.length) +
+                command.length <= queue.bundleLimit);
+}
+
+void addToBundle(Queue& queue, const Command& command)
+    // Add the message in the specified 'command' to the bundle of the
+    // specified 'queue', which is then due to be sent after '--bundle-usec'
+    // if the message is its first.  The behavior is undefined unless
+    // 'fitsBundle(queue, command)'.
+{
+    if (queue.bundleSize == 0) {
+        queue.bundlePriority = command.priority;
+        queue.bundleDeadline =
+            deadlineAfterMicroseconds(queue.shared.options.bundleMicroseconds);
+    }
+
+    char *const header  = &queue.bundle[queue.bundleSize];
+    char *const message = encodeBundleHeader(header, command.length);
+    memcpy(message, command.payload, command.length);
+    queue.bundleSize += message - header + command.length;
+}
+
+void loadBundle(Command& bundled, Queue& queue)
+    // Load into the specified 'bundled' the bundle of the specified 'queue'
+    // as the message to send.
+{
+    bundled.queue    = &queue;
+    bundled.handle   = queue.handle;
+    bundled.priority = queue.bundlePriority;
+    bundled.length   = queue.bundleSize;
+    bundled.payload  = &queue.bundle[0];
+}
+
+int bundleMessage(const Command&  command,
+                  const char     *commandName,
+                  Shared&         shared,
+                  const timespec *deadline = 0)
+    // Add the message in the specified 'command' to its queue's bundle, as
+    // '--bundle-usec' does, first sending the bundle as 'sendOrKeep' does if
+    // the message doesn't fit in it.  Return zero on success, 'FAIL_TIMEOUT'
+    // if the optionally specified 'deadline' is not null and passes first (in
+    // which case the message isn't added), or another nonzero value
+    // otherwise.  Use the specified 'commandName' in diagnostics.
+{
+    Queue& queue = *command.queue;
+    if (!fitsBundle(queue, command)) {
+        Command bundled(command);
+        loadBundle(bundled, queue);
+        if (const int rc = sendOrKeep(bundled, commandName, shared, deadline))
+            return rc;
+
+        queue.bundleSize = 0;
+    }
+
+    addToBundle(queue, command);
+    return 0;
+}
+
+int sendBundles(const Command& command, Shared& shared, bool lingering)
+    // Send the bundle of each queue, as 'sendOrKeep' does, in the order in
+    // which they're due, using a copy of the specified 'command'.  If the
+    // specified 'lingering' is 'true', then wait for each bundle to be due
+    // before sending it, unless standard input has something to read first,
+    // in which case return without sending the rest.  Return zero on success
+    // or a nonzero value otherwise.
+{
+    for (;;) {
+        Queue *due = 0;
+        for (size_t i = 0; i < shared.queues.size(); ++i) {
+            Queue *const queue = shared.queues[i];
+            if (queue && queue->bundleSize &&
+                (!due || isBefore(queue->bundleDeadline, due->bundleDeadline)))
+            {
+                due = queue;
+            }
+        }
+
+        if (!due)
+            return 0;
+
+        if (lingering) {
+            pollfd    input = { fileno(stdin), POLLIN, 0 };
+            const int rc    =
+                poll(&input, 1, millisecondsUntil(due->bundleDeadline));
+            if (rc > 0)
+                return 0;  // another message might join the bundle
+
+            if (rc == -1 && errno == EINTR)
+                continue;
+        }
+
+        Command bundled(command);
+        loadBundle(bundled, *due);
+        if (const int rc = sendOrKeep(bundled, "send", shared))
+            return rc;
+
+        due->bundleSize = 0;
+    }
+}
+
+struct ReadHookData {
+    // What 'beforeRead' needs.
+    Command& command;
+    Shared&  shared;
+};
+
+extern "C" void beforeRead(void *data)
+    // Flush the output of the 'Shared' object in the 'ReadHookData' at the
+    // specified 'data', and, with '--bundle-usec', send the bundles as they
+    // come due, unless more input arrives first.  This is installed as the
+    // read hook of standard input, so that pending output is written, and
+    // bundles are sent, before the main thread blocks reading the next
+    // command.
+{
+    ReadHookData& hook = *static_cast<ReadHookData*>(data);
+    flushOutput(hook.shared);  // failures are reported
+
+    if (hook.shared.options.bundle) {
+        sendBundles(hook.command, hook.shared, true);  // failures are reported
+        flushOutput(hook.shared);  // e.g. "busy" from sending them
+    }
+}
+
+int sendHandler(Command& command, Shared& shared)
+{
+    // In the binary protocol, the command header is also the message header.
+    if (!shared.options.binary) {
+        if (const int rc = readMessageHeader(command, "send", shared))
+            return rc;
+    }
+
+    if (const int rc = readPayload(command, shared))
+        return rc;
+
+    // With a "timeout" prefix, give up on the message if there's no room for
+    // it in time.
+    timespec deadline;
+    if (command.timed)
+        deadline = deadlineAfter(command.milliseconds);
+
+    const timespec *const timeout = command.timed ? &deadline : 0;
+    const int             rc      =
+        shared.options.bundle
+            ? bundleMessage(command, "send", shared, timeout)
+            : sendOrKeep(command, "send", shared, timeout);
+    switch (rc) {
+      case 0:
+        break;
+      case FAIL_TIMEOUT:
+        return respond(OP_TIMEDOUT, command.handle, OP_SEND, 0, shared);
+      default:
+        return rc;
+    }
+
+    return respond(OP_ACK,
+                   command.handle,
+                   command.priority,
+                   command.length,
+                   shared);
+}
+
+int readCount(unsigned& count, Command& command, Shared& shared)
+    // Load into the specified 'count' the number of messages in the "sendv"
+    // or "probe" 'command', which in the text protocol follows the command's
+    // name (and handle), and in the binary protocol is the command header's
+    // length.  Return zero on success, 'INCOMPLETE' if more input is not
+    // available yet, or another nonzero value otherwise.
+{
+    unsigned long long value = command.length;
+    int                rc    = 0;
+    if (!shared.options.binary) {
+        rc = command.input.number(value);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+    }
+
+    if (rc || value > std::numeric_limits<unsigned>::max()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read a valid message count from \""
+                  << commandName(command.opcode) << "\" command."
+                  << std::endl;
+        return 1;
+    }
+
+    count = value;
+    return 0;
+}
+
+int sendvHandler(Command& command, Shared& shared)
+    // Send a batch of messages, each as in 'sendHandler', and then acknowledge
+    // all of them at once with "ackv <count> <bytes>".  If a message in the
+    // batch cannot be read or sent, acknowledge only the messages preceding
+    // it, so that '<count>' is the index of the message that failed.
+{
+    unsigned count;
+    if (const int rc = readCount(count, command, shared))
+        return rc;
+
+    unsigned           sent  = 0;
+    unsigned long long bytes = 0;
+    int                rc    = 0;
+    for (; sent < count; ++sent) {
+        if ((rc = readMessageHeader(command, "sendv", shared)) ||
+            (rc = readPayload(command, shared))                ||
+            (rc = shared.options.bundle
+                      ? bundleMessage(command, "sendv", shared)
+                      : sendOrKeep(command, "sendv", shared)))
+        {
+            break;
+        }
+
+        bytes += command.length;
+    }
+
+    const int respondResult =
+        respond(OP_ACKV, command.handle, sent, bytes, shared);
+    return rc ? rc : respondResult;
+}
+
+int writeSharedMessage(unsigned            handle,
+                       unsigned            priority,
+                       size_t              size,
+                       unsigned long long  offset,
+                       Shared&             shared)
+    // Write to standard output that the message of the specified 'size' and
+    // 'priority', from the queue having the specified 'handle', is at the
+    // specified 'offset' in the shared memory.  In the text protocol, this is
+    // the message's usual prefix followed by the offset instead of the
+    // payload, e.g. "2 5 4096\n"; in the binary protocol, it is an 'OP_MSG'
+    // header followed by the offset.  Return zero on success or 'FAIL_WRITE'
+    // otherwise.
+{
+    char  buffer[80];
+    char *end = buffer;
+    if (shared.options.binary) {
+        encodeHeader(buffer, OP_MSG, handle, priority, size);
+        encodeOffset(buffer + HEADER_SIZE, offset);
+        end += HEADER_SIZE + OFFSET_SIZE;
+    }
+    else {
+        if (shared.options.multi) {
+            end    = appendDecimal(end, handle);
+            *end++ = ' ';
+        }
+        end    = appendDecimal(end, priority);
+        *end++ = ' ';
+        end    = appendDecimal(end, size);
+        *end++ = ' ';
+        end    = appendDecimal(end, offset);
+        *end++ = '\n';
+    }
+
+    assert(end <= buffer + sizeof buffer);
+    return writeOutput(buffer, end - buffer, shared);
+}
+
+int shareMessage(const char *data,
+                 size_t      size,
+                 unsigned    priority,
+                 unsigned    handle,
+                 Shared&     shared)
+    // Copy the message of the specified 'size' bytes at the specified 'data'
+    // into the shared memory ring, waiting for the user to release room as
+    // necessary, and then write out where it is, as 'writeSharedMessage'
+    // does with the specified 'priority' and 'handle'.  Return zero on
+    // success or a nonzero value otherwise.
+{
+    // Other threads wait meanwhile, so that messages are written out in the
+    // same order as they are in the ring.
+    SharedMemory& memory = *shared.sharedMemory;
+    Lock          lock(shared.sharedMemoryMutex, shared.consumerThreadExists);
+
+    char *destination;
+    while (!(destination = memory.reserve(size))) {
+        // The user might be waiting to read the messages that it would then
+        // release, so write them out before waiting.
+        lock.release();
+        if (const int rc = flushOutput(shared))
+            return rc;
+
+        timespec pause = {};
+        pause.tv_nsec  = ROOM_POLL_MILLISECONDS * 1000000;
+        nanosleep(&pause, 0);
+        lock.acquire();
+    }
+
+    memcpy(destination, data, size);
+    return writeSharedMessage(handle,
+                              priority,
+                              size,
+                              memory.commit(size),
+                              shared);
+}
+
+class PooledBuffer {
+    // A buffer from a 'BufferPool' (or null, if there is no pool or no free
+    // buffer), which is given back to the pool when this object is
+    // destroyed, to be reused once the output has written 'reusableAt'
+    // bytes.
+
+    BufferPool *const pool;
+
+    PooledBuffer(const PooledBuffer&);             // not copyable
+    PooledBuffer& operator=(const PooledBuffer&);  // not assignable
+
+  public:
+    char *const        buffer;
+    unsigned long long reusableAt;
+
+    PooledBuffer(BufferPool *bufferPool, Output& output)
+    : pool(bufferPool)
+    , buffer(bufferPool ? bufferPool->acquire(output.written()) : 0)
+    , reusableAt(0)
+    {}
+
+    ~PooledBuffer()
+    {
+        if (buffer)
+            pool->release(buffer, reusableAt);
+    }
+};
+
+int spliceOutput(const char   *prefix,
+                 size_t        prefixSize,
+                 const char   *data,
+                 size_t        size,
+                 PooledBuffer& pooled,
+                 Shared&       shared)
+    // Write to standard output the specified 'prefixSize' bytes at the
+    // specified 'prefix' followed by the specified 'size' bytes at the
+    // specified 'data', which is in the specified 'pooled' buffer.  If 'size'
+    // is at least '--splice', then splice 'data' into the pipe rather than
+    // copying it, and keep 'pooled' from being reused until the pipe is done
+    // with it.  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    iovec parts[2];
+    parts[0].iov_base = const_cast<char*>(prefix);
+    parts[0].iov_len  = prefixSize;
+    parts[1].iov_base = const_cast<char*>(data);
+    parts[1].iov_len  = size;
+
+    int rc;
+    if (size < shared.options.spliceBytes)
+        rc = shared.output.write(parts, 2);
+    else {
+        unsigned long long end;
+        rc = shared.output.splice(parts, 1, data, size, end);
+        pooled.reusableAt = end + shared.output.pipeCapacity();
+    }
+
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to return message: "
+                  << strerror(shared.output.error()) << std::endl;
+        return FAIL_WRITE;
+    }
+
+    return 0;
+}
+
+// A received message is formatted in a buffer that has room before the
+// message for the text protocol's prefix of numbers (see 'doReceive'), which
+// is at most this many characters.  The binary protocol's header fits there
+// too.
+const int NUMBERS_MAX_SIZE =
+    std::numeric_limits<unsigned>::digits10 + 1 +  // handle
+    1 +  // separating whitespace
+    std::numeric_limits<unsigned>::digits10 + 1 +  // priority
+    1 +  // separating whitespace
+    std::numeric_limits<ssize_t>::digits10 + 1 +   // message size
+    1;   // whitespace before the payload
+
+// Each queue that is read has this many receive buffers: one for the main
+// thread's "receive", and one for the queue's consumer thread.
+const size_t RECEIVE_BUFFERS = 2;
+
+// With '--fragment', a queue puts back together at most this many messages
+// at once, e.g. one from each of this many senders.
+const size_t MAX_PARTIAL_MESSAGES = 64;
+
+size_t receiveBufferSize(ssize_t msgsize)
+    // Return the size of a buffer in which to receive and format a message
+    // from a queue having the specified 'msgsize'.
+{
+    return NUMBERS_MAX_SIZE +  // <priority> <space> <size> <space>
+           msgsize +           // the payload received from the queue
+           1;                  // a trailing newline
+}
+
+bool reassemble(char              *&bufferBegin,
+                char              *&msgBegin,
+                ssize_t&            msgSize,
+                std::vector<char>&  assembled,
+                Queue&              queue)
+    // Take the specified 'msgSize' bytes at the specified 'msgBegin', just
+    // received from the specified 'queue' with '--fragment', as a fragment.
+    // If it is a whole message, then point 'msgBegin' and 'msgSize' at the
+    // message after the fragment's header, move the specified 'bufferBegin'
+    // along with 'msgBegin', and return 'true'.  If it is the
+    // last of a message's fragments, then load the message's buffer into
+    // the specified 'assembled', point the specified 'bufferBegin' at it and
+    // 'msgBegin' and 'msgSize' at the message in it (after room for
+    // 'NUMBERS_MAX_SIZE' characters), and return 'true'.  Otherwise, keep the
+    // fragment (or, if it's invalid, discard it) and return 'false'.
+{
+    Shared& shared = queue.shared;
+
+    unsigned long long id;
+    size_t             offset;
+    size_t             total;
+    if (size_t(msgSize) >= FRAGMENT_HEADER_SIZE) {
+        decodeFragmentHeader(id, offset, total, msgBegin);
+        if (offset == 0 && total == msgSize - FRAGMENT_HEADER_SIZE) {
+            bufferBegin += FRAGMENT_HEADER_SIZE;
+            msgBegin    += FRAGMENT_HEADER_SIZE;
+            msgSize      = total;
+            return true;
+        }
+    }
+
+    switch (queue.reassembler->add(msgBegin, msgSize, assembled)) {
+      case Reassembler::REASSEMBLY_COMPLETE:
+        bufferBegin = &assembled[0];
+        msgBegin    = bufferBegin + NUMBERS_MAX_SIZE;
+        msgSize     = assembled.size() - NUMBERS_MAX_SIZE - 1;
+        return true;
+      case Reassembler::REASSEMBLY_DROPPED: {
+          Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+          std::cerr << "Discarded an incomplete message from queue "
+                    << repr(queue.name) << " to make room for another."
+                    << std::endl;
+          break;
+      }
+      case Reassembler::REASSEMBLY_INVALID: {
+          Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+          std::cerr << "Discarded a " << msgSize << " byte message from "
+                       "queue " << repr(queue.name) << ", since it isn't a "
+                       "valid fragment." << std::endl;
+          break;
+      }
+    }
+
+    return false;
+}
+
+bool unpack(char              *&bufferBegin,
+            char              *&msgBegin,
+            ssize_t&            msgSize,
+            std::vector<char>&  unpacked,
+            Queue&              queue)
+    // Take the specified 'msgSize' bytes at the specified 'msgBegin', just
+    // received from the specified 'queue' with '--compress', as 'pack' made
+    // them.  If they are the message as it was, then point 'msgBegin' and
+    // 'msgSize' at the message after its marker, move the specified
+    // 'bufferBegin' along with 'msgBegin', and return 'true'.  If they are
+    // the message compressed, then decompress it into the specified
+    // 'unpacked', point 'bufferBegin' at it and 'msgBegin' and 'msgSize' at
+    // the message in it (after room for 'NUMBERS_MAX_SIZE' characters), and
+    // return 'true'.  Otherwise, discard the message and return 'false'.
+{
+    if (msgSize > 0 && msgBegin[0] == PACKED_RAW) {
+        __atomic_fetch_add(&queue.payloadBytes, msgSize - 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&queue.packedBytes, msgSize, __ATOMIC_RELAXED);
+        ++bufferBegin;
+        ++msgBegin;
+        --msgSize;
+        return true;
+    }
+
+    if (msgSize > 0 && msgBegin[0] == PACKED_LZ) {
+        const size_t size = lzDecompressedSize(msgBegin + 1, msgSize - 1);
+        if (size <= queue.maxMessageSize) {
+            unpacked.resize(NUMBERS_MAX_SIZE + size + 1);
+            char *const begin = &unpacked[0] + NUMBERS_MAX_SIZE;
+            if (!lzDecompress(begin, size, msgBegin + 1, msgSize - 1)) {
+                __atomic_fetch_add(&queue.payloadBytes,
+                                   size,
+                                   __ATOMIC_RELAXED);
+                __atomic_fetch_add(&queue.packedBytes,
+                                   msgSize,
+                                   __ATOMIC_RELAXED);
+                bufferBegin = &unpacked[0];
+                msgBegin    = begin;
+                msgSize     = size;
+                return true;
+            }
+        }
+    }
+
+    Shared& shared = queue.shared;
+    Lock    lock(shared.stderrMutex, shared.consumerThreadExists);
+    std::cerr << "Discarded a " << msgSize << " byte message from queue "
+              << repr(queue.name) << ", since it isn't a valid compressed "
+                 "message." << std::endl;
+    return false;
+}
+
+bool unbundle(char     *&bufferBegin,
+              char     *&msgBegin,
+              ssize_t&   msgSize,
+              unsigned   priority,
+              Queue&     queue)
+    // Take the specified 'msgSize' bytes at the specified 'msgBegin', just
+    // received from the specified 'queue' with '--bundle-usec', as a bundle
+    // of messages having the specified 'priority'.  If it is valid, then
+    // keep the messages after the first in 'queue.unbundling', point
+    // 'msgBegin' and 'msgSize' at the first, move the specified
+    // 'bufferBegin' along with 'msgBegin', and return 'true'.  Otherwise,
+    // discard it and return 'false'.
+{
+    const char *const end  = msgBegin + msgSize;
+    const char       *next = msgBegin;
+    size_t            size  = 0;
+    bool              valid = !decodeBundleHeader(size, next, end);
+
+    const size_t headerSize = next - msgBegin;
+    const size_t firstSize  = size;
+    while (valid && (next += size) != end)
+        valid = !decodeBundleHeader(size, next, end);
+
+    Shared& shared = queue.shared;
+    if (!valid) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Discarded a " << end - msgBegin << " byte message from "
+                     "queue " << repr(queue.name) << ", since it isn't a "
+                     "valid bundle." << std::endl;
+        return false;
+    }
+
+    bufferBegin += headerSize;
+    msgBegin    += headerSize;
+    msgSize      = firstSize;
+
+    const char *const restBegin = msgBegin + msgSize;
+    if (restBegin != end) {
+        Lock lock(queue.unbundlingMutex, shared.consumerThreadExists);
+        queue.unbundling.push_back(Unbundling());
+
+        Unbundling& rest = queue.unbundling.back();
+        rest.priority = priority;
+        rest.messages.assign(restBegin, end);
+        rest.offset   = 0;
+    }
+
+    return true;
+}
+
+bool takeUnbundled(char              *&bufferBegin,
+                   char              *&msgBegin,
+                   ssize_t&            msgSize,
+                   unsigned&           priority,
+                   std::vector<char>&  spilled,
+                   size_t              room,
+                   Queue&              queue)
+    // If the specified 'queue' has messages kept from bundles received with
+    // '--bundle-usec', then take the one that was received first, copy it
+    // into the buffer at the specified 'bufferBegin' after room for
+    // 'NUMBERS_MAX_SIZE' characters (or, if it's larger than the specified
+    // 'room', likewise into the specified 'spilled', and point 'bufferBegin'
+    // there), point the specified 'msgBegin' and 'msgSize' at it, load its
+    // priority into the specified 'priority', and return 'true'.  Otherwise,
+    // return 'false'.
+{
+    Lock lock(queue.unbundlingMutex, queue.shared.consumerThreadExists);
+    if (queue.unbundling.empty())
+        return false;
+
+    Unbundling&       rest = queue.unbundling.front();
+    const char *const end  = &rest.messages[0] + rest.messages.size();
+    const char       *next = &rest.messages[0] + rest.offset;
+    size_t            size = 0;
+    decodeBundleHeader(size, next, end);  // checked by 'unbundle'
+
+    if (size > room) {
+        spilled.resize(NUMBERS_MAX_SIZE + size + 1);
+        bufferBegin = &spilled[0];
+    }
+
+    msgBegin = bufferBegin + NUMBERS_MAX_SIZE;
+    memcpy(msgBegin, next, size);
+    msgSize  = size;
+    priority = rest.priority;
+
+    rest.offset = next + size - &rest.messages[0];
+    if (rest.offset == rest.messages.size())
+        queue.unbundling.pop_front();
+
+    return true;
+}
+
+// "probe" sends markers of this many bytes: 'PROBE_MAGIC', and then the ID
+// of the process that sent it, its sequence number (see
+// 'Queue::probeMarkers'), and the 'Stats::now' at which it was sent, as
+// native-endian 'unsigned long long'.
+const char   PROBE_MAGIC[8]    = { 'm', 'q', 'p', 'r', 'o', 'b', 'e', 0 };
+const size_t PROBE_MARKER_SIZE = sizeof PROBE_MAGIC +
+                                 3 * sizeof(unsigned long long);
+
+bool isStrayMarker(const char *data, size_t size, const Queue& queue)
+    // Return whether the message of the specified 'size' bytes at the
+    // specified 'data' is a marker that "probe" sent to the specified 'queue'
+    // and then gave up on.
+{
+    if (size != PROBE_MARKER_SIZE ||
+        memcmp(data, PROBE_MAGIC, sizeof PROBE_MAGIC))
+    {
+        return false;
+    }
+
+    unsigned long long fields[2];  // process, sequence
+    memcpy(fields, data + sizeof PROBE_MAGIC, sizeof fields);
+    return fields[0] == (unsigned long long)(getpid()) &&
+           fields[1] <  queue.probeMarkers;
+}
+
+int receiveWhole(char              *&bufferBegin,
+                 char              *&msgBegin,
+                 ssize_t&            msgSize,
+                 unsigned&           priority,
+                 std::vector<char>&  assembled,
+                 std::vector<char>&  unpacked,
+                 size_t              room,
+                 Queue&              queue,
+                 const timespec     *deadline)
+    // Receive a message from the specified 'queue' into the specified 'room'
+    // bytes at the specified 'msgBegin', within the buffer at the specified
+    // 'bufferBegin', as '--fragment', '--compress', and '--bundle-usec' have
+    // it (using the specified 'assembled' and 'unpacked' as 'reassemble' and
+    // 'unpack' do), and load its size into the specified 'msgSize' and its
+    // priority into the specified 'priority', moving 'bufferBegin' and
+    // 'msgBegin' as they do.  Discard markers that "probe" gave up on (see
+    // 'isStrayMarker').  Write pending output before waiting too long, as
+    // 'sendMessage' does.  Return zero once a whole message is received,
+    // or if 'mq_receive' fails, in which case 'msgSize' is -1 and 'errno'
+    // says why.  Return 'FAIL_TIMEOUT' if the specified 'deadline'
+    // ('CLOCK_REALTIME') is not null and passes first, or another nonzero
+    // value if writing output fails.
+{
+    Shared& shared = queue.shared;
+    for (;;) {
+        // If output is pending and due before 'deadline', then block only
+        // until the output is due, write it, and then go around again.
+        timespec        outputDeadline;
+        const bool      outputPending = nextOutputDeadline(shared,
+                                                           outputDeadline);
+        const bool      outputFirst   =
+            outputPending &&
+            (!deadline || isBefore(outputDeadline, *deadline));
+        const timespec *timeout = outputFirst ? &outputDeadline : deadline;
+
+        msgSize = receiveFromQueue(queue.descriptor,
+                                   msgBegin,
+                                   room,
+                                   priority,
+                                   timeout,
+                                   shared.stats);
+        if (msgSize != -1) {
+            // With '--fragment', keep receiving until a message is whole.
+            if (queue.reassembler &&
+                !reassemble(bufferBegin, msgBegin, msgSize, assembled, queue))
+            {
+                continue;
+            }
+
+            if (shared.options.compress &&
+                !unpack(bufferBegin, msgBegin, msgSize, unpacked, queue))
+            {
+                continue;
+            }
+
+            if (shared.options.bundle &&
+                !unbundle(bufferBegin, msgBegin, msgSize, priority, queue))
+            {
+                continue;
+            }
+
+            if (queue.strayMarkers && isStrayMarker(msgBegin, msgSize, queue))
+            {
+                --queue.strayMarkers;
+                continue;
+            }
+
+            return 0;
+        }
+
+        if (errno != ETIMEDOUT)
+            return 0;
+
+        if (!outputFirst)
+            return FAIL_TIMEOUT;
+
+        if (const int rc = flushOutput(shared))
+            return rc;
+    }
+}
+
+int doReceive(Queue&          queue,
+              Shared&         shared,
+              bool            consuming,
+              const timespec *deadline = 0)
+    // Receive a message from the specified 'queue' and print the message to
+    // standard output, prefixed by the queue's handle (if '--multi') and the
+    // message's priority and length.  If the specified 'consuming' is 'true'
+    // and there are '--output-fd' workers, print it to one of them instead
+    // (see 'chooseWorker').  With '--shm', put the message in the shared
+    // memory instead, and print its offset there.  If the optionally
+    // specified 'deadline' ('CLOCK_REALTIME') is not null and passes before a
+    // message is available, return 'FAIL_TIMEOUT'.  Note that a 'deadline' in
+    // the past means "don't wait."  'doReceive' is used by both
+    // 'receiveHandler' (not 'consuming') and 'consume' ('consuming').
+{
+    // Note on the implementation: This code goes out of its way to arrange the
+    // output contiguously in memory before calling 'write'.  In part this
+    // makes the 'write' call simpler, but also it's a (perhaps unnecessary)
+    // optimization that minimizes the number of syscalls ('write' is called
+    // only once per message in the common case).
+    //
+    // The message, once received, will be printed to stdout prefixed with its
+    // priority and size, e.g. a priority-2 message containing "hello" would
+    // be written to stdout as "2 5 hello\n" (without the null terminator), or
+    // as "7 2 5 hello\n" if it came from the queue having handle 7 in
+    // '--multi' mode.  'NUMBERS_MAX_SIZE' is the maximum possible number of
+    // characters that could be necessary for the "7 2 5 " prefix.
+    //
+    // The buffer comes from the queue's receive pool, and so was allocated
+    // when the queue was opened and is not initialized here.  With
+    // '--fragment', a message that came in more than one fragment is
+    // formatted in the buffer in which it was put back together instead, and
+    // with '--compress', a compressed message is formatted in the buffer into
+    // which it was decompressed.  With '--bundle-usec', a message kept from
+    // a bundle is copied into the buffer (or, if it doesn't fit, into a
+    // buffer of its own).
+    PooledBuffer received(queue.receivePool, shared.output);
+    if (!received.buffer) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "No receive buffer is free for queue "
+                  << repr(queue.name) << '.' << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    const size_t bufferSize = receiveBufferSize(queue.msgsize);
+
+    // With '--shm', receive the message right into the shared memory if
+    // there's room, no other thread could be putting messages there, and the
+    // message needn't be decompressed.  Otherwise, it's copied there
+    // afterward (see 'shareMessage').
+    SharedMemory *const memory = shared.sharedMemory;
+    char *const         direct = memory && !shared.consumerThreadExists &&
+                                 !shared.options.compress &&
+                                 !shared.options.bundle
+                                     ? memory->reserve(queue.msgsize)
+                                     : 0;
+
+    // Which worker gets the message is chosen once it has arrived, since
+    // their backlogs may change while waiting for it.
+    const bool toWorker = consuming && !shared.workers.empty();
+
+    // With '--splice', a message that might be large enough to be spliced
+    // is received into a page-aligned buffer from the pool, if one is free,
+    // so that the pipe can take the buffer's pages as they are.  Only
+    // standard output is spliced into.
+    BufferPool *const pool =
+        shared.splicePool && !memory && !toWorker &&
+        size_t(queue.msgsize) >= shared.options.spliceBytes &&
+        size_t(queue.msgsize) < shared.splicePool->bufferSize()
+            ? shared.splicePool
+            : 0;
+    PooledBuffer pooled(pool, shared.output);
+
+    char *bufferBegin = received.buffer;
+    char *msgBegin    = direct        ? direct
+                      : pooled.buffer ? pooled.buffer
+                                      : bufferBegin + NUMBERS_MAX_SIZE;
+    std::vector<char> assembled;
+    std::vector<char> unpacked;
+    std::vector<char> spilled;
+
+    // The room available for the message itself is the full size of the buffer
+    // minus the space reserved for the prefix and for the trailing newline.
+    const size_t msgBufferSize = bufferSize - NUMBERS_MAX_SIZE - 1;
+
+    if (shared.options.debug) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "About to receive with"
+                     " bufferSize=" << bufferSize
+                  << " NUMBERS_MAX_SIZE=" << NUMBERS_MAX_SIZE
+                  << " msgBufferSize=" << msgBufferSize
+                  << " queue.msgsize=" << queue.msgsize << std::endl;     
+    }
+
+    unsigned priority;
+    ssize_t  msgSize;
+
+    // Messages kept from a bundle ('--bundle-usec') are taken before another
+    // is received.
+    const bool held = takeUnbundled(bufferBegin,
+                                    msgBegin,
+                                    msgSize,
+                                    priority,
+                                    spilled,
+                                    msgBufferSize,
+                                    queue);
+
+    if (!held) {
+        const int rc = receiveWhole(bufferBegin,
+                                    msgBegin,
+                                    msgSize,
+                                    priority,
+                                    assembled,
+                                    unpacked,
+                                    msgBufferSize,
+                                    queue,
+                                    deadline);
+        if (rc)
+            return rc;
+    }
+
+    // Handle mq_receive failure.
+    if (msgSize == -1) {
+        const int error = errno;
+        if (error == EINTR || error == EBADF) {
+            return FAIL_INTERRUPTED_OR_CLOSED;
+        }
+
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to receive message: " << strerror(error)
+                  << std::endl;
+        return FAIL_RECEIVE;
+    }
+
+    if (shared.options.debug) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "received a priority " << priority << " message of size "
+                  << msgSize << std::endl;
+    } 
+
+    assert(msgSize >= 0);
+
+    if (direct && !held) {
+        return writeSharedMessage(queue.handle,
+                                  priority,
+                                  msgSize,
+                                  memory->commit(msgSize),
+                                  shared);
+    }
+
+    if (memory)
+        return shareMessage(msgBegin, msgSize, priority, queue.handle, shared);
+
+    Output& output = toWorker ? chooseWorker(shared) : shared.output;
+
+    // A message put back together from fragments, decompressed, or kept from
+    // a bundle isn't in 'pooled'.
+    const bool splicing =
+        pooled.buffer && assembled.empty() && unpacked.empty() && !held;
+
+    if (shared.options.binary) {
+        // The binary protocol's header goes immediately before the payload
+        // (unless it's in a pooled buffer), and nothing goes after it.
+        assert(NUMBERS_MAX_SIZE >= HEADER_SIZE);
+        char *const headerBegin =
+            splicing ? bufferBegin : msgBegin - HEADER_SIZE;
+        encodeHeader(headerBegin, OP_MSG, queue.handle, priority, msgSize);
+        if (splicing) {
+            return spliceOutput(headerBegin,
+                                HEADER_SIZE,
+                                msgBegin,
+                                msgSize,
+                                pooled,
+                                shared);
+        }
+
+        return writeOutput(headerBegin, HEADER_SIZE + msgSize, output, shared);
+    }
+
+    // Put a newline character after the retrieved message.
+    msgBegin[msgSize] = '\n';
+
+    // Format the numeric prefix, "[<handle> ]<priority> <size> ", backward
+    // from the end of the room reserved for it, so that the prefix ends just
+    // before the payload.
+    char *const numbersEnd   = bufferBegin + NUMBERS_MAX_SIZE;
+    char       *numbersBegin = numbersEnd;
+    *--numbersBegin = ' ';
+    numbersBegin    = formatDecimal(numbersBegin, msgSize);
+    *--numbersBegin = ' ';
+    numbersBegin    = formatDecimal(numbersBegin, priority);
+    if (shared.options.multi) {
+        *--numbersBegin = ' ';
+        numbersBegin    = formatDecimal(numbersBegin, queue.handle);
+    }
+
+    const int numbersSize = numbersEnd - numbersBegin;
+    assert(numbersBegin >= bufferBegin);
+
+    if (shared.options.debug) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "formatted numbersSize=" << numbersSize << std::endl;
+    }
+
+    if (splicing) {
+        return spliceOutput(numbersBegin,
+                            numbersSize,
+                            msgBegin,
+                            msgSize + 1,  // and the newline character
+                            pooled,
+                            shared);
+    }
+
+    return writeOutput(numbersBegin,
+                       numbersSize +  // the prefix
+                       msgSize +  // the payload
+                       1,  // newline character
+                       output,
+                       shared);
+}
+
+int receiveHandler(Command& command, Shared& shared)
+{
+    // Assume that if receive fails, it won't be due to the queue having been
+    // closed, because only a 'close' handler would close the queue.
+    // That means that if we get 'FAIL_INTERRUPTED_OR_CLOSED', then it was due
+    // to a signal interruption, and so we should retry.
+    timespec deadline;
+    if (command.timed)
+        deadline = deadlineAfter(command.milliseconds);
+
+    // With '--bundle-usec', the message awaited might be in a bundle that
+    // would otherwise wait for the next command to be read.
+    if (shared.options.bundle) {
+        if (const int rc = sendBundles(command, shared, false))
+            return rc;
+    }
+
+    for (;;) {
+        const int rc = doReceive(*command.queue,
+                                 shared,
+                                 false,
+                                 command.timed ? &deadline : 0);
+
+        if (rc == FAIL_TIMEOUT)
+            return respond(OP_TIMEDOUT, command.handle, OP_RECEIVE, 0, shared);
+
+        if (rc != FAIL_INTERRUPTED_OR_CLOSED)
+            return rc;
+    }
+}
+
+// Signal handler for 'SIGUSR1', installed in 'consumeHandler'.
+extern "C" void noOpSignalHandler(int) {
+    // TODO: Would it be sufficient to set the 'sigaction' to ignore rather
+    //       than call this no-op function?
+}
+
+int readCredits(Command& command, bool required, Shared& shared)
+    // Load into 'command.length' the number of credits given by the "consume"
+    // or "credit" in the specified 'command', or zero if there are none.  In
+    // the text protocol, they follow the command (and its handle) on the same
+    // line, and must if the specified 'required' is 'true'; in the binary
+    // protocol, they are the header's length, which has been read already.
+    // Return zero on success, 'INCOMPLETE' if more input is not available
+    // yet, or another nonzero value otherwise.
+{
+    if (shared.options.binary)
+        return 0;
+
+    command.length = 0;
+
+    int rc = 0;
+    if (!required) {
+        // Look past spaces, but not past the end of the line, for a number.
+        char next;
+        while ((rc = command.input.peek(next)) == Input::INPUT_OK &&
+               (next == ' ' || next == '\t'))
+        {
+            command.input.ignore();
+        }
+
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+
+        if (rc == Input::INPUT_END || (!rc && (next < '0' || next > '9')))
+            return 0;  // no credits
+    }
+
+    if (!rc)
+        rc = command.input.number(command.length);
+
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read a valid number of credits from \""
+                  << commandName(command.opcode) << "\" command."
+                  << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+void addCredits(Queue& queue, unsigned long long credits, Shared& shared)
+    // Let "consume" take the specified 'credits' more messages from the
+    // specified 'queue', and from now on take messages only while it has
+    // credits, unless 'credits' is zero.
+{
+    if (!credits)
+        return;
+
+    Lock lock(shared.stoppedMutex, shared.consumerThreadExists);
+
+    // An idle "timeout" counts only the time that "consume" could have
+    // taken a message.
+    if (!queue.credits && queue.consumeTimed)
+        queue.consumeDeadline = deadlineAfter(queue.consumeMilliseconds);
+
+    queue.credited  = true;
+    queue.credits  += credits;
+    pthread_cond_broadcast(&shared.creditCondition);
+}
+
+bool hasCredit(const Queue& queue)
+    // Return whether "consume" may take a message from the specified 'queue'
+    // now, i.e. whether it has credits or was given none.  In the threaded
+    // engine, the behavior is undefined unless 'Shared::stoppedMutex' is
+    // held.
+{
+    return !queue.credited || queue.credits;
+}
+
+int creditHandler(Command& command, Shared& shared)
+{
+    if (const int rc = readCredits(command, true, shared))
+        return rc;
+
+    addCredits(*command.queue, command.length, shared);
+    return 0;
+}
+
+extern "C" void *consume(void *data);  // defined further below
+
+int consumeHandler(Command& command, Shared& shared)
+{
+    Queue& queue = *command.queue;
+    if (const int rc = readCredits(command, false, shared))
+        return rc;
+
+    addCredits(queue, command.length, shared);
+
+    if (queue.consumerThreadExists) {
+        // A consumer thread that stopped for being idle can be replaced.
+        Lock lock(shared.stoppedMutex);
+        if (!queue.consumerIdle)
+            return 0;  // already consuming
+
+        lock.release();
+        pthread_join(queue.consumerThread, 0);
+        queue.consumerThreadExists = false;
+        queue.consumerIdle         = false;
+    }
+
+    queue.consumeTimed        = command.timed;
+    queue.consumeMilliseconds = command.milliseconds;
+
+    // Don't do anything when a 'SIGUSR1' signal is received.  'SIGUSR1' is the
+    // signal used to wake up the consumer thread (if we ever create a consumer
+    // thread) from 'mq_receive', on systems where closing the queue is not
+    // sufficient.  We can't ignore the signal (since we want it to interrupt
+    // 'mq_receive'), but we also don't want it to do anything.  So, let the
+    // handler be a no-op function ('noOpSignalHandler'). TODO: is that true?
+    struct sigaction doNothing = {};
+    doNothing.sa_handler = &noOpSignalHandler;
+    sigaction(SIGUSR1,     // signal
+              &doNothing,  // action
+              0);          // don't need old action
+
+    // Once any consumer thread exists, the main thread must lock, so set the
+    // flag before creating the thread.  If this thread can't be created, it
+    // doesn't matter that the flag is left set.
+    const bool hadConsumerThread = shared.consumerThreadExists;
+    shared.consumerThreadExists  = true;
+    queue.consumerThreadExists   = true;
+
+    const int rc = pthread_create(&queue.consumerThread,
+                                  0,         // pthread_attr_t (0 -> defaults)
+                                  &consume,  // start routine
+                                  &queue);   // argument to start routine
+    if (rc) {
+        const int error = errno;
+        queue.consumerThreadExists = false;
+        Lock lock(shared.stderrMutex, hadConsumerThread);
+        std::cerr << "Unable to create consumer thread: " << strerror(error)
+                  << std::endl;
+    }
+ 
+    return rc;
+}
+
+int countHandler(Command& command, Shared& shared)
+{
+    mq_attr attributes;
+    if (const int rc = mq_getattr(command.queue->descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to get queue attributes to query message count: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    return respond(OP_COUNTED,
+                   command.handle,
+                   0,
+                   attributes.mq_curmsgs,
+                   shared);
+}
+
+int msgsizeHandler(Command& command, Shared& shared)
+{
+    mq_attr attributes;
+    if (const int rc = mq_getattr(command.queue->descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to get queue attributes to report msgsize: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    return respond(OP_MSGSIZED,
+                   command.handle,
+                   0,
+                   attributes.mq_msgsize,
+                   shared);
+}
+
+int maxmsgHandler(Command& command, Shared& shared)
+{
+    mq_attr attributes;
+    if (const int rc = mq_getattr(command.queue->descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to get queue attributes to report maxmsg: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    return respond(OP_MAXMSGED,
+                   command.handle,
+                   0,
+                   attributes.mq_maxmsg,
+                   shared);
+}
+
+int statsHandler(Command&, Shared& shared)
+    // Write out the counters and histograms of 'shared.stats' as one
+    // response.  In the text protocol, it's "stats" followed by the
+    // "<name>=<value>" pairs on one line; in the binary protocol, the pairs
+    // are the payload, and the header's length is theirs.  The response has
+    // no queue handle, because the statistics are of the whole process
+    // (except for the compression of each queue, with '--compress').
+{
+    std::string response;
+    try {
+        std::string line;
+        shared.stats.format(line);
+
+        // With '--compress', also say how much smaller each queue's
+        // messages have been sent, as "compression.<handle>=<packed>/<raw>".
+        for (size_t i = 0; shared.options.compress && i < shared.queues.size();
+             ++i)
+        {
+            const Queue *const queue = shared.queues[i];
+            if (!queue)
+                continue;
+
+            char field[80];
+            snprintf(field, sizeof field, " compression.%u=%llu/%llu",
+                     queue->handle,
+                     __atomic_load_n(&queue->packedBytes, __ATOMIC_RELAXED),
+                     __atomic_load_n(&queue->payloadBytes, __ATOMIC_RELAXED));
+            line += field;
+        }
+
+        if (shared.options.binary) {
+            char header[HEADER_SIZE];
+            encodeHeader(header, OP_STATSED, 0, 0, line.size());
+            response.assign(header, sizeof header);
+            response += line;
+        }
+        else {
+            response = "stats ";
+            response += line;
+            response += '\n';
+        }
+    }
+    catch (const std::bad_alloc&) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to allocate memory for statistics." << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    return writeOutput(response.data(), response.size(), shared);
+}
+
+// "probe" gives up on a marker that it can't send, or that doesn't come
+// back, within this long.
+const unsigned PROBE_TIMEOUT_MILLISECONDS = 1000;
+
+int putBackUnbundled(Queue& queue)
+    // Send the messages kept from bundles received from the specified
+    // 'queue' (see 'unbundle'), or passed over by "probe", that no "receive"
+    // or "consume" took back to the queue at their priorities (as bundles,
+    // with '--bundle-usec'), without waiting for room.  Use a descriptor of
+    // their own, since "close" has closed the queue's by then, and it might
+    // not have been open for writing, or might block.  Return zero on
+    // success, or say how many messages were lost and return a nonzero value
+    // otherwise.  The behavior is undefined if any other thread is using
+    // 'queue'.
+{
+    if (queue.unbundling.empty())
+        return 0;
+
+    Shared&     shared     = queue.shared;
+    const mqd_t descriptor = mq_open(queue.name.c_str(),
+                                     O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    int         error      = descriptor == mqd_t(-1) ? errno : 0;
+
+    const mqd_t closed = queue.descriptor;
+    queue.descriptor   = descriptor;
+    while (!error && !queue.unbundling.empty()) {
+        const Unbundling& rest = queue.unbundling.front();
+        const char *const end  = &rest.messages[0] + rest.messages.size();
+        const char       *data = &rest.messages[0] + rest.offset;
+        size_t            size = end - data;
+
+        // Without '--bundle-usec', only "probe" keeps messages, as bundles of
+        // one, and they go back as they came.
+        if (!shared.options.bundle)
+            decodeBundleHeader(size, data, end);
+
+        if (sendToQueue(queue,
+                        data,
+                        size,
+                        rest.priority,
+                        0))  // no timeout, but the queue is nonblocking
+        {
+            error = errno;
+            break;
+        }
+
+        queue.unbundling.pop_front();
+    }
+    queue.descriptor = closed;
+
+    if (descriptor != mqd_t(-1))
+        mq_close(descriptor);
+
+    if (!error)
+        return 0;
+
+    size_t lost = 0;
+    for (size_t i = 0; i < queue.unbundling.size(); ++i) {
+        const Unbundling& rest = queue.unbundling[i];
+        const char *const end  = &rest.messages[0] + rest.messages.size();
+        const char       *next = &rest.messages[0] + rest.offset;
+        for (size_t size = 0;
+             next != end && !decodeBundleHeader(size, next, end);
+             next += size)
+        {
+            ++lost;
+        }
+    }
+    queue.unbundling.clear();
+
+    Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+    std::cerr << "Discarded " << lost << " message(s) kept from bundles "
+                 "received from queue " << repr(queue.name) << ", since "
+                 "they can't be put back: " << strerror(error) << std::endl;
+    return 1;
+}
+
+void holdMessage(Queue&      queue,
+                 size_t      position,
+                 unsigned    priority,
+                 const char *data,
+                 size_t      size)
+    // Keep the specified 'size' bytes at the specified 'data' as a message
+    // having the specified 'priority', to be put back in the specified
+    // 'queue' (see 'putBackUnbundled') after the specified 'position'
+    // messages or bundles already kept, and before any others.
+{
+    Lock lock(queue.unbundlingMutex, queue.shared.consumerThreadExists);
+    Unbundling& held = *queue.unbundling.insert(
+                                       queue.unbundling.begin() + position,
+                                       Unbundling());
+
+    held.priority = priority;
+    held.messages.resize(MAX_BUNDLE_HEADER_SIZE + size);
+    char *const begin = &held.messages[0];
+    char *const end   = encodeBundleHeader(begin, size);
+    std::copy(data, data + size, end);
+    held.messages.resize(end - begin + size);
+    held.offset = 0;
+}
+
+int awaitMarker(Queue&              queue,
+                unsigned long long  sequence,
+                Stats&              probeStats,
+                bool&               arrived,
+                bool&               passedOver)
+    // Receive from the specified 'queue' until the marker that "probe" sent
+    // having the specified 'sequence' arrives, and then count the time it
+    // took in the specified 'probeStats' and in those of the process, and
+    // set the specified 'arrived' to 'true'.  Discard other markers, and
+    // keep any other message (see 'holdMessage') to be put back, setting the
+    // specified 'passedOver' to 'true'.  If the marker hasn't arrived after
+    // 'PROBE_TIMEOUT_MILLISECONDS', then set 'arrived' to 'false'.  Return
+    // zero on success or a nonzero value otherwise.
+{
+    Shared& shared = queue.shared;
+    arrived = false;
+
+    PooledBuffer received(queue.receivePool, shared.output);
+    if (!received.buffer) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "No receive buffer is free for queue "
+                  << repr(queue.name) << '.' << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    const size_t   room     = receiveBufferSize(queue.msgsize) -
+                              NUMBERS_MAX_SIZE - 1;
+    const timespec deadline = deadlineAfter(PROBE_TIMEOUT_MILLISECONDS);
+    const unsigned long long processId = getpid();
+
+    for (;;) {
+        char              *bufferBegin = received.buffer;
+        char              *msgBegin    = bufferBegin + NUMBERS_MAX_SIZE;
+        std::vector<char>  assembled;
+        std::vector<char>  unpacked;
+        unsigned           priority;
+        ssize_t            msgSize;
+
+        // A message passed over goes before the rest of its bundle.
+        size_t heldBefore;
+        {
+            Lock lock(queue.unbundlingMutex, shared.consumerThreadExists);
+            heldBefore = queue.unbundling.size();
+        }
+
+        switch (const int rc = receiveWhole(bufferBegin,
+                                            msgBegin,
+                                            msgSize,
+                                            priority,
+                                            assembled,
+                                            unpacked,
+                                            room,
+                                            queue,
+                                            &deadline)) {
+          case 0:
+            break;
+          case FAIL_TIMEOUT:
+            return 0;
+          default:
+            return rc;
+        }
+
+        if (msgSize == -1) {
+            const int error = errno;
+            if (error == EINTR)
+                continue;
+
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Failed to receive a \"probe\" marker: "
+                      << strerror(error) << std::endl;
+            return FAIL_RECEIVE;
+        }
+
+        if (size_t(msgSize) != PROBE_MARKER_SIZE ||
+            memcmp(msgBegin, PROBE_MAGIC, sizeof PROBE_MAGIC))
+        {
+            holdMessage(queue, heldBefore, priority, msgBegin, msgSize);
+            passedOver = true;
+            continue;
+        }
+
+        unsigned long long fields[3];  // process, sequence, time sent
+        memcpy(fields, msgBegin + sizeof PROBE_MAGIC, sizeof fields);
+        if (fields[0] != processId || fields[1] != sequence)
+            continue;  // another's
+
+        probeStats.record(Stats::TRANSIT, (long long)(fields[2]));
+        shared.stats.record(Stats::TRANSIT, (long long)(fields[2]));
+        arrived = true;
+        return 0;
+    }
+}
+
+int probeHandler(Command& command, Shared& shared)
+    // Send the number of markers given by the specified 'command' through
+    // its queue at the highest priority, one at a time, receiving each back
+    // before sending the next, and write out how many were sent and came
+    // back, how long they took to pass through the queue, and how long the
+    // whole command took.  In the text protocol, the response is "probe"
+    // (and the handle, if '--multi') followed by "<name>=<value>" pairs on
+    // one line; in the binary protocol, the pairs are the payload, and the
+    // header's length is theirs.  A marker is sent and received as any other
+    // message is (e.g. compressed, with '--compress'), and its transit time
+    // is measured with 'CLOCK_MONOTONIC' from just before it's sent until
+    // it's received, so it doesn't include standard input and output.  If
+    // the queue can't be probed, or other messages arrive in the meantime
+    // (which are put back), then the response is "refused" and the reason
+    // instead of the pairs (in the binary protocol, it has priority 1, and
+    // the reason is the payload).  Return zero on success, including then,
+    // or a nonzero value otherwise.
+{
+    const long long startedAt = Stats::now();
+
+    unsigned count;
+    if (const int rc = readCount(count, command, shared))
+        return rc;
+
+    Queue&  queue = *command.queue;
+    mq_attr attributes;
+    if (mq_getattr(queue.descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to get the attributes of queue "
+                  << repr(queue.name) << ": " << strerror(error) << std::endl;
+        return 1;
+    }
+
+    // The reactor would have to stop serving everything else to wait for a
+    // marker, so it doesn't probe.
+    const char *refusal =
+        shared.options.reactor
+            ? "reactor"
+        : !queue.receivePool || !queue.openForWriting
+            ? "access"
+        : queue.consumerThreadExists || queue.consuming
+            ? "consuming"
+        : queue.partlySent || (queue.pending && queue.pending->bytes())
+            ? "pending"
+        : attributes.mq_curmsgs || !queue.unbundling.empty()
+            ? "nonempty"
+        : queue.maxPayloadSize < PROBE_MARKER_SIZE
+            ? "msgsize"
+            : 0;
+
+    // With '--bundle-usec', each marker is a bundle of its own.
+    char        marker[MAX_BUNDLE_HEADER_SIZE + PROBE_MARKER_SIZE];
+    char *const body = shared.options.bundle
+                           ? encodeBundleHeader(marker, PROBE_MARKER_SIZE)
+                           : marker;
+    memcpy(body, PROBE_MAGIC, sizeof PROBE_MAGIC);
+
+    Command probe(command);
+    probe.payload  = marker;
+    probe.length   = body + PROBE_MARKER_SIZE - marker;
+    probe.priority = sysconf(_SC_MQ_PRIO_MAX) - 1;
+
+    Stats    probeStats;
+    unsigned sent    = 0;
+    unsigned arrived = 0;
+    for (; !refusal && sent < count; ++sent) {
+        const unsigned long long sequence  = queue.probeMarkers;
+        const unsigned long long fields[3] = {
+            (unsigned long long)(getpid()),
+            sequence,
+            (unsigned long long)(Stats::now())
+        };
+        memcpy(body + sizeof PROBE_MAGIC, fields, sizeof fields);
+
+        const timespec deadline = deadlineAfter(PROBE_TIMEOUT_MILLISECONDS);
+        const int      rc       =
+            sendMessage(probe, "probe", shared, &deadline);
+        if (rc == FAIL_TIMEOUT)
+            break;  // the queue stayed full
+
+        if (rc)
+            return rc;
+
+        // A marker given up on is discarded if it arrives later.
+        bool      came;
+        bool      passedOver  = false;
+        const int awaitResult = awaitMarker(queue,
+                                            sequence,
+                                            probeStats,
+                                            came,
+                                            passedOver);
+        queue.strayMarkers += !came;
+        ++queue.probeMarkers;
+
+        if (awaitResult || passedOver) {
+            const int putBackResult = putBackUnbundled(queue);
+            if (awaitResult || putBackResult)
+                return awaitResult ? awaitResult : putBackResult;
+
+            refusal = "traffic";
+        }
+
+        arrived += came;
+    }
+
+    std::string response;
+    try {
+        std::string line;
+        if (refusal) {
+            line = refusal;
+        }
+        else {
+            char field[80];
+            snprintf(field, sizeof field, "sent=%u received=%u transit_ns=",
+                     sent,
+                     arrived);
+            line = field;
+            probeStats.formatHistogram(line, Stats::TRANSIT);
+            snprintf(field, sizeof field, " elapsed_ns=%lld",
+                     Stats::now() - startedAt);
+            line += field;
+        }
+
+        if (shared.options.binary) {
+            char header[HEADER_SIZE];
+            encodeHeader(header,
+                         OP_PROBED,
+                         command.handle,
+                         refusal != 0,
+                         line.size());
+            response.assign(header, sizeof header);
+            response += line;
+        }
+        else {
+            response = "probe ";
+            if (shared.options.multi) {
+                char handle[16];
+                snprintf(handle, sizeof handle, "%u ", command.handle);
+                response += handle;
+            }
+            if (refusal)
+                response += "refused ";
+            response += line;
+            response += '\n';
+        }
+    }
+    catch (const std::bad_alloc&) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to allocate memory for \"probe\" response."
+                  << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    return writeOutput(response.data(), response.size(), shared);
+}
+
+int openDescriptor(OpenedQueue&     opened,
+                   const Options&   options,
+                   pthread_mutex_t& stderrMutex,
+                   bool             locking)
+    // Open the message queue named by the specified 'options', as they
+    // specify, and load its descriptor and attributes into the specified
+    // 'opened'.  Hold the specified 'stderrMutex' while writing to standard
+    // error if the specified 'locking' is 'true'.  Return zero on success or
+    // a nonzero value otherwise.
+{
+    const mqd_t descriptor = openQueue(options);
+    if (descriptor == mqd_t(-1)) {
+        const int error = errno;
+        Lock lock(stderrMutex, locking);
+        std::cerr << "Unable to open queue named " << repr(options.queueName)
+                  << ": " << strerror(error) << std::endl;
+        return error;
+    }
+
+    mq_attr attributes;
+    if (const int rc = mq_getattr(descriptor, &attributes)) {
+        const int error = errno;
+        mq_close(descriptor);
+        Lock lock(stderrMutex, locking);
+        std::cerr << "Unable to get queue attributes initially: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    if (options.debug) {
+        Lock lock(stderrMutex, locking);
+        std::cerr << "Got the following attributes for message queue "
+                  << repr(options.queueName) << ": "
+                     " mq_maxmsg="  << attributes.mq_maxmsg
+                  << " mq_msgsize=" << attributes.mq_msgsize
+                  << " mq_curmsgs=" << attributes.mq_curmsgs << std::endl;
+    }
+
+    opened.descriptor = descriptor;
+    opened.attributes = attributes;
+    return 0;
+}
+
+int openHandle(unsigned           handle,
+               const Options&     options,
+               Shared&            shared,
+               const OpenedQueue *alreadyOpened = 0)
+    // Open the message queue named by the specified 'options', as they
+    // specify, and serve it as the specified 'handle'.  If the optionally
+    // specified 'alreadyOpened' is not null, serve the queue it has opened
+    // instead, as though 'options' had just opened it.  Return zero on
+    // success or a nonzero value otherwise.
+{
+    if (findQueue(shared, handle)) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "A queue is already open having handle " << handle
+                  << '.' << std::endl;
+        return 1;
+    }
+
+    OpenedQueue opened;
+    if (alreadyOpened)
+        opened = *alreadyOpened;
+    else if (const int rc = openDescriptor(opened,
+                                           options,
+                                           shared.stderrMutex,
+                                           shared.consumerThreadExists))
+    {
+        return rc;
+    }
+
+    const mqd_t    descriptor = opened.descriptor;
+    const mq_attr& attributes = opened.attributes;
+
+    // With '--shm', every message received must fit in the ring.
+    if (shared.sharedMemory && options.operation != Options::WRITE_ONLY &&
+        size_t(attributes.mq_msgsize) > shared.sharedMemory->ringCapacity())
+    {
+        mq_close(descriptor);
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The maximum message size of queue "
+                  << repr(options.queueName) << ", " << attributes.mq_msgsize
+                  << " bytes, is larger than the shared memory ring, which "
+                     "holds at most " << shared.sharedMemory->ringCapacity()
+                  << " bytes." << std::endl;
+        return 1;
+    }
+
+    // With '--fragment', every message has a fragment header and some of
+    // the message.
+    if (options.fragmentBytes &&
+        size_t(attributes.mq_msgsize) <= FRAGMENT_HEADER_SIZE)
+    {
+        mq_close(descriptor);
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The maximum message size of queue "
+                  << repr(options.queueName) << ", " << attributes.mq_msgsize
+                  << " bytes, leaves no room for fragments, which have a "
+                  << FRAGMENT_HEADER_SIZE << " byte header." << std::endl;
+        return 1;
+    }
+
+    // With '--compress', the byte that says whether a message is compressed
+    // is part of what's sent (and fragmented).
+    const size_t maxSentSize    = options.fragmentBytes
+                                ? options.fragmentBytes
+                                : attributes.mq_msgsize;
+    const size_t maxMessageSize = maxSentSize - options.compress;
+
+    if (handle >= shared.queues.size())
+        shared.queues.resize(handle + 1);
+
+    // With '--spool' but without '--pending', only the disk limits it.
+    const bool keepsPending =
+        (options.pendingBytes || !options.spoolDirectory.empty()) &&
+        options.operation != Options::READ_ONLY;
+    Pending *const pending =
+        keepsPending
+            ? new Pending(options.pendingBytes
+                              ? options.pendingBytes
+                              : std::numeric_limits<size_t>::max(),
+                          maxMessageSize,
+                          options.spoolDirectory.empty()
+                              ? 0
+                              : new Spool(options.spoolDirectory,
+                                          maxMessageSize))
+            : 0;
+
+    BufferPool *const receivePool =
+        options.operation != Options::WRITE_ONLY
+            ? new BufferPool(receiveBufferSize(attributes.mq_msgsize),
+                             RECEIVE_BUFFERS,
+                             options.hugePages)
+            : 0;
+
+    Reassembler *const reassembler =
+        options.fragmentBytes && options.operation != Options::WRITE_ONLY
+            ? new Reassembler(NUMBERS_MAX_SIZE,  // room for the prefix
+                              1,                 // and for a newline
+                              maxSentSize,
+                              MAX_PARTIAL_MESSAGES)
+            : 0;
+
+    shared.queues[handle] = new Queue(handle,
+                                      options.queueName,
+                                      descriptor,
+                                      attributes.mq_msgsize,
+                                      options.fragmentBytes,
+                                      options.compress,
+                                      options.bundle,
+                                      options.operation !=
+                                          Options::READ_ONLY,
+                                      pending,
+                                      receivePool,
+                                      reassembler,
+                                      shared);
+    return 0;
+}
+
+// Bits of the flags of an "open" command in the binary protocol.  In the text
+// protocol, they are the letters 'r', 'w', 'o', and 'c', respectively.
+const unsigned OPEN_FLAG_READ   = 1,  // as '--read'
+               OPEN_FLAG_WRITE  = 2,  // as '--write'
+               OPEN_FLAG_OPEN   = 4,  // as '--open'
+               OPEN_FLAG_CREATE = 8;  // as '--create'
+
+int openHandler(Command& command, Shared& shared)
+    // Open another queue as the handle in the specified 'command'.  In the
+    // text protocol, the queue's name and flags follow the handle, e.g.
+    // "open 3 /jobs rwo"; in the binary protocol, the name is the payload and
+    // the flags are the priority.  The flags work like their command line
+    // counterparts, and the rest of the options are from the command line.
+{
+    if (!shared.options.multi) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The \"open\" command requires --multi." << std::endl;
+        return 1;
+    }
+
+    std::string name;
+    unsigned    flags = 0;
+    if (shared.options.binary) {
+        const char *nameBegin;
+        int         rc = 0;
+        if (command.length > NAME_MAX ||
+            (rc = command.input.bytes(nameBegin, command.length)))
+        {
+            if (rc == Input::INPUT_AGAIN)
+                return INCOMPLETE;
+
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read the " << command.length << " byte "
+                         "queue name from \"open\" command." << std::endl;
+            return 1;
+        }
+
+        name.assign(nameBegin, command.length);
+        flags = command.priority;
+    }
+    else {
+        const char *begin;
+        size_t      size;
+        int         rc = command.input.token(begin, size);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+        if (rc) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read the queue name from \"open\" "
+                         "command." << std::endl;
+            return 1;
+        }
+
+        name.assign(begin, size);  // before 'begin' is invalidated
+
+        rc = command.input.token(begin, size);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+        for (const char *letter = begin; !rc && letter != begin + size;
+             ++letter)
+        {
+            switch (*letter) {
+              case 'r': flags |= OPEN_FLAG_READ;   break;
+              case 'w': flags |= OPEN_FLAG_WRITE;  break;
+              case 'o': flags |= OPEN_FLAG_OPEN;   break;
+              case 'c': flags |= OPEN_FLAG_CREATE; break;
+              default: rc = Input::INPUT_INVALID;
+            }
+        }
+        if (rc) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read valid flags from \"open\" command."
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    const bool read   = flags & OPEN_FLAG_READ,
+               write  = flags & OPEN_FLAG_WRITE,
+               open   = flags & OPEN_FLAG_OPEN,
+               create = flags & OPEN_FLAG_CREATE;
+    if (!(read || write) || !(open || create)) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The flags of \"open\" command must include read and/or "
+                     "write, and open and/or create." << std::endl;
+        return 1;
+    }
+
+    Options options(shared.options);
+    options.queueName = name;
+    options.operation = read && write ? Options::READ_WRITE
+                                      : read ? Options::READ_ONLY
+                                             : Options::WRITE_ONLY;
+    options.open      = open && create ? Options::OPEN_CREATE
+                                       : open ? Options::OPEN_ONLY
+                                              : Options::CREATE_ONLY;
+
+    if (const int rc = openHandle(command.handle, options, shared))
+        return rc;
+
+    return respond(OP_OPENED, command.handle, 0, 0, shared);
+}
+
+int closeHandler(Command& command, Shared& shared)
+{
+    // Send the bundles first, since they might become pending messages.
+    int result = shared.options.bundle ? sendBundles(command, shared, false)
+                                       : 0;
+
+    // With a "timeout", pending messages are sent only until it passes.  A
+    // sender thread that's already waiting for room is woken up with
+    // 'SIGUSR1' (see 'consumeHandler') to see the deadline, and again every
+    // so often in case it was about to wait when the first signal came.
+    const bool     timed    = command.opcode == OP_CLOSE && command.timed;
+    const timespec deadline = deadlineAfter(command.milliseconds);
+    if (timed) {
+        struct sigaction doNothing = {};
+        doNothing.sa_handler = &noOpSignalHandler;
+        sigaction(SIGUSR1, &doNothing, 0);
+    }
+
+    Lock stoppedLock(shared.stoppedMutex, shared.consumerThreadExists);
+
+    shared.stopped = true;
+    pthread_cond_broadcast(&shared.creditCondition);  // no more are coming
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue)
+            continue;
+
+        if (queue->senderThreadExists) {
+            // Send whatever is still pending before closing the queue.
+            queue->pending->close();
+            void *failed = 0;
+            if (timed) {
+                queue->drainDeadline = deadline;
+                __atomic_store_n(&queue->drainTimed, true, __ATOMIC_RELEASE);
+                timespec retry = deadline;
+                for (;;) {
+                    pthread_kill(queue->senderThread, SIGUSR1);
+                    if (pthread_timedjoin_np(queue->senderThread,
+                                             &failed,
+                                             &retry) != ETIMEDOUT)
+                    {
+                        break;
+                    }
+
+                    retry = deadlineAfter(10);
+                }
+            }
+            else {
+                pthread_join(queue->senderThread, &failed);
+            }
+            queue->senderThreadExists = false;
+            if (failed && !result)
+                result = 1;  // already reported
+        }
+
+        if (const int rc = mq_close(queue->descriptor)) {
+            const int error = errno;
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to close the message queue "
+                      << repr(queue->name) << ": " << strerror(error)
+                      << std::endl;
+            if (!result)
+                result = rc;
+        }
+
+        if (queue->consumerThreadExists) {
+            pthread_kill(queue->consumerThread, SIGUSR1);  // and ignore rcode
+        }
+    }
+
+    return result;
+}
+
+// --------------
+// thread drivers
+// --------------
+
+void tuneThread(const char *thread, int cpu, int priority, Shared& shared)
+    // Pin the calling thread, called the specified 'thread' in diagnostics,
+    // to the specified 'cpu' unless it is -1, and give it the 'SCHED_FIFO'
+    // scheduling policy at the specified 'priority' unless it is zero.  Say
+    // so on standard error if either is not permitted, but carry on without.
+{
+    if (cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (const int error = pthread_setaffinity_np(pthread_self(),
+                                                     sizeof cpus,
+                                                     &cpus))
+        {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to run the " << thread << " on CPU " << cpu
+                      << ": " << strerror(error) << std::endl;
+        }
+    }
+
+    if (priority) {
+        sched_param parameters = {};
+        parameters.sched_priority = priority;
+        if (const int error = pthread_setschedparam(pthread_self(),
+                                                    SCHED_FIFO,
+                                                    &parameters))
+        {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to run the " << thread
+                      << " with realtime priority " << priority << ": "
+                      << strerror(error) << std::endl;
+        }
+    }
+}
+
+int pollReceive(Queue& queue, Shared& shared, const timespec *deadline)
+    // Receive a message from the specified 'queue' for "consume", as
+    // 'doReceive' does, but without waiting in 'mq_receive' for one to
+    // arrive: try again and again until one has, sleeping '--busy-poll'
+    // microseconds in between, or with zero, only letting other threads on
+    // the CPU run.  Return 'FAIL_TIMEOUT' if the specified 'deadline'
+    // ('CLOCK_REALTIME') is not null and passes first, or
+    // 'FAIL_INTERRUPTED_OR_CLOSED' if "close" is issued first.
+{
+    const long     microseconds = shared.options.busyPollMicroseconds;
+    const timespec backoff      = { microseconds / 1000000,
+                                    microseconds % 1000000 * 1000 };
+
+    for (;;) {
+        const int rc = doReceive(queue, shared, true, &DONT_WAIT);
+        if (rc != FAIL_TIMEOUT)
+            return rc;
+
+        if (deadline) {
+            timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (!isBefore(now, *deadline))
+                return FAIL_TIMEOUT;
+        }
+
+        {
+            Lock lock(shared.stoppedMutex);
+            if (shared.stopped)
+                return FAIL_INTERRUPTED_OR_CLOSED;
+        }
+
+        if (microseconds)
+            nanosleep(&backoff, 0);
+        else
+            sched_yield();
+    }
+}
+
+void *consume(void *data)
+    // Receive messages from a POSIX message queue and print the messages to
+    // standard output (or to the '--output-fd' workers), each prefixed by its
+    // priority and length.  'data' must be a pointer to the 'Queue' object.
+{
+    Queue&  queue  = *static_cast<Queue*>(data);
+    Shared& shared = queue.shared;
+
+    // The thread otherwise has whatever '--cpu' and '--realtime' gave the
+    // thread that started it.
+    tuneThread("consumer thread", shared.options.consumerCpu, 0, shared);
+
+    for (;;) {
+        // With credits, wait for one before taking any message, so that
+        // messages stay in the queue (in priority order) until the user is
+        // ready for them, and take no more than there are credits.
+        unsigned long long allowed = shared.options.batch;
+        {
+            Lock lock(shared.stoppedMutex);
+            while (!hasCredit(queue) && !shared.stopped) {
+                pthread_cond_wait(&shared.creditCondition,
+                                  &shared.stoppedMutex);
+            }
+
+            if (!hasCredit(queue)) {
+                // "close" was issued.
+                lock.release();
+                flushOutput(shared);  // failure is reported
+                return 0;
+            }
+
+            if (queue.credited && queue.credits < allowed)
+                allowed = queue.credits;
+        }
+
+        // Wait for a message (with '--busy-poll', by polling), and then take
+        // those already behind it in the queue, up to the batch limit,
+        // without waiting.  Write out the batch once the queue is empty or
+        // the limit is reached.  With a "timeout", stop if no message
+        // arrives in time.
+        timespec idleDeadline;
+        if (queue.consumeTimed)
+            idleDeadline = deadlineAfter(queue.consumeMilliseconds);
+
+        const timespec *const idle = queue.consumeTimed ? &idleDeadline : 0;
+
+        int rc = shared.options.busyPoll
+                     ? pollReceive(queue, shared, idle)
+                     : doReceive(queue, shared, true, idle);
+        if (rc == FAIL_TIMEOUT) {
+            rc = respond(OP_TIMEDOUT, queue.handle, OP_CONSUME, 0, shared);
+            flushOutput(shared);  // failure is reported
+
+            Lock lock(shared.stoppedMutex);
+            queue.consumerIdle = true;
+            return rc ? data : 0;
+        }
+
+        unsigned long long received = rc == 0;
+        while (rc == 0 && received < allowed) {
+            rc = doReceive(queue, shared, true, &DONT_WAIT);
+            received += rc == 0;
+        }
+
+        if (received) {
+            Lock lock(shared.stoppedMutex);
+            if (queue.credited)
+                queue.credits -= std::min(received, queue.credits);
+        }
+
+        if (rc == 0 || rc == FAIL_TIMEOUT)
+            rc = flushOutput(shared);
+
+        if (rc == FAIL_INTERRUPTED_OR_CLOSED) {
+            Lock lock(shared.stoppedMutex);
+            if (shared.stopped) {
+                flushOutput(shared);  // failure is reported
+                if (shared.options.debug) {
+                    Lock lock(shared.stderrMutex);
+                    std::cerr << "Consumer thread is finishing." << std::endl;
+                }
+                return 0;  // we're done
+            }
+
+            // otherwise, go around again
+        }
+        else if (rc) {
+            flushOutput(shared);  // failure is reported
+            return data;  // an error occurred (reported in 'doReceive').
+                          // Return 'data' just because it's non-zero.
+        }
+    }
+}
+
+void *sendPending(void *data)
+    // Send the pending messages of a queue, in order (or, with '--spool', in
+    // priority order), waiting for room in the queue as necessary, until its
+    // pending messages are closed and none remain.  Write out "ready"
+    // whenever they are no longer busy.  'data' must be a pointer to the
+    // 'Queue' object.
+{
+    Queue&      queue  = *static_cast<Queue*>(data);
+    Shared&     shared = queue.shared;
+    std::string buffer;
+
+    try {
+        buffer.resize(queue.maxMessageSize);
+    }
+    catch (const std::bad_alloc&) {
+        queue.pending->close();
+        Lock lock(shared.stderrMutex);
+        std::cerr << "Failed to allocate memory for sending pending messages."
+                  << std::endl;
+        return data;
+    }
+
+    for (;;) {
+        unsigned priority;
+        size_t   size;
+        const int rc = queue.pending->take(priority, &buffer[0], size, 0);
+        if (rc == Pending::PENDING_CLOSED)
+            return 0;  // we're done
+
+        for (;;) {
+            // Once "close" has a "timeout", wait for room only until then.
+            const timespec *const deadline =
+                __atomic_load_n(&queue.drainTimed, __ATOMIC_ACQUIRE)
+                    ? &queue.drainDeadline
+                    : 0;
+            if (!sendToQueue(queue, &buffer[0], size, priority, deadline))
+                break;
+
+            const int error = errno;
+            if (error == EINTR)
+                continue;
+
+            if (error == ETIMEDOUT && deadline) {
+                reportUnsent(queue, shared);
+                return data;
+            }
+
+            queue.pending->close();  // so that nothing more is kept
+            Lock lock(shared.stderrMutex);
+            std::cerr << "Unable to send pending message: " << strerror(error)
+                      << std::endl;
+            return data;  // an error occurred. Return 'data' just because
+                          // it's non-zero.
+        }
+
+        if (queue.pending->pop() == Pending::PENDING_READY) {
+            // Let the user know right away.
+            if (respond(OP_READY, queue.handle, 0, 0, shared) ||
+                flushOutput(shared))
+            {
+                queue.pending->close();
+                return data;  // failure is reported
+            }
+        }
+    }
+}
+
+int reportUnknownCommand(const Command& command, Shared& shared)
+    // Report to stderr that the specified 'command' is not recognized, and
+    // return a nonzero value.
+{
+    Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+    if (shared.options.binary)
+        std::cerr << "Unknown command opcode " << command.opcode;
+    else
+        std::cerr << "Unknown command "
+                  << repr(std::string(command.name, command.nameSize));
+    std::cerr << std::endl;
+    return 1;
+}
+
+int handleCommands(Command& command, Shared& shared)
+    // Read commands from standard input and handle each in turn, blocking as
+    // necessary, until "close", the end of input, or an error.  Return zero
+    // on success or a nonzero value otherwise.
+{
+    for (;;) {
+        const int readResult = readCommand(command, shared);
+        if (readResult == READ_EOF)
+            return 0;
+
+        if (readResult == READ_ERROR)
+            return readResult;
+
+        int rc;
+        switch (command.opcode) {
+          case OP_SEND:    rc = sendHandler(command, shared);    break;
+          case OP_SENDV:   rc = sendvHandler(command, shared);   break;
+          case OP_RECEIVE: rc = receiveHandler(command, shared); break;
+          case OP_CONSUME: rc = consumeHandler(command, shared); break;
+          case OP_COUNT:   rc = countHandler(command, shared);   break;
+          case OP_MSGSIZE: rc = msgsizeHandler(command, shared); break;
+          case OP_MAXMSG:  rc = maxmsgHandler(command, shared);  break;
+          case OP_OPEN:    rc = openHandler(command, shared);    break;
+          case OP_STATS:   rc = statsHandler(command, shared);   break;
+          case OP_CREDIT:  rc = creditHandler(command, shared);  break;
+          case OP_PROBE:   rc = probeHandler(command, shared);   break;
+          case OP_CLOSE:
+            return 0;  // "close" is handled at the end.
+          default:
+            return reportUnknownCommand(command, shared);
+        }
+
+        if (rc)
+            return rc;
+    }
+}
+
+// -------
+// reactor
+// -------
+
+// With the '--reactor' option, 'mq' runs on one thread that waits with
+// 'epoll' for standard input, standard output, and the message queues
+// themselves (on Linux, an 'mqd_t' is a file descriptor), rather than on a
+// main thread that blocks on each command plus a consumer thread per queue
+// that blocks in 'mq_receive'.  No mutex or signal is needed, a full queue
+// doesn't hold up "consume" output, and shutdown is deterministic: after
+// "close" (or the end of input) nothing more is received, and 'mq' returns
+// once all of its output is written.
+
+const size_t MAX_OUTPUT_BACKLOG = 1 << 20;
+    // Stop reading commands and receiving messages while at least this many
+    // bytes of output are waiting for standard output to become writable.
+    // In the threaded engine, this is how much a writer thread may fall
+    // behind before the threads writing to it wait.
+
+// The signals that end 'mq' by default and can be caught, after which
+// 'NonblockingGuard' must still restore the flags that it changed.
+const int TERMINATING_SIGNALS[] = { SIGHUP, SIGINT, SIGPIPE, SIGTERM };
+const size_t NUM_TERMINATING_SIGNALS =
+    sizeof TERMINATING_SIGNALS / sizeof TERMINATING_SIGNALS[0];
+
+// The descriptors of the 'NonblockingGuard' that exists, if any, and their
+// original flags, for 'restoreFlagsAndDie'.
+const int *guardedFds    = 0;
+const int *guardedFlags  = 0;
+size_t     guardedCount  = 0;
+
+extern "C" void restoreFlagsAndDie(int signal)
+    // Restore the original flags of the guarded descriptors, and then end
+    // the process with the specified 'signal', as if it weren't caught.
+{
+    for (size_t i = 0; i < guardedCount; ++i) {
+        if (guardedFlags[i] != -1)
+            fcntl(guardedFds[i], F_SETFL, guardedFlags[i]);
+    }
+
+    struct sigaction defaultAction = {};
+    defaultAction.sa_handler = SIG_DFL;
+    sigaction(signal, &defaultAction, 0);
+    raise(signal);
+}
+
+class NonblockingGuard {
+    // Set 'O_NONBLOCK' on file descriptors for the lifetime of this object,
+    // and then restore their original flags, also if a signal that ends the
+    // process is caught first (though 'SIGKILL' can't be).  The flags belong
+    // to open file descriptions, which 'mq' may share with other processes,
+    // e.g. standard input with the shell that started it, and which would
+    // find them nonblocking otherwise.  At most one 'NonblockingGuard' may
+    // exist at a time.
+
+    std::vector<int> fds;
+    std::vector<int> originalFlags;
+    struct sigaction originalActions[NUM_TERMINATING_SIGNALS];
+
+    NonblockingGuard(const NonblockingGuard&);             // not copyable
+    NonblockingGuard& operator=(const NonblockingGuard&);  // not assignable
+
+  public:
+    explicit NonblockingGuard(const std::vector<int>& fds)
+    : fds(fds)
+    {
+        for (size_t i = 0; i < fds.size(); ++i)
+            originalFlags.push_back(fcntl(fds[i], F_GETFL));
+
+        // The handler sees the descriptors only once they're complete.
+        guardedFds   = &this->fds[0];
+        guardedFlags = &originalFlags[0];
+        guardedCount = fds.size();
+
+        struct sigaction restore = {};
+        restore.sa_handler = &restoreFlagsAndDie;
+        for (size_t i = 0; i < NUM_TERMINATING_SIGNALS; ++i) {
+            sigaction(TERMINATING_SIGNALS[i], 0, &originalActions[i]);
+
+            // A signal that is ignored doesn't end the process.
+            if (originalActions[i].sa_handler == SIG_DFL)
+                sigaction(TERMINATING_SIGNALS[i], &restore, 0);
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (originalFlags[i] != -1)
+                fcntl(fds[i], F_SETFL, originalFlags[i] | O_NONBLOCK);
+        }
+    }
+
+    ~NonblockingGuard()
+    {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (originalFlags[i] != -1)
+                fcntl(fds[i], F_SETFL, originalFlags[i]);
+        }
+
+        for (size_t i = 0; i < NUM_TERMINATING_SIGNALS; ++i)
+            sigaction(TERMINATING_SIGNALS[i], &originalActions[i], 0);
+
+        guardedCount = 0;
+    }
+};
+
+class Reactor {
+    // 'Reactor' is the state of the '--reactor' event loop.  Commands are
+    // executed in order.  A command that must wait (a "send" to a full queue,
+    // or a "receive" from an empty one) holds up the commands after it, but
+    // not "consume" or output.  The queue that such a command waits on is
+    // 'command.queue'.  With '--pending', a "send" waits only if the queue's
+    // pending messages are full, and pending messages are sent whenever their
+    // queue has room, regardless of the commands.  A "timeout" on a command
+    // that waits is kept as 'deadline'.
+
+    enum State {
+        READY,               // executing commands
+        WAITING_TO_SEND,     // the current message awaits room in the queue
+        WAITING_TO_RECEIVE,  // a "receive" awaits a message
+        CLOSING              // no more commands; finishing output
+    };
+
+    // 'registered' value for a file descriptor that 'epoll' doesn't support,
+    // e.g. a regular file, which is always ready.
+    enum { UNPOLLABLE = -1 };
+
+    struct Worker {
+        // An '--output-fd', which is written to without blocking, as standard
+        // output is, while the 'Reactor' runs.  'output' is the corresponding
+        // element of 'Shared::workers'.
+        Output *output;
+        int     fd;
+        bool    ready;
+        int     registered;
+    };
+
+    Command&           command;
+    Shared&            shared;
+    const int          inputFd;
+    const int          outputFd;
+    int                epollFd;
+    State              state;
+    unsigned           sendvRemaining;  // messages left in current "sendv"
+    unsigned           sendvSent;
+    unsigned long long sendvBytes;
+    std::string        pendingMessage;  // copy of the one being sent
+    timespec           deadline;        // of a timed command that waits
+    bool               resuming;        // rereading a "send" that waited
+    bool               expired;         // the "send" being reread timed out
+
+    // Whether standard input and output are ready, as far as we know, i.e.
+    // have not said "try again" since 'epoll' last said that they were ready.
+    // The same is kept for each queue in its 'Queue'.
+    bool inputReady;
+    bool outputReady;
+
+    // The events registered with 'epoll' for standard input and output.
+    int inputRegistered;
+    int outputRegistered;
+
+    std::vector<Worker> workers;
+
+    Reactor(const Reactor&);             // not copyable
+    Reactor& operator=(const Reactor&);  // not assignable
+
+    int runCommands();
+        // Execute commands from standard input until one must wait, or
+        // until there isn't a complete command available.  Return zero on
+        // success or a nonzero value if an error occurred (which will have
+        // been reported).  This and the functions below have the same
+        // contract.
+
+    int runCommand();
+        // Read and execute one command, or return 'INCOMPLETE'.
+
+    int sendRecord();
+        // Read and send the next message of a "sendv", or return
+        // 'INCOMPLETE'.
+
+    int trySend(const char *commandName, bool& sent);
+        // Send (or keep pending, or with '--bundle-usec', add to its queue's
+        // bundle) the message in 'command' without waiting, and load into the
+        // specified 'sent' whether it was.  If the queue (or its pending
+        // messages) is full, then arrange to read the message again once it
+        // isn't.
+
+    int sendNow(const Command& message, const char *commandName);
+        // Send (or keep pending) the specified 'message' without waiting.
+        // Return zero on success, 'FAIL_TIMEOUT' if the queue (or its
+        // pending messages) is full, or another nonzero value otherwise.
+
+    int sendBundles();
+        // Send the bundle of each queue that is due ('--bundle-usec'),
+        // unless the queue (or its pending messages) is full.
+
+    bool bundleDue(const Queue& queue) const;
+        // Return whether the specified 'queue' has a bundle that is due to
+        // be sent, which every bundle is once closing, or while a "receive"
+        // waits (since the message it awaits might be in one).
+
+    int sendPending();
+        // Send the pending messages of each queue until none remain or the
+        // queue is full.
+
+    bool keeping() const;
+        // Return whether any queue has pending messages, or a bundle.
+
+    bool drainTimed() const;
+        // Return whether "close" had a "timeout", and some queue still has
+        // pending messages, which are discarded once it passes.
+
+    bool partlySent() const;
+        // Return whether some fragments of the message of the "send" that is
+        // waiting have been sent ('--fragment'), in which case the rest must
+        // be sent, and so it can't time out.
+
+    int expire();
+        // Give up on whatever has a "timeout" that has passed.
+
+    bool nextDeadline(timespec& when) const;
+        // Load into the specified 'when' the earliest deadline of a
+        // "timeout" that could pass, and return 'true', or return 'false' if
+        // there is none.
+
+    bool mayDrain() const;
+        // Return whether messages may be received for "consume" now, which
+        // is until "close" or, if messages are pending then, until they are
+        // sent, in case they're bound for a queue that is being consumed.
+
+    size_t drainLimit() const;
+        // Return the number of bytes of output waiting to be written at
+        // which to stop receiving messages for "consume".
+
+    size_t consumeBacklog() const;
+        // Return the number of bytes of output waiting to be written that
+        // counts against 'drainLimit': that of standard output, or the most
+        // that any '--output-fd' worker has, since the next message might go
+        // to any of them.
+
+    int flushWorkers();
+        // Write what output each '--output-fd' worker that is ready has
+        // waiting.
+
+    bool hasRoom(const Queue& queue);
+        // Return whether a message received from the specified 'queue' would
+        // have room, which it always does unless '--shm'.
+
+    int receive();
+        // Receive a message for "receive" without waiting, or arrange to try
+        // again once a message is available (and has room).
+
+    int drain();
+        // Receive messages for "consume" from each queue that is being
+        // consumed, until the queue is empty or the batch limit is reached.
+
+    int wait();
+        // Wait for any file descriptor to become ready for what we'd do with
+        // it next.  Don't wait if there is something to do already.
+
+    int watch(int fd, int& registered, int wanted);
+        // Make the specified 'wanted' events be those that 'epoll' reports
+        // for the specified 'fd', where 'registered' holds the events that
+        // are currently registered for 'fd'.
+
+  public:
+    Reactor(Command& command, Shared& shared);
+
+    ~Reactor();
+
+    int run();
+        // Run the event loop until "close", the end of input, or an error.
+        // Return zero on success or a nonzero value otherwise.
+};
+
+Reactor::Reactor(Command& command, Shared& shared)
+: command(command)
+, shared(shared)
+, inputFd(fileno(stdin))
+, outputFd(fileno(stdout))
+, epollFd(epoll_create1(EPOLL_CLOEXEC))
+, state(READY)
+, sendvRemaining(0)
+, sendvSent(0)
+, sendvBytes(0)
+, deadline()
+, resuming(false)
+, expired(false)
+, inputReady(true)
+, outputReady(true)
+, inputRegistered(0)
+, outputRegistered(0)
+{
+    workers.resize(shared.workers.size());
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker& worker = workers[i];
+        worker.output     = shared.workers[i];
+        worker.fd         = shared.options.outputFds[i];
+        worker.ready      = true;
+        worker.registered = 0;
+    }
+}
+
+Reactor::~Reactor()
+{
+    if (epollFd != -1)
+        close(epollFd);
+}
+
+int Reactor::run()
+{
+    if (epollFd == -1) {
+        std::cerr << "Unable to create epoll instance: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+
+    for (;;) {
+        if (const int rc = sendPending())
+            return rc;
+
+        if (state == WAITING_TO_SEND && command.queue->writable) {
+            state    = READY;  // the message will be read again, and sent
+            resuming = true;
+        }
+
+        if (state == WAITING_TO_RECEIVE && command.queue->readable) {
+            if (const int rc = receive())
+                return rc;
+        }
+
+        if (const int rc = expire())
+            return rc;
+
+        if (state == READY && inputReady) {
+            if (const int rc = runCommands())
+                return rc;
+        }
+
+        if (const int rc = sendBundles())
+            return rc;
+
+        if (mayDrain()) {
+            if (const int rc = drain())
+                return rc;
+        }
+
+        if (outputReady && shared.output.backlog()) {
+            if (const int rc = flushOutput(shared.output, shared))
+                return rc;
+
+            outputReady = !shared.output.backlog();
+        }
+
+        if (const int rc = flushWorkers())
+            return rc;
+
+        if (state == CLOSING && !shared.output.backlog() &&
+            !consumeBacklog() && !keeping())
+        {
+            return 0;
+        }
+
+        if (const int rc = wait())
+            return rc;
+    }
+}
+
+int Reactor::runCommands()
+{
+    while (state == READY &&
+           shared.output.backlog() < MAX_OUTPUT_BACKLOG)
+    {
+        command.input.setMark();
+
+        const int rc = sendvRemaining ? sendRecord() : runCommand();
+        if (rc == INCOMPLETE) {
+            command.input.resetToMark();
+            inputReady = false;
+            return 0;
+        }
+
+        if (rc)
+            return rc;
+    }
+
+    command.input.clearMark();
+    return 0;
+}
+
+int Reactor::runCommand()
+{
+    switch (const int rc = readCommand(command, shared)) {
+      case READ_OK:
+        break;
+      case READ_EOF:
+        state = CLOSING;
+        return 0;
+      default:
+        return rc;
+    }
+
+    switch (command.opcode) {
+      case OP_SEND: {
+          // In the binary protocol, the command header is also the message
+          // header.
+          int rc;
+          if ((!shared.options.binary &&
+               (rc = readMessageHeader(command, "send", shared))) ||
+              (rc = readPayload(command, shared)))
+          {
+              return rc;
+          }
+
+          bool sent;
+          if ((rc = trySend("send", sent)) || !sent)
+              return rc;
+
+          return respond(OP_ACK,
+                         command.handle,
+                         command.priority,
+                         command.length,
+                         shared);
+      }
+      case OP_SENDV: {
+          if (const int rc = readCount(sendvRemaining, command, shared))
+              return rc;
+
+          sendvSent  = 0;
+          sendvBytes = 0;
+          return sendvRemaining
+              ? 0
+              : respond(OP_ACKV, command.handle, 0, 0, shared);
+      }
+      case OP_RECEIVE:
+        if (command.timed)
+            deadline = deadlineAfter(command.milliseconds);
+        return receive();
+      case OP_CONSUME: {
+          if (const int rc = readCredits(command, false, shared))
+              return rc;
+
+          Queue& queue = *command.queue;
+          addCredits(queue, command.length, shared);
+          queue.consuming           = true;
+          queue.consumeTimed        = command.timed;
+          queue.consumeMilliseconds = command.milliseconds;
+          if (command.timed)
+              queue.consumeDeadline = deadlineAfter(command.milliseconds);
+          return 0;
+      }
+      case OP_COUNT:
+        return countHandler(command, shared);
+      case OP_MSGSIZE:
+        return msgsizeHandler(command, shared);
+      case OP_MAXMSG:
+        return maxmsgHandler(command, shared);
+      case OP_OPEN:
+        return openHandler(command, shared);
+      case OP_STATS:
+        return statsHandler(command, shared);
+      case OP_CREDIT:
+        return creditHandler(command, shared);
+      case OP_PROBE:
+        return probeHandler(command, shared);
+      case OP_CLOSE:
+        state = CLOSING;
+        if (command.timed)
+            deadline = deadlineAfter(command.milliseconds);
+        return 0;
+      default:
+        return reportUnknownCommand(command, shared);
+    }
+}
+
+int Reactor::sendRecord()
+{
+    int  rc;
+    bool sent = false;
+    if ((rc = readMessageHeader(command, "sendv", shared)) ||
+        (rc = readPayload(command, shared))                ||
+        (rc = trySend("sendv", sent)))
+    {
+        if (rc == INCOMPLETE)
+            return rc;
+
+        // Acknowledge the messages that were sent before the failure.
+        sendvRemaining = 0;
+        respond(OP_ACKV, command.handle, sendvSent, sendvBytes, shared);
+        return rc;
+    }
+
+    if (!sent)
+        return 0;
+
+    ++sendvSent;
+    sendvBytes += command.length;
+    if (--sendvRemaining)
+        return 0;
+
+    return respond(OP_ACKV, command.handle, sendvSent, sendvBytes, shared);
+}
+
+int Reactor::trySend(const char *commandName, bool& sent)
+{
+    // The deadline of a "send" that waited stays as it was when the message
+    // was first read.
+    if (command.timed && !resuming)
+        deadline = deadlineAfter(command.milliseconds);
+    resuming = false;
+
+    if (expired) {
+        expired = false;
+        sent    = false;  // and never will be
+        return respond(OP_TIMEDOUT, command.handle, OP_SEND, 0, shared);
+    }
+
+    // With '--bundle-usec', the message joins its queue's bundle, which
+    // might have to be sent first to make room.
+    Queue& queue = *command.queue;
+    int    rc    = 0;
+    if (!shared.options.bundle)
+        rc = sendNow(command, commandName);
+    else {
+        if (!fitsBundle(queue, command)) {
+            Command bundled(command);
+            loadBundle(bundled, queue);
+            if (!(rc = sendNow(bundled, commandName)))
+                queue.bundleSize = 0;
+        }
+
+        if (!rc)
+            addToBundle(queue, command);
+    }
+
+    sent = rc == 0;
+    if (rc != FAIL_TIMEOUT)
+        return rc;
+
+    // The queue (or its pending messages) is full.  Go back to the beginning
+    // of the message, so that it is read again (and then sent) once there's
+    // room.
+    command.input.resetToMark();
+    state = WAITING_TO_SEND;
+    return 0;
+}
+
+int Reactor::sendNow(const Command& message, const char *commandName)
+{
+    // A message can't skip ahead of those already pending.
+    Queue&     queue  = *message.queue;
+    const bool behind = queue.pending && queue.pending->bytes();
+    int        rc     = FAIL_TIMEOUT;
+    if (!behind) {
+        rc = sendMessage(message, commandName, shared, &DONT_WAIT);
+        if (rc == FAIL_TIMEOUT)
+            queue.writable = false;
+    }
+
+    // Only what remains of a message that's partly sent could be kept, so
+    // it's sent the rest of the way instead.
+    if (rc == FAIL_TIMEOUT && queue.pending && !queue.partlySent)
+        rc = keepPending(message, shared, &DONT_WAIT);
+
+    return rc;
+}
+
+int Reactor::sendBundles()
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue || !bundleDue(*queue) ||
+            (!queue->writable && !queue->pending))
+        {
+            continue;
+        }
+
+        Command bundled(command);
+        loadBundle(bundled, *queue);
+        const int rc = sendNow(bundled, "send");
+        if (rc == FAIL_TIMEOUT)
+            continue;  // until there's room
+
+        if (rc)
+            return rc;
+
+        queue->bundleSize = 0;
+
+        // Now there's room for the message that's waiting, if any.
+        if (state == WAITING_TO_SEND && queue == command.queue) {
+            state    = READY;
+            resuming = true;
+        }
+    }
+
+    return 0;
+}
+
+bool Reactor::bundleDue(const Queue& queue) const
+{
+    if (!queue.bundleSize)
+        return false;
+
+    if (state == CLOSING || state == WAITING_TO_RECEIVE)
+        return true;
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return !isBefore(now, queue.bundleDeadline);
 }
 
-extern "C" void *consume(void *data);  // defined further below
+int Reactor::sendPending()
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue || !queue->pending || !queue->writable)
+            continue;
+
+        pendingMessage.resize(queue->maxMessageSize);
+        char *const data = &pendingMessage[0];
+
+        unsigned priority;
+        size_t   size;
+        while (!queue->pending->take(priority, data, size, &DONT_WAIT)) {
+            if (sendToQueue(*queue, data, size, priority, &DONT_WAIT))
+            {
+                const int error = errno;
+                if (error == ETIMEDOUT) {
+                    queue->writable = false;
+                    break;
+                }
+
+                if (error == EINTR)
+                    continue;
+
+                std::cerr << "Unable to send pending message: "
+                          << strerror(error) << std::endl;
+                return 3;
+            }
+
+            // Now there's room for the message that's waiting, if any.
+            if (state == WAITING_TO_SEND && queue == command.queue) {
+                state    = READY;
+                resuming = true;
+            }
+
+            if (queue->pending->pop() == Pending::PENDING_READY) {
+                const int rc = respond(OP_READY, queue->handle, 0, 0, shared);
+                if (rc)
+                    return rc;
+            }
+        }
+    }
+
+    return 0;
+}
 
-int consumeHandler(std::string&, Shared& shared)
+int Reactor::expire()
 {
-    // Don't do anything when a 'SIGUSR1' signal is received.  'SIGUSR1' is the
-    // signal used to wake up the consumer thread (if we ever create a consumer
-    // thread) from 'mq_receive', on systems where closing the queue is not
-    // sufficient.  We can't ignore the signal (since we want it to interrupt
-    // 'mq_receive'), but we also don't want it to do anything.  So, let the
-    // handler be a no-op function ('noOpSignalHandler'). TODO: is that true?
-    struct sigaction doNothing = {};
-    doNothing.sa_handler = &noOpSignalHandler;
-    sigaction(SIGUSR1,     // signal
-              &doNothing,  // action
-              0);          // don't need old action
+    timespec earliest;
+    if (!nextDeadline(earliest))
+        return 0;
 
-    shared.consumerThreadExists = true;
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (isBefore(now, earliest))
+        return 0;
 
-    const int rc = pthread_create(&shared.consumerThread,
-                                  0,         // pthread_attr_t (0 -> defaults)
-                                  &consume,  // start routine
-                                  &shared);  // argument to start routine
-    if (rc) {
-        const int error = errno;
-        shared.consumerThreadExists = false;
-        std::cerr << "Unable to create consumer thread: " << strerror(error)
-                  << std::endl;
+    if (drainTimed() && !isBefore(now, deadline)) {
+        for (size_t i = 0; i < shared.queues.size(); ++i) {
+            const Queue *const queue = shared.queues[i];
+            if (queue && queue->pending && queue->pending->bytes())
+                reportUnsent(*queue, shared);
+        }
+
+        return 1;
     }
- 
-    return rc;
-}
 
-int countHandler(std::string&, Shared& shared)
-{
-    mq_attr attributes;
-    if (const int rc = mq_getattr(shared.queue, &attributes)) {
-        const int error = errno;
-        std::cerr << "Unable to get queue attributes to query message count: "
-                  << strerror(error) << std::endl;
-        return rc;
+    if (command.timed && !isBefore(now, deadline) && !partlySent()) {
+        if (state == WAITING_TO_SEND) {
+            // Read the message again, but then drop it (see 'trySend').
+            state    = READY;
+            resuming = true;
+            expired  = true;
+        }
+        else if (state == WAITING_TO_RECEIVE) {
+            state = READY;
+            const int rc =
+                respond(OP_TIMEDOUT, command.handle, OP_RECEIVE, 0, shared);
+            if (rc)
+                return rc;
+        }
+    }
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (queue && queue->consuming && queue->consumeTimed &&
+            hasCredit(*queue) && !queue->readable &&
+            !isBefore(now, queue->consumeDeadline))
+        {
+            queue->consuming = false;
+            const int rc =
+                respond(OP_TIMEDOUT, queue->handle, OP_CONSUME, 0, shared);
+            if (rc)
+                return rc;
+        }
     }
 
-    Lock lock(shared.stdoutMutex, shared.consumerThreadExists);
-    std::cout << "count " << attributes.mq_curmsgs << std::endl;
- 
     return 0;
 }
 
-int msgsizeHandler(std::string&, Shared& shared)
+bool Reactor::nextDeadline(timespec& when) const
 {
-    mq_attr attributes;
-    if (const int rc = mq_getattr(shared.queue, &attributes)) {
-        const int error = errno;
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Unable to get queue attributes to report msgsize: "
-                  << strerror(error) << std::endl;
-        return rc;
+    bool found = false;
+    if ((command.timed &&
+         (state == WAITING_TO_SEND || state == WAITING_TO_RECEIVE) &&
+         !partlySent()) ||
+        drainTimed())
+    {
+        when  = deadline;
+        found = true;
     }
 
-    Lock lock(shared.stdoutMutex, shared.consumerThreadExists);
-    std::cout << "msgsize " << attributes.mq_msgsize << std::endl;
- 
-    return 0;
+    // A queue that's readable isn't idle, and neither is one whose
+    // "consume" is out of credits.
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        const Queue *const queue = shared.queues[i];
+        if (queue && queue->consuming && queue->consumeTimed &&
+            hasCredit(*queue) && !queue->readable &&
+            (!found || isBefore(queue->consumeDeadline, when)))
+        {
+            when  = queue->consumeDeadline;
+            found = true;
+        }
+
+        // With '--bundle-usec', a bundle is sent once it's due.
+        if (queue && queue->bundleSize &&
+            (!found || isBefore(queue->bundleDeadline, when)))
+        {
+            when  = queue->bundleDeadline;
+            found = true;
+        }
+    }
+
+    return found;
 }
 
-int maxmsgHandler(std::string&, Shared& shared)
+bool Reactor::mayDrain() const
 {
-    mq_attr attributes;
-    if (const int rc = mq_getattr(shared.queue, &attributes)) {
-        const int error = errno;
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Unable to get queue attributes to report maxmsg: "
-                  << strerror(error) << std::endl;
-        return rc;
+    return state == READY || state == WAITING_TO_SEND ||
+           (state == CLOSING && keeping());
+}
+
+size_t Reactor::drainLimit() const
+{
+    // With '--splice', messages are received only while standard output has
+    // room for them, since otherwise they'd be copied into the backlog
+    // rather than spliced.
+    return shared.splicePool ? 1 : MAX_OUTPUT_BACKLOG;
+}
+
+size_t Reactor::consumeBacklog() const
+{
+    if (workers.empty())
+        return shared.output.backlog();
+
+    size_t most = 0;
+    for (size_t i = 0; i < workers.size(); ++i)
+        most = std::max(most, workers[i].output->backlog());
+
+    return most;
+}
+
+int Reactor::flushWorkers()
+{
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker& worker = workers[i];
+        if (!worker.ready || !worker.output->backlog())
+            continue;
+
+        if (const int rc = flushOutput(*worker.output, shared))
+            return rc;
+
+        worker.ready = !worker.output->backlog();
     }
 
-    Lock lock(shared.stdoutMutex, shared.consumerThreadExists);
-    std::cout << "maxmsg " << attributes.mq_maxmsg << std::endl;
- 
     return 0;
 }
 
-int closeHandler(std::string&, Shared& shared)
+bool Reactor::partlySent() const
 {
-    Lock stoppedLock(shared.stoppedMutex, shared.consumerThreadExists);
+    // A queue's pending messages are sent before any "send" to it, so the
+    // message partly sent is pending, if any are.
+    if (state != WAITING_TO_SEND)
+        return false;
 
-    shared.stopped = true;
+    const Queue& queue = *command.queue;
+    return queue.partlySent && !(queue.pending && queue.pending->bytes());
+}
 
-    const int rc = mq_close(shared.queue);
+bool Reactor::drainTimed() const
+{
+    if (state != CLOSING || !command.timed)
+        return false;
 
-    if (rc) {
-        const int error = errno;
-        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-        std::cerr << "Unable to close the message queue: "
-                  << strerror(error) << std::endl;
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        const Queue *const queue = shared.queues[i];
+        if (queue && queue->pending && queue->pending->bytes())
+            return true;
     }
 
-    if (shared.consumerThreadExists) {
-        pthread_kill(shared.consumerThread, SIGUSR1);  // and ignore rcode
+    return false;
+}
+
+bool Reactor::keeping() const
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        const Queue *const queue = shared.queues[i];
+        if (queue &&
+            ((queue->pending && queue->pending->bytes()) || queue->bundleSize))
+        {
+            return true;
+        }
     }
 
-    return rc;
+    return false;
 }
 
-// --------------
-// thread drivers
-// --------------
+bool Reactor::hasRoom(const Queue& queue)
+{
+    return !shared.sharedMemory || shared.sharedMemory->reserve(queue.msgsize);
+}
 
-void *consume(void *data)
-    // Receive messages from a POSIX message queue and print the messages to
-    // standard output, each prefixed by its priority and length.  'data' must
-    // be a pointer to a 'Shared' object.
+int Reactor::receive()
 {
-    Shared&     shared = *static_cast<Shared*>(data);
-    std::string buffer;
+    if (!hasRoom(*command.queue)) {
+        state = WAITING_TO_RECEIVE;
+        return 0;
+    }
 
-    for (;;) {
-        const int rc = doReceive(buffer, shared);
+    const int rc = doReceive(*command.queue, shared, false, &DONT_WAIT);
+    switch (rc) {
+      case 0:
+        state = READY;
+        return 0;
+      case FAIL_TIMEOUT:
+        command.queue->readable = false;
+        // fall through
+      case FAIL_INTERRUPTED_OR_CLOSED:
+        state = WAITING_TO_RECEIVE;
+        return 0;
+      default:
+        return rc;
+    }
+}
 
-        if (rc == FAIL_INTERRUPTED_OR_CLOSED) {
-            Lock lock(shared.stoppedMutex);
-            if (shared.stopped) {
-                if (shared.options.debug) {
-                    Lock lock(shared.stderrMutex);
-                    std::cerr << "Consumer thread is finishing." << std::endl;
-                }
-                return 0;  // we're done
+int Reactor::drain()
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue || !queue->consuming)
+            continue;
+
+        bool received = false;
+        for (long count = 0;
+             queue->readable && hasCredit(*queue) &&
+                 count < shared.options.batch;
+             ++count)
+        {
+            if (consumeBacklog() >= drainLimit() || !hasRoom(*queue))
+                break;
+
+            const int rc = doReceive(*queue, shared, true, &DONT_WAIT);
+            if (rc == 0) {
+                received = true;
+                if (queue->credited)
+                    --queue->credits;
             }
-
-            // otherwise, go around again
+            else if (rc == FAIL_TIMEOUT)
+                queue->readable = false;
+            else if (rc != FAIL_INTERRUPTED_OR_CLOSED)
+                return rc;
         }
-        else if (rc) {
-            return data;  // an error occurred (reported in 'doReceive').
-                          // Return 'data' just because it's non-zero.
+
+        // A "consume" with a "timeout" has until then to get another message.
+        if (received && queue->consumeTimed) {
+            queue->consumeDeadline =
+                deadlineAfter(queue->consumeMilliseconds);
         }
     }
+
+    return 0;
 }
 
-int serve(const mqd_t& mq, const Options& options)
+int Reactor::wait()
 {
-    mq_attr attributes;
-    if (const int rc = mq_getattr(mq, &attributes)) {
-        const int error = errno;
-        std::cerr << "Unable to get queue attributes initially: "
-                  << strerror(error) << std::endl;
+    const size_t backlog    = shared.output.backlog();
+    const bool   backlogged = backlog >= MAX_OUTPUT_BACKLOG;
+    const bool   draining   = consumeBacklog() < drainLimit() && mayDrain();
+
+    // Is there something to do without waiting?
+    bool busy = (state == READY && inputReady && !backlogged)             ||
+                (state == WAITING_TO_SEND && command.queue->writable)     ||
+                (outputReady && backlog);
+
+    // A message that's waiting for room in the shared memory ring ('--shm')
+    // is waiting for the user, who doesn't say when there's room.
+    bool crowded = false;
+
+    const bool wantInput  = state == READY && !inputReady && !backlogged;
+    const bool wantOutput = !outputReady && backlog;
+
+    int rc;
+    if ((rc = watch(inputFd,
+                    inputRegistered,
+                    wantInput ? int(EPOLLIN) : 0)) ||
+        (rc = watch(outputFd,
+                    outputRegistered,
+                    wantOutput ? int(EPOLLOUT) : 0)))
+    {
         return rc;
     }
 
-    if (options.debug) {
-        std::cerr << "Got the following attributes for message queue "
-                  << repr(options.queueName) << ": "
-                     " mq_maxmsg="  << attributes.mq_maxmsg
-                  << " mq_msgsize=" << attributes.mq_msgsize
-                  << " mq_curmsgs=" << attributes.mq_curmsgs << std::endl;
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker&    worker  = workers[i];
+        const bool waiting = worker.output->backlog() != 0;
+
+        busy = busy || (worker.ready && waiting);
+        if ((rc = watch(worker.fd,
+                        worker.registered,
+                        !worker.ready && waiting ? int(EPOLLOUT) : 0)))
+        {
+            return rc;
+        }
+    }
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue)
+            continue;
+
+        const bool waitedOn   = queue == command.queue;
+        const bool receiving  = (waitedOn && state == WAITING_TO_RECEIVE) ||
+                                (draining && queue->consuming &&
+                                 hasCredit(*queue));
+        const bool sending    = (waitedOn && state == WAITING_TO_SEND) ||
+                                (queue->pending && queue->pending->bytes()) ||
+                                bundleDue(*queue);
+        const bool wantIn     = receiving && !queue->readable;
+        const bool wantOut    = sending && !queue->writable;
+
+        const bool roomy      = !receiving || !queue->readable ||
+                                hasRoom(*queue);
+
+        busy    = busy || (receiving && queue->readable && roomy) ||
+                          (sending && queue->writable);
+        crowded = crowded || !roomy;
+
+        if ((rc = watch(queue->descriptor,
+                        queue->registered,
+                        (wantIn  ? int(EPOLLIN)  : 0) |
+                            (wantOut ? int(EPOLLOUT) : 0))))
+        {
+            return rc;
+        }
+    }
+
+    // If nothing is to be done now, then wait until the next "timeout" (in
+    // milliseconds, rounded up), if any, or until it's time to look for room
+    // again.
+    int      timeout = busy ? 0 : crowded ? int(ROOM_POLL_MILLISECONDS) : -1;
+    timespec when;
+    if (!busy && nextDeadline(when)) {
+        timeout = millisecondsUntil(when);
+        if (crowded && timeout > ROOM_POLL_MILLISECONDS)
+            timeout = ROOM_POLL_MILLISECONDS;
+    }
+
+    epoll_event events[64];
+    const int   numEvents = epoll_wait(epollFd,
+                                       events,
+                                       sizeof events / sizeof events[0],
+                                       timeout);
+    if (numEvents == -1) {
+        if (errno == EINTR)
+            return 0;
+
+        std::cerr << "Unable to wait for events: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+
+    for (const epoll_event *event = events; event != events + numEvents;
+         ++event)
+    {
+        const int fd = event->data.fd;
+        if (fd == inputFd) {
+            inputReady = true;  // including errors and hangups, which 'read'
+                                // will then report
+            continue;
+        }
+
+        if (fd == outputFd) {
+            outputReady = true;  // likewise
+            continue;
+        }
+
+        Worker *worker = 0;
+        for (size_t i = 0; !worker && i < workers.size(); ++i) {
+            if (workers[i].fd == fd)
+                worker = &workers[i];
+        }
+
+        if (worker) {
+            worker->ready = true;  // likewise
+            continue;
+        }
+
+        // There are few enough queues that a linear search is fine.
+        Queue *queue = 0;
+        for (size_t i = 0; !queue && i < shared.queues.size(); ++i) {
+            if (shared.queues[i] && shared.queues[i]->descriptor == fd)
+                queue = shared.queues[i];
+        }
+
+        assert(queue);
+        if (event->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            queue->readable = true;
+        if (event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            queue->writable = true;
+    }
+
+    return 0;
+}
+
+int Reactor::watch(int fd, int& registered, int wanted)
+{
+    if (registered == wanted || registered == UNPOLLABLE)
+        return 0;
+
+    // Descriptors that aren't wanted are removed rather than left with no
+    // events, because otherwise 'epoll' would still report their hangups.
+    epoll_event event = {};
+    event.events  = wanted;
+    event.data.fd = fd;
+
+    const int operation = !wanted     ? EPOLL_CTL_DEL
+                        : !registered ? EPOLL_CTL_ADD
+                                      : EPOLL_CTL_MOD;
+
+    if (epoll_ctl(epollFd, operation, fd, &event)) {
+        if (errno == EPERM && operation == EPOLL_CTL_ADD) {
+            // 'fd' is something like a regular file, which is always ready.
+            registered = UNPOLLABLE;
+            return 0;
+        }
+
+        std::cerr << "Unable to watch file descriptor " << fd << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
     }
 
-    Shared shared(mq, attributes.mq_msgsize, options);
+    registered = wanted;
+    return 0;
+}
+
+int react(Command& command, Shared& shared)
+    // Serve commands from standard input using a 'Reactor'.  Return zero on
+    // success or a nonzero value otherwise.
+{
+    // Standard input and output, and each '--output-fd', are read and
+    // written without blocking.
+    std::vector<int> fds;
+    fds.push_back(fileno(stdin));
+    fds.push_back(fileno(stdout));
+    fds.insert(fds.end(),
+               shared.options.outputFds.begin(),
+               shared.options.outputFds.end());
+    const NonblockingGuard guard(fds);
+
+    Reactor reactor(command, shared);
+    return reactor.run();
+}
+
+int serve(const Options& options, const std::vector<OpenedQueue>& opened)
+    // Serve commands from standard input as the specified 'options' say,
+    // using the queues in the specified 'opened', in the order of their
+    // handles, rather than opening them.  Return zero on success or a
+    // nonzero value otherwise.
+{
+    Output output(fileno(stdout),
+                  options.flushBytes,
+                  options.flushMicroseconds);
+    Shared shared(output, options);
+    if (options.sharedMemoryFd != -1)
+        shared.sharedMemory = new SharedMemory(options.sharedMemoryFd);
+
+    // Threads started from here on start out as this one is.
+    tuneThread("main thread", options.cpu, options.realtimePriority, shared);
+
+    // Each '--output-fd' is written to through its own 'Output', buffered
+    // like standard output.
+    shared.workers.reserve(options.outputFds.size());
+    for (size_t i = 0; i < options.outputFds.size(); ++i) {
+        const int fd = options.outputFds[i];
+        if (fd == fileno(stdin) || fd == fileno(stdout) ||
+            fcntl(fd, F_GETFL) == -1)
+        {
+            std::cerr << "Output file descriptor " << fd
+                      << " is not open or is standard input or output."
+                      << std::endl;
+            return 1;
+        }
+
+        shared.workers.push_back(new Output(fd,
+                                            options.flushBytes,
+                                            options.flushMicroseconds));
+        shared.workers.back()->setStats(&shared.stats);
+    }
 
     class ThreadJoinGuard {
-        const pthread_t& thread;
-        const bool&      shouldJoin;
+        const std::vector<Queue*>& queues;
 
       public:
-        ThreadJoinGuard(const pthread_t& thread, const bool& shouldJoin)
-        : thread(thread)
-        , shouldJoin(shouldJoin)
+        explicit ThreadJoinGuard(const std::vector<Queue*>& queues)
+        : queues(queues)
         {}
 
         ~ThreadJoinGuard() {
-            if (shouldJoin)
-                pthread_join(thread, 0);
+            join();
         }
-    };
 
-    // If a "consumer" thread ends up getting created, make sure we join() it
-    // before leaving this function. 
-    ThreadJoinGuard threadJoinGuard(shared.consumerThread,
-                                    shared.consumerThreadExists);
-
-    // Buffer used for reading from standard input, and as a temporary place to
-    // put messages received on demand.
-    std::string chunk;
-    int         commandResult = 0;
-
-    while (std::cin >> chunk) {
-        #define HANDLE_COMMAND(MSG_NAME)                                 \
-            if (chunk == #MSG_NAME) {                                    \
-                if (const int rc = MSG_NAME ## Handler(chunk, shared)) { \
-                    commandResult = rc;                                  \
-                    break;                                               \
-                }                                                        \
+        void join() {
+            for (size_t i = 0; i < queues.size(); ++i) {
+                if (queues[i] && queues[i]->consumerThreadExists) {
+                    pthread_join(queues[i]->consumerThread, 0);
+                    queues[i]->consumerThreadExists = false;
+                }
             }
+        }
+    };
 
-        HANDLE_COMMAND(send)
-        else HANDLE_COMMAND(receive)
-        else HANDLE_COMMAND(consume)
-        else HANDLE_COMMAND(count)
-        else HANDLE_COMMAND(msgsize)
-        else HANDLE_COMMAND(maxmsg)
-        else if (chunk == "close") {
-            break;  // "close" is handled at the end.
+    // If any "consumer" threads end up getting created, make sure we join()
+    // them before leaving this function. 
+    ThreadJoinGuard threadJoinGuard(shared.queues);
+
+    // The queue named last on the command line has handle 0, and those named
+    // by '--queue' options follow it.
+    Options queueOptions(options);
+    for (size_t i = 0; i <= options.moreQueueNames.size(); ++i) {
+        if (i > MAX_HANDLE) {
+            std::cerr << "Too many queues. At most " << MAX_HANDLE + 1
+                      << " may be open." << std::endl;
+            return 1;
         }
-        else {
-            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
-            std::cerr << "Unknown command \"" << chunk << '\"' << std::endl;
-            commandResult = 1;
-            break;
+
+        if (i)
+            queueOptions.queueName = options.moreQueueNames[i - 1];
+
+        if (const int rc = openHandle(i,
+                                      queueOptions,
+                                      shared,
+                                      i < opened.size() ? &opened[i] : 0))
+        {
+            return rc;
+        }
+    }
+
+    // With '--splice', there are enough pooled buffers for the pipe to hold
+    // as many as it can while one more is being received for each queue
+    // (and for "receive").  Each buffer has room for a message from any
+    // queue open so far, and its newline.
+    if (options.spliceBytes && !shared.sharedMemory && output.pipeCapacity())
+    {
+        size_t largest = 0;
+        for (size_t i = 0; i < shared.queues.size(); ++i) {
+            if (size_t(shared.queues[i]->msgsize) > largest)
+                largest = shared.queues[i]->msgsize;
+        }
+
+        const size_t bufferSize = largest + 1;
+        shared.splicePool =
+            new BufferPool(bufferSize,
+                           output.pipeCapacity() / bufferSize + 2 +
+                               shared.queues.size());
+    }
+
+    // With '--mlock', what has been allocated so far, such as the receive
+    // buffers, stays in memory.  Not what is mapped later, though, such as
+    // the stacks of threads, which would count against the limit in full.
+    if (options.lockMemory && mlockall(MCL_CURRENT)) {
+        std::cerr << "Unable to lock mq's memory: " << strerror(errno)
+                  << std::endl;
+    }
+
+    // In the threaded engine, standard output and each '--output-fd' are
+    // written by a writer thread of their own, so that no thread waits for a
+    // slow reader while it holds a command or a message (e.g. "ack" behind a
+    // consumer's write).  Not with '--splice', though, since the writer
+    // would have to copy what is spliced.
+    if (!options.reactor && !shared.splicePool) {
+        if (output.startWriter(MAX_OUTPUT_BACKLOG)) {
+            std::cerr << "Unable to start writing output: "
+                      << strerror(output.error()) << std::endl;
+            return 1;
+        }
+
+        for (size_t i = 0; i < shared.workers.size(); ++i) {
+            if (shared.workers[i]->startWriter(MAX_OUTPUT_BACKLOG)) {
+                std::cerr << "Unable to start writing output: "
+                          << strerror(shared.workers[i]->error())
+                          << std::endl;
+                return 1;
+            }
         }
+    }
+
+    // The command most recently read from standard input.  Its buffer is used
+    // as a temporary place to put messages received on demand.
+    Input   input(fileno(stdin));
+    Command command(input);
+    ReadHookData readHookData = { command, shared };
+    if (!options.reactor)
+        input.setReadHook(&beforeRead, &readHookData);
+
+    const int commandResult = options.reactor
+                            ? react(command, shared)
+                            : handleCommands(command, shared);
+
+    const int flushResult = flushOutput(shared);
+    const int closeResult = closeHandler(command, shared);
+
+    // Only once the consumer threads are done and the writer threads have
+    // written everything queued for them is it known whether all of the
+    // output was written.
+    threadJoinGuard.join();
+
+    // Messages kept from bundles are no longer in the queue, and would be
+    // lost if they weren't put back.
+    int putBackResult = 0;
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        if (shared.queues[i] && putBackUnbundled(*shared.queues[i]))
+            putBackResult = 1;
+    }
+
+    const int writeError  = stopWriters(shared);
+    const int writeResult = writeError ? FAIL_WRITE : 0;
+    if (writeError && !commandResult && !flushResult) {
+        std::cerr << "Failed to write output: " << strerror(writeError)
+                  << std::endl;
+    }
+
+    return commandResult ? commandResult
+                         : flushResult ? flushResult
+                         : closeResult ? closeResult
+                         : putBackResult ? putBackResult : writeResult;
+}
 
-        #undef HANDLE_COMMAND
+int broker(const Options& options)
+    // Open the queues that the specified 'options' name, and then serve each
+    // client that connects to the '--listen' socket from a child process of
+    // its own, whose standard input and output are the connection, as if it
+    // were an 'mq' started with 'options' that found the queues open.  Only
+    // a failure ends the loop.  Return the child's result in a child, or a
+    // nonzero value in this process.
+{
+    pthread_mutex_t          stderrMutex = PTHREAD_MUTEX_INITIALIZER;
+    const bool               locking     = false;  // no threads here
+    std::vector<OpenedQueue> opened;
+
+    Options queueOptions(options);
+    for (size_t i = 0;
+         i <= options.moreQueueNames.size() && i <= MAX_HANDLE;
+         ++i)
+    {
+        if (i)
+            queueOptions.queueName = options.moreQueueNames[i - 1];
+
+        opened.push_back(OpenedQueue());
+        if (const int rc = openDescriptor(opened.back(),
+                                          queueOptions,
+                                          stderrMutex,
+                                          locking))
+        {
+            return rc;
+        }
     }
 
-    const int closeResult = closeHandler(chunk, shared);
-    return commandResult ? commandResult : closeResult;
+    Listener listener(options.listenPath);
+
+    // Children are reaped as they exit.
+    struct sigaction reap = {};
+    reap.sa_handler = SIG_IGN;
+    sigaction(SIGCHLD, &reap, 0);
+
+    for (;;) {
+        int connection;
+        if (const int error = listener.accept(connection)) {
+            std::cerr << "Unable to accept a connection on "
+                      << repr(options.listenPath) << ": " << strerror(error)
+                      << std::endl;
+            return error;
+        }
+
+        const pid_t child = fork();
+        if (child == 0) {
+            listener.close();
+
+            struct sigaction defaultAction = {};
+            defaultAction.sa_handler = SIG_DFL;
+            sigaction(SIGCHLD, &defaultAction, 0);
+
+            if (dup2(connection, fileno(stdin))  == -1 ||
+                dup2(connection, fileno(stdout)) == -1)
+            {
+                std::cerr << "Unable to serve a connection: "
+                          << strerror(errno) << std::endl;
+                return 1;
+            }
+
+            close(connection);
+            if (options.debug)
+                std::cerr << "Serving a client in process " << getpid()
+                          << std::endl;
+
+            return serve(options, opened);
+        }
+
+        // A client that can't be served is dropped, but the others aren't.
+        if (child == -1) {
+            std::cerr << "Unable to fork to serve a connection: "
+                      << strerror(errno) << std::endl;
+        }
+
+        close(connection);
+    }
 }
 
 // ----
@@ -882,14 +5722,10 @@ int main(int argc, char *argv[]) try {
         return 0;
     }
 
-    const mqd_t mq = openQueue(options);
-    if (mq == mqd_t(-1)) {
-        std::cerr << "Unable to open queue named " << repr(options.queueName)
-                  << ": " << strerror(errno) << '\n';
-        return errno;
-    }
+    if (!options.listenPath.empty())
+        return broker(options);
 
-    return serve(mq, options);
+    return serve(options, std::vector<OpenedQueue>());
 }
 catch (const std::exception& error) {
     std::cerr << error.what() << std::endl;
@@ -0,0 +1,945 @@
+// POSIX
+#include <errno.h>     // errno, EINTR
+#include <poll.h>      // poll
+#include <signal.h>    // signal, SIGPIPE
+#include <string.h>    // strerror
+#include <sys/wait.h>  // waitpid
+#include <time.h>      // clock_gettime
+#include <unistd.h>    // fork, execvp, pipe, dup2, close, getpid, rmdir,
+                       // usleep
+
+// Standard C
+#include <stdlib.h>    // rand_r, mkdtemp
+
+// Standard C++
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lz.h"
+#include "repr.h"
+
+// mq-test runs regression checks against an 'mq' executable, driving it
+// through its standard input and output as any user would, on scratch queues
+// that are unlinked afterward.  It prints each check that fails, and exits
+// with a nonzero status if any did.
+
+// -------------
+// child process
+// -------------
+
+class Process {
+    // 'Process' is an 'mq' (or whatever is run) whose standard input,
+    // output, and error are pipes to this process.
+
+    pid_t       pid;
+    int         input;
+    int         output;
+    int         error;
+    std::string out;
+    std::string err;
+
+    Process(const Process&);             // not copyable
+    Process& operator=(const Process&);  // not assignable
+
+    int pump(int milliseconds);
+        // Read whatever standard output and standard error have, waiting up
+        // to the specified 'milliseconds' for something.  Return zero if
+        // something was read, or a nonzero value on timeout or end of file.
+
+  public:
+    Process();
+
+    ~Process();
+        // Kill the process, if it's still running.
+
+    int start(const std::vector<std::string>& args);
+        // Run the program named by the first of the specified 'args', with
+        // the rest as its arguments.  Return zero on success or a nonzero
+        // value otherwise.
+
+    int write(const std::string& data);
+        // Write the specified 'data' to the standard input of the process.
+        // Return zero on success or a nonzero value otherwise.
+
+    int await(const std::string& text, int milliseconds = 5000);
+        // Read standard output until the specified 'text' is in it, for up
+        // to the specified 'milliseconds'.  Return zero if it is or a
+        // nonzero value otherwise.
+
+    int finish();
+        // Close the standard input of the process, read what it writes
+        // until it exits, and return its exit status, or -1 if a signal
+        // ended it.
+
+    const std::string& standardOutput() const;
+        // Return what the process has written to standard output so far.
+
+    const std::string& standardError() const;
+        // Return what the process has written to standard error so far.
+};
+
+Process::Process()
+: pid(-1)
+, input(-1)
+, output(-1)
+, error(-1)
+{}
+
+Process::~Process()
+{
+    if (pid != -1) {
+        kill(pid, SIGKILL);
+        finish();
+    }
+}
+
+int Process::start(const std::vector<std::string>& args)
+{
+    int toChild[2], fromChild[2], errorsFromChild[2];
+    if (pipe(toChild) || pipe(fromChild) || pipe(errorsFromChild)) {
+        std::cerr << "Unable to create pipe: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        std::cerr << "Unable to fork: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    if (pid == 0) {
+        dup2(toChild[0], 0);
+        dup2(fromChild[1], 1);
+        dup2(errorsFromChild[1], 2);
+        close(toChild[0]);
+        close(toChild[1]);
+        close(fromChild[0]);
+        close(fromChild[1]);
+        close(errorsFromChild[0]);
+        close(errorsFromChild[1]);
+
+        std::vector<char*> argv;
+        for (size_t i = 0; i < args.size(); ++i)
+            argv.push_back(const_cast<char*>(args[i].c_str()));
+        argv.push_back(0);
+
+        execvp(argv[0], &argv[0]);
+        std::cerr << "Unable to run " << repr(args[0]) << ": "
+                  << strerror(errno) << std::endl;
+        _exit(127);
+    }
+
+    close(toChild[0]);
+    close(fromChild[1]);
+    close(errorsFromChild[1]);
+    input  = toChild[1];
+    output = fromChild[0];
+    error  = errorsFromChild[0];
+    return 0;
+}
+
+int Process::write(const std::string& data)
+{
+    for (size_t done = 0; done < data.size(); ) {
+        const ssize_t rc = ::write(input,
+                                   data.data() + done,
+                                   data.size() - done);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        done += rc;
+    }
+
+    return 0;
+}
+
+int Process::pump(int milliseconds)
+{
+    pollfd fds[2] = {};
+    int    count  = 0;
+    if (output != -1) {
+        fds[count].fd     = output;
+        fds[count].events = POLLIN;
+        ++count;
+    }
+    if (error != -1) {
+        fds[count].fd     = error;
+        fds[count].events = POLLIN;
+        ++count;
+    }
+    if (!count)
+        return 1;
+
+    const int ready = poll(fds, count, milliseconds);
+    if (ready <= 0)
+        return ready == -1 && errno == EINTR ? 0 : 1;
+
+    for (int i = 0; i < count; ++i) {
+        if (!fds[i].revents)
+            continue;
+
+        char          buffer[65536];
+        const ssize_t rc = read(fds[i].fd, buffer, sizeof buffer);
+        if (rc <= 0) {
+            close(fds[i].fd);
+            (fds[i].fd == output ? output : error) = -1;
+        }
+        else
+            (fds[i].fd == output ? out : err).append(buffer, rc);
+    }
+
+    return 0;
+}
+
+int Process::await(const std::string& text, int milliseconds)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const long long deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 +
+                               milliseconds;
+
+    while (out.find(text) == std::string::npos) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long long left = deadline - now.tv_sec * 1000LL -
+                               now.tv_nsec / 1000000;
+        if (left <= 0 || (pump(int(left)) && output == -1))
+            return out.find(text) == std::string::npos;
+    }
+
+    return 0;
+}
+
+int Process::finish()
+{
+    if (input != -1) {
+        close(input);
+        input = -1;
+    }
+
+    while (output != -1 || error != -1)
+        pump(-1);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+
+    pid = -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+const std::string& Process::standardOutput() const
+{
+    return out;
+}
+
+const std::string& Process::standardError() const
+{
+    return err;
+}
+
+// --------
+// fixtures
+// --------
+
+std::string mqPath   = "./mq";
+int         checks   = 0;
+int         failures = 0;
+
+void check(bool condition, const char *what, const std::string& detail = "")
+    // Count a check, described by the specified 'what', which passed if the
+    // specified 'condition' is 'true'.  If it failed, say so, along with the
+    // optionally specified 'detail'.
+{
+    ++checks;
+    if (condition)
+        return;
+
+    ++failures;
+    std::cout << "FAILED: " << what;
+    if (!detail.empty())
+        std::cout << ": " << detail;
+    std::cout << std::endl;
+}
+
+class ScratchQueue {
+    // 'ScratchQueue' is the name of a queue that is unlinked when this
+    // object is created and again when it's destroyed.
+
+    std::string queueName;
+
+  public:
+    explicit ScratchQueue(const char *suffix)
+    {
+        std::ostringstream name;
+        name << "/mq-test-" << getpid() << '-' << suffix;
+        queueName = name.str();
+        unlink();
+    }
+
+    ~ScratchQueue()
+    {
+        unlink();
+    }
+
+    void unlink()
+    {
+        std::vector<std::string> args;
+        args.push_back(mqPath);
+        args.push_back("--unlink");
+        args.push_back(queueName);
+        Process process;
+        if (!process.start(args))
+            process.finish();
+    }
+
+    const std::string& name() const
+    {
+        return queueName;
+    }
+};
+
+std::vector<std::string> mqArgs(const std::string& options,
+                                const ScratchQueue& queue)
+    // Return the arguments that run 'mq' with the specified
+    // whitespace-separated 'options' on the specified 'queue'.
+{
+    std::vector<std::string> args(1, mqPath);
+    std::istringstream       words(options);
+    std::string              word;
+    while (words >> word)
+        args.push_back(word);
+
+    args.push_back(queue.name());
+    return args;
+}
+
+int run(std::string&        output,
+        const std::string&  options,
+        const ScratchQueue& queue,
+        const std::string&  input,
+        std::string        *errors = 0)
+    // Run 'mq' with the specified 'options' on the specified 'queue', give
+    // it the specified 'input', and load what it writes to standard output
+    // into the specified 'output' (and to standard error into the
+    // optionally specified 'errors').  Return its exit status.
+{
+    Process process;
+    if (process.start(mqArgs(options, queue)) || process.write(input))
+        return 127;
+
+    const int status = process.finish();
+    output = process.standardOutput();
+    if (errors)
+        *errors = process.standardError();
+    return status;
+}
+
+std::string header(unsigned           opcode,
+                   unsigned           priority = 0,
+                   unsigned long long length   = 0,
+                   unsigned           handle   = 0)
+    // Return a header of the binary protocol having the specified 'opcode',
+    // and the optionally specified 'priority', 'length', and 'handle'.
+{
+    std::string result(16, '\0');
+    result[0] = char(opcode);
+    for (int i = 0; i < 2; ++i)
+        result[2 + i] = char(handle >> (8 * i));
+    for (int i = 0; i < 4; ++i)
+        result[4 + i] = char(priority >> (8 * i));
+    for (int i = 0; i < 8; ++i)
+        result[8 + i] = char(length >> (8 * i));
+
+    return result;
+}
+
+// ------
+// checks
+// ------
+
+void testSendv()
+    // "sendv" sends every record, in order, and acknowledges them all at
+    // once with their number and total length.  A malformed record ends
+    // 'mq', having acknowledged only the records before it.
+{
+    ScratchQueue queue("sendv");
+    std::string  output;
+
+    int status = run(output,
+                     "--open --create --read --write",
+                     queue,
+                     "sendv 3\n0 1 a\n2 2 bb\n0 3 ccc\n"
+                     "receive\nreceive\nreceive\n");
+    check(status == 0, "sendv exit status");
+    check(output == "ackv 3 6\n2 2 bb\n0 1 a\n0 3 ccc\n",
+          "sendv acks and sends every record",
+          repr(output));
+
+    std::string errors;
+    status = run(output,
+                 "--open --read --write",
+                 queue,
+                 "sendv 2\n0 1 a\n",
+                 &errors);
+    check(status != 0, "sendv with too few records fails");
+    check(output == "ackv 1 1\n",
+          "sendv acknowledges the records before a bad one",
+          repr(output));
+    check(!errors.empty(), "sendv with too few records says why");
+}
+
+void testBinary()
+    // With '--binary', every command and response is a 16 byte header,
+    // followed by a payload of the header's length, which may contain any
+    // bytes.
+{
+    ScratchQueue      queue("binary");
+    std::string       output;
+    const std::string payload("he\nl\0", 5);
+
+    int status = run(output,
+                     "--binary --open --create --read --write",
+                     queue,
+                     header(1, 3, 5) + payload +        // send
+                     header(8, 0, 2) +                  // sendv
+                         header(1, 1, 2) + "ab" +
+                         header(1, 0, 1) + "c" +
+                     header(2) + header(2) + header(2)  // receive
+                     + header(4));                      // count
+    check(status == 0, "binary exit status");
+    check(output == header(0x81, 3, 5) +                // ack
+                    header(0x88, 2, 3) +                // ackv
+                    header(0x82, 3, 5) + payload +      // msg
+                    header(0x82, 1, 2) + "ab" +
+                    header(0x82, 0, 1) + "c" +
+                    header(0x84, 0, 0),                 // count
+          "binary responses are framed by their headers",
+          repr(output));
+
+    std::string errors;
+    status = run(output,
+                 "--binary --open --read --write",
+                 queue,
+                 header(1, 0, 9) + "abc",
+                 &errors);
+    check(status != 0, "binary send of a truncated payload fails");
+    check(output.empty() && !errors.empty(),
+          "binary send of a truncated payload isn't sent, and says why",
+          repr(output));
+
+    status = run(output,
+                 "--binary --open --read --write",
+                 queue,
+                 header(0x55),
+                 &errors);
+    check(status != 0 && output.empty() && !errors.empty(),
+          "binary command with an unknown opcode fails",
+          repr(errors));
+}
+
+void testInput()
+    // A payload larger than the input buffer (64 KiB to begin with) is read
+    // whole, even if it comes after its header has been parsed.
+{
+    ScratchQueue      queue("input");
+    const std::string large(70000, 'x');
+
+    Process process;
+    process.start(mqArgs("--fragment 100000 --open --create --read --write "
+                         "--maxmsg 10 --msgsize 8192",
+                         queue));
+    process.write("send 0 70000 ");
+    usleep(100000);  // for 'mq' to parse the header before the payload comes
+    process.write(large + "\nreceive\n");
+    const int status = process.finish();
+    check(status == 0 &&
+              process.standardOutput() ==
+                  "ack 70000\n0 70000 " + large + "\n",
+          "a large payload is read after its header",
+          repr(process.standardError()));
+}
+
+void testPending()
+    // With '--pending', "close" waits for room in the queue for the messages
+    // still pending, but with a "timeout", only until it passes, and then
+    // 'mq' discards them, says so, and fails.
+{
+    ScratchQueue queue("pending");
+    std::string  output;
+    std::string  errors;
+
+    run(output,
+        "--open --create --write --maxmsg 2 --msgsize 64",
+        queue,
+        "");
+
+    for (int i = 0; i < 2; ++i) {
+        const std::string engine(i ? "--reactor " : "");
+        const std::string with(i ? " with --reactor" : "");
+
+        int status = run(output,
+                         engine + "--pending 4096 --open --write",
+                         queue,
+                         "send 0 1 a\nsend 0 1 b\nsend 0 1 c\n"
+                         "timeout 200 close\n",
+                         &errors);
+        check(status != 0 &&
+                  output == "ack 1\nack 1\nack 1\n" &&
+                  errors.find("Discarded") != std::string::npos,
+              ("close with a timeout gives up on pending messages" +
+                   with).c_str(),
+              repr(output + errors));
+
+        status = run(output, "--open --read", queue, "receive\nreceive\n");
+        check(status == 0 && output == "0 1 a\n0 1 b\n",
+              ("pending messages that fit were sent" + with).c_str(),
+              repr(output));
+
+        status = run(output,
+                     engine + "--pending 4096 --open --write",
+                     queue,
+                     "send 0 1 d\ntimeout 1000 close\n",
+                     &errors);
+        check(status == 0 && errors.empty(),
+              ("close with a timeout sends pending messages" + with).c_str(),
+              repr(errors));
+
+        status = run(output, "--open --read", queue, "receive\n");
+        check(output == "0 1 d\n",
+              ("a pending message is sent before close" + with).c_str(),
+              repr(output));
+    }
+}
+
+void testCredits()
+    // A "consume" given credits takes only that many messages, leaving the
+    // rest in the queue until "credit" gives it more, in either engine.
+{
+    ScratchQueue queue("credits");
+    std::string  output;
+
+    for (int i = 0; i < 2; ++i) {
+        const std::string engine(i ? "--reactor " : "");
+        const std::string with(i ? " with --reactor" : "");
+        int status = run(output,
+                         "--open --create --write",
+                         queue,
+                         "send 0 1 a\nsend 0 1 b\nsend 0 1 c\n");
+        check(status == 0, "credits send exit status");
+
+        Process reader;
+        reader.start(mqArgs(engine + "--open --read", queue));
+        reader.write("consume 2\n");
+        check(reader.await("0 1 b\n") == 0,
+              ("consume takes its credits' worth" + with).c_str());
+        reader.write("count\n");
+        check(reader.await("count 1\n") == 0,
+              ("consume leaves the rest in the queue" + with).c_str(),
+              repr(reader.standardOutput()));
+        reader.write("credit 1\n");
+        check(reader.await("0 1 c\n") == 0,
+              ("credit lets consume take more" + with).c_str());
+        status = reader.finish();
+        check(status == 0 &&
+                  reader.standardOutput() ==
+                      "0 1 a\n0 1 b\ncount 1\n0 1 c\n",
+              ("consume takes no more than its credits" + with).c_str(),
+              repr(reader.standardOutput()));
+    }
+}
+
+void testSpool()
+    // With '--spool', messages that don't fit in the queue are acknowledged
+    // right away, and sent as the queue drains, highest priority first.  The
+    // spool's files don't outlive 'mq'.
+{
+    ScratchQueue queue("spool");
+    std::string  output;
+    char         directory[] = "/tmp/mq-test-spool-XXXXXX";
+    if (!mkdtemp(directory)) {
+        check(false, "spool directory", strerror(errno));
+        return;
+    }
+
+    run(output,
+        "--open --create --write --maxmsg 2 --msgsize 64",
+        queue,
+        "");
+
+    for (int i = 0; i < 2; ++i) {
+        const std::string engine(i ? "--reactor " : "");
+        const std::string with(i ? " with --reactor" : "");
+
+        Process writer;
+        writer.start(mqArgs(engine + "--spool " + directory +
+                                " --open --write",
+                            queue));
+        writer.write("send 1 1 a\nsend 1 1 b\n"
+                     "send 1 1 c\nsend 5 1 d\nsend 3 1 e\ncount\n");
+        const std::string acks("ack 1\nack 1\nack 1\nack 1\nack 1\n");
+        check(writer.await(acks + "count 2\n") == 0,
+              ("messages that don't fit are acknowledged" + with).c_str(),
+              repr(writer.standardOutput()));
+
+        // Whenever the reader makes room, the writer sends the spooled
+        // message of highest priority.
+        int status = run(output,
+                         "--open --read",
+                         queue,
+                         "receive\nreceive\nreceive\nreceive\nreceive\n");
+        std::string spooled;
+        for (size_t at = 0; at < output.size(); at += 6) {
+            const char message = output[at + 4];
+            if (message == 'c' || message == 'd' || message == 'e')
+                spooled += message;
+        }
+        check(status == 0 &&
+                  output.size() == 30 &&
+                  output.compare(0, 6, "1 1 a\n") == 0 &&
+                  output.find("1 1 b\n") != std::string::npos &&
+                  spooled == "dec",
+              ("spooled messages are sent by priority" + with).c_str(),
+              repr(output));
+
+        status = writer.finish();
+        check(status == 0, ("spool exit status" + with).c_str(),
+              repr(writer.standardError()));
+
+        // With nothing receiving, a "close" with a "timeout" gives up on
+        // what's still spooled.
+        std::string errors;
+        status = run(output,
+                     engine + "--spool " + directory + " --open --write",
+                     queue,
+                     "send 1 1 f\nsend 1 1 g\nsend 1 1 h\n"
+                     "timeout 200 close\n",
+                     &errors);
+        check(status != 0 && errors.find("Discarded") != std::string::npos,
+              ("close with a timeout gives up on the spool" + with).c_str(),
+              repr(errors));
+        run(output, "--open --read", queue, "receive\nreceive\n");
+    }
+
+    check(rmdir(directory) == 0, "spool files don't outlive mq",
+          strerror(errno));
+}
+
+void testFragment()
+    // With '--fragment', a message larger than the queue's 'msgsize' is sent
+    // as several fragments, and received whole.  '--fragment' needs a single
+    // receiver, and so can't be combined with '--listen'.
+{
+    ScratchQueue      queue("fragment");
+    std::string       output;
+    const std::string large(300, 'x');
+
+    int status = run(output,
+                     "--fragment 4096 --open --create --read --write "
+                     "--maxmsg 10 --msgsize 64",
+                     queue,
+                     "send 2 300 " + large + "\nsend 1 3 abc\ncount\n");
+    check(status == 0, "fragment send exit status");
+    check(output == "ack 300\nack 3\ncount 8\n",
+          "a large message is sent as several fragments",
+          repr(output));
+
+    status = run(output,
+                 "--fragment 4096 --open --read",
+                 queue,
+                 "receive\nreceive\ncount\n");
+    check(status == 0, "fragment receive exit status");
+    check(output == "2 300 " + large + "\n1 3 abc\ncount 0\n",
+          "fragments are put back together",
+          repr(output));
+
+    std::string errors;
+    status = run(output,
+                 "--fragment 4096 --listen /tmp/mq-test.sock --open --read",
+                 queue,
+                 "",
+                 &errors);
+    check(status != 0 && !errors.empty(),
+          "--fragment can't be combined with --listen",
+          repr(errors));
+}
+
+std::string lzRoundTrip(const std::string& input)
+    // Return the specified 'input' compressed and then decompressed, or a
+    // description of what went wrong.
+{
+    std::string compressed(input.size() + input.size() / 8 + 32, '\0');
+    const size_t size = lzCompress(&compressed[0],
+                                   compressed.size(),
+                                   input.data(),
+                                   input.size());
+    if (!size)
+        return "<not compressible within the limit>";
+
+    if (lzDecompressedSize(compressed.data(), size) != input.size())
+        return "<wrong decompressed size>";
+
+    std::string output(input.size(), '\0');
+    if (lzDecompress(&output[0], output.size(), compressed.data(), size))
+        return "<not decompressible>";
+
+    return output;
+}
+
+void testLz()
+    // The LZ codec of '--compress' gives back what it compressed, and
+    // rejects a block that is corrupt rather than reading or writing out of
+    // bounds.  'mq' with '--compress' passes messages through unchanged.
+{
+    std::vector<std::string> inputs;
+    inputs.push_back("");
+    inputs.push_back("a");
+    inputs.push_back(std::string(100000, 'z'));
+    inputs.push_back("abcabcabcabcabcabcabcabcabcabc, and then something");
+
+    unsigned    seed = 1;
+    std::string text;
+    for (int i = 0; i < 20000; ++i) {
+        // Words from a small vocabulary, with literal runs of every length.
+        static const char *const words[] = {
+            "queue ", "message ", "priority ", "send ", "receive ", "\n"
+        };
+        text += words[rand_r(&seed) % 6];
+        if (rand_r(&seed) % 50 == 0)
+            text += std::string(rand_r(&seed) % 300, char(rand_r(&seed)));
+    }
+    inputs.push_back(text);
+
+    std::string noise;
+    for (int i = 0; i < 5000; ++i)
+        noise += char(rand_r(&seed));
+    inputs.push_back(noise);
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const std::string output = lzRoundTrip(inputs[i]);
+        std::ostringstream what;
+        what << "lz round trip of input " << i << " (" << inputs[i].size()
+             << " bytes)";
+        check(output == inputs[i],
+              what.str().c_str(),
+              output.size() < 64 ? output : "");
+    }
+
+    // A truncated block is rejected, and one with bytes overwritten at
+    // random decompresses to something or is rejected, but either way
+    // doesn't read or write out of bounds (which would crash, or be caught
+    // by a memory checker).
+    std::string compressed(text.size() * 2, '\0');
+    compressed.resize(lzCompress(&compressed[0],
+                                 compressed.size(),
+                                 text.data(),
+                                 text.size()));
+
+    int truncatedAccepted = 0;
+    for (int i = 0; i < 2000; ++i) {
+        std::string corrupt(compressed);
+        const bool  truncated = i % 2 == 0;
+        if (truncated)
+            corrupt.resize(rand_r(&seed) % corrupt.size());
+        else {
+            for (int flips = 1 + i % 4; flips; --flips)
+                corrupt[rand_r(&seed) % corrupt.size()] = char(rand_r(&seed));
+        }
+
+        std::string output(text.size(), '\0');
+        const int   rc = lzDecompress(&output[0],
+                                      output.size(),
+                                      corrupt.data(),
+                                      corrupt.size());
+        truncatedAccepted += truncated && !rc;
+    }
+    check(lzDecompress(0, 0, "", 0) != 0, "lz rejects an empty block");
+    check(truncatedAccepted == 0, "lz rejects truncated blocks");
+
+    ScratchQueue queue("compress");
+    std::string  output;
+    const int    status = run(output,
+                              "--compress --open --create --read --write",
+                              queue,
+                              "send 0 5000 " + std::string(5000, 'c') +
+                                  "\nreceive\n");
+    check(status == 0 &&
+              output == "ack 5000\n0 5000 " + std::string(5000, 'c') + "\n",
+          "--compress passes messages through unchanged",
+          repr(output.substr(0, 64)));
+}
+
+void testBundle()
+    // With '--bundle-usec', consecutive messages of the same priority are
+    // sent as one bundle, and received one at a time.  Those of a bundle
+    // that weren't taken by the time the queue is closed are put back in
+    // the queue, or else 'mq' says that they're lost and fails.
+{
+    ScratchQueue queue("bundle");
+    std::string  output;
+
+    int status = run(output,
+                     "--bundle-usec 100000 --open --create --write "
+                     "--maxmsg 1 --msgsize 64",
+                     queue,
+                     "send 0 1 a\nsend 0 2 bb\nsend 0 3 ccc\n");
+    check(status == 0, "bundle send exit status");
+
+    status = run(output,
+                 "--bundle-usec 0 --open --read",
+                 queue,
+                 "count\nreceive\ncount\n");
+    check(status == 0 && output == "count 1\n0 1 a\ncount 0\n",
+          "three messages are sent as one bundle",
+          repr(output));
+
+    status = run(output,
+                 "--bundle-usec 0 --open --read",
+                 queue,
+                 "count\nreceive\nreceive\ncount\n");
+    check(status == 0 && output == "count 1\n0 2 bb\n0 3 ccc\ncount 0\n",
+          "messages left in a bundle at close are put back",
+          repr(output));
+
+    // The same, but with "consume" out of credits holding the rest.
+    run(output,
+        "--bundle-usec 100000 --open --write",
+        queue,
+        "send 0 1 a\nsend 0 2 bb\n");
+    {
+        Process reader;
+        reader.start(mqArgs("--bundle-usec 0 --open --read", queue));
+        reader.write("consume 1\n");
+        check(reader.await("0 1 a\n") == 0, "consume takes a credit's worth");
+        status = reader.finish();
+        check(status == 0 && reader.standardOutput() == "0 1 a\n",
+              "consume leaves the rest of a bundle",
+              repr(reader.standardOutput()));
+    }
+
+    status = run(output, "--bundle-usec 0 --open --read", queue, "receive\n");
+    check(status == 0 && output == "0 2 bb\n",
+          "messages left in a bundle by consume are put back",
+          repr(output));
+
+    // If the queue has filled up meanwhile, they're lost, and 'mq' says so.
+    run(output,
+        "--bundle-usec 100000 --open --write",
+        queue,
+        "send 0 1 a\nsend 0 2 bb\n");
+    Process reader;
+    reader.start(mqArgs("--bundle-usec 0 --open --read", queue));
+    reader.write("receive\n");
+    check(reader.await("0 1 a\n") == 0, "receive takes one of a bundle");
+    run(output, "--open --write", queue, "send 0 1 z\n");
+    status = reader.finish();
+    check(status != 0 &&
+              reader.standardError().find("Discarded 1 ") != std::string::npos,
+          "messages left in a bundle that can't be put back are reported",
+          repr(reader.standardError()));
+}
+
+void testProbe()
+    // "probe" sends markers through an empty queue and receives them back.
+    // It refuses a queue that has messages in it, and '--reactor', in its
+    // response, and 'mq' carries on.  Messages that arrive while it runs are
+    // put back in the order they came, and no marker is left behind.
+{
+    ScratchQueue queue("probe");
+    std::string  output;
+
+    int status = run(output,
+                     "--open --create --read --write --maxmsg 10 "
+                     "--msgsize 64",
+                     queue,
+                     "probe 3\ncount\n");
+    check(status == 0 &&
+              output.compare(0, 26, "probe sent=3 received=3 tr") == 0 &&
+              output.find("\ncount 0\n") != std::string::npos,
+          "probe of an empty queue",
+          repr(output));
+
+    status = run(output, "--reactor --open --read --write", queue,
+                 "probe 1\ncount\n");
+    check(status == 0 && output == "probe refused reactor\ncount 0\n",
+          "probe is refused with --reactor",
+          repr(output));
+
+    run(output, "--open --write", queue, "send 1 1 a\n");
+    status = run(output, "--open --read --write", queue,
+                 "probe 1\ncount\n");
+    check(status == 0 && output == "probe refused nonempty\ncount 1\n",
+          "probe of a queue that isn't empty is refused",
+          repr(output));
+
+    status = run(output, "--binary --open --read --write", queue,
+                 header(13, 0, 1) + header(4));  // probe, count
+    check(status == 0 &&
+              output == header(0x8D, 1, 8) + "nonempty" + header(0x84, 0, 1),
+          "binary probe is refused with priority 1 and the reason",
+          repr(output));
+
+    status = run(output, "--open --read", queue, "receive\ncount\n");
+    check(output == "1 1 a\ncount 0\n",
+          "probe leaves a queue that isn't empty alone",
+          repr(output));
+
+    // Messages at the markers' priority are passed over if they arrive
+    // during the "probe", which is then refused for "traffic" (or, if they
+    // come first, for "nonempty").
+    Process prober;
+    prober.start(mqArgs("--open --read --write", queue));
+    prober.write("probe 1000000\ncount\n");
+    std::string input;
+    for (int i = 0; i < 8; ++i)
+        input += "send 32767 1 " + std::string(1, char('a' + i)) + "\n";
+    run(output, "--open --write", queue, input);
+    status = prober.finish();
+    const std::string& refused = prober.standardOutput();
+    check(status == 0 &&
+              refused.compare(0, 14, "probe refused ") == 0 &&
+              refused.find("\ncount 8\n") != std::string::npos,
+          "probe stops for other messages",
+          repr(refused));
+
+    status = run(output, "--open --read", queue,
+                 "receive\nreceive\nreceive\nreceive\n"
+                 "receive\nreceive\nreceive\nreceive\ncount\n");
+    check(output == "32767 1 a\n32767 1 b\n32767 1 c\n32767 1 d\n"
+                    "32767 1 e\n32767 1 f\n32767 1 g\n32767 1 h\n"
+                    "count 0\n",
+          "messages passed over by probe are put back in order",
+          repr(output));
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && std::string(argv[1]) == "--help")) {
+        std::cerr << "usage: " << argv[0] << " [<mq executable>]\n";
+        return 1;
+    }
+
+    if (argc == 2)
+        mqPath = argv[1];
+
+    signal(SIGPIPE, SIG_IGN);  // an 'mq' that fails stops reading
+
+    testSendv();
+    testBinary();
+    testInput();
+    testPending();
+    testCredits();
+    testSpool();
+    testFragment();
+    testLz();
+    testBundle();
+    testProbe();
+
+    std::cout << checks - failures << " of " << checks << " checks passed."
+              << std::endl;
+    return failures != 0;
+}
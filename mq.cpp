@@ -0,0 +1,6503 @@
+
+// POSIX
+#include <errno.h>     // error codes
+#include <fcntl.h>     // file open constants
+#include <mqueue.h>    // mq_*
+#include <poll.h>      // poll
+#include <pthread.h>   // pthread_*
+#include <sched.h>     // sched_*, cpu_set_t, CPU_*
+#include <signal.h>    // SIGUSR1, SIGCHLD
+#include <string.h>    // strerror, memcmp, stpcpy
+#include <sys/epoll.h> // epoll_*
+#include <sys/mman.h>  // mlockall
+#include <sys/stat.h>  // file mode constants 
+#include <time.h>      // nanosleep
+#include <unistd.h>    // close, dup2, fork
+
+// Standard C
+#include <limits.h>    // NAME_MAX
+#include <stdio.h>     // fileno, snprintf
+
+// Standard C++
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>     // std::exit
+#include <deque>
+#include <ios>         // std::dec, std::oct
+#include <iostream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>   // std::runtime_error, std::exception
+#include <string>
+#include <vector>
+
+#include "bundle.h"
+#include "codec.h"
+#include "fragment.h"
+#include "input.h"
+#include "listener.h"
+#include "lz.h"
+#include "output.h"
+#include "pending.h"
+#include "pool.h"
+#include "repr.h"
+#include "shm.h"
+#include "spool.h"
+#include "stats.h"
+
+// --------------------
+// command line parsing
+// --------------------
+
+void usage(const char *argv0, std::ostream& out)
+{
+    out << "usage: " << argv0 << "  <options ...>  <message queue>\n"
+        << "       " << argv0 << " --help\n";
+}
+
+void help(const char *argv0, std::ostream& out)
+{
+    out << argv0 << 
+"  <Options ...>  <Message Queue>\n"
+"\n"
+"Options:\n"
+"--help      print this prompt to standard output\n"
+"--readme    print the README file for this utility\n"
+"--read      open the queue receiving messages\n"
+"--write     open the queue for sending messages\n"
+"--open      open the queue (if without --create, then only if existing)\n"
+"--create    create the queue (if without --open, then exclusively)\n"
+"--permissions <octal>    Unix file permissions to use if creating queue \n"
+"--maxmsg    maximum number of messages to allow in the queue, if possible\n"
+"--msgsize   maximum size of any message in the queue, if possible\n"
+"--unlink    unlink the specified message queue (see MQ_UNLINK(3))\n"
+"--debug     print to stderr trace useful when debugging\n"
+"--binary    use the binary protocol on stdin and stdout (see --readme)\n"
+"--flush-bytes <n>    buffer up to n bytes of output between writes \n"
+"                     (default 65536, or 0 to write each response at once)\n"
+"--flush-usec <n>     write buffered output once it is n microseconds old\n"
+"                     (default 0, i.e. only before mq would otherwise wait)\n"
+"--reactor            serve from a single epoll event loop instead of from\n"
+"                     threads (Linux only)\n"
+"--batch <n>          after \"consume\" waits for a message, take up to n-1\n"
+"                     more already in the queue before writing them out\n"
+"                     (default 64)\n"
+"--pending <bytes>    rather than wait for room in a full queue, keep up to\n"
+"                     this many bytes of messages pending, and say \"busy\"\n"
+"                     when half full and \"ready\" once empty (see --readme)\n"
+"--spool <dir>        rather than wait for room in a full queue, keep\n"
+"                     messages in files in this directory until there's\n"
+"                     room, sending them in priority order (the limit is\n"
+"                     --pending, if specified; see --readme)\n"
+"--multi              prefix commands and responses with a queue handle, so\n"
+"                     that one mq can serve many queues (see --readme)\n"
+"--queue <name>       also open the named queue, as the next handle after\n"
+"                     the final argument's handle 0 (implies --multi, and\n"
+"                     may be repeated)\n"
+"--fragment <bytes>   send and receive messages of up to this many bytes,\n"
+"                     splitting those larger than the queue's msgsize into\n"
+"                     fragments (every sender and receiver must use it; see\n"
+"                     --readme)\n"
+"--compress           compress messages sent when that makes them smaller,\n"
+"                     and decompress messages received (every sender and\n"
+"                     receiver must use it; see --readme)\n"
+"--bundle-usec <n>    send consecutive messages of the same priority to a\n"
+"                     queue together as one, once there are enough to fill\n"
+"                     it or the first is n microseconds old (every sender\n"
+"                     and receiver must use it; see --readme)\n"
+"--shm <fd>           pass message payloads through the shared memory file\n"
+"                     open as file descriptor fd (e.g. a memfd) instead of\n"
+"                     through stdin and stdout (see --readme)\n"
+"--splice <bytes>     if stdout is a pipe, give it received messages of at\n"
+"                     least this many bytes with vmsplice instead of\n"
+"                     copying them (default 0, i.e. never)\n"
+"--hugepages          allocate the buffers into which messages are received\n"
+"                     from huge pages, if the system has any reserved\n"
+"--output-fd <fds>    write messages received for \"consume\" to the\n"
+"                     comma-separated inherited file descriptors instead of\n"
+"                     to stdout, one message to one of them (see --readme)\n"
+"--fan-out <policy>   how --output-fd chooses: round-robin (the default) or\n"
+"                     least-backlog\n"
+"--listen <path>      open the queues once, and then serve each client that\n"
+"                     connects to a Unix domain socket at this path as if\n"
+"                     it were stdin and stdout (see --readme)\n"
+"--busy-poll <n>      have \"consume\" poll the queue without waiting for\n"
+"                     messages, sleeping n microseconds between polls (or\n"
+"                     with 0, only yielding the CPU; see --readme)\n"
+"--cpu <n>            run on CPU n (see --readme)\n"
+"--consumer-cpu <n>   run the threads of \"consume\" on CPU n instead\n"
+"--realtime <prio>    run with the SCHED_FIFO scheduling policy at this\n"
+"                     priority, if permitted\n"
+"--mlock              lock mq's memory, such as its receive buffers, once\n"
+"                     its queues are open, if permitted\n"
+"\n"
+"If --unlink is specified, the only other option that may be specified is\n"
+"--debug.\n"
+"\n"
+"Otherwise, at least one of --create and/or --open must be specified, and at\n"
+"least one of --read and/or --write must be specified.  If either of\n"
+"--maxmsg or --msgsize is specified, then the other must be specified as\n"
+"well.\n"
+"\n"
+"Message Queue:\n"
+"The name of the POSIX local message queue to open (and possibly create).\n"
+"With --multi, this is the queue having handle 0.\n"
+"Note that on many systems, message queue names are required to begin with a\n"
+"forward slash.  Also note that message queues are not necessarily visible\n"
+"on the file system.\n";
+}
+
+const char README[] = 
+"![mq](mq.png)\n"
+"\n"
+"mq\n"
+"=======\n"
+"a POSIX message queue wrapper\n"
+"\n"
+"Why\n"
+"---\n"
+"I don't want to have to write bindings to POSIX's `mq_*` functions for all of\n"
+"the languages under the sun.  Instead, I want to be able to interact with a\n"
+"message queue using an intermediate subprocess that I communicate with using\n"
+"pipes.\n"
+"\n"
+"What\n"
+"----\n"
+"`mq` is a C++ program that opens or creates a POSIX message queue based on its\n"
+"command line arguments, and then provides send and/or receive access to the\n"
+"message queue via a protocol read from stdin and written to stdout.  Errors go\n"
+"to stderr.\n"
+"\n"
+"How\n"
+"---\n"
+"Here's an example.  Standard input is here prefixed with a prompt \"`> `\" for\n"
+"readability, though there would be no prompt in reality.\n"
+"\n"
+"The example opens (or first creates with Unix permissions `600`) the message\n"
+"queue named `/my-queue` (on many systems, queue names must be prefixed with a\n"
+"`/`) for both reading and writing, and then sends and receives various messages\n"
+"before closing the queue:\n"
+"\n"
+"    $ mq --open --create --read --write --permissions 600 /my-queue\n"
+"    > send 0 47 hello, here is my message of length forty-seven\n"
+"    ack 0 47\n"
+"    > send 0 32 here is one of length thirty-two\n"
+"    ack 0 32\n"
+"    > receive\n"
+"    0 47 hello, here is my message of length forty-seven\n"
+"    > receive\n"
+"    0 32 here is one of length thirty-two\n"
+"    > send 1 3 one\n"
+"    > send 2 3 two\n"
+"    > send 3 8 goodbye!\n"
+"    > consume\n"
+"    1 3 one\n"
+"    2 3 two\n"
+"    3 8 goodbye!\n"
+"    > close\n"
+"    $\n"
+"\n"
+"The integer before the message length is the message priority, which must be\n"
+"non-negative.\n"
+"\n"
+"Here's an example that demonstrates the persistence of the queue.  It is\n"
+"destroyed when the system goes down, or when it is `unlink`ed and no open file\n"
+"descriptors remain for it:\n"
+"\n"
+"    $ mq --open --create --read --write --permissions 600 /todo\n"
+"    > send 0 19 send a few messages\n"
+"    ack 0 19\n"
+"    > send 0 10 like these\n"
+"    ack 0 10\n"
+"    > send 0 54 and read from another process after this one goes away\n"
+"    ack 0 54\n"
+"    > close\n"
+"    $ echo Notice how now we can omit the \"create\" and \"permissions\" options.\n"
+"    Notice how now we can omit the \"create\" and \"permissions\" options.\n"
+"    $ mq --open --read /todo\n"
+"    > consume\n"
+"    0 19 send a few messages\n"
+"    0 10 like these\n"
+"    0 54 and read from another process after this one goes away\n"
+"    > close\n"
+"    $\n"
+"\n"
+"More\n"
+"----\n"
+"What follows are descriptions of the wire protocol, how errors and handled and\n"
+"reported, and build instructions.\n"
+"\n"
+"### Wire Protocol\n"
+"The wire protocol used to communicate with `mq` is a hybrid between a\n"
+"whitespace delimited text protocol and a length-prefixed binary protocol.\n"
+"Message payloads are prefixed by their length, in decimal as text, and so the\n"
+"payloads themselves may contain aribitrary bytes without conflicting with\n"
+"delimiter characters.  Otherwise, though, components in the wire protocol are\n"
+"whitespace separated.\n"
+"\n"
+"#### mq stdin\n"
+"The standard input of `mq` is the pipe to which the user sends commands, such\n"
+"as to send or receive a message from the queue.\n"
+"\n"
+"##### Grammar\n"
+"\n"
+"    stdin            ::=  (ws? command+ ws?)?\n"
+"\n"
+"    sep              ::=  /[ ]/\n"
+"\n"
+"    ws               ::=  /[\t\r\n ]+/\n"
+"\n"
+"    command          ::=  send-command\n"
+"                       |  sendv-command\n"
+"                       |  receive-command\n"
+"                       |  consume-command\n"
+"                       |  count-command\n"
+"                       |  msgsize-command\n"
+"                       |  maxmsg-command\n"
+"                       |  close-command\n"
+"                       |  stats-command\n"
+"                       |  credit-command\n"
+"                       |  probe-command\n"
+"                       |  timed-command\n"
+"\n"
+"    timed-command    ::=  \"timeout\" sep milliseconds sep\n"
+"                              (send-command | receive-command | consume-command)\n"
+"                       |  \"timeout\" sep milliseconds sep close-command\n"
+"\n"
+"    milliseconds     ::=  num\n"
+"\n"
+"    send-command     ::=  \"send\" sep priority sep length sep data ws\n"
+"\n"
+"    sendv-command    ::=  \"sendv\" sep count (ws priority sep length sep data)* ws\n"
+"\n"
+"    count            ::=  num\n"
+"\n"
+"    num              ::=  \"0\"\n"
+"                       |  /[1-9][0-9]*/\n"
+"\n"
+"    priority         ::=  num\n"
+"     \n"
+"    length           ::=  num\n"
+"\n"
+"    data             ::=  /.*/\n"
+"\n"
+"    receive-command  ::=  \"receive\" ws\n"
+"\n"
+"    consume-command  ::=  \"consume\" (sep credits)? ws\n"
+"\n"
+"    credits          ::=  num\n"
+"\n"
+"    count-command    ::=  \"count\" ws\n"
+"\n"
+"    msgsize-command  ::=  \"msgsize\" ws\n"
+"\n"
+"    maxmsg-command   ::=  \"maxmsg\" ws\n"
+"\n"
+"    close-command    ::=  \"close\" ws\n"
+"\n"
+"    stats-command    ::=  \"stats\" ws\n"
+"\n"
+"    credit-command   ::=  \"credit\" sep credits ws\n"
+"\n"
+"    probe-command    ::=  \"probe\" sep count ws\n"
+"\n"
+"##### Semantics\n"
+"Any `data` prefixed by a `length` must have that length.  The `count` in a\n"
+"`sendv` command is the number of messages that follow it, each of which is\n"
+"sent as if by its own `send` command.  The `close` command\n"
+"exists so that the user can receive any already-popped messages from the queue,\n"
+"or `ack` responses from `mq`, before closing the pipe, thus preventing messages\n"
+"from being lost on shutdown.  Lengths are base ten non-negative integers in\n"
+"text.\n"
+"\n"
+"A `timeout` prefix bounds how long the command after it may wait, in\n"
+"milliseconds.  If a `send` can't put its message in the queue in time, the\n"
+"message is dropped; if a `receive` doesn't get a message in time, it gives up;\n"
+"and a `consume` stops once no message has arrived for that long.  In each\n"
+"case, `mq` then writes a `timeout` response naming the command, and carries on\n"
+"with the next command.  Another `consume` can follow a `consume` that timed\n"
+"out.  On `close`, a `timeout` bounds how long `mq` waits for room in the queue\n"
+"for messages still pending (see Pending Sends); when it passes, they're\n"
+"discarded, and `mq` says so on standard error and exits with a nonzero status.\n"
+"\n"
+"A `consume` followed by a number of `credits` takes only that many messages\n"
+"from the queue, and then waits for the user to give it more with `credit`\n"
+"(which adds to whatever credits remain).  Until then, messages stay in the\n"
+"queue, where a message of higher priority can still overtake them, rather than\n"
+"in pipes and buffers on their way to a user that isn't ready for them.\n"
+"Without credits (or with zero), `consume` takes messages as fast as they come.\n"
+"A `credit` to a `consume` that had none puts it under the same flow control,\n"
+"and a `consume` to a queue that is already being consumed adds its credits.\n"
+"A `timeout` on `consume` doesn't count time spent waiting for credits.\n"
+"\n"
+"A `probe` measures how long messages take to pass through the queue itself,\n"
+"apart from the pipes and the protocol (see Probing below).\n"
+"\n"
+"#### mq stdout\n"
+"`mq` responds to the user's commands through its standard output pipe:  popped\n"
+"messages and acknowledgements of messages sent.\n"
+"\n"
+"##### Grammar\n"
+"\n"
+"    stdout    ::=  (ws? response+ ws?)?\n"
+"\n"
+"    sep       ::=  /[ ]/\n"
+"\n"
+"    ws        ::=  /[\t\r\n ]+/\n"
+"    \n"
+"    response  ::=  msg\n"
+"                |  ack\n"
+"                |  ackv\n"
+"                |  count\n"
+"                |  msgsize\n"
+"                |  maxmsg\n"
+"                |  busy\n"
+"                |  ready\n"
+"                |  timeout\n"
+"                |  stats\n"
+"                |  probe\n"
+"\n"
+"    msg       ::=  priority sep length sep data ws\n"
+"\n"
+"    ack       ::=  \"ack\" sep priority sep length ws\n"
+"\n"
+"    ackv      ::=  \"ackv\" sep num sep num ws\n"
+"\n"
+"    count     ::=  \"count\" sep num ws\n"
+"\n"
+"    msgsize   ::=  \"msgsize\" sep num\n"
+"\n"
+"    maxmsg    ::=  \"maxmsg\" sep num\n"
+"\n"
+"    busy      ::=  \"busy\" sep num ws\n"
+"\n"
+"    ready     ::=  \"ready\" ws\n"
+"\n"
+"    timeout   ::=  \"timeout\" sep (\"send\" | \"receive\" | \"consume\") ws\n"
+"\n"
+"    stats     ::=  \"stats\" (sep stat)* ws\n"
+"\n"
+"    stat      ::=  /[a-z_.0-9]+=[0-9:,/]*/\n"
+"\n"
+"    probe     ::=  \"probe\" (sep stat)* ws\n"
+"                |  \"probe\" sep \"refused\" sep reason ws\n"
+"\n"
+"    reason    ::=  /[a-z]+/\n"
+"\n"
+"    num       ::=  \"0\"\n"
+"                |  /[1-9][0-9]*/\n"
+"\n"
+"    priority  ::=  num\n"
+"\n"
+"    length    ::=  num\n"
+"\n"
+"    data      ::=  /.*/\n"
+"\n"
+"##### Semantics\n"
+"The `length` in a `msg` response is the length of the `data`.  The `length` in\n"
+"an `ack` message is the length of the `data` in the sent messages that is being\n"
+"acknowledged.  An `ackv` response acknowledges a whole `sendv` command with the\n"
+"number of messages sent and the total length of their `data`.  If fewer\n"
+"messages were sent than the `sendv` command specified, then the number is the\n"
+"(zero-based) index of the message that could not be sent, and the reason is\n"
+"reported to stderr.  Lengths are base ten non-negative integers in text.\n"
+"\n"
+"#### mq stderr\n"
+"\n"
+"##### Grammar\n"
+"\n"
+"    stderr      ::=  (diagnostic newline)*\n"
+"\n"
+"    newline     ::=  /[\n]/\n"
+"\n"
+"    diagnostic  ::=  /[^\n\r]*/\n"
+"\n"
+"##### Semantics\n"
+"Each `diagnostic` is a human-readable English language description of the error\n"
+"that occurred.  The text encoding is UTF-8 (but without the newline character).\n"
+"\n"
+"### Binary Protocol\n"
+"If the `--binary` option is specified on the command line, then `mq`'s stdin\n"
+"and stdout use a binary protocol instead of the text protocol described above.\n"
+"Every command and every response begins with a 16 byte header:\n"
+"\n"
+"| offset | size | field                                  |\n"
+"| ------ | ---- | -------------------------------------- |\n"
+"| 0      | 1    | opcode                                 |\n"
+"| 1      | 1    | reserved (zero)                        |\n"
+"| 2      | 2    | queue handle (unsigned, little-endian) |\n"
+"| 4      | 4    | priority (unsigned, little-endian)     |\n"
+"| 8      | 8    | length (unsigned, little-endian)       |\n"
+"\n"
+"The commands have the same meanings as in the text protocol:\n"
+"\n"
+"| command   | opcode | priority         | length            | followed by       |\n"
+"| --------- | ------ | ---------------- | ----------------- | ----------------- |\n"
+"| `send`    | 1      | message priority | message length    | message data      |\n"
+"| `receive` | 2      |                  |                   |                   |\n"
+"| `consume` | 3      |                  | credits, or zero  |                   |\n"
+"| `count`   | 4      |                  |                   |                   |\n"
+"| `msgsize` | 5      |                  |                   |                   |\n"
+"| `maxmsg`  | 6      |                  |                   |                   |\n"
+"| `close`   | 7      |                  |                   |                   |\n"
+"| `sendv`   | 8      |                  | number of records | that many `send`s |\n"
+"| `open`    | 9      | flags            | name length       | queue name        |\n"
+"| `timeout` | 10     |                  | milliseconds      | a timed command   |\n"
+"| `stats`   | 11     |                  |                   |                   |\n"
+"| `credit`  | 12     |                  | credits           |                   |\n"
+"| `probe`   | 13     |                  | number of markers |                   |\n"
+"\n"
+"A response has the opcode of the command to which it responds, with the high\n"
+"bit set.  Messages from both `receive` and `consume` have the opcode of\n"
+"`receive`:\n"
+"\n"
+"| response  | opcode | priority         | length               | followed by  |\n"
+"| --------- | ------ | ---------------- | -------------------- | ------------ |\n"
+"| `ack`     | 0x81   | message priority | message length       |              |\n"
+"| `msg`     | 0x82   | message priority | message length       | message data |\n"
+"| `count`   | 0x84   |                  | number of messages   |              |\n"
+"| `msgsize` | 0x85   |                  | maximum message size |              |\n"
+"| `maxmsg`  | 0x86   |                  | maximum messages     |              |\n"
+"| `ackv`    | 0x88   | number sent      | total length sent    |              |\n"
+"| `open`    | 0x89   |                  |                      |              |\n"
+"| `timeout` | 0x8A   | timed opcode     |                      |              |\n"
+"| `stats`   | 0x8B   |                  | length of the stats  | the stats    |\n"
+"| `probe`   | 0x8D   | 1 if refused     | length of the stats  | the stats    |\n"
+"| `busy`    | 0xC1   |                  | pending bytes        |              |\n"
+"| `ready`   | 0xC2   |                  |                      |              |\n"
+"\n"
+"Fields that are not used by an opcode should be zero.  The queue handle is\n"
+"used only with `--multi` (see below).  The handles in the `send` records of a\n"
+"`sendv` are ignored; each record goes to the queue of the `sendv`.\n"
+"\n"
+"### Multiple Queues\n"
+"One `mq` process can serve many queues.  With the `--multi` option, every\n"
+"command except `close` and `stats` is followed by the handle of the queue to\n"
+"which it refers, and every response (except `stats`) is likewise prefixed by\n"
+"the handle of its queue:\n"
+"\n"
+"    $ mq --multi --queue /jobs --open --create --read --write /results\n"
+"    > send 1 0 5 hello\n"
+"    ack 1 5\n"
+"    > open 2 /logs rwoc\n"
+"    open 2\n"
+"    > count 2\n"
+"    count 2 0\n"
+"    > consume 1\n"
+"    1 0 5 hello\n"
+"    > close\n"
+"    $\n"
+"\n"
+"The queue named last on the command line has handle 0, and each `--queue`\n"
+"option (which implies `--multi`) opens another queue as the next handle, with\n"
+"the same options.  Handles are integers from 0 to 65535.\n"
+"\n"
+"The `open <handle> <name> <flags>` command opens another queue while `mq` is\n"
+"running.  The `<flags>` are one or more of the letters `r`, `w`, `o`, and `c`,\n"
+"meaning `--read`, `--write`, `--open`, and `--create`, respectively; the\n"
+"other options (such as `--permissions`) are taken from the command line.\n"
+"In the binary protocol, the flags are the bits 1, 2, 4, and 8 of the header's\n"
+"priority, and the handle is the header's queue handle.  A handle cannot be\n"
+"reopened, and `close` closes all of the queues.\n"
+"\n"
+"In the text protocol, the handle goes right after the command's name, and\n"
+"right after the response's name (or at the start of a `msg`):\n"
+"\n"
+"    command   ::=  \"send\" sep handle sep priority sep length sep data ws\n"
+"                |  \"sendv\" sep handle sep count (ws priority sep length sep data)* ws\n"
+"                |  (\"receive\" | \"count\" | \"msgsize\" | \"maxmsg\") sep handle ws\n"
+"                |  \"consume\" sep handle (sep credits)? ws\n"
+"                |  \"credit\" sep handle sep credits ws\n"
+"                |  \"open\" sep handle sep name sep flags ws\n"
+"                |  \"close\" ws\n"
+"\n"
+"    response  ::=  handle sep priority sep length sep data ws\n"
+"                |  \"ack\" sep handle sep length ws\n"
+"                |  \"ackv\" sep handle sep num sep num ws\n"
+"                |  (\"count\" | \"msgsize\" | \"maxmsg\") sep handle sep num ws\n"
+"                |  \"open\" sep handle ws\n"
+"\n"
+"    handle    ::=  num\n"
+"\n"
+"    flags     ::=  /[rwoc]+/\n"
+"\n"
+"### Pending Sends\n"
+"Normally, a `send` to a full queue waits until the queue has room, and so\n"
+"holds up every command after it.  With the `--pending <bytes>` option, such a\n"
+"message is instead copied into a buffer of up to `<bytes>` bytes (counting a\n"
+"few bytes of bookkeeping per message) kept for the queue, and is acknowledged\n"
+"right away.  Pending messages are sent in order, ahead of any later messages\n"
+"to the same queue, as the queue drains.  Only when the buffer itself is full\n"
+"does a `send` wait.\n"
+"\n"
+"So that the user can slow down before that happens, `mq` writes `busy <bytes>`\n"
+"when the buffer becomes at least half full, and then `ready` once it's empty\n"
+"again.  These are not responses to any particular command.  With `--multi`,\n"
+"each names its queue's handle, e.g. `busy 3 2048`.\n"
+"\n"
+"Note that an `ack` then means that `mq` has accepted the message, not that the\n"
+"message is in the queue yet.  Pending messages are sent before the queue is\n"
+"closed, so `close` (or the end of input) waits for the queue to have room for\n"
+"them, forever if nothing receives from it.  To wait only so long, use\n"
+"`timeout <milliseconds> close`, after which the messages still pending are\n"
+"discarded, `mq` says so on standard error, and it exits with a nonzero status.\n"
+"\n"
+"#### Spooling\n"
+"The kernel keeps message queues small (see `/proc/sys/fs/mqueue/msg_max` and\n"
+"`RLIMIT_MSGQUEUE`), and a bursty writer soon fills one.  With the\n"
+"`--spool <directory>` option, messages that don't fit are instead kept in\n"
+"files in `<directory>`, each a few megabytes, that are memory-mapped and\n"
+"appended to, and removed once every message in them has been sent.  The\n"
+"files are unlinked as soon as they are created, so they aren't visible there\n"
+"and don't outlive `mq`; the spool is not a way to keep messages across\n"
+"restarts.  Space for each file is reserved when it is created, and if it\n"
+"can't be, then the `send` fails.\n"
+"\n"
+"Spooled messages are sent as the queue drains, as pending messages are, but in\n"
+"priority order, highest first, as if the queue had room for them all.  A\n"
+"message already being sent is not overtaken.  Without `--pending`, the spool\n"
+"is limited only by the file system, and so `mq` never says `busy`; with\n"
+"`--pending <bytes>`, the spool holds up to `<bytes>` bytes, and `busy` and\n"
+"`ready` work as described above.  As with pending messages, `close` waits for\n"
+"every spooled message to be sent, which can be forever if nothing receives\n"
+"from the queue, unless it has a `timeout`.\n"
+"\n"
+"### Fragmentation\n"
+"The kernel charges a queue for `maxmsg` times `msgsize` bytes, so sizing\n"
+"`msgsize` for the rare huge message wastes memory, and leaves room for fewer\n"
+"messages.  With the `--fragment <bytes>` option, `mq` sends and receives\n"
+"messages of up to `<bytes>` bytes (at most 4 GiB) whatever the queue's\n"
+"`msgsize`, splitting each message that doesn't fit into fragments that do,\n"
+"and putting them back together when it receives them.  The queue can then have\n"
+"a small `msgsize` and a large `maxmsg`.  The `msgsize` command still reports\n"
+"the queue's `msgsize`.\n"
+"\n"
+"Every message in the queue then begins with a 16 byte fragment header: the\n"
+"message's identifier (8 bytes), the offset of the fragment in the message\n"
+"(4 bytes), and the size of the whole message (4 bytes), each little-endian.\n"
+"So every `mq` that sends to or receives from the queue must use `--fragment`,\n"
+"and so must any other program, unless it understands the header.  A message\n"
+"that fits is a single fragment, having offset zero, and is passed along\n"
+"without being copied.  The identifier includes the sender's process ID, so\n"
+"fragments of messages from different senders can come interleaved, and a\n"
+"count that starts at random, so that a sender that reuses the process ID of\n"
+"one that died doesn't reuse its identifiers.  If\n"
+"fragments of more than 64 messages are waiting for the rest of their\n"
+"messages, the message that began earliest is discarded (its sender probably\n"
+"died), and `mq` says so on standard error.\n"
+"\n"
+"All of a message's fragments have its priority.  A `timeout` on `send` stops\n"
+"applying once the first fragment is sent; the rest are sent however long that\n"
+"takes.  With `--reactor`, `mq` doesn't wait for them, but it sends no other\n"
+"message to the queue until they're all sent.  `--fragment` can't be combined\n"
+"with `--shm`.\n"
+"\n"
+"A message can be put back together only by whoever receives all of its\n"
+"fragments, so a queue with fragmented messages must have a single receiver:\n"
+"one `mq`, with the queue open under one handle.  With several receivers (e.g.\n"
+"several `mq`s consuming the same queue), each gets some of the fragments of a\n"
+"message, and the message is lost.  For the same reason, `--fragment` can't be\n"
+"combined with `--listen`, whose clients receive from the queue separately.\n"
+"\n"
+"### Compression\n"
+"With the `--compress` option, `mq` compresses the messages that it sends, and\n"
+"decompresses the messages that it receives, so that text that repeats itself\n"
+"(JSON, say) takes less of the queue.  The compression is a small LZ77 codec in\n"
+"the manner of LZ4, built into `mq`; it favors speed over ratio.\n"
+"\n"
+"Every message in the queue then begins with a one byte marker: 0 if the rest\n"
+"is the message as it was, or 1 if the rest is the message compressed.  A\n"
+"message is sent compressed only if it is at least 64 bytes long and\n"
+"compression makes it at least an eighth smaller; otherwise, decompressing it\n"
+"wouldn't be worth the little room it saves.  So every `mq` that sends to or\n"
+"receives from the queue must use `--compress`, and so must any other program,\n"
+"unless it understands the marker and the format (described in `lz.h`).  A\n"
+"message that isn't valid is discarded, and `mq` says so on standard error.\n"
+"\n"
+"Because of the marker, the largest message that can be sent is one byte\n"
+"smaller than the queue's `msgsize` (or, with `--fragment`, than `<bytes>`).\n"
+"Messages are compressed as they're put in the queue, so pending and spooled\n"
+"messages are kept as they were.  With `--fragment`, the compressed message is\n"
+"what is split into fragments.  With `--shm`, messages are copied into the\n"
+"shared memory after they're received rather than received into it directly,\n"
+"and with `--splice`, a message that was compressed isn't spliced, since it's\n"
+"decompressed into a buffer of its own.  The `stats` command reports how much\n"
+"the messages of each queue were compressed (see Statistics, below).\n"
+"\n"
+"### Bundling\n"
+"Every message in a queue takes one of its `maxmsg` slots, however small, and\n"
+"takes a system call to send and another to receive.  With the `--bundle-usec\n"
+"<n>` option, `mq` instead sends consecutive messages of the same priority to a\n"
+"queue together, as one bundle, and takes them apart again when it receives\n"
+"them.  A bundle is sent once the next message doesn't fit in it (a bundle fits\n"
+"in one of the queue's messages, even with `--fragment`) or has another\n"
+"priority, or once its first message is `<n>` microseconds old and `mq` has no\n"
+"more input to read (with `<n>` zero, as soon as it has none).  Bundles are also\n"
+"sent before a `receive` waits, and before the queue is closed.\n"
+"\n"
+"Each message in a bundle is preceded by its size, as a varint: seven bits per\n"
+"byte, least significant first, the high bit meaning \"more.\"  So every `mq`\n"
+"that sends to or receives from the queue must use `--bundle-usec`, and so must\n"
+"any other program, unless it understands the format.  A bundle that isn't\n"
+"valid is discarded, and `mq` says so on standard error.  Because of the size,\n"
+"the largest message that can be sent is a few bytes smaller than it would be\n"
+"otherwise.\n"
+"\n"
+"The messages of a bundle are written out one at a time, each as its own\n"
+"response, whether for `receive` or for `consume`, and each counts against\n"
+"credits and `--batch` as any message does.  The messages after the first wait\n"
+"in `mq` until they're taken, and so they're never spliced (with `--splice`);\n"
+"with `--shm`, messages are copied into the shared memory after they're\n"
+"received rather than received into it directly.  Messages that are still\n"
+"waiting in `mq` when it closes the queue (e.g. because `consume` ran out of\n"
+"credits) are put back in the queue, as a bundle having their priority, and so\n"
+"after any messages of that priority that arrived since.  If they can't be put\n"
+"back, e.g. because the queue has filled up, then they are lost, and `mq` says\n"
+"so on standard error and exits with a nonzero status.\n"
+"\n"
+"As with `--pending`, an `ack` means that `mq` has accepted the message, not\n"
+"that the message is in the queue yet.  Bundles are what is kept pending,\n"
+"spooled, compressed, and (for a message too large to share a bundle)\n"
+"fragmented.  The `sent` and `received` statistics count bundles, and so does\n"
+"`count`, which is the number of messages that the queue itself holds, not\n"
+"counting those waiting in `mq`.\n"
+"\n"
+"### Shared Memory\n"
+"Large messages are expensive to pass through pipes, since each byte is copied\n"
+"into and out of the pipe.  With the `--shm <fd>` option, message payloads are\n"
+"instead passed through a file that both `mq` and the user map into memory,\n"
+"typically a `memfd` that the user creates, sizes, and then passes to `mq` as\n"
+"the inherited file descriptor `<fd>`.  Standard input and output then carry\n"
+"only where each payload is, as an offset from the beginning of the file:\n"
+"\n"
+"    $ mq --shm 3 --open --create --read --write /my-queue\n"
+"    > send 0 5 64\n"
+"    ack 0 5\n"
+"    > receive\n"
+"    0 5 32768\n"
+"\n"
+"Here the user put \"hello\" at offset 64 of a 65536 byte file, and `mq` put the\n"
+"message it received at offset 32768.  In the text protocol, the offset takes\n"
+"the place of the `data` in both commands (including each message of a\n"
+"`sendv`) and messages.  In the binary protocol, it takes the place of the\n"
+"payload, as eight little-endian bytes after the header, whose length is still\n"
+"that of the message.\n"
+"\n"
+"The file is divided as follows:\n"
+"\n"
+"| offset             | size               | contents                      |\n"
+"| ------------------ | ------------------ | ----------------------------- |\n"
+"| 0                  | 8                  | released count (see below)    |\n"
+"| 8                  | 56                 | reserved                      |\n"
+"| 64                 | up to half of size | the user's messages to send   |\n"
+"| half of size (rounded down) | the rest  | the ring of received messages |\n"
+"\n"
+"The user's part belongs to the user, who must not change a message in it until\n"
+"`mq` has acknowledged the message.  `mq` puts received messages into the ring\n"
+"one after another, each in contiguous bytes, wrapping around to the ring's\n"
+"beginning when a message doesn't fit at its end.  To give the space back, the\n"
+"user stores into the released count (a native-endian eight byte unsigned\n"
+"integer) the number of messages that it has finished with so far, in the order\n"
+"that they were received.  `mq` waits for room when there isn't any, and it may\n"
+"need room for a message of the queue's maximum size before receiving one, so\n"
+"release messages as soon as possible.  Every queue that is opened for reading\n"
+"must have a maximum message size no larger than the ring.\n"
+"\n"
+"### Splicing\n"
+"When standard output is a pipe, the `--splice <bytes>` option has `mq` give\n"
+"each received message of at least `<bytes>` bytes to the pipe with\n"
+"`vmsplice(2)`, rather than copying it into the pipe with `write`.  Nothing\n"
+"changes in the protocol.  Such messages are received into page-aligned buffers\n"
+"that are not reused until a pipe's worth of output has followed them, so that\n"
+"the pipe can refer to their pages rather than copy them.  Note that the reader\n"
+"of the pipe then must not `splice` the messages onward (e.g. with `tee(2)`)\n"
+"rather than read them, since their pages would then be referred to for longer.\n"
+"\n"
+"### Fan-Out\n"
+"When a pool of worker processes shares the messages of a queue, the\n"
+"`--output-fd <fds>` option has `mq` write the messages received for `consume`\n"
+"straight to the workers, rather than to standard output for something else to\n"
+"split.  `<fds>` is a comma-separated list of inherited file descriptors, such\n"
+"as the write ends of one pipe per worker (here, named pipes):\n"
+"\n"
+"    $ mq --output-fd 3,4,5 --open --read /my-queue 3>w0 4>w1 5>w2\n"
+"\n"
+"Each message goes whole to exactly one of them, formatted just as it would\n"
+"have been on standard output.  Everything else, including the messages of\n"
+"`receive`, still goes to standard output.  The `--fan-out <policy>` option\n"
+"chooses which descriptor gets each message:\n"
+"\n"
+"| policy          | chooses                                                  |\n"
+"| --------------- | -------------------------------------------------------- |\n"
+"| `round-robin`   | each in turn (the default)                               |\n"
+"| `least-backlog` | the one with the fewest bytes not yet read by its worker |\n"
+"\n"
+"A descriptor's backlog is what `mq` has yet to write to it plus, if it is a\n"
+"pipe, what is in the pipe (`FIONREAD`).  With `--reactor`, the descriptors are\n"
+"written without blocking, and `consume` pauses while any of them has a full\n"
+"backlog.  Otherwise, writing to a worker that isn't reading blocks the\n"
+"`consume` that chose it.  `--output-fd` cannot be combined with `--shm`, and\n"
+"messages written to it are never spliced.\n"
+"\n"
+"### Listening\n"
+"Starting an `mq` for every short job costs a process, argument parsing, and\n"
+"opening the queues.  With the `--listen <path>` option, one long-running `mq`\n"
+"opens the queues once, binds a Unix domain socket to `<path>`, and serves each\n"
+"client that connects to it as if the connection were its standard input and\n"
+"output.  A client speaks the same protocol, with the same options, as it would\n"
+"to an `mq` of its own, and the end of its input is the end of its session:\n"
+"\n"
+"    $ mq --listen /tmp/mq.sock --open --create --read --write /my-queue &\n"
+"    $ echo 'send 0 5 hello' | socat - UNIX-CONNECT:/tmp/mq.sock\n"
+"    ack 0 5\n"
+"\n"
+"Each client is served by a child process of its own, forked from the `mq`\n"
+"that listens once it has opened the queues, so clients share the queues'\n"
+"descriptors but not anything else: a client's `open`, `close`, `consume`,\n"
+"pending messages, and `stats` are its own, and one client failing doesn't\n"
+"affect the others.  Errors from all of them go to the listening `mq`'s\n"
+"standard error.  The listening `mq` runs until it's killed.  A socket left at\n"
+"`<path>` that nobody is listening on (e.g. by an `mq` that was killed) is\n"
+"replaced, but if another `mq` is listening there, `--listen` fails.\n"
+"`--listen` cannot be combined with `--shm` or with `--output-fd`, since those\n"
+"belong to whoever started `mq`, nor with `--fragment` (see Fragmentation).\n"
+"\n"
+"### Busy Polling\n"
+"A `consume` that waits in `mq_receive` for a message is woken by the kernel\n"
+"when one arrives, and that wakeup can take tens of microseconds, more or less.\n"
+"With the `--busy-poll <usec>` option, the threads of `consume` instead poll\n"
+"their queues: each tries to receive without waiting, and then tries again\n"
+"until a message is there, sleeping `<usec>` microseconds in between (or, with\n"
+"`0`, only letting other threads on the CPU run first).  That trades a CPU for\n"
+"less latency, so the following options go with it:\n"
+"\n"
+"| option               | effect                                            |\n"
+"| -------------------- | ------------------------------------------------- |\n"
+"| `--cpu <n>`          | run `mq`'s threads on CPU `<n>`                   |\n"
+"| `--consumer-cpu <n>` | run the threads of `consume` on CPU `<n>` instead |\n"
+"| `--realtime <prio>`  | run `mq` with `SCHED_FIFO` at priority `<prio>`   |\n"
+"| `--mlock`            | lock `mq`'s memory once its queues are open       |\n"
+"\n"
+"Each of them that isn't permitted (e.g. `--realtime` without\n"
+"`CAP_SYS_NICE`) is reported on standard error, and `mq` carries on without\n"
+"it.  `--mlock` locks what `mq` has allocated by the time its queues are open,\n"
+"including the buffers into which messages are received, but not memory\n"
+"allocated later, such as for queues opened by `open`.  A polling thread with\n"
+"`--realtime` keeps anything of lower priority from running on its CPU, so give\n"
+"it a CPU of its own with `--consumer-cpu`.  Every poll counts in the\n"
+"`receive_ns` statistic.  `--busy-poll` and `--consumer-cpu` cannot be combined\n"
+"with `--reactor`.\n"
+"\n"
+"### Statistics\n"
+"The `stats` command reports what `mq` has done so far, for the whole process,\n"
+"as one response.  In the text protocol, the response is `stats` followed by\n"
+"space-separated `<name>=<value>` pairs on one line; in the binary protocol,\n"
+"the pairs are the payload of the `stats` response.  For example:\n"
+"\n"
+"    > stats\n"
+"    stats sent=2 sent_bytes=8 received=1 received_bytes=3 interrupted=0 stalled=0 partial_writes=0 send_ns=2048:1,4096:1 receive_ns=2048:1 write_ns= transit_ns=\n"
+"\n"
+"| name             | value                                                  |\n"
+"| ---------------- | ------------------------------------------------------ |\n"
+"| `sent`           | messages put in a queue                                |\n"
+"| `sent_bytes`     | total length of the messages sent                      |\n"
+"| `received`       | messages taken from a queue                            |\n"
+"| `received_bytes` | total length of the messages received                  |\n"
+"| `interrupted`    | system calls retried because a signal interrupted them |\n"
+"| `stalled`        | attempts to send that found the queue full             |\n"
+"| `partial_writes` | writes to stdout that could not write everything       |\n"
+"| `send_ns`        | histogram of the durations of `mq_send` calls          |\n"
+"| `receive_ns`     | histogram of the durations of `mq_receive` calls       |\n"
+"| `write_ns`       | histogram of the durations of writes to stdout         |\n"
+"| `transit_ns`     | histogram of the transit times of `probe` markers      |\n"
+"\n"
+"With `--compress`, there is also a `compression.<handle>` pair for each open\n"
+"queue, whose value is `<packed>/<raw>`: the total size of the messages sent to\n"
+"and received from the queue as they were in it, and as they were before\n"
+"compression.\n"
+"\n"
+"A histogram is a comma-separated list of `<bound>:<count>`, one for each\n"
+"power of two that bounds any durations: `<count>` calls took less than\n"
+"`<bound>` nanoseconds, but at least half of it.  A histogram is empty if there\n"
+"were no such calls yet.  Note that a call that waits (e.g. `mq_receive` on an\n"
+"empty queue) counts the time spent waiting.  The numbers are updated without\n"
+"locking, so while other threads are busy, they are not necessarily consistent\n"
+"with each other.\n"
+"\n"
+"### Probing\n"
+"The `probe <n>` command sends `<n>` marker messages through its queue, one at\n"
+"a time, and receives each back before sending the next, to tell how long the\n"
+"queue itself takes apart from everything around it:\n"
+"\n"
+"    > probe 3\n"
+"    probe sent=3 received=3 transit_ns=2048:2,8192:1 elapsed_ns=31427\n"
+"\n"
+"A marker is sent at the highest priority (`MQ_PRIO_MAX - 1`), as any other\n"
+"message would be (e.g. compressed with `--compress`), and carries the\n"
+"`CLOCK_MONOTONIC` time at which it was sent.  `transit_ns` is the histogram\n"
+"(as in `stats`) of the time from then until the marker was received and\n"
+"reassembled, decompressed, or unbundled as necessary.  `elapsed_ns` is how\n"
+"long the whole command took inside `mq`, from reading it to writing its\n"
+"response.  So the user's own round trip for the `probe`, less `elapsed_ns`, is\n"
+"what the pipes and the protocol cost, and `elapsed_ns` divided by the markers,\n"
+"less their transit, is what `mq` costs per message around the queue.\n"
+"\n"
+"A `probe` that can't be done is refused, and `mq` carries on with the next\n"
+"command.  The response then names the reason instead of the stats (in the\n"
+"binary protocol, it has priority 1, and the reason is its payload):\n"
+"\n"
+"    > probe 3\n"
+"    probe refused nonempty\n"
+"\n"
+"| reason      | meaning                                                       |\n"
+"| ----------- | ------------------------------------------------------------- |\n"
+"| `reactor`   | `--reactor` would have to stop everything else to wait        |\n"
+"| `access`    | the queue isn't open for both reading and writing             |\n"
+"| `consuming` | the queue is being consumed by this `mq`                      |\n"
+"| `pending`   | the queue has messages pending (`--pending` or `--spool`)     |\n"
+"| `nonempty`  | the queue has messages in it                                  |\n"
+"| `msgsize`   | the queue's messages are too small for a marker               |\n"
+"| `traffic`   | another message of the markers' priority arrived              |\n"
+"\n"
+"Messages of a lower priority than the markers' that arrive while a `probe` runs\n"
+"stay in the queue.  If one of the markers' priority arrives, then `probe` waits\n"
+"for its marker, puts back what it received in the meantime (in the order it\n"
+"came, but after any that arrived since), and is refused for `traffic`, although\n"
+"the markers it sent are counted in `stats`.  Markers that aren't the one\n"
+"awaited (e.g. a marker from another `mq`'s `probe`) are discarded.  A marker\n"
+"that can't be sent, or doesn't come back, within a second (e.g. because another\n"
+"process received it) is given up on, and is missing from `received`; if it\n"
+"turns up later, it's discarded rather than received.  Every marker is also\n"
+"counted in `stats`, including in the `transit_ns` histogram there.\n"
+"\n"
+"### Error Handling\n"
+"Any error reported to the user through `mq`'s standard error pipe is grounds\n"
+"for terminating the `mq` process.  It will not terminate itself on purpose,\n"
+"and many errors are recoverable, but for simplicity's sake it's best to start\n"
+"again when an error occurs.  Note that if the `--debug` option is specified on\n"
+"the command line, debugging information will be printed to stderr in addition\n"
+"to reported errors.\n"
+"\n"
+"### Build\n"
+"The `mq` binary is built in place using the `Makefile`:\n"
+"\n"
+"    $ make\n"
+"    $ ls mq\n"
+"\n"
+"### Benchmark\n"
+"`make` also builds `mq-bench`, which measures the throughput and latency of\n"
+"`mq` by running producer and consumer `mq` processes on a scratch queue and\n"
+"driving them through the protocol described above.  Message sizes, the mix of\n"
+"priorities, the numbers of producers and consumers, whether consumers use\n"
+"`consume` or `receive`, and the protocol (text or binary) are all options, and\n"
+"options after `--` are passed to every `mq` process:\n"
+"\n"
+"    $ ./mq-bench --messages 100000 --size 64 --max-size 4096 --priorities 4\n"
+"    messages: 100000  bytes: 207565754  seconds: 0.352\n"
+"    throughput: 284247 msgs/s  590.00 MB/s\n"
+"    latency (us): p50 207.4  p99 626.9  p999 1819.5  max 2466.9\n"
+"    $ ./mq-bench --producers 2 --consumers 2 --binary -- --reactor\n"
+"\n"
+"Latency is measured from when a producer writes a message to when a consumer\n"
+"reads it.  The scratch queue is unlinked afterward.  See `mq-bench --help`.\n"
+"\n"
+"### Tests\n"
+"`make` also builds `mq-test`, and `make check` runs it.  It checks `mq`'s\n"
+"behavior by running `mq` processes on scratch queues, as a user would, and\n"
+"prints each check that fails:\n"
+"\n"
+"    $ make check\n"
+"    ./mq-test ./mq\n"
+"    67 of 67 checks passed.\n"
+"\n"
+"Its exit status is nonzero if any check failed.  The scratch queues are\n"
+"unlinked afterward.\n"
+"\n"
+"### Credits\n"
+"The mascot image for this project is a combination of two illustrations:\n"
+"\n"
+"- queue by Kirby Wu from the Noun Project\n"
+"- Command Line by Focus from the Noun Project\n"
+"\n"
+;
+
+void readme() {
+    std::cout << README;
+}
+
+struct FindArgs {
+    const char *const *const begin;
+    const char *const *const end;
+
+    FindArgs(const char *const *begin, const char *const *end)
+    : begin(begin)
+    , end(end)
+    {}
+
+    const char *const *operator()(const std::string& argument) const {
+        const char *const *const result = std::find(begin, end, argument);
+        return result == end ? 0 : result;
+    }
+};
+
+int checkArgs(int argc, const char *const argv[])
+{
+    if (argc < 2) {
+        usage(argv[0], std::cerr);
+        return 1;
+    }
+
+    const FindArgs find(argv + 1, argv + argc);
+
+    if (find("--help") || find("-h")) {
+        help(argv[0], std::cout);
+        std::exit(0);
+    }
+
+    if (find("--readme")) {
+        readme();
+        std::exit(0);
+    }
+
+    if (argv[argc - 1][0] == '-') {
+        std::cerr << "Final argument must be a non-option (the queue name).\n";
+        return 6;
+    }
+
+    const bool unlink = find("--unlink");
+
+    if (unlink && ((find("--debug") && argc != 4) || argc != 3)) {
+        std::cerr << "--unlink must be alone or with --debug.\n";
+        return 2;
+    }
+
+    if (unlink)
+        return 0;  // don't need to enforce other requirements
+
+    if (!find("--read") && !find("--write")) {
+        std::cerr << "One or both of --read and --write must be specified.\n";
+        return 3;
+    }
+
+    if (!find("--open") && !find("--create")) {
+       std::cerr << "One or both of --open and --create must be specified.\n";
+       return 4;
+    }
+
+    if (bool(find("--msgsize")) != bool(find("--maxmsg"))) {
+        std::cerr << "Specify neither of both of --msgsize and --maxmsg.\n";
+        return 5;
+    }
+
+    // Make sure there aren't any unsupported flags specified, like
+    // --chicken-dinner
+    const char *const flags[] = { 
+        "read", "write", "open", "create", "msgsize", "maxmsg", "readme",
+        "debug", "permissions", "binary", "flush-bytes", "flush-usec",
+        "batch", "reactor", "multi", "queue", "pending", "shm", "splice",
+        "hugepages", "output-fd", "fan-out", "spool", "fragment", "compress",
+        "bundle-usec", "listen", "busy-poll", "cpu", "consumer-cpu",
+        "realtime", "mlock"
+    };
+    const char *const *const endFlags =
+        flags + sizeof(flags) / sizeof(flags[0]);
+
+    // For each argument passed (except the last one), if it looks like a flag
+    // (begins with "--"), then make sure the rest of it is in 'flags'.
+    for (const char *const *it = argv + 1; it != argv + argc - 1; ++it)
+    {
+        const std::string arg(*it);
+        if (   arg.size() > 2
+            && arg.substr(0, 2) == "--"
+            && std::find(flags, endFlags, arg.substr(2)) == endFlags)
+        {
+            std::cerr << "Unrecognized option " << repr(arg) << '\n';
+            return 6;
+        }
+    }
+
+    return 0;
+}
+
+struct Options {
+    enum { READ_ONLY, WRITE_ONLY,  READ_WRITE }  operation;
+    enum { OPEN_ONLY, CREATE_ONLY, OPEN_CREATE } open;
+    int                                          filePermissions;
+    bool                                         maxesSpecified;
+    ssize_t                                      maxmsg;
+    ssize_t                                      msgsize;                  
+    bool                                         unlink;
+    bool                                         debug;
+    bool                                         binary;
+    size_t                                       flushBytes;
+    long                                         flushMicroseconds;
+    long                                         batch;
+    size_t                                       pendingBytes;
+    std::string                                  spoolDirectory;
+    size_t                                       fragmentBytes;
+    bool                                         compress;
+    bool                                         bundle;
+    long                                         bundleMicroseconds;
+    int                                          sharedMemoryFd;
+    size_t                                       spliceBytes;
+    bool                                         reactor;
+    bool                                         hugePages;
+    std::vector<int>                             outputFds;
+    enum { ROUND_ROBIN, LEAST_BACKLOG }          fanOut;
+    bool                                         multi;
+    std::string                                  queueName;
+    std::vector<std::string>                     moreQueueNames;
+    std::string                                  listenPath;
+    bool                                         busyPoll;
+    long                                         busyPollMicroseconds;
+    int                                          cpu;
+    int                                          consumerCpu;
+    int                                          realtimePriority;
+    bool                                         lockMemory;
+
+    Options()
+    : operation(READ_WRITE)
+    , open(OPEN_CREATE)
+    , filePermissions(0600)
+    , maxesSpecified(false)
+    , maxmsg(-1)   // arbitrarily chosen
+    , msgsize(-1)  // arbitrarily chosen
+    , unlink(false)
+    , debug(false)
+    , binary(false)
+    , flushBytes(65536)
+    , flushMicroseconds(0)
+    , batch(64)
+    , pendingBytes(0)
+    , fragmentBytes(0)
+    , compress(false)
+    , bundle(false)
+    , bundleMicroseconds(0)
+    , sharedMemoryFd(-1)
+    , spliceBytes(0)
+    , reactor(false)
+    , hugePages(false)
+    , fanOut(ROUND_ROBIN)
+    , multi(false)
+    , busyPoll(false)
+    , busyPollMicroseconds(0)
+    , cpu(-1)
+    , consumerCpu(-1)
+    , realtimePriority(0)
+    , lockMemory(false)
+    {}
+};
+
+template <typename OUTPUT>
+int parse(OUTPUT&          output,
+          const char      *input, 
+          std::ios_base& (*base)(std::ios_base&) = &std::dec)
+    // Read one object of type 'OBJECT' into the specified 'object' from the
+    // specified 'input' using the optionally specified 'base' manipulator.
+    // Return zero on success or a nonzero value otherwise.  The behavior is
+    // undefined if 'input' is null.  Note that 'input' need not be completely
+    // consumed by this function.
+{
+    std::stringstream ss(input);
+    assert(ss);
+
+    ss >> output;
+    return !ss;
+}
+
+Options parseOptions(int argc, const char *const argv[])
+{
+    const FindArgs find(argv + 1, argv + argc);
+
+    Options options;
+
+    options.debug = find("--debug");   
+ 
+    options.queueName = argv[argc - 1];
+
+    if (find("--unlink")) {
+        options.unlink = true;
+        return options;  // the rest can be ignored.
+    }
+
+    options.binary  = find("--binary");
+    options.reactor = find("--reactor");
+    options.hugePages = find("--hugepages");
+    options.compress  = find("--compress");
+    options.lockMemory = find("--mlock");
+
+    for (const char *const *it = argv + 1; it != argv + argc - 1; ++it) {
+        if (std::string(*it) == "--queue")
+            options.moreQueueNames.push_back(*(it + 1));
+    }
+    options.multi = find("--multi") || !options.moreQueueNames.empty();
+
+    const bool read  = find("--read"),
+               write = find("--write");
+    options.operation = read && write ? Options::READ_WRITE
+                                      : read ? Options::READ_ONLY
+                                             : Options::WRITE_ONLY;
+
+    const bool open   = find("--open"),
+               create = find("--create");
+    options.open = open && create ? Options::OPEN_CREATE
+                                  : open ? Options::OPEN_ONLY
+                                         : Options::CREATE_ONLY;
+
+    const char *const *const permissionsOption = find("--permissions");
+    if (permissionsOption) {
+        const char *const permissionsString = *(permissionsOption + 1);
+        if (parse(options.filePermissions, permissionsString, &std::oct)) {
+            throw std::runtime_error("Invalid (octal) file permissions: " +
+                                     repr(permissionsString));
+        }
+    }
+
+    const char *const *const maxmsgOption = find("--maxmsg");
+    if (maxmsgOption) {
+        const char *const maxmsgString = *(maxmsgOption + 1);
+        if (parse(options.maxmsg, maxmsgString)) {
+            throw std::runtime_error("Invalid maxmsg: " + repr(maxmsgString));
+        }
+    }
+
+    const char *const *const msgsizeOption = find("--msgsize");
+    if (msgsizeOption) {
+        const char *const msgsizeString = *(msgsizeOption + 1);
+        if (parse(options.msgsize, msgsizeString)) {
+            throw std::runtime_error("Invalid msgsize: " +
+                                     repr(msgsizeString));
+        }
+    }
+
+    options.maxesSpecified = maxmsgOption || msgsizeOption;
+
+    const char *const *const flushBytesOption = find("--flush-bytes");
+    if (flushBytesOption) {
+        const char *const flushBytesString = *(flushBytesOption + 1);
+        if (parse(options.flushBytes, flushBytesString)) {
+            throw std::runtime_error("Invalid flush-bytes: " +
+                                     repr(flushBytesString));
+        }
+    }
+
+    const char *const *const flushUsecOption = find("--flush-usec");
+    if (flushUsecOption) {
+        const char *const flushUsecString = *(flushUsecOption + 1);
+        if (parse(options.flushMicroseconds, flushUsecString) ||
+            options.flushMicroseconds < 0)
+        {
+            throw std::runtime_error("Invalid flush-usec: " +
+                                     repr(flushUsecString));
+        }
+    }
+
+    const char *const *const batchOption = find("--batch");
+    if (batchOption) {
+        const char *const batchString = *(batchOption + 1);
+        if (parse(options.batch, batchString) || options.batch < 1) {
+            throw std::runtime_error("Invalid batch: " + repr(batchString));
+        }
+    }
+
+    const char *const *const pendingOption = find("--pending");
+    if (pendingOption) {
+        const char *const pendingString = *(pendingOption + 1);
+        if (parse(options.pendingBytes, pendingString)) {
+            throw std::runtime_error("Invalid pending: " +
+                                     repr(pendingString));
+        }
+    }
+
+    const char *const *const spoolOption = find("--spool");
+    if (spoolOption) {
+        options.spoolDirectory = *(spoolOption + 1);
+        struct stat status;
+        if (stat(options.spoolDirectory.c_str(), &status) ||
+            !S_ISDIR(status.st_mode))
+        {
+            throw std::runtime_error("Invalid spool: " +
+                                     repr(options.spoolDirectory) +
+                                     " is not a directory.");
+        }
+    }
+
+    const char *const *const shmOption = find("--shm");
+    if (shmOption) {
+        const char *const shmString = *(shmOption + 1);
+        if (parse(options.sharedMemoryFd, shmString) ||
+            options.sharedMemoryFd < 0)
+        {
+            throw std::runtime_error("Invalid shm: " + repr(shmString));
+        }
+    }
+
+    const char *const *const fragmentOption = find("--fragment");
+    if (fragmentOption) {
+        const char *const fragmentString = *(fragmentOption + 1);
+        if (parse(options.fragmentBytes, fragmentString) ||
+            options.fragmentBytes == 0 ||
+            options.fragmentBytes > MAX_FRAGMENTED_SIZE)
+        {
+            throw std::runtime_error("Invalid fragment: " +
+                                     repr(fragmentString));
+        }
+
+        if (options.sharedMemoryFd != -1) {
+            throw std::runtime_error(
+                                "--fragment cannot be combined with --shm.");
+        }
+    }
+
+    const char *const *const bundleUsecOption = find("--bundle-usec");
+    if (bundleUsecOption) {
+        const char *const bundleUsecString = *(bundleUsecOption + 1);
+        if (parse(options.bundleMicroseconds, bundleUsecString) ||
+            options.bundleMicroseconds < 0)
+        {
+            throw std::runtime_error("Invalid bundle-usec: " +
+                                     repr(bundleUsecString));
+        }
+
+        options.bundle = true;
+    }
+
+    const char *const *const spliceOption = find("--splice");
+    if (spliceOption) {
+        const char *const spliceString = *(spliceOption + 1);
+        if (parse(options.spliceBytes, spliceString)) {
+            throw std::runtime_error("Invalid splice: " +
+                                     repr(spliceString));
+        }
+    }
+
+    const char *const *const outputFdOption = find("--output-fd");
+    if (outputFdOption) {
+        const std::string outputFdString = *(outputFdOption + 1);
+        std::string::size_type begin = 0;
+        for (;;) {
+            const std::string::size_type end = outputFdString.find(',', begin);
+            const std::string fdString = outputFdString.substr(begin,
+                                                                end - begin);
+            int fd;
+            if (fdString.empty() ||
+                fdString.find_first_not_of("0123456789") != fdString.npos ||
+                parse(fd, fdString.c_str()))
+            {
+                throw std::runtime_error("Invalid output-fd: " +
+                                         repr(outputFdString));
+            }
+
+            if (std::find(options.outputFds.begin(),
+                          options.outputFds.end(),
+                          fd) != options.outputFds.end())
+            {
+                throw std::runtime_error("Repeated output-fd: " +
+                                         repr(fdString));
+            }
+
+            options.outputFds.push_back(fd);
+            if (end == std::string::npos)
+                break;
+
+            begin = end + 1;
+        }
+
+        if (options.sharedMemoryFd != -1) {
+            throw std::runtime_error(
+                               "--output-fd cannot be combined with --shm.");
+        }
+    }
+
+    const char *const *const fanOutOption = find("--fan-out");
+    if (fanOutOption) {
+        const std::string fanOutString = *(fanOutOption + 1);
+        if (fanOutString == "round-robin")
+            options.fanOut = Options::ROUND_ROBIN;
+        else if (fanOutString == "least-backlog")
+            options.fanOut = Options::LEAST_BACKLOG;
+        else {
+            throw std::runtime_error("Invalid fan-out: " +
+                                     repr(fanOutString));
+        }
+    }
+
+    const char *const *const listenOption = find("--listen");
+    if (listenOption) {
+        options.listenPath = *(listenOption + 1);
+        if (options.listenPath.empty() || options.listenPath[0] == '-') {
+            throw std::runtime_error("Invalid listen: " +
+                                     repr(options.listenPath));
+        }
+
+        // Each client has a connection of its own, but these belong to
+        // whoever started 'mq'.
+        if (options.sharedMemoryFd != -1) {
+            throw std::runtime_error(
+                                  "--listen cannot be combined with --shm.");
+        }
+
+        if (!options.outputFds.empty()) {
+            throw std::runtime_error(
+                            "--listen cannot be combined with --output-fd.");
+        }
+
+        // A message's fragments would be received by different clients,
+        // none of which could put it back together.
+        if (options.fragmentBytes) {
+            throw std::runtime_error(
+                             "--listen cannot be combined with --fragment.");
+        }
+    }
+
+    const char *const *const busyPollOption = find("--busy-poll");
+    if (busyPollOption) {
+        const char *const busyPollString = *(busyPollOption + 1);
+        if (parse(options.busyPollMicroseconds, busyPollString) ||
+            options.busyPollMicroseconds < 0)
+        {
+            throw std::runtime_error("Invalid busy-poll: " +
+                                     repr(busyPollString));
+        }
+
+        // The reactor has no thread to spare for polling.
+        if (options.reactor) {
+            throw std::runtime_error(
+                             "--busy-poll cannot be combined with --reactor.");
+        }
+
+        options.busyPoll = true;
+    }
+
+    const char *const *const cpuOption = find("--cpu");
+    if (cpuOption) {
+        const char *const cpuString = *(cpuOption + 1);
+        if (parse(options.cpu, cpuString) ||
+            options.cpu < 0 ||
+            options.cpu >= CPU_SETSIZE)
+        {
+            throw std::runtime_error("Invalid cpu: " + repr(cpuString));
+        }
+    }
+
+    const char *const *const consumerCpuOption = find("--consumer-cpu");
+    if (consumerCpuOption) {
+        const char *const consumerCpuString = *(consumerCpuOption + 1);
+        if (parse(options.consumerCpu, consumerCpuString) ||
+            options.consumerCpu < 0 ||
+            options.consumerCpu >= CPU_SETSIZE)
+        {
+            throw std::runtime_error("Invalid consumer-cpu: " +
+                                     repr(consumerCpuString));
+        }
+
+        if (options.reactor) {
+            throw std::runtime_error(
+                          "--consumer-cpu cannot be combined with --reactor.");
+        }
+    }
+
+    const char *const *const realtimeOption = find("--realtime");
+    if (realtimeOption) {
+        const char *const realtimeString = *(realtimeOption + 1);
+        if (parse(options.realtimePriority, realtimeString) ||
+            options.realtimePriority < sched_get_priority_min(SCHED_FIFO) ||
+            options.realtimePriority > sched_get_priority_max(SCHED_FIFO))
+        {
+            throw std::runtime_error("Invalid realtime: " +
+                                     repr(realtimeString));
+        }
+    }
+
+    return options;
+}
+
+// -------------------------
+// message queue open/create
+// -------------------------
+
+mqd_t openQueue(const Options& options)
+{
+    int openFlags = 0;
+    switch (options.operation) {
+      case Options::READ_ONLY:  openFlags |= O_RDONLY; break;
+      case Options::WRITE_ONLY: openFlags |= O_WRONLY; break;
+      default:
+        assert(options.operation == Options::READ_WRITE);
+        openFlags |= O_RDWR;
+    }
+
+    switch (options.open) {
+      case Options::OPEN_ONLY: break;
+      case Options::CREATE_ONLY: openFlags |= O_EXCL | O_CREAT; break;
+      default: 
+        assert(options.open == Options::OPEN_CREATE);
+        openFlags |= O_CREAT;
+    }
+
+    mq_attr  attributes;
+    mq_attr *attributesPtr = 0;
+    if (options.maxesSpecified) {
+        attributes.mq_maxmsg  = options.maxmsg;
+        attributes.mq_msgsize = options.msgsize;
+        attributesPtr         = &attributes;
+    }
+
+    if (options.debug) {
+        std::cerr << "Attempting to open a message queue named "
+                  << repr(options.queueName) << std::endl;
+    }
+
+    return mq_open(options.queueName.c_str(),
+                   openFlags, 
+                   options.filePermissions, 
+                   attributesPtr);
+}
+
+struct OpenedQueue {
+    // A message queue opened before it's served, e.g. by '--listen' for all
+    // of its clients, and its attributes as they were then.
+
+    mqd_t   descriptor;
+    mq_attr attributes;
+};
+
+struct Shared;
+
+struct Unbundling {
+    // The rest of a bundle received with '--bundle-usec': the messages in it
+    // that are yet to be taken, the first of which has its header at
+    // 'offset' in 'messages'.  A message that "probe" passed over is kept as
+    // a bundle of one.
+
+    unsigned          priority;
+    std::vector<char> messages;
+    size_t            offset;
+};
+
+struct Queue {
+    // A message queue being served, known in the protocol by its 'handle'
+    // (always zero unless '--multi'), and the state of consuming from it and
+    // sending to it.  A "consume" having a "timeout" stops once no message has
+    // arrived for 'consumeMilliseconds', and then a consumer thread sets
+    // 'consumerIdle' (guarded by 'Shared::stoppedMutex').  'pending' holds the
+    // messages that are waiting for room in the queue, and is null unless
+    // '--pending' or '--spool' was specified and the queue is open for
+    // writing.  In the threaded engine, pending messages are sent by a sender
+    // thread, which waits for room only until 'drainDeadline' once
+    // 'drainTimed' is set (atomically) by a "close" having a "timeout".
+    // 'openForWriting' is whether the queue is open for writing.
+    // 'receivePool' holds the buffers into which messages are received, and is
+    // null unless the queue is open for reading.  If "consume" was given
+    // credits, then 'credited' is set, and 'credits' is how many more messages
+    // it may take from the queue (both guarded by 'Shared::stoppedMutex' in
+    // the threaded engine).  With '--fragment', messages of up to
+    // 'maxMessageSize' bytes are sent in fragments of up to 'msgsize' bytes
+    // built in 'fragment', and received ones are put back together by
+    // 'reassembler' (null unless the queue is open for reading); see
+    // 'sendToQueue'.  With '--compress', messages are compressed into 'packed'
+    // (see 'pack'), and 'payloadBytes' and 'packedBytes' count the bytes of
+    // the messages sent and received before and after compression.  With
+    // '--bundle-usec', messages of up to 'maxPayloadSize' bytes are sent in
+    // bundles of up to 'maxMessageSize' bytes built in 'bundle', which is sent
+    // once it has no room for the next message (counting up to 'bundleLimit'
+    // bytes, so that it fits in one fragment), or at 'bundleDeadline'; see
+    // 'bundleMessage'.  The messages after the first of each bundle received,
+    // and those that "probe" passed over, are kept in 'unbundling' (guarded by
+    // 'unbundlingMutex') until they are taken, or until 'putBackUnbundled'
+    // puts them back, for which it replaces 'descriptor' for a while.
+    // 'probeMarkers' counts the markers that "probe" has sent, and
+    // 'strayMarkers' those that it gave up on and that haven't been received
+    // since (see 'isStrayMarker').  The 'Reactor' fields are unused by the
+    // threaded engine.
+
+    const unsigned     handle;
+    const std::string  name;
+    mqd_t              descriptor;
+    const ssize_t      msgsize;
+    const size_t       maxMessageSize;  // 'msgsize' or '--fragment', less
+                                        // a byte if '--compress'
+    const size_t       maxPayloadSize;  // less a bundle header if bundling
+    const size_t       bundleLimit;
+    const bool         openForWriting;
+    Shared&            shared;
+    bool               consumerThreadExists;
+    pthread_t          consumerThread;
+    bool               consumerIdle;         // the thread stopped (and why)
+    bool               consumeTimed;         // "consume" had a "timeout"
+    unsigned           consumeMilliseconds;  // idle timeout if 'consumeTimed'
+    bool               credited;
+    unsigned long long credits;
+    Pending *const     pending;      // owned
+    BufferPool *const  receivePool;  // owned
+    bool               senderThreadExists;
+    pthread_t          senderThread;
+    bool               drainTimed;
+    timespec           drainDeadline;
+    Reassembler *const reassembler;     // owned
+    std::vector<char>  fragment;
+    bool               partlySent;      // some of a message's fragments
+    unsigned long long fragmentId;      // of the message partly sent
+    size_t             fragmentOffset;  // of its next fragment
+    std::vector<char>  packed;
+    unsigned long long payloadBytes;
+    unsigned long long packedBytes;
+    std::vector<char>  bundle;
+    size_t             bundleSize;      // bytes of 'bundle' used
+    unsigned           bundlePriority;  // of the messages in it
+    timespec           bundleDeadline;
+    std::deque<Unbundling> unbundling;
+    pthread_mutex_t        unbundlingMutex;
+    unsigned long long probeMarkers;
+    unsigned long long strayMarkers;
+
+    // 'Reactor' state: whether "consume" was issued (and, if it had a
+    // "timeout", when it will stop being idle), whether the queue is readable
+    // and writable as far as we know, and the events registered with 'epoll'
+    // for 'descriptor'.
+    bool               consuming;
+    timespec           consumeDeadline;
+    bool               readable;
+    bool               writable;
+    int                registered;
+
+    Queue(unsigned           queueHandle,
+          const std::string& queueName,
+          mqd_t              queueDescriptor,
+          ssize_t            messageSize,
+          size_t             fragmentBytes,  // or zero
+          bool               compressing,
+          bool               bundling,
+          bool               writing,
+          Pending           *pendingMessages,
+          BufferPool        *receiveBuffers,
+          Reassembler       *reassembledMessages,
+          Shared&            sharedData)
+    : handle(queueHandle)
+    , name(queueName)
+    , descriptor(queueDescriptor)
+    , msgsize(messageSize)
+    , maxMessageSize((fragmentBytes ? fragmentBytes : messageSize) -
+                     compressing)
+    , maxPayloadSize(bundling
+                         ? maxMessageSize - bundleHeaderSize(maxMessageSize)
+                         : maxMessageSize)
+    , bundleLimit(fragmentBytes
+                      ? std::min(maxMessageSize,
+                                 messageSize - FRAGMENT_HEADER_SIZE -
+                                     compressing)
+                      : maxMessageSize)
+    , openForWriting(writing)
+    , shared(sharedData)
+    , consumerThreadExists(false)
+    , consumerIdle(false)
+    , consumeTimed(false)
+    , consumeMilliseconds(0)
+    , credited(false)
+    , credits(0)
+    , pending(pendingMessages)
+    , receivePool(receiveBuffers)
+    , senderThreadExists(false)
+    , drainTimed(false)
+    , drainDeadline()
+    , reassembler(reassembledMessages)
+    , fragment(fragmentBytes ? messageSize : 0)
+    , partlySent(false)
+    , fragmentId(0)
+    , fragmentOffset(0)
+    , packed(compressing ? maxMessageSize + 1 : 0)
+    , payloadBytes(0)
+    , packedBytes(0)
+    , bundle(bundling ? maxMessageSize : 0)
+    , bundleSize(0)
+    , bundlePriority(0)
+    , bundleDeadline()
+    , probeMarkers(0)
+    , strayMarkers(0)
+    , consuming(false)
+    , consumeDeadline()
+    , readable(true)
+    , writable(true)
+    , registered(0)
+    {
+        pthread_mutex_init(&unbundlingMutex, 0);
+    }
+
+    ~Queue()
+    {
+        delete pending;
+        delete receivePool;
+        delete reassembler;
+        pthread_mutex_destroy(&unbundlingMutex);
+    }
+};
+
+// Handles fit in the two bytes that the binary protocol has for them.
+const unsigned MAX_HANDLE = 65535;
+
+struct Shared {
+    // Data shared between threads: mutexes, the message queues, and some
+    // other misc.  'queues' is indexed by handle, and is null where no queue
+    // has that handle.  Only the main thread modifies 'queues'; a consumer
+    // thread refers only to its own 'Queue'.  'consumerThreadExists' is
+    // whether any queue has a consumer thread, i.e. whether locking is
+    // necessary.  It includes sender threads.  'sharedMemory' is null unless
+    // '--shm', and 'sharedMemoryMutex' guards its ring.  'splicePool' is null
+    // unless '--splice' and standard output is a pipe.  A consumer thread
+    // that is out of credits waits on 'creditCondition' with 'stoppedMutex'.
+    // 'stats' is updated by every thread without locking, and is reported
+    // by "stats".  'workers' has an output for each '--output-fd', in order,
+    // to which messages received for "consume" go instead of to 'output',
+    // and 'nextWorker' counts the choices among them (see 'chooseWorker').
+
+    pthread_mutex_t      stoppedMutex;
+    pthread_cond_t       creditCondition;
+    bool                 stopped;
+    Output&              output;
+    std::vector<Queue*>  queues;
+    pthread_mutex_t      stderrMutex;
+    bool                 consumerThreadExists;
+    const Options&       options;
+    SharedMemory        *sharedMemory;  // owned
+    pthread_mutex_t      sharedMemoryMutex;
+    BufferPool          *splicePool;    // owned
+    Stats                stats;
+    std::vector<Output*> workers;       // owned
+    unsigned             nextWorker;
+
+    explicit Shared(Output& standardOutput, const Options& commandLineOptions)
+    : stopped(false)
+    , output(standardOutput)
+    , consumerThreadExists(false)
+    , options(commandLineOptions)
+    , sharedMemory(0)
+    , splicePool(0)
+    , nextWorker(0)
+    {
+        const pthread_mutexattr_t *const defaultAttributes = 0;
+
+        pthread_mutex_init(&stoppedMutex,      defaultAttributes);
+        pthread_mutex_init(&stderrMutex,       defaultAttributes);
+        pthread_mutex_init(&sharedMemoryMutex, defaultAttributes);
+        pthread_cond_init(&creditCondition, 0);
+
+        output.setStats(&stats);
+    }
+
+    ~Shared()
+    {
+        // A writer thread might still be counting in 'stats'.
+        output.stopWriter();
+        output.setStats(0);
+
+        for (size_t i = 0; i < queues.size(); ++i)
+            delete queues[i];
+
+        for (size_t i = 0; i < workers.size(); ++i)
+            delete workers[i];  // which stops its writer thread first
+
+        delete sharedMemory;
+        delete splicePool;
+
+        pthread_mutex_destroy(&stoppedMutex);
+        pthread_mutex_destroy(&stderrMutex);
+        pthread_mutex_destroy(&sharedMemoryMutex);
+        pthread_cond_destroy(&creditCondition);
+    }
+};
+
+Queue *findQueue(const Shared& shared, unsigned handle)
+    // Return the queue having the specified 'handle' in the specified
+    // 'shared', or null if there is none.
+{
+    return handle < shared.queues.size() ? shared.queues[handle] : 0;
+}
+
+class Lock {
+    pthread_mutex_t& mutex;
+    bool             holding;
+
+  public:
+    explicit Lock(pthread_mutex_t& mutex, bool lockOnInit = true)
+    : mutex(mutex)
+    , holding(false)
+    {
+        if (lockOnInit)
+            acquire();
+    }
+
+    void acquire() {
+        if (holding)
+            return;
+
+        pthread_mutex_lock(&mutex);
+        holding = true;
+    }
+
+    void release() {
+        if (!holding)
+            return;
+
+        pthread_mutex_unlock(&mutex);
+        holding = false;
+    }
+
+    ~Lock()
+    {
+        if (holding)
+            release();
+    }
+};
+
+
+// -------------
+// wire protocol
+// -------------
+
+// With the '--binary' option, commands and responses are not text.  Instead,
+// each begins with a 'HEADER_SIZE' byte header consisting of, in order: a one
+// byte opcode, a reserved byte (zero), a two byte unsigned queue handle (see
+// '--multi'), a four byte unsigned priority, and an eight byte unsigned
+// length, where the integers are little-endian.  What the priority and length
+// mean depends on the opcode.  A header may be followed by a payload, e.g. the
+// message in a "send" command.
+
+// Every command of the protocol is described once, here, as
+// 'X(name, OPCODE, opcode, response, handle)': its name in the text protocol,
+// the suffix of its 'Opcode' enumerator, its opcode in the binary protocol,
+// the name in the text protocol of the response that 'respond' writes for it
+// (or null if there is none, e.g. for messages), and which queue handle it
+// has (see 'HandleKind').  The opcodes and the tables by which commands are
+// looked up are generated from this list.
+#define MQ_COMMANDS(X)                                                     \
+    X("send",    SEND,    1,  "ack",     HANDLE_OPEN)                      \
+    X("receive", RECEIVE, 2,  0,         HANDLE_OPEN)                      \
+    X("consume", CONSUME, 3,  0,         HANDLE_OPEN)                      \
+    X("count",   COUNT,   4,  "count",   HANDLE_OPEN)                      \
+    X("msgsize", MSGSIZE, 5,  "msgsize", HANDLE_OPEN)                      \
+    X("maxmsg",  MAXMSG,  6,  "maxmsg",  HANDLE_OPEN)                      \
+    X("close",   CLOSE,   7,  0,         HANDLE_NONE)                      \
+    X("sendv",   SENDV,   8,  "ackv",    HANDLE_OPEN)                      \
+    X("open",    OPEN,    9,  "open",    HANDLE_NEW)                       \
+    X("timeout", TIMEOUT, 10, "timeout", HANDLE_NONE)                      \
+    X("stats",   STATS,   11, "stats",   HANDLE_NONE)                      \
+    X("credit",  CREDIT,  12, 0,         HANDLE_OPEN)                      \
+    X("probe",   PROBE,   13, "probe",   HANDLE_OPEN)
+
+enum HandleKind {
+    // With '--multi', whether a command in the text protocol is followed by
+    // a queue handle, and if so, whether it must be that of an open queue.
+    // In the binary protocol, every command has a handle, but it's ignored
+    // unless the command's kind isn't 'HANDLE_NONE'.
+    HANDLE_NONE,  // e.g. "close" and the "timeout" prefix
+    HANDLE_NEW,   // "open"
+    HANDLE_OPEN
+};
+
+enum Opcode {
+    // commands, e.g. 'OP_SEND'.  Note that "timeout" is a prefix to another
+    // command, bounding its wait.
+#define MQ_OPCODE(NAME, SUFFIX, OPCODE, RESPONSE, HANDLE) \
+    OP_ ## SUFFIX = OPCODE,
+    MQ_COMMANDS(MQ_OPCODE)
+#undef MQ_OPCODE
+
+    // A response has the opcode of its command with the high bit set.
+    // Messages have 'OP_MSG' whether they are from "receive" or "consume".
+    OP_RESPONSE = 0x80,
+    OP_ACK      = OP_RESPONSE | OP_SEND,
+    OP_MSG      = OP_RESPONSE | OP_RECEIVE,
+    OP_COUNTED  = OP_RESPONSE | OP_COUNT,
+    OP_MSGSIZED = OP_RESPONSE | OP_MSGSIZE,
+    OP_MAXMSGED = OP_RESPONSE | OP_MAXMSG,
+    OP_ACKV     = OP_RESPONSE | OP_SENDV,
+    OP_OPENED   = OP_RESPONSE | OP_OPEN,
+    OP_TIMEDOUT = OP_RESPONSE | OP_TIMEOUT,
+    OP_STATSED  = OP_RESPONSE | OP_STATS,
+    OP_PROBED   = OP_RESPONSE | OP_PROBE,
+
+    // Notifications are responses that aren't to any particular command.
+    // "busy" and "ready" are about a queue's pending messages ('--pending').
+    OP_NOTICE = 0xC0,
+    OP_BUSY   = OP_NOTICE | 1,
+    OP_READY  = OP_NOTICE | 2
+};
+
+const int HEADER_SIZE = 16;
+
+// With '--shm', a message's payload is replaced by its offset in the shared
+// memory, which in the binary protocol is this many little-endian bytes.
+const int OFFSET_SIZE = 8;
+
+struct CommandName {
+    int         opcode;
+    const char *name;
+    size_t      nameSize;
+    const char *responseName;
+    HandleKind  handle;
+};
+
+// the commands, in the order of 'MQ_COMMANDS'
+const CommandName COMMAND_NAMES[] = {
+#define MQ_COMMAND_NAME(NAME, SUFFIX, OPCODE, RESPONSE, HANDLE) \
+    { OPCODE, NAME, sizeof NAME - 1, RESPONSE, HANDLE },
+    MQ_COMMANDS(MQ_COMMAND_NAME)
+#undef MQ_COMMAND_NAME
+};
+
+const CommandName *const COMMAND_NAMES_END =
+    COMMAND_NAMES + sizeof COMMAND_NAMES / sizeof COMMAND_NAMES[0];
+
+class CommandIndex {
+    // Find a command by its opcode or by its name in constant time, rather
+    // than by comparing against each command in turn.  Names are hashed by
+    // their length and their first and last characters, which distinguishes
+    // nearly all of the commands; a collision costs only another probe.
+
+    enum { NUM_OPCODES = 256, NUM_SLOTS = 32 };  // 'NUM_SLOTS' a power of 2
+
+    const CommandName *byOpcode[NUM_OPCODES];
+    const CommandName *byName[NUM_SLOTS];  // open addressing
+
+    static unsigned hash(const char *name, size_t nameSize)
+    {
+        return nameSize + (unsigned char)(name[0]) +
+               5 * (unsigned char)(name[nameSize - 1]);
+    }
+
+  public:
+    CommandIndex()
+    {
+        std::fill(byOpcode, byOpcode + NUM_OPCODES, (CommandName*)(0));
+        std::fill(byName, byName + NUM_SLOTS, (CommandName*)(0));
+
+        for (const CommandName *entry = COMMAND_NAMES;
+             entry != COMMAND_NAMES_END;
+             ++entry)
+        {
+            byOpcode[entry->opcode] = entry;
+
+            unsigned slot = hash(entry->name, entry->nameSize);
+            while (byName[slot % NUM_SLOTS])
+                ++slot;
+            byName[slot % NUM_SLOTS] = entry;
+        }
+    }
+
+    const CommandName *find(int opcode) const
+        // Return the command having the specified 'opcode', or null if there
+        // is none.
+    {
+        return unsigned(opcode) < NUM_OPCODES ? byOpcode[opcode] : 0;
+    }
+
+    const CommandName *find(const char *name, size_t nameSize) const
+        // Return the command having the specified 'nameSize' byte 'name', or
+        // null if there is none.
+    {
+        if (!nameSize)
+            return 0;
+
+        for (unsigned slot = hash(name, nameSize);; ++slot) {
+            const CommandName *const entry = byName[slot % NUM_SLOTS];
+            if (!entry)
+                return 0;
+
+            if (entry->nameSize == nameSize &&
+                !memcmp(entry->name, name, nameSize))
+            {
+                return entry;
+            }
+        }
+    }
+};
+
+const CommandIndex COMMANDS;
+
+const char *commandName(int opcode)
+    // Return the name in the text protocol of the command having the
+    // specified 'opcode'.  The behavior is undefined unless there is one.
+{
+    const CommandName *const entry = COMMANDS.find(opcode);
+    assert(entry);
+    return entry->name;
+}
+
+void encodeHeader(char               *header,
+                  int                 opcode,
+                  unsigned            handle,
+                  unsigned            priority,
+                  unsigned long long  length)
+    // Write to the specified 'header' the binary protocol encoding of the
+    // specified 'opcode', 'handle', 'priority', and 'length'.  The behavior is
+    // undefined unless 'header' has room for at least 'HEADER_SIZE' bytes,
+    // and unless 'handle <= MAX_HANDLE'.
+{
+    header[0] = char(opcode);
+    header[1] = 0;
+    header[2] = char(handle);
+    header[3] = char(handle >> 8);
+
+    for (int i = 0; i < 4; ++i)
+        header[4 + i] = char(priority >> (8 * i));
+
+    for (int i = 0; i < 8; ++i)
+        header[8 + i] = char(length >> (8 * i));
+}
+
+void decodeHeader(int&                opcode,
+                  unsigned&           handle,
+                  unsigned&           priority,
+                  unsigned long long& length,
+                  const char         *header)
+    // Load into the specified 'opcode', 'handle', 'priority', and 'length' the
+    // values encoded in the specified binary protocol 'header'.  The behavior
+    // is undefined unless 'header' has at least 'HEADER_SIZE' bytes.
+{
+    const unsigned char *const bytes =
+        reinterpret_cast<const unsigned char*>(header);
+
+    opcode = bytes[0];
+    handle = bytes[2] | unsigned(bytes[3]) << 8;
+
+    priority = 0;
+    for (int i = 0; i < 4; ++i)
+        priority |= unsigned(bytes[4 + i]) << (8 * i);
+
+    length = 0;
+    for (int i = 0; i < 8; ++i)
+        length |= (unsigned long long)(bytes[8 + i]) << (8 * i);
+}
+
+void encodeOffset(char *encoded, unsigned long long offset)
+    // Write to the specified 'encoded' the binary protocol encoding of the
+    // specified shared memory 'offset'.  The behavior is undefined unless
+    // 'encoded' has room for at least 'OFFSET_SIZE' bytes.
+{
+    for (int i = 0; i < OFFSET_SIZE; ++i)
+        encoded[i] = char(offset >> (8 * i));
+}
+
+unsigned long long decodeOffset(const char *encoded)
+    // Return the shared memory offset encoded in the specified binary
+    // protocol 'encoded'.  The behavior is undefined unless 'encoded' has at
+    // least 'OFFSET_SIZE' bytes.
+{
+    const unsigned char *const bytes =
+        reinterpret_cast<const unsigned char*>(encoded);
+
+    unsigned long long offset = 0;
+    for (int i = 0; i < OFFSET_SIZE; ++i)
+        offset |= (unsigned long long)(bytes[i]) << (8 * i);
+
+    return offset;
+}
+
+struct Command {
+    // A command read from standard input, and the means to read the rest of
+    // it.  'name' is the command as it was spelled in the text protocol, and
+    // 'payload' is the most recently read message payload; both point into
+    // 'input's buffer, and so are valid only until the next read.  'priority'
+    // and 'length' are set by whichever function read the most recent header,
+    // which for the binary protocol includes the command itself.  'queue' is
+    // the queue having the command's 'handle', or null for commands that
+    // don't refer to an open queue.  'timed' is whether the command had a
+    // "timeout" prefix, and if so, 'milliseconds' is the timeout.
+
+    Input&             input;
+    const char        *name;
+    size_t             nameSize;
+    int                opcode;
+    unsigned           handle;
+    Queue             *queue;
+    bool               timed;
+    unsigned           milliseconds;
+    unsigned           priority;
+    unsigned long long length;
+    const char        *payload;
+
+    explicit Command(Input& standardInput)
+    : input(standardInput)
+    , name(0)
+    , nameSize(0)
+    , opcode(0)
+    , handle(0)
+    , queue(0)
+    , timed(false)
+    , milliseconds(0)
+    , priority(0)
+    , length(0)
+    , payload(0)
+    {}
+};
+
+const int READ_OK    = 0,
+          READ_EOF   = 1,
+          READ_ERROR = 2;
+
+// 'INCOMPLETE' is returned by the functions that read commands when standard
+// input is nonblocking (see '--reactor') and has run out in the middle of a
+// command.  It is not an error, and is never reported.
+const int INCOMPLETE = -1;
+
+int readBareCommand(Command& command, Shared& shared)
+    // Read the next command from standard input into the specified 'command',
+    // except that a "timeout" prefix is read as if it were a command.  Return
+    // as for 'readCommand'.
+{
+    if (!shared.options.binary) {
+        switch (command.input.token(command.name, command.nameSize)) {
+          case Input::INPUT_OK: break;
+          case Input::INPUT_END: return READ_EOF;
+          case Input::INPUT_AGAIN: return INCOMPLETE;
+          default: {
+              Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+              std::cerr << "Unable to read command: "
+                        << strerror(command.input.error()) << std::endl;
+              return READ_ERROR;
+          }
+        }
+
+        const CommandName *const entry =
+            COMMANDS.find(command.name, command.nameSize);
+
+        command.opcode = entry ? entry->opcode : 0;
+        command.handle = 0;
+
+        // With '--multi', most commands are followed by the handle of the
+        // queue to which they refer.
+        if (shared.options.multi && entry && entry->handle != HANDLE_NONE) {
+            unsigned long long handle;
+            const int          rc = command.input.number(handle);
+            if (rc == Input::INPUT_AGAIN)
+                return INCOMPLETE;
+
+            if (rc || handle > MAX_HANDLE) {
+                Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+                std::cerr << "Unable to read a valid queue handle from \""
+                          << entry->name << "\" command." << std::endl;
+                return READ_ERROR;
+            }
+
+            command.handle = handle;
+        }
+    }
+    else {
+        const char *header;
+        const int   rc = command.input.bytes(header, HEADER_SIZE);
+        if (rc == Input::INPUT_END && command.input.buffered() == 0)
+            return READ_EOF;
+
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+
+        if (rc) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read a complete command header. Only "
+                      << command.input.buffered() << " bytes were read."
+                      << std::endl;
+            return READ_ERROR;
+        }
+
+        decodeHeader(command.opcode,
+                     command.handle,
+                     command.priority,
+                     command.length,
+                     header);
+
+        if (!shared.options.multi)
+            command.handle = 0;
+    }
+
+    // Only some commands refer to an open queue, and an unrecognized command
+    // is reported by the caller.
+    const CommandName *const entry = COMMANDS.find(command.opcode);
+    command.queue = findQueue(shared, command.handle);
+    if (!command.queue && entry && entry->handle == HANDLE_OPEN) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "No queue is open having handle " << command.handle
+                  << '.' << std::endl;
+        return READ_ERROR;
+    }
+
+    return READ_OK;
+}
+
+int readCommand(Command& command, Shared& shared)
+    // Read the next command from standard input into the specified 'command'.
+    // Return 'READ_OK' on success, 'READ_EOF' if the input is exhausted,
+    // 'INCOMPLETE' if more input is not available yet, or 'READ_ERROR' if a
+    // partial command was read or its handle is not that of an open queue
+    // (this is reported to stderr).  If the command is not recognized,
+    // 'command.opcode' will be zero.  If the command has a "timeout" prefix,
+    // then 'command.timed' is set, and 'command.milliseconds' is the timeout.
+{
+    command.timed = false;
+
+    int rc = readBareCommand(command, shared);
+    if (rc || command.opcode != OP_TIMEOUT)
+        return rc;
+
+    // In the text protocol, the timeout follows "timeout"; in the binary
+    // protocol, it's the prefix header's length.
+    unsigned long long milliseconds = command.length;
+    if (!shared.options.binary) {
+        rc = command.input.number(milliseconds);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+    }
+
+    if (rc || milliseconds > std::numeric_limits<unsigned>::max()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read a valid number of milliseconds from "
+                     "\"timeout\" prefix." << std::endl;
+        return READ_ERROR;
+    }
+
+    rc = readBareCommand(command, shared);
+    if (rc == READ_OK &&
+        command.opcode != OP_SEND    &&
+        command.opcode != OP_RECEIVE &&
+        command.opcode != OP_CONSUME &&
+        command.opcode != OP_CLOSE)
+    {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The \"timeout\" prefix applies only to \"send\", "
+                     "\"receive\", \"consume\", and \"close\"."
+                  << std::endl;
+        return READ_ERROR;
+    }
+
+    if (rc == READ_EOF) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The input ended after a \"timeout\" prefix."
+                  << std::endl;
+        return READ_ERROR;
+    }
+
+    command.timed        = true;
+    command.milliseconds = milliseconds;
+    return rc;
+}
+
+// -----------------
+// handling commands
+// -----------------
+
+int readMessageHeader(Command&    command,
+                      const char *commandName,
+                      Shared&     shared)
+    // Read from standard input the priority and size of a message to send,
+    // loading them into the specified 'command'.  In the text protocol, these
+    // are of the form "<priority> <size> "; in the binary protocol, they are
+    // an 'OP_SEND' header.  Return zero on success, 'INCOMPLETE' if more
+    // input is not available yet, or another nonzero value otherwise.  Use
+    // the specified 'commandName' in diagnostics.
+{
+    if (shared.options.binary) {
+        const char *header;
+        if (const int rc = command.input.bytes(header, HEADER_SIZE)) {
+            if (rc == Input::INPUT_AGAIN)
+                return INCOMPLETE;
+
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read message header from \""
+                      << commandName << "\" command." << std::endl;
+            return 1;
+        }
+
+        // The handle in a message header is ignored, since the message goes
+        // to the queue of the command that it's part of.
+        int      opcode;
+        unsigned handle;
+        decodeHeader(opcode, handle, command.priority, command.length, header);
+        if (opcode != OP_SEND) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Message header in \"" << commandName
+                      << "\" command has opcode " << opcode << " instead of "
+                      << int(OP_SEND) << '.' << std::endl;
+            return 6;
+        }
+
+        return 0;
+    }
+
+    unsigned long long priority;
+    int                rc = command.input.number(priority);
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc || priority > std::numeric_limits<unsigned>::max()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read message priority from \"" << commandName
+                  << "\" command." << std::endl;
+        return 1;
+    }
+
+    rc = command.input.number(command.length);
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read message size from \"" << commandName
+                  << "\" command." << std::endl;
+        return 2;
+    }
+
+    // Discard space character between size and payload.
+    rc = command.input.ignore();
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read the separator after the message size in "
+                     "\"" << commandName << "\" command." << std::endl;
+        return 4;
+    }
+
+    command.priority = priority;
+    return 0;
+}
+
+int readSharedPayload(Command& command, Shared& shared)
+    // Read from standard input the shared memory offset of the
+    // 'command.length' byte payload of a message, and point
+    // 'command.payload' at the payload in the shared memory.  Return as for
+    // 'readPayload'.
+{
+    unsigned long long offset;
+    int                rc;
+    if (shared.options.binary) {
+        const char *encoded;
+        rc = command.input.bytes(encoded, OFFSET_SIZE);
+        if (rc == Input::INPUT_OK)
+            offset = decodeOffset(encoded);
+    }
+    else
+        rc = command.input.number(offset);
+
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read the shared memory offset of a "
+                  << command.length << " byte message." << std::endl;
+        return 5;
+    }
+
+    command.payload = shared.sharedMemory->userBytes(offset, command.length);
+    if (!command.payload) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The " << command.length << " byte message at offset "
+                  << offset << " is not within the user's part of the shared "
+                     "memory." << std::endl;
+        return 8;
+    }
+
+    return 0;
+}
+
+int readPayload(Command& command, Shared& shared)
+    // Read from standard input the 'command.length' byte payload of a message
+    // and point 'command.payload' at it.  With '--shm', the payload is in the
+    // shared memory, and only its offset is read.  Return zero on success,
+    // 'INCOMPLETE' if more input is not available yet, or another nonzero
+    // value otherwise.
+{
+    const size_t maxSize = command.queue->maxPayloadSize;
+    if (command.length > maxSize) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "A " << command.length << " byte message is larger than "
+                     "the queue's maximum message size of " << maxSize
+                  << " bytes." << std::endl;
+        return 7;
+    }
+
+    if (shared.sharedMemory)
+        return readSharedPayload(command, shared);
+
+    if (const int rc = command.input.bytes(command.payload, command.length)) {
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read from input all of the supposed "
+                  << command.length << " byte message. "
+                  << command.input.buffered() << " were read instead."
+                  << std::endl;
+        return 5;
+    }
+
+    return 0;
+}
+
+const int FAIL_RECEIVE               = 1,
+          FAIL_WRITE                 = 2,
+          FAIL_ALLOC                 = 3,
+          FAIL_INTERRUPTED_OR_CLOSED = 4,
+          FAIL_TIMEOUT               = 5;
+
+// A zero absolute deadline has always passed, so it means "don't wait."
+const timespec DONT_WAIT = {};
+
+// The user releases room in the shared memory ring ('--shm') without telling
+// 'mq', so when a message doesn't fit, 'mq' looks again this often.
+const long ROOM_POLL_MILLISECONDS = 1;
+
+bool isBefore(const timespec& left, const timespec& right)
+    // Return whether the specified 'left' time is before the specified 'right'
+    // time.
+{
+    return left.tv_sec < right.tv_sec ||
+           (left.tv_sec == right.tv_sec && left.tv_nsec < right.tv_nsec);
+}
+
+timespec deadlineAfter(unsigned milliseconds)
+    // Return the 'CLOCK_REALTIME' time that is the specified 'milliseconds'
+    // from now.
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec  += milliseconds / 1000;
+    deadline.tv_nsec += long(milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+
+    return deadline;
+}
+
+timespec deadlineAfterMicroseconds(long microseconds)
+    // Return the 'CLOCK_REALTIME' time that is the specified 'microseconds'
+    // from now.
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec  += microseconds / 1000000;
+    deadline.tv_nsec += microseconds % 1000000 * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+
+    return deadline;
+}
+
+int millisecondsUntil(const timespec& deadline)
+    // Return the number of milliseconds from now until the specified
+    // 'deadline' ('CLOCK_REALTIME'), rounded up, or zero if it has passed,
+    // for 'poll' and the like.
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    const long long milliseconds =
+        (deadline.tv_sec - now.tv_sec) * 1000LL +
+        (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return milliseconds < 0 ? 0
+         : milliseconds > std::numeric_limits<int>::max()
+             ? std::numeric_limits<int>::max()
+             : int(milliseconds);
+}
+
+int flushOutput(Output& output, Shared& shared)
+    // Write any output pending in the specified 'output'.  Return zero on
+    // success or 'FAIL_WRITE' otherwise.
+{
+    if (output.flush()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to write output: "
+                  << strerror(output.error()) << std::endl;
+        return FAIL_WRITE;
+    }
+
+    return 0;
+}
+
+int flushOutput(Shared& shared)
+    // Write any output pending in 'shared.output' and in each of
+    // 'shared.workers'.  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    int rc = flushOutput(shared.output, shared);
+    for (size_t i = 0; i < shared.workers.size(); ++i) {
+        if (flushOutput(*shared.workers[i], shared))
+            rc = FAIL_WRITE;
+    }
+
+    return rc;
+}
+
+int stopWriters(Shared& shared)
+    // Stop the writer threads of 'shared.output' and of each of
+    // 'shared.workers', once they have written everything queued for them.
+    // Return zero if every write to them succeeded, or the 'errno' value of
+    // a failed write otherwise.  The behavior is undefined if any other
+    // thread is writing output.
+{
+    shared.output.stopWriter();
+    int error = shared.output.error();
+    for (size_t i = 0; i < shared.workers.size(); ++i) {
+        shared.workers[i]->stopWriter();
+        if (!error)
+            error = shared.workers[i]->error();
+    }
+
+    return error;
+}
+
+bool nextOutputDeadline(Shared& shared, timespec& when)
+    // If 'shared.output' or any of 'shared.workers' has pending output, load
+    // into the specified 'when' the earliest time by which it should be
+    // written, and return 'true'.  Otherwise, return 'false'.
+{
+    bool found = shared.output.deadline(when);
+    for (size_t i = 0; i < shared.workers.size(); ++i) {
+        timespec workerWhen;
+        if (shared.workers[i]->deadline(workerWhen) &&
+            (!found || isBefore(workerWhen, when)))
+        {
+            when  = workerWhen;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+Output& chooseWorker(Shared& shared)
+    // Return the one of 'shared.workers' that is to get the next message
+    // received for "consume": the next in turn with '--fan-out round-robin',
+    // or the one with the fewest bytes not yet read by its reader (whether
+    // still pending in the 'Output' or already in the pipe) with
+    // '--fan-out least-backlog', ties going to the next in turn.  The
+    // behavior is undefined unless 'shared.workers' is not empty.
+{
+    assert(!shared.workers.empty());
+
+    const size_t count = shared.workers.size();
+    const size_t turn  =
+        __atomic_fetch_add(&shared.nextWorker, 1, __ATOMIC_RELAXED) % count;
+    if (shared.options.fanOut == Options::ROUND_ROBIN)
+        return *shared.workers[turn];
+
+    size_t chosen = turn;
+    size_t least  = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < count && least; ++i) {
+        const size_t  index   = (turn + i) % count;
+        Output&       worker  = *shared.workers[index];
+        const size_t  backlog = worker.backlog() + worker.unread();
+        if (backlog < least) {
+            chosen = index;
+            least  = backlog;
+        }
+    }
+
+    return *shared.workers[chosen];
+}
+
+int writeOutput(const char *outputBegin,
+                size_t      outputSize,
+                Output&     output,
+                Shared&     shared)
+    // Write the specified 'outputSize' bytes starting at the specified
+    // 'outputBegin' to the specified 'output' (possibly later, along with
+    // other output).  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    if (output.write(outputBegin, outputSize)) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to return message: "
+                  << strerror(output.error()) << std::endl;
+        return FAIL_WRITE;
+    }
+
+    return 0;
+}
+
+int writeOutput(const char *outputBegin, size_t outputSize, Shared& shared)
+    // Write the specified 'outputSize' bytes starting at the specified
+    // 'outputBegin' to standard output (possibly later, along with other
+    // output).  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    return writeOutput(outputBegin, outputSize, shared.output, shared);
+}
+
+int sendToQueue(mqd_t           queue,
+                const char     *data,
+                size_t          size,
+                unsigned        priority,
+                const timespec *timeout,
+                Stats&          stats)
+    // Send to the specified 'queue' the message of the specified 'size' bytes
+    // at the specified 'data' having the specified 'priority', as 'mq_send'
+    // does, or as 'mq_timedsend' does if the specified 'timeout' is not null.
+    // Time the call and count its outcome in the specified 'stats'.  Return
+    // zero on success or -1 with 'errno' set otherwise.
+{
+    const long long startedAt = Stats::now();
+    const int       rc        = timeout
+                              ? mq_timedsend(queue, data, size, priority,
+                                             timeout)
+                              : mq_send(queue, data, size, priority);
+    const int       error     = errno;
+    stats.record(Stats::SEND, startedAt);
+
+    if (rc == 0) {
+        stats.add(Stats::SENT);
+        stats.add(Stats::SENT_BYTES, size);
+    }
+    else if (error == EINTR)
+        stats.add(Stats::INTERRUPTED);
+    else if (error == ETIMEDOUT || error == EAGAIN)
+        stats.add(Stats::STALLED);
+
+    errno = error;
+    return rc;
+}
+
+// With '--compress', every message in a queue begins with one of these bytes.
+const char PACKED_RAW = 0,  // the rest is the message
+           PACKED_LZ  = 1;  // the rest is the message compressed (see "lz.h")
+
+// Messages shorter than this aren't worth compressing.
+const size_t MIN_COMPRESSED_SIZE = 64;
+
+size_t pack(char *packed, const char *data, size_t size)
+    // Write to the specified 'packed' the message of the specified 'size'
+    // bytes at the specified 'data' as it is sent with '--compress', and
+    // return the size of that.  The message is compressed only if that
+    // makes it at least an eighth smaller, since otherwise the receiver's
+    // work to decompress it would buy little room in the queue.  The
+    // behavior is undefined unless 'packed' has room for 'size + 1' bytes.
+{
+    if (size >= MIN_COMPRESSED_SIZE) {
+        const size_t compressedSize =
+            lzCompress(packed + 1, size - size / 8, data, size);
+        if (compressedSize) {
+            packed[0] = PACKED_LZ;
+            return compressedSize + 1;
+        }
+    }
+
+    packed[0] = PACKED_RAW;
+    memcpy(packed + 1, data, size);
+    return size + 1;
+}
+
+int sendFragments(Queue&          queue,
+                  const char     *data,
+                  size_t          size,
+                  unsigned        priority,
+                  const timespec *timeout)
+    // Send to the specified 'queue' the message of the specified 'size' bytes
+    // at the specified 'data' having the specified 'priority' as fragments
+    // (see "fragment.h").  The specified 'timeout' applies only until the
+    // first fragment is sent, and then the threaded engine waits as long as
+    // it takes to send the rest.  The reactor can't wait, and so it gives up
+    // at 'timeout' as before, but then 'queue.partlySent' is set, and it must
+    // send the same message again to finish it, before any other.  Return
+    // zero on success or -1 with 'errno' set otherwise.
+{
+    if (!queue.partlySent) {
+        queue.fragmentId     = newMessageId();
+        queue.fragmentOffset = 0;
+    }
+
+    const size_t  maxPartSize = queue.msgsize - FRAGMENT_HEADER_SIZE;
+    char *const   fragment    = &queue.fragment[0];
+    do {
+        const size_t partSize =
+            std::min(maxPartSize, size - queue.fragmentOffset);
+        encodeFragmentHeader(fragment,
+                             queue.fragmentId,
+                             queue.fragmentOffset,
+                             size);
+        memcpy(fragment + FRAGMENT_HEADER_SIZE,
+               data + queue.fragmentOffset,
+               partSize);
+
+        if (sendToQueue(queue.descriptor,
+                        fragment,
+                        FRAGMENT_HEADER_SIZE + partSize,
+                        priority,
+                        timeout,
+                        queue.shared.stats))
+        {
+            // A message that can't be sent at all is abandoned.
+            if (errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR)
+                queue.partlySent = false;
+
+            return -1;
+        }
+
+        queue.fragmentOffset += partSize;
+        queue.partlySent      = true;
+        if (!queue.shared.options.reactor)
+            timeout = 0;
+    } while (queue.fragmentOffset < size);
+
+    queue.partlySent = false;
+    return 0;
+}
+
+int sendToQueue(Queue&          queue,
+                const char     *data,
+                size_t          size,
+                unsigned        priority,
+                const timespec *timeout)
+    // Send to the specified 'queue' the message of the specified 'size' bytes
+    // at the specified 'data' having the specified 'priority', as the other
+    // 'sendToQueue' does, except that with '--compress' the message is sent
+    // as 'pack' makes it, and with '--fragment' it's sent by 'sendFragments'
+    // (which see about 'timeout').  Return zero on success or -1 with 'errno'
+    // set otherwise.
+{
+    const Options& options     = queue.shared.options;
+    const size_t   payloadSize = size;
+    if (options.compress) {
+        size = pack(&queue.packed[0], data, size);
+        data = &queue.packed[0];
+    }
+
+    const int rc = options.fragmentBytes
+                 ? sendFragments(queue, data, size, priority, timeout)
+                 : sendToQueue(queue.descriptor,
+                               data,
+                               size,
+                               priority,
+                               timeout,
+                               queue.shared.stats);
+
+    if (!rc && options.compress) {
+        __atomic_fetch_add(&queue.payloadBytes, payloadSize, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&queue.packedBytes, size, __ATOMIC_RELAXED);
+    }
+
+    return rc;
+}
+
+ssize_t receiveFromQueue(mqd_t           queue,
+                         char           *data,
+                         size_t          size,
+                         unsigned&       priority,
+                         const timespec *timeout,
+                         Stats&          stats)
+    // Receive from the specified 'queue' into the specified 'size' bytes at
+    // the specified 'data' a message, loading its priority into the specified
+    // 'priority', as 'mq_receive' does, or as 'mq_timedreceive' does if the
+    // specified 'timeout' is not null.  Time the call and count its outcome
+    // in the specified 'stats'.  Return the size of the message on success or
+    // -1 with 'errno' set otherwise.
+{
+    const long long startedAt = Stats::now();
+    const ssize_t   rc        = timeout
+                              ? mq_timedreceive(queue, data, size, &priority,
+                                                timeout)
+                              : mq_receive(queue, data, size, &priority);
+    const int       error     = errno;
+    stats.record(Stats::RECEIVE, startedAt);
+
+    if (rc != -1) {
+        stats.add(Stats::RECEIVED);
+        stats.add(Stats::RECEIVED_BYTES, rc);
+    }
+    else if (error == EINTR)
+        stats.add(Stats::INTERRUPTED);
+
+    errno = error;
+    return rc;
+}
+
+int sendMessage(const Command&  command,
+                const char     *commandName,
+                Shared&         shared,
+                const timespec *deadline = 0)
+    // Send the payload in the specified 'command' to the command's queue with
+    // the command's priority, retrying if interrupted by a signal.  Return
+    // zero on success, 'FAIL_TIMEOUT' if the optionally specified 'deadline'
+    // ('CLOCK_REALTIME') is not null and passes while the queue is full, or
+    // another nonzero value otherwise.  Note that a 'deadline' in the past
+    // means "don't wait."  Use the specified 'commandName' in diagnostics.
+{
+    // looping for retry on signal interruption
+    for (;;) {
+        // If output is pending and due before 'deadline', then block only
+        // until the output is due, write it, and then go around again.
+        timespec        outputDeadline;
+        const bool      outputPending = nextOutputDeadline(shared,
+                                                           outputDeadline);
+        const bool      outputFirst   =
+            outputPending &&
+            (!deadline || isBefore(outputDeadline, *deadline));
+        const timespec *timeout = outputFirst ? &outputDeadline : deadline;
+
+        const int rc = sendToQueue(*command.queue,
+                                   command.payload,
+                                   command.length,
+                                   command.priority,
+                                   timeout);
+        if (rc == -1) {
+            // failed to send
+            const int error = errno;
+            if (error == ETIMEDOUT) {
+                if (!outputFirst)
+                    return FAIL_TIMEOUT;
+
+                if (const int rc = flushOutput(shared))
+                    return rc;
+            }
+            else if (error != EINTR) {
+                Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+                std::cerr << "Unable to send message for \"" << commandName
+                          << "\" command: " << strerror(error) << std::endl;
+                return 3;
+            }
+        }
+        else {
+            // send succeeded
+            return 0;
+        }
+    }
+}
+
+int respond(int                 opcode,
+            unsigned            handle,
+            unsigned            priority,
+            unsigned long long  length,
+            Shared&             shared)
+    // Write to standard output a response having no payload, i.e. anything
+    // other than a message.  In the text protocol, the response consists of
+    // its name, then the specified 'handle' if '--multi', and then the
+    // number(s) relevant to it; in the binary protocol, it is the header
+    // having the specified 'opcode', 'handle', 'priority', and 'length'.
+    // Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    if (shared.options.binary) {
+        char header[HEADER_SIZE];
+        encodeHeader(header, opcode, handle, priority, length);
+        return writeOutput(header, sizeof header, shared);
+    }
+
+    const char *name;
+    switch (opcode) {
+      case OP_BUSY:  name = "busy";  break;
+      case OP_READY: name = "ready"; break;
+      default: {
+          const CommandName *const entry =
+              COMMANDS.find(opcode & ~OP_RESPONSE);
+          assert(entry && entry->responseName);
+          name = entry->responseName;
+      }
+    }
+
+    char  buffer[80];
+    char *end = stpcpy(buffer, name);
+    if (shared.options.multi) {
+        *end++ = ' ';
+        end    = appendDecimal(end, handle);
+    }
+    if (opcode == OP_ACKV) {
+        *end++ = ' ';
+        end    = appendDecimal(end, priority);
+    }
+    if (opcode == OP_TIMEDOUT) {
+        // The priority is the opcode of the command that timed out.
+        *end++ = ' ';
+        end    = stpcpy(end, commandName(priority));
+    }
+    else if (opcode != OP_OPENED && opcode != OP_READY) {
+        *end++ = ' ';
+        end    = appendDecimal(end, length);
+    }
+    *end++ = '\n';
+
+    assert(end <= buffer + sizeof buffer);
+    return writeOutput(buffer, end - buffer, shared);
+}
+
+int keepPending(const Command&  command,
+                Shared&         shared,
+                const timespec *deadline = 0)
+    // Add the message in the specified 'command' to its queue's pending
+    // messages, waiting while they are full, and writing out "busy" if they
+    // become busy.  Return zero on success, 'FAIL_TIMEOUT' if the optionally
+    // specified 'deadline' ('CLOCK_REALTIME') is not null and passes while
+    // the pending messages are full, or another nonzero value otherwise.  As
+    // in 'sendMessage', pending output is written before waiting too long.
+    // The behavior is undefined unless the queue has pending messages.
+{
+    Queue& queue = *command.queue;
+    assert(queue.pending);
+
+    for (;;) {
+        timespec        outputDeadline;
+        const bool      outputPending = nextOutputDeadline(shared,
+                                                           outputDeadline);
+        const bool      outputFirst   =
+            outputPending &&
+            (!deadline || isBefore(outputDeadline, *deadline));
+        const timespec *timeout = outputFirst ? &outputDeadline : deadline;
+
+        switch (queue.pending->push(command.priority,
+                                    command.payload,
+                                    command.length,
+                                    timeout)) {
+          case Pending::PENDING_OK:
+            return 0;
+          case Pending::PENDING_BUSY:
+            return respond(OP_BUSY,
+                           queue.handle,
+                           0,
+                           queue.pending->bytes(),
+                           shared);
+          case Pending::PENDING_TIMEOUT:
+            if (!outputFirst)
+                return FAIL_TIMEOUT;
+
+            if (const int rc = flushOutput(shared))
+                return rc;
+            break;
+          case Pending::PENDING_ERROR: {
+              const int error = errno;
+              Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+              std::cerr << "Unable to spool a message for queue "
+                        << repr(queue.name) << ": " << strerror(error)
+                        << std::endl;
+              return error;
+          }
+          default: {
+              Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+              std::cerr << "Unable to keep a message pending for queue "
+                        << repr(queue.name) << ", because its pending "
+                           "messages can no longer be sent." << std::endl;
+              return 3;
+          }
+        }
+    }
+}
+
+void reportUnsent(const Queue& queue, Shared& shared)
+    // Say on standard error that the messages pending for the specified
+    // 'queue' are discarded, since "close" timed out waiting for room.
+{
+    Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+    std::cerr << "Discarded the messages pending for queue "
+              << repr(queue.name) << " (" << queue.pending->bytes()
+              << " bytes, counting bookkeeping), since \"close\" timed out"
+                 " waiting for room in the queue." << std::endl;
+}
+
+extern "C" void *sendPending(void *data);  // defined further below
+
+int startSender(Queue& queue, Shared& shared)
+    // Create the thread that sends the specified 'queue's pending messages.
+    // Return zero on success or a nonzero value otherwise.
+{
+    // As in 'consumeHandler', set the flags before creating the thread.
+    const bool hadThread        = shared.consumerThreadExists;
+    shared.consumerThreadExists = true;
+    queue.senderThreadExists    = true;
+
+    const int rc = pthread_create(&queue.senderThread,
+                                  0,             // default attributes
+                                  &sendPending,  // start routine
+                                  &queue);       // argument to start routine
+    if (rc) {
+        queue.senderThreadExists = false;
+        Lock lock(shared.stderrMutex, hadThread);
+        std::cerr << "Unable to create sender thread: " << strerror(rc)
+                  << std::endl;
+    }
+
+    return rc;
+}
+
+int sendOrKeep(const Command&  command,
+               const char     *commandName,
+               Shared&         shared,
+               const timespec *deadline = 0)
+    // Send the message in the specified 'command' as 'sendMessage' does,
+    // unless its queue can keep messages pending ('--pending' or
+    // '--spool').  In that case, send it only if nothing is pending already
+    // and the queue has room, and otherwise keep it pending for the queue's
+    // sender thread, which is started if necessary.  Return zero on success,
+    // 'FAIL_TIMEOUT' if the optionally specified 'deadline' is not null and
+    // passes first, or another nonzero value otherwise.  Use the specified
+    // 'commandName' in diagnostics.
+{
+    Queue& queue = *command.queue;
+    if (!queue.pending)
+        return sendMessage(command, commandName, shared, deadline);
+
+    // A message can't skip ahead of those already pending.  The sender
+    // thread removes a message only after sending it, so this is not a race.
+    if (queue.pending->bytes() == 0) {
+        const int rc = sendMessage(command, commandName, shared, &DONT_WAIT);
+        if (rc != FAIL_TIMEOUT)
+            return rc;
+    }
+
+    if (!queue.senderThreadExists) {
+        if (const int rc = startSender(queue, shared))
+            return rc;
+    }
+
+    return keepPending(command, shared, deadline);
+}
+
+bool fitsBundle(const Queue& queue, const Command& command)
+    // Return whether the message in the specified 'command' can be added to
+    // the bundle of the specified 'queue' without sending the bundle first,
+    // i.e. whether the bundle is empty, or has the message's priority and
+    // room for it and isn't partly sent already (see 'sendToQueue').
+{
+    return queue.bundleSize == 0 ||
+           (command.priority == queue.bundlePriority && !queue.partlySent &&
+            queue.bundleSize + bundleHeaderSize(command.length) +
+                command.length <= queue.bundleLimit);
+}
+
+void addToBundle(Queue& queue, const Command& command)
+    // Add the message in the specified 'command' to the bundle of the
+    // specified 'queue', which is then due to be sent after '--bundle-usec'
+    // if the message is its first.  The behavior is undefined unless
+    // 'fitsBundle(queue, command)'.
+{
+    if (queue.bundleSize == 0) {
+        queue.bundlePriority = command.priority;
+        queue.bundleDeadline =
+            deadlineAfterMicroseconds(queue.shared.options.bundleMicroseconds);
+    }
+
+    char *const header  = &queue.bundle[queue.bundleSize];
+    char *const message = encodeBundleHeader(header, command.length);
+    memcpy(message, command.payload, command.length);
+    queue.bundleSize += message - header + command.length;
+}
+
+void loadBundle(Command& bundled, Queue& queue)
+    // Load into the specified 'bundled' the bundle of the specified 'queue'
+    // as the message to send.
+{
+    bundled.queue    = &queue;
+    bundled.handle   = queue.handle;
+    bundled.priority = queue.bundlePriority;
+    bundled.length   = queue.bundleSize;
+    bundled.payload  = &queue.bundle[0];
+}
+
+int bundleMessage(const Command&  command,
+                  const char     *commandName,
+                  Shared&         shared,
+                  const timespec *deadline = 0)
+    // Add the message in the specified 'command' to its queue's bundle, as
+    // '--bundle-usec' does, first sending the bundle as 'sendOrKeep' does if
+    // the message doesn't fit in it.  Return zero on success, 'FAIL_TIMEOUT'
+    // if the optionally specified 'deadline' is not null and passes first (in
+    // which case the message isn't added), or another nonzero value
+    // otherwise.  Use the specified 'commandName' in diagnostics.
+{
+    Queue& queue = *command.queue;
+    if (!fitsBundle(queue, command)) {
+        Command bundled(command);
+        loadBundle(bundled, queue);
+        if (const int rc = sendOrKeep(bundled, commandName, shared, deadline))
+            return rc;
+
+        queue.bundleSize = 0;
+    }
+
+    addToBundle(queue, command);
+    return 0;
+}
+
+int sendBundles(const Command& command, Shared& shared, bool lingering)
+    // Send the bundle of each queue, as 'sendOrKeep' does, in the order in
+    // which they're due, using a copy of the specified 'command'.  If the
+    // specified 'lingering' is 'true', then wait for each bundle to be due
+    // before sending it, unless standard input has something to read first,
+    // in which case return without sending the rest.  Return zero on success
+    // or a nonzero value otherwise.
+{
+    for (;;) {
+        Queue *due = 0;
+        for (size_t i = 0; i < shared.queues.size(); ++i) {
+            Queue *const queue = shared.queues[i];
+            if (queue && queue->bundleSize &&
+                (!due || isBefore(queue->bundleDeadline, due->bundleDeadline)))
+            {
+                due = queue;
+            }
+        }
+
+        if (!due)
+            return 0;
+
+        if (lingering) {
+            pollfd    input = { fileno(stdin), POLLIN, 0 };
+            const int rc    =
+                poll(&input, 1, millisecondsUntil(due->bundleDeadline));
+            if (rc > 0)
+                return 0;  // another message might join the bundle
+
+            if (rc == -1 && errno == EINTR)
+                continue;
+        }
+
+        Command bundled(command);
+        loadBundle(bundled, *due);
+        if (const int rc = sendOrKeep(bundled, "send", shared))
+            return rc;
+
+        due->bundleSize = 0;
+    }
+}
+
+struct ReadHookData {
+    // What 'beforeRead' needs.
+    Command& command;
+    Shared&  shared;
+};
+
+extern "C" void beforeRead(void *data)
+    // Flush the output of the 'Shared' object in the 'ReadHookData' at the
+    // specified 'data', and, with '--bundle-usec', send the bundles as they
+    // come due, unless more input arrives first.  This is installed as the
+    // read hook of standard input, so that pending output is written, and
+    // bundles are sent, before the main thread blocks reading the next
+    // command.
+{
+    ReadHookData& hook = *static_cast<ReadHookData*>(data);
+    flushOutput(hook.shared);  // failures are reported
+
+    if (hook.shared.options.bundle) {
+        sendBundles(hook.command, hook.shared, true);  // failures are reported
+        flushOutput(hook.shared);  // e.g. "busy" from sending them
+    }
+}
+
+int sendHandler(Command& command, Shared& shared)
+{
+    // In the binary protocol, the command header is also the message header.
+    if (!shared.options.binary) {
+        if (const int rc = readMessageHeader(command, "send", shared))
+            return rc;
+    }
+
+    if (const int rc = readPayload(command, shared))
+        return rc;
+
+    // With a "timeout" prefix, give up on the message if there's no room for
+    // it in time.
+    timespec deadline;
+    if (command.timed)
+        deadline = deadlineAfter(command.milliseconds);
+
+    const timespec *const timeout = command.timed ? &deadline : 0;
+    const int             rc      =
+        shared.options.bundle
+            ? bundleMessage(command, "send", shared, timeout)
+            : sendOrKeep(command, "send", shared, timeout);
+    switch (rc) {
+      case 0:
+        break;
+      case FAIL_TIMEOUT:
+        return respond(OP_TIMEDOUT, command.handle, OP_SEND, 0, shared);
+      default:
+        return rc;
+    }
+
+    return respond(OP_ACK,
+                   command.handle,
+                   command.priority,
+                   command.length,
+                   shared);
+}
+
+int readCount(unsigned& count, Command& command, Shared& shared)
+    // Load into the specified 'count' the number of messages in the "sendv"
+    // or "probe" 'command', which in the text protocol follows the command's
+    // name (and handle), and in the binary protocol is the command header's
+    // length.  Return zero on success, 'INCOMPLETE' if more input is not
+    // available yet, or another nonzero value otherwise.
+{
+    unsigned long long value = command.length;
+    int                rc    = 0;
+    if (!shared.options.binary) {
+        rc = command.input.number(value);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+    }
+
+    if (rc || value > std::numeric_limits<unsigned>::max()) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read a valid message count from \""
+                  << commandName(command.opcode) << "\" command."
+                  << std::endl;
+        return 1;
+    }
+
+    count = value;
+    return 0;
+}
+
+int sendvHandler(Command& command, Shared& shared)
+    // Send a batch of messages, each as in 'sendHandler', and then acknowledge
+    // all of them at once with "ackv <count> <bytes>".  If a message in the
+    // batch cannot be read or sent, acknowledge only the messages preceding
+    // it, so that '<count>' is the index of the message that failed.
+{
+    unsigned count;
+    if (const int rc = readCount(count, command, shared))
+        return rc;
+
+    unsigned           sent  = 0;
+    unsigned long long bytes = 0;
+    int                rc    = 0;
+    for (; sent < count; ++sent) {
+        if ((rc = readMessageHeader(command, "sendv", shared)) ||
+            (rc = readPayload(command, shared))                ||
+            (rc = shared.options.bundle
+                      ? bundleMessage(command, "sendv", shared)
+                      : sendOrKeep(command, "sendv", shared)))
+        {
+            break;
+        }
+
+        bytes += command.length;
+    }
+
+    const int respondResult =
+        respond(OP_ACKV, command.handle, sent, bytes, shared);
+    return rc ? rc : respondResult;
+}
+
+int writeSharedMessage(unsigned            handle,
+                       unsigned            priority,
+                       size_t              size,
+                       unsigned long long  offset,
+                       Shared&             shared)
+    // Write to standard output that the message of the specified 'size' and
+    // 'priority', from the queue having the specified 'handle', is at the
+    // specified 'offset' in the shared memory.  In the text protocol, this is
+    // the message's usual prefix followed by the offset instead of the
+    // payload, e.g. "2 5 4096\n"; in the binary protocol, it is an 'OP_MSG'
+    // header followed by the offset.  Return zero on success or 'FAIL_WRITE'
+    // otherwise.
+{
+    char  buffer[80];
+    char *end = buffer;
+    if (shared.options.binary) {
+        encodeHeader(buffer, OP_MSG, handle, priority, size);
+        encodeOffset(buffer + HEADER_SIZE, offset);
+        end += HEADER_SIZE + OFFSET_SIZE;
+    }
+    else {
+        if (shared.options.multi) {
+            end    = appendDecimal(end, handle);
+            *end++ = ' ';
+        }
+        end    = appendDecimal(end, priority);
+        *end++ = ' ';
+        end    = appendDecimal(end, size);
+        *end++ = ' ';
+        end    = appendDecimal(end, offset);
+        *end++ = '\n';
+    }
+
+    assert(end <= buffer + sizeof buffer);
+    return writeOutput(buffer, end - buffer, shared);
+}
+
+int shareMessage(const char *data,
+                 size_t      size,
+                 unsigned    priority,
+                 unsigned    handle,
+                 Shared&     shared)
+    // Copy the message of the specified 'size' bytes at the specified 'data'
+    // into the shared memory ring, waiting for the user to release room as
+    // necessary, and then write out where it is, as 'writeSharedMessage'
+    // does with the specified 'priority' and 'handle'.  Return zero on
+    // success or a nonzero value otherwise.
+{
+    // Other threads wait meanwhile, so that messages are written out in the
+    // same order as they are in the ring.
+    SharedMemory& memory = *shared.sharedMemory;
+    Lock          lock(shared.sharedMemoryMutex, shared.consumerThreadExists);
+
+    char *destination;
+    while (!(destination = memory.reserve(size))) {
+        // The user might be waiting to read the messages that it would then
+        // release, so write them out before waiting.
+        lock.release();
+        if (const int rc = flushOutput(shared))
+            return rc;
+
+        timespec pause = {};
+        pause.tv_nsec  = ROOM_POLL_MILLISECONDS * 1000000;
+        nanosleep(&pause, 0);
+        lock.acquire();
+    }
+
+    memcpy(destination, data, size);
+    return writeSharedMessage(handle,
+                              priority,
+                              size,
+                              memory.commit(size),
+                              shared);
+}
+
+class PooledBuffer {
+    // A buffer from a 'BufferPool' (or null, if there is no pool or no free
+    // buffer), which is given back to the pool when this object is
+    // destroyed, to be reused once the output has written 'reusableAt'
+    // bytes.
+
+    BufferPool *const pool;
+
+    PooledBuffer(const PooledBuffer&);             // not copyable
+    PooledBuffer& operator=(const PooledBuffer&);  // not assignable
+
+  public:
+    char *const        buffer;
+    unsigned long long reusableAt;
+
+    PooledBuffer(BufferPool *bufferPool, Output& output)
+    : pool(bufferPool)
+    , buffer(bufferPool ? bufferPool->acquire(output.written()) : 0)
+    , reusableAt(0)
+    {}
+
+    ~PooledBuffer()
+    {
+        if (buffer)
+            pool->release(buffer, reusableAt);
+    }
+};
+
+int spliceOutput(const char   *prefix,
+                 size_t        prefixSize,
+                 const char   *data,
+                 size_t        size,
+                 PooledBuffer& pooled,
+                 Shared&       shared)
+    // Write to standard output the specified 'prefixSize' bytes at the
+    // specified 'prefix' followed by the specified 'size' bytes at the
+    // specified 'data', which is in the specified 'pooled' buffer.  If 'size'
+    // is at least '--splice', then splice 'data' into the pipe rather than
+    // copying it, and keep 'pooled' from being reused until the pipe is done
+    // with it.  Return zero on success or 'FAIL_WRITE' otherwise.
+{
+    iovec parts[2];
+    parts[0].iov_base = const_cast<char*>(prefix);
+    parts[0].iov_len  = prefixSize;
+    parts[1].iov_base = const_cast<char*>(data);
+    parts[1].iov_len  = size;
+
+    int rc;
+    if (size < shared.options.spliceBytes)
+        rc = shared.output.write(parts, 2);
+    else {
+        unsigned long long end;
+        rc = shared.output.splice(parts, 1, data, size, end);
+        pooled.reusableAt = end + shared.output.pipeCapacity();
+    }
+
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to return message: "
+                  << strerror(shared.output.error()) << std::endl;
+        return FAIL_WRITE;
+    }
+
+    return 0;
+}
+
+// A received message is formatted in a buffer that has room before the
+// message for the text protocol's prefix of numbers (see 'doReceive'), which
+// is at most this many characters.  The binary protocol's header fits there
+// too.
+const int NUMBERS_MAX_SIZE =
+    std::numeric_limits<unsigned>::digits10 + 1 +  // handle
+    1 +  // separating whitespace
+    std::numeric_limits<unsigned>::digits10 + 1 +  // priority
+    1 +  // separating whitespace
+    std::numeric_limits<ssize_t>::digits10 + 1 +   // message size
+    1;   // whitespace before the payload
+
+// Each queue that is read has this many receive buffers: one for the main
+// thread's "receive", and one for the queue's consumer thread.
+const size_t RECEIVE_BUFFERS = 2;
+
+// With '--fragment', a queue puts back together at most this many messages
+// at once, e.g. one from each of this many senders.
+const size_t MAX_PARTIAL_MESSAGES = 64;
+
+size_t receiveBufferSize(ssize_t msgsize)
+    // Return the size of a buffer in which to receive and format a message
+    // from a queue having the specified 'msgsize'.
+{
+    return NUMBERS_MAX_SIZE +  // <priority> <space> <size> <space>
+           msgsize +           // the payload received from the queue
+           1;                  // a trailing newline
+}
+
+bool reassemble(char              *&bufferBegin,
+                char              *&msgBegin,
+                ssize_t&            msgSize,
+                std::vector<char>&  assembled,
+                Queue&              queue)
+    // Take the specified 'msgSize' bytes at the specified 'msgBegin', just
+    // received from the specified 'queue' with '--fragment', as a fragment.
+    // If it is a whole message, then point 'msgBegin' and 'msgSize' at the
+    // message after the fragment's header, move the specified 'bufferBegin'
+    // along with 'msgBegin', and return 'true'.  If it is the
+    // last of a message's fragments, then load the message's buffer into
+    // the specified 'assembled', point the specified 'bufferBegin' at it and
+    // 'msgBegin' and 'msgSize' at the message in it (after room for
+    // 'NUMBERS_MAX_SIZE' characters), and return 'true'.  Otherwise, keep the
+    // fragment (or, if it's invalid, discard it) and return 'false'.
+{
+    Shared& shared = queue.shared;
+
+    unsigned long long id;
+    size_t             offset;
+    size_t             total;
+    if (size_t(msgSize) >= FRAGMENT_HEADER_SIZE) {
+        decodeFragmentHeader(id, offset, total, msgBegin);
+        if (offset == 0 && total == msgSize - FRAGMENT_HEADER_SIZE) {
+            bufferBegin += FRAGMENT_HEADER_SIZE;
+            msgBegin    += FRAGMENT_HEADER_SIZE;
+            msgSize      = total;
+            return true;
+        }
+    }
+
+    switch (queue.reassembler->add(msgBegin, msgSize, assembled)) {
+      case Reassembler::REASSEMBLY_COMPLETE:
+        bufferBegin = &assembled[0];
+        msgBegin    = bufferBegin + NUMBERS_MAX_SIZE;
+        msgSize     = assembled.size() - NUMBERS_MAX_SIZE - 1;
+        return true;
+      case Reassembler::REASSEMBLY_DROPPED: {
+          Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+          std::cerr << "Discarded an incomplete message from queue "
+                    << repr(queue.name) << " to make room for another."
+                    << std::endl;
+          break;
+      }
+      case Reassembler::REASSEMBLY_INVALID: {
+          Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+          std::cerr << "Discarded a " << msgSize << " byte message from "
+                       "queue " << repr(queue.name) << ", since it isn't a "
+                       "valid fragment." << std::endl;
+          break;
+      }
+    }
+
+    return false;
+}
+
+bool unpack(char              *&bufferBegin,
+            char              *&msgBegin,
+            ssize_t&            msgSize,
+            std::vector<char>&  unpacked,
+            Queue&              queue)
+    // Take the specified 'msgSize' bytes at the specified 'msgBegin', just
+    // received from the specified 'queue' with '--compress', as 'pack' made
+    // them.  If they are the message as it was, then point 'msgBegin' and
+    // 'msgSize' at the message after its marker, move the specified
+    // 'bufferBegin' along with 'msgBegin', and return 'true'.  If they are
+    // the message compressed, then decompress it into the specified
+    // 'unpacked', point 'bufferBegin' at it and 'msgBegin' and 'msgSize' at
+    // the message in it (after room for 'NUMBERS_MAX_SIZE' characters), and
+    // return 'true'.  Otherwise, discard the message and return 'false'.
+{
+    if (msgSize > 0 && msgBegin[0] == PACKED_RAW) {
+        __atomic_fetch_add(&queue.payloadBytes, msgSize - 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&queue.packedBytes, msgSize, __ATOMIC_RELAXED);
+        ++bufferBegin;
+        ++msgBegin;
+        --msgSize;
+        return true;
+    }
+
+    if (msgSize > 0 && msgBegin[0] == PACKED_LZ) {
+        const size_t size = lzDecompressedSize(msgBegin + 1, msgSize - 1);
+        if (size <= queue.maxMessageSize) {
+            unpacked.resize(NUMBERS_MAX_SIZE + size + 1);
+            char *const begin = &unpacked[0] + NUMBERS_MAX_SIZE;
+            if (!lzDecompress(begin, size, msgBegin + 1, msgSize - 1)) {
+                __atomic_fetch_add(&queue.payloadBytes,
+                                   size,
+                                   __ATOMIC_RELAXED);
+                __atomic_fetch_add(&queue.packedBytes,
+                                   msgSize,
+                                   __ATOMIC_RELAXED);
+                bufferBegin = &unpacked[0];
+                msgBegin    = begin;
+                msgSize     = size;
+                return true;
+            }
+        }
+    }
+
+    Shared& shared = queue.shared;
+    Lock    lock(shared.stderrMutex, shared.consumerThreadExists);
+    std::cerr << "Discarded a " << msgSize << " byte message from queue "
+              << repr(queue.name) << ", since it isn't a valid compressed "
+                 "message." << std::endl;
+    return false;
+}
+
+bool unbundle(char     *&bufferBegin,
+              char     *&msgBegin,
+              ssize_t&   msgSize,
+              unsigned   priority,
+              Queue&     queue)
+    // Take the specified 'msgSize' bytes at the specified 'msgBegin', just
+    // received from the specified 'queue' with '--bundle-usec', as a bundle
+    // of messages having the specified 'priority'.  If it is valid, then
+    // keep the messages after the first in 'queue.unbundling', point
+    // 'msgBegin' and 'msgSize' at the first, move the specified
+    // 'bufferBegin' along with 'msgBegin', and return 'true'.  Otherwise,
+    // discard it and return 'false'.
+{
+    const char *const end  = msgBegin + msgSize;
+    const char       *next = msgBegin;
+    size_t            size  = 0;
+    bool              valid = !decodeBundleHeader(size, next, end);
+
+    const size_t headerSize = next - msgBegin;
+    const size_t firstSize  = size;
+    while (valid && (next += size) != end)
+        valid = !decodeBundleHeader(size, next, end);
+
+    Shared& shared = queue.shared;
+    if (!valid) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Discarded a " << end - msgBegin << " byte message from "
+                     "queue " << repr(queue.name) << ", since it isn't a "
+                     "valid bundle." << std::endl;
+        return false;
+    }
+
+    bufferBegin += headerSize;
+    msgBegin    += headerSize;
+    msgSize      = firstSize;
+
+    const char *const restBegin = msgBegin + msgSize;
+    if (restBegin != end) {
+        Lock lock(queue.unbundlingMutex, shared.consumerThreadExists);
+        queue.unbundling.push_back(Unbundling());
+
+        Unbundling& rest = queue.unbundling.back();
+        rest.priority = priority;
+        rest.messages.assign(restBegin, end);
+        rest.offset   = 0;
+    }
+
+    return true;
+}
+
+bool takeUnbundled(char              *&bufferBegin,
+                   char              *&msgBegin,
+                   ssize_t&            msgSize,
+                   unsigned&           priority,
+                   std::vector<char>&  spilled,
+                   size_t              room,
+                   Queue&              queue)
+    // If the specified 'queue' has messages kept from bundles received with
+    // '--bundle-usec', then take the one that was received first, copy it
+    // into the buffer at the specified 'bufferBegin' after room for
+    // 'NUMBERS_MAX_SIZE' characters (or, if it's larger than the specified
+    // 'room', likewise into the specified 'spilled', and point 'bufferBegin'
+    // there), point the specified 'msgBegin' and 'msgSize' at it, load its
+    // priority into the specified 'priority', and return 'true'.  Otherwise,
+    // return 'false'.
+{
+    Lock lock(queue.unbundlingMutex, queue.shared.consumerThreadExists);
+    if (queue.unbundling.empty())
+        return false;
+
+    Unbundling&       rest = queue.unbundling.front();
+    const char *const end  = &rest.messages[0] + rest.messages.size();
+    const char       *next = &rest.messages[0] + rest.offset;
+    size_t            size = 0;
+    decodeBundleHeader(size, next, end);  // checked by 'unbundle'
+
+    if (size > room) {
+        spilled.resize(NUMBERS_MAX_SIZE + size + 1);
+        bufferBegin = &spilled[0];
+    }
+
+    msgBegin = bufferBegin + NUMBERS_MAX_SIZE;
+    memcpy(msgBegin, next, size);
+    msgSize  = size;
+    priority = rest.priority;
+
+    rest.offset = next + size - &rest.messages[0];
+    if (rest.offset == rest.messages.size())
+        queue.unbundling.pop_front();
+
+    return true;
+}
+
+// "probe" sends markers of this many bytes: 'PROBE_MAGIC', and then the ID
+// of the process that sent it, its sequence number (see
+// 'Queue::probeMarkers'), and the 'Stats::now' at which it was sent, as
+// native-endian 'unsigned long long'.
+const char   PROBE_MAGIC[8]    = { 'm', 'q', 'p', 'r', 'o', 'b', 'e', 0 };
+const size_t PROBE_MARKER_SIZE = sizeof PROBE_MAGIC +
+                                 3 * sizeof(unsigned long long);
+
+bool isStrayMarker(const char *data, size_t size, const Queue& queue)
+    // Return whether the message of the specified 'size' bytes at the
+    // specified 'data' is a marker that "probe" sent to the specified 'queue'
+    // and then gave up on.
+{
+    if (size != PROBE_MARKER_SIZE ||
+        memcmp(data, PROBE_MAGIC, sizeof PROBE_MAGIC))
+    {
+        return false;
+    }
+
+    unsigned long long fields[2];  // process, sequence
+    memcpy(fields, data + sizeof PROBE_MAGIC, sizeof fields);
+    return fields[0] == (unsigned long long)(getpid()) &&
+           fields[1] <  queue.probeMarkers;
+}
+
+int receiveWhole(char              *&bufferBegin,
+                 char              *&msgBegin,
+                 ssize_t&            msgSize,
+                 unsigned&           priority,
+                 std::vector<char>&  assembled,
+                 std::vector<char>&  unpacked,
+                 size_t              room,
+                 Queue&              queue,
+                 const timespec     *deadline)
+    // Receive a message from the specified 'queue' into the specified 'room'
+    // bytes at the specified 'msgBegin', within the buffer at the specified
+    // 'bufferBegin', as '--fragment', '--compress', and '--bundle-usec' have
+    // it (using the specified 'assembled' and 'unpacked' as 'reassemble' and
+    // 'unpack' do), and load its size into the specified 'msgSize' and its
+    // priority into the specified 'priority', moving 'bufferBegin' and
+    // 'msgBegin' as they do.  Discard markers that "probe" gave up on (see
+    // 'isStrayMarker').  Write pending output before waiting too long, as
+    // 'sendMessage' does.  Return zero once a whole message is received,
+    // or if 'mq_receive' fails, in which case 'msgSize' is -1 and 'errno'
+    // says why.  Return 'FAIL_TIMEOUT' if the specified 'deadline'
+    // ('CLOCK_REALTIME') is not null and passes first, or another nonzero
+    // value if writing output fails.
+{
+    Shared& shared = queue.shared;
+    for (;;) {
+        // If output is pending and due before 'deadline', then block only
+        // until the output is due, write it, and then go around again.
+        timespec        outputDeadline;
+        const bool      outputPending = nextOutputDeadline(shared,
+                                                           outputDeadline);
+        const bool      outputFirst   =
+            outputPending &&
+            (!deadline || isBefore(outputDeadline, *deadline));
+        const timespec *timeout = outputFirst ? &outputDeadline : deadline;
+
+        msgSize = receiveFromQueue(queue.descriptor,
+                                   msgBegin,
+                                   room,
+                                   priority,
+                                   timeout,
+                                   shared.stats);
+        if (msgSize != -1) {
+            // With '--fragment', keep receiving until a message is whole.
+            if (queue.reassembler &&
+                !reassemble(bufferBegin, msgBegin, msgSize, assembled, queue))
+            {
+                continue;
+            }
+
+            if (shared.options.compress &&
+                !unpack(bufferBegin, msgBegin, msgSize, unpacked, queue))
+            {
+                continue;
+            }
+
+            if (shared.options.bundle &&
+                !unbundle(bufferBegin, msgBegin, msgSize, priority, queue))
+            {
+                continue;
+            }
+
+            if (queue.strayMarkers && isStrayMarker(msgBegin, msgSize, queue))
+            {
+                --queue.strayMarkers;
+                continue;
+            }
+
+            return 0;
+        }
+
+        if (errno != ETIMEDOUT)
+            return 0;
+
+        if (!outputFirst)
+            return FAIL_TIMEOUT;
+
+        if (const int rc = flushOutput(shared))
+            return rc;
+    }
+}
+
+int doReceive(Queue&          queue,
+              Shared&         shared,
+              bool            consuming,
+              const timespec *deadline = 0)
+    // Receive a message from the specified 'queue' and print the message to
+    // standard output, prefixed by the queue's handle (if '--multi') and the
+    // message's priority and length.  If the specified 'consuming' is 'true'
+    // and there are '--output-fd' workers, print it to one of them instead
+    // (see 'chooseWorker').  With '--shm', put the message in the shared
+    // memory instead, and print its offset there.  If the optionally
+    // specified 'deadline' ('CLOCK_REALTIME') is not null and passes before a
+    // message is available, return 'FAIL_TIMEOUT'.  Note that a 'deadline' in
+    // the past means "don't wait."  'doReceive' is used by both
+    // 'receiveHandler' (not 'consuming') and 'consume' ('consuming').
+{
+    // Note on the implementation: This code goes out of its way to arrange the
+    // output contiguously in memory before calling 'write'.  In part this
+    // makes the 'write' call simpler, but also it's a (perhaps unnecessary)
+    // optimization that minimizes the number of syscalls ('write' is called
+    // only once per message in the common case).
+    //
+    // The message, once received, will be printed to stdout prefixed with its
+    // priority and size, e.g. a priority-2 message containing "hello" would
+    // be written to stdout as "2 5 hello\n" (without the null terminator), or
+    // as "7 2 5 hello\n" if it came from the queue having handle 7 in
+    // '--multi' mode.  'NUMBERS_MAX_SIZE' is the maximum possible number of
+    // characters that could be necessary for the "7 2 5 " prefix.
+    //
+    // The buffer comes from the queue's receive pool, and so was allocated
+    // when the queue was opened and is not initialized here.  With
+    // '--fragment', a message that came in more than one fragment is
+    // formatted in the buffer in which it was put back together instead, and
+    // with '--compress', a compressed message is formatted in the buffer into
+    // which it was decompressed.  With '--bundle-usec', a message kept from
+    // a bundle is copied into the buffer (or, if it doesn't fit, into a
+    // buffer of its own).
+    PooledBuffer received(queue.receivePool, shared.output);
+    if (!received.buffer) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "No receive buffer is free for queue "
+                  << repr(queue.name) << '.' << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    const size_t bufferSize = receiveBufferSize(queue.msgsize);
+
+    // With '--shm', receive the message right into the shared memory if
+    // there's room, no other thread could be putting messages there, and the
+    // message needn't be decompressed.  Otherwise, it's copied there
+    // afterward (see 'shareMessage').
+    SharedMemory *const memory = shared.sharedMemory;
+    char *const         direct = memory && !shared.consumerThreadExists &&
+                                 !shared.options.compress &&
+                                 !shared.options.bundle
+                                     ? memory->reserve(queue.msgsize)
+                                     : 0;
+
+    // Which worker gets the message is chosen once it has arrived, since
+    // their backlogs may change while waiting for it.
+    const bool toWorker = consuming && !shared.workers.empty();
+
+    // With '--splice', a message that might be large enough to be spliced
+    // is received into a page-aligned buffer from the pool, if one is free,
+    // so that the pipe can take the buffer's pages as they are.  Only
+    // standard output is spliced into.
+    BufferPool *const pool =
+        shared.splicePool && !memory && !toWorker &&
+        size_t(queue.msgsize) >= shared.options.spliceBytes &&
+        size_t(queue.msgsize) < shared.splicePool->bufferSize()
+            ? shared.splicePool
+            : 0;
+    PooledBuffer pooled(pool, shared.output);
+
+    char *bufferBegin = received.buffer;
+    char *msgBegin    = direct        ? direct
+                      : pooled.buffer ? pooled.buffer
+                                      : bufferBegin + NUMBERS_MAX_SIZE;
+    std::vector<char> assembled;
+    std::vector<char> unpacked;
+    std::vector<char> spilled;
+
+    // The room available for the message itself is the full size of the buffer
+    // minus the space reserved for the prefix and for the trailing newline.
+    const size_t msgBufferSize = bufferSize - NUMBERS_MAX_SIZE - 1;
+
+    if (shared.options.debug) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "About to receive with"
+                     " bufferSize=" << bufferSize
+                  << " NUMBERS_MAX_SIZE=" << NUMBERS_MAX_SIZE
+                  << " msgBufferSize=" << msgBufferSize
+                  << " queue.msgsize=" << queue.msgsize << std::endl;     
+    }
+
+    unsigned priority;
+    ssize_t  msgSize;
+
+    // Messages kept from a bundle ('--bundle-usec') are taken before another
+    // is received.
+    const bool held = takeUnbundled(bufferBegin,
+                                    msgBegin,
+                                    msgSize,
+                                    priority,
+                                    spilled,
+                                    msgBufferSize,
+                                    queue);
+
+    if (!held) {
+        const int rc = receiveWhole(bufferBegin,
+                                    msgBegin,
+                                    msgSize,
+                                    priority,
+                                    assembled,
+                                    unpacked,
+                                    msgBufferSize,
+                                    queue,
+                                    deadline);
+        if (rc)
+            return rc;
+    }
+
+    // Handle mq_receive failure.
+    if (msgSize == -1) {
+        const int error = errno;
+        if (error == EINTR || error == EBADF) {
+            return FAIL_INTERRUPTED_OR_CLOSED;
+        }
+
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to receive message: " << strerror(error)
+                  << std::endl;
+        return FAIL_RECEIVE;
+    }
+
+    if (shared.options.debug) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "received a priority " << priority << " message of size "
+                  << msgSize << std::endl;
+    } 
+
+    assert(msgSize >= 0);
+
+    if (direct && !held) {
+        return writeSharedMessage(queue.handle,
+                                  priority,
+                                  msgSize,
+                                  memory->commit(msgSize),
+                                  shared);
+    }
+
+    if (memory)
+        return shareMessage(msgBegin, msgSize, priority, queue.handle, shared);
+
+    Output& output = toWorker ? chooseWorker(shared) : shared.output;
+
+    // A message put back together from fragments, decompressed, or kept from
+    // a bundle isn't in 'pooled'.
+    const bool splicing =
+        pooled.buffer && assembled.empty() && unpacked.empty() && !held;
+
+    if (shared.options.binary) {
+        // The binary protocol's header goes immediately before the payload
+        // (unless it's in a pooled buffer), and nothing goes after it.
+        assert(NUMBERS_MAX_SIZE >= HEADER_SIZE);
+        char *const headerBegin =
+            splicing ? bufferBegin : msgBegin - HEADER_SIZE;
+        encodeHeader(headerBegin, OP_MSG, queue.handle, priority, msgSize);
+        if (splicing) {
+            return spliceOutput(headerBegin,
+                                HEADER_SIZE,
+                                msgBegin,
+                                msgSize,
+                                pooled,
+                                shared);
+        }
+
+        return writeOutput(headerBegin, HEADER_SIZE + msgSize, output, shared);
+    }
+
+    // Put a newline character after the retrieved message.
+    msgBegin[msgSize] = '\n';
+
+    // Format the numeric prefix, "[<handle> ]<priority> <size> ", backward
+    // from the end of the room reserved for it, so that the prefix ends just
+    // before the payload.
+    char *const numbersEnd   = bufferBegin + NUMBERS_MAX_SIZE;
+    char       *numbersBegin = numbersEnd;
+    *--numbersBegin = ' ';
+    numbersBegin    = formatDecimal(numbersBegin, msgSize);
+    *--numbersBegin = ' ';
+    numbersBegin    = formatDecimal(numbersBegin, priority);
+    if (shared.options.multi) {
+        *--numbersBegin = ' ';
+        numbersBegin    = formatDecimal(numbersBegin, queue.handle);
+    }
+
+    const int numbersSize = numbersEnd - numbersBegin;
+    assert(numbersBegin >= bufferBegin);
+
+    if (shared.options.debug) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "formatted numbersSize=" << numbersSize << std::endl;
+    }
+
+    if (splicing) {
+        return spliceOutput(numbersBegin,
+                            numbersSize,
+                            msgBegin,
+                            msgSize + 1,  // and the newline character
+                            pooled,
+                            shared);
+    }
+
+    return writeOutput(numbersBegin,
+                       numbersSize +  // the prefix
+                       msgSize +  // the payload
+                       1,  // newline character
+                       output,
+                       shared);
+}
+
+int receiveHandler(Command& command, Shared& shared)
+{
+    // Assume that if receive fails, it won't be due to the queue having been
+    // closed, because only a 'close' handler would close the queue.
+    // That means that if we get 'FAIL_INTERRUPTED_OR_CLOSED', then it was due
+    // to a signal interruption, and so we should retry.
+    timespec deadline;
+    if (command.timed)
+        deadline = deadlineAfter(command.milliseconds);
+
+    // With '--bundle-usec', the message awaited might be in a bundle that
+    // would otherwise wait for the next command to be read.
+    if (shared.options.bundle) {
+        if (const int rc = sendBundles(command, shared, false))
+            return rc;
+    }
+
+    for (;;) {
+        const int rc = doReceive(*command.queue,
+                                 shared,
+                                 false,
+                                 command.timed ? &deadline : 0);
+
+        if (rc == FAIL_TIMEOUT)
+            return respond(OP_TIMEDOUT, command.handle, OP_RECEIVE, 0, shared);
+
+        if (rc != FAIL_INTERRUPTED_OR_CLOSED)
+            return rc;
+    }
+}
+
+// Signal handler for 'SIGUSR1', installed in 'consumeHandler'.
+extern "C" void noOpSignalHandler(int) {
+    // TODO: Would it be sufficient to set the 'sigaction' to ignore rather
+    //       than call this no-op function?
+}
+
+int readCredits(Command& command, bool required, Shared& shared)
+    // Load into 'command.length' the number of credits given by the "consume"
+    // or "credit" in the specified 'command', or zero if there are none.  In
+    // the text protocol, they follow the command (and its handle) on the same
+    // line, and must if the specified 'required' is 'true'; in the binary
+    // protocol, they are the header's length, which has been read already.
+    // Return zero on success, 'INCOMPLETE' if more input is not available
+    // yet, or another nonzero value otherwise.
+{
+    if (shared.options.binary)
+        return 0;
+
+    command.length = 0;
+
+    int rc = 0;
+    if (!required) {
+        // Look past spaces, but not past the end of the line, for a number.
+        char next;
+        while ((rc = command.input.peek(next)) == Input::INPUT_OK &&
+               (next == ' ' || next == '\t'))
+        {
+            command.input.ignore();
+        }
+
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+
+        if (rc == Input::INPUT_END || (!rc && (next < '0' || next > '9')))
+            return 0;  // no credits
+    }
+
+    if (!rc)
+        rc = command.input.number(command.length);
+
+    if (rc == Input::INPUT_AGAIN)
+        return INCOMPLETE;
+
+    if (rc) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to read a valid number of credits from \""
+                  << commandName(command.opcode) << "\" command."
+                  << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+void addCredits(Queue& queue, unsigned long long credits, Shared& shared)
+    // Let "consume" take the specified 'credits' more messages from the
+    // specified 'queue', and from now on take messages only while it has
+    // credits, unless 'credits' is zero.
+{
+    if (!credits)
+        return;
+
+    Lock lock(shared.stoppedMutex, shared.consumerThreadExists);
+
+    // An idle "timeout" counts only the time that "consume" could have
+    // taken a message.
+    if (!queue.credits && queue.consumeTimed)
+        queue.consumeDeadline = deadlineAfter(queue.consumeMilliseconds);
+
+    queue.credited  = true;
+    queue.credits  += credits;
+    pthread_cond_broadcast(&shared.creditCondition);
+}
+
+bool hasCredit(const Queue& queue)
+    // Return whether "consume" may take a message from the specified 'queue'
+    // now, i.e. whether it has credits or was given none.  In the threaded
+    // engine, the behavior is undefined unless 'Shared::stoppedMutex' is
+    // held.
+{
+    return !queue.credited || queue.credits;
+}
+
+int creditHandler(Command& command, Shared& shared)
+{
+    if (const int rc = readCredits(command, true, shared))
+        return rc;
+
+    addCredits(*command.queue, command.length, shared);
+    return 0;
+}
+
+extern "C" void *consume(void *data);  // defined further below
+
+int consumeHandler(Command& command, Shared& shared)
+{
+    Queue& queue = *command.queue;
+    if (const int rc = readCredits(command, false, shared))
+        return rc;
+
+    addCredits(queue, command.length, shared);
+
+    if (queue.consumerThreadExists) {
+        // A consumer thread that stopped for being idle can be replaced.
+        Lock lock(shared.stoppedMutex);
+        if (!queue.consumerIdle)
+            return 0;  // already consuming
+
+        lock.release();
+        pthread_join(queue.consumerThread, 0);
+        queue.consumerThreadExists = false;
+        queue.consumerIdle         = false;
+    }
+
+    queue.consumeTimed        = command.timed;
+    queue.consumeMilliseconds = command.milliseconds;
+
+    // Don't do anything when a 'SIGUSR1' signal is received.  'SIGUSR1' is the
+    // signal used to wake up the consumer thread (if we ever create a consumer
+    // thread) from 'mq_receive', on systems where closing the queue is not
+    // sufficient.  We can't ignore the signal (since we want it to interrupt
+    // 'mq_receive'), but we also don't want it to do anything.  So, let the
+    // handler be a no-op function ('noOpSignalHandler'). TODO: is that true?
+    struct sigaction doNothing = {};
+    doNothing.sa_handler = &noOpSignalHandler;
+    sigaction(SIGUSR1,     // signal
+              &doNothing,  // action
+              0);          // don't need old action
+
+    // Once any consumer thread exists, the main thread must lock, so set the
+    // flag before creating the thread.  If this thread can't be created, it
+    // doesn't matter that the flag is left set.
+    const bool hadConsumerThread = shared.consumerThreadExists;
+    shared.consumerThreadExists  = true;
+    queue.consumerThreadExists   = true;
+
+    const int rc = pthread_create(&queue.consumerThread,
+                                  0,         // pthread_attr_t (0 -> defaults)
+                                  &consume,  // start routine
+                                  &queue);   // argument to start routine
+    if (rc) {
+        const int error = errno;
+        queue.consumerThreadExists = false;
+        Lock lock(shared.stderrMutex, hadConsumerThread);
+        std::cerr << "Unable to create consumer thread: " << strerror(error)
+                  << std::endl;
+    }
+ 
+    return rc;
+}
+
+int countHandler(Command& command, Shared& shared)
+{
+    mq_attr attributes;
+    if (const int rc = mq_getattr(command.queue->descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to get queue attributes to query message count: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    return respond(OP_COUNTED,
+                   command.handle,
+                   0,
+                   attributes.mq_curmsgs,
+                   shared);
+}
+
+int msgsizeHandler(Command& command, Shared& shared)
+{
+    mq_attr attributes;
+    if (const int rc = mq_getattr(command.queue->descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to get queue attributes to report msgsize: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    return respond(OP_MSGSIZED,
+                   command.handle,
+                   0,
+                   attributes.mq_msgsize,
+                   shared);
+}
+
+int maxmsgHandler(Command& command, Shared& shared)
+{
+    mq_attr attributes;
+    if (const int rc = mq_getattr(command.queue->descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Unable to get queue attributes to report maxmsg: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    return respond(OP_MAXMSGED,
+                   command.handle,
+                   0,
+                   attributes.mq_maxmsg,
+                   shared);
+}
+
+int statsHandler(Command&, Shared& shared)
+    // Write out the counters and histograms of 'shared.stats' as one
+    // response.  In the text protocol, it's "stats" followed by the
+    // "<name>=<value>" pairs on one line; in the binary protocol, the pairs
+    // are the payload, and the header's length is theirs.  The response has
+    // no queue handle, because the statistics are of the whole process
+    // (except for the compression of each queue, with '--compress').
+{
+    std::string response;
+    try {
+        std::string line;
+        shared.stats.format(line);
+
+        // With '--compress', also say how much smaller each queue's
+        // messages have been sent, as "compression.<handle>=<packed>/<raw>".
+        for (size_t i = 0; shared.options.compress && i < shared.queues.size();
+             ++i)
+        {
+            const Queue *const queue = shared.queues[i];
+            if (!queue)
+                continue;
+
+            char field[80];
+            snprintf(field, sizeof field, " compression.%u=%llu/%llu",
+                     queue->handle,
+                     __atomic_load_n(&queue->packedBytes, __ATOMIC_RELAXED),
+                     __atomic_load_n(&queue->payloadBytes, __ATOMIC_RELAXED));
+            line += field;
+        }
+
+        if (shared.options.binary) {
+            char header[HEADER_SIZE];
+            encodeHeader(header, OP_STATSED, 0, 0, line.size());
+            response.assign(header, sizeof header);
+            response += line;
+        }
+        else {
+            response = "stats ";
+            response += line;
+            response += '\n';
+        }
+    }
+    catch (const std::bad_alloc&) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to allocate memory for statistics." << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    return writeOutput(response.data(), response.size(), shared);
+}
+
+// "probe" gives up on a marker that it can't send, or that doesn't come
+// back, within this long.
+const unsigned PROBE_TIMEOUT_MILLISECONDS = 1000;
+
+int putBackUnbundled(Queue& queue)
+    // Send the messages kept from bundles received from the specified
+    // 'queue' (see 'unbundle'), or passed over by "probe", that no "receive"
+    // or "consume" took back to the queue at their priorities (as bundles,
+    // with '--bundle-usec'), without waiting for room.  Use a descriptor of
+    // their own, since "close" has closed the queue's by then, and it might
+    // not have been open for writing, or might block.  Return zero on
+    // success, or say how many messages were lost and return a nonzero value
+    // otherwise.  The behavior is undefined if any other thread is using
+    // 'queue'.
+{
+    if (queue.unbundling.empty())
+        return 0;
+
+    Shared&     shared     = queue.shared;
+    const mqd_t descriptor = mq_open(queue.name.c_str(),
+                                     O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    int         error      = descriptor == mqd_t(-1) ? errno : 0;
+
+    const mqd_t closed = queue.descriptor;
+    queue.descriptor   = descriptor;
+    while (!error && !queue.unbundling.empty()) {
+        const Unbundling& rest = queue.unbundling.front();
+        const char *const end  = &rest.messages[0] + rest.messages.size();
+        const char       *data = &rest.messages[0] + rest.offset;
+        size_t            size = end - data;
+
+        // Without '--bundle-usec', only "probe" keeps messages, as bundles of
+        // one, and they go back as they came.
+        if (!shared.options.bundle)
+            decodeBundleHeader(size, data, end);
+
+        if (sendToQueue(queue,
+                        data,
+                        size,
+                        rest.priority,
+                        0))  // no timeout, but the queue is nonblocking
+        {
+            error = errno;
+            break;
+        }
+
+        queue.unbundling.pop_front();
+    }
+    queue.descriptor = closed;
+
+    if (descriptor != mqd_t(-1))
+        mq_close(descriptor);
+
+    if (!error)
+        return 0;
+
+    size_t lost = 0;
+    for (size_t i = 0; i < queue.unbundling.size(); ++i) {
+        const Unbundling& rest = queue.unbundling[i];
+        const char *const end  = &rest.messages[0] + rest.messages.size();
+        const char       *next = &rest.messages[0] + rest.offset;
+        for (size_t size = 0;
+             next != end && !decodeBundleHeader(size, next, end);
+             next += size)
+        {
+            ++lost;
+        }
+    }
+    queue.unbundling.clear();
+
+    Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+    std::cerr << "Discarded " << lost << " message(s) kept from bundles "
+                 "received from queue " << repr(queue.name) << ", since "
+                 "they can't be put back: " << strerror(error) << std::endl;
+    return 1;
+}
+
+void holdMessage(Queue&      queue,
+                 size_t      position,
+                 unsigned    priority,
+                 const char *data,
+                 size_t      size)
+    // Keep the specified 'size' bytes at the specified 'data' as a message
+    // having the specified 'priority', to be put back in the specified
+    // 'queue' (see 'putBackUnbundled') after the specified 'position'
+    // messages or bundles already kept, and before any others.
+{
+    Lock lock(queue.unbundlingMutex, queue.shared.consumerThreadExists);
+    Unbundling& held = *queue.unbundling.insert(
+                                       queue.unbundling.begin() + position,
+                                       Unbundling());
+
+    held.priority = priority;
+    held.messages.resize(MAX_BUNDLE_HEADER_SIZE + size);
+    char *const begin = &held.messages[0];
+    char *const end   = encodeBundleHeader(begin, size);
+    std::copy(data, data + size, end);
+    held.messages.resize(end - begin + size);
+    held.offset = 0;
+}
+
+int awaitMarker(Queue&              queue,
+                unsigned long long  sequence,
+                Stats&              probeStats,
+                bool&               arrived,
+                bool&               passedOver)
+    // Receive from the specified 'queue' until the marker that "probe" sent
+    // having the specified 'sequence' arrives, and then count the time it
+    // took in the specified 'probeStats' and in those of the process, and
+    // set the specified 'arrived' to 'true'.  Discard other markers, and
+    // keep any other message (see 'holdMessage') to be put back, setting the
+    // specified 'passedOver' to 'true'.  If the marker hasn't arrived after
+    // 'PROBE_TIMEOUT_MILLISECONDS', then set 'arrived' to 'false'.  Return
+    // zero on success or a nonzero value otherwise.
+{
+    Shared& shared = queue.shared;
+    arrived = false;
+
+    PooledBuffer received(queue.receivePool, shared.output);
+    if (!received.buffer) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "No receive buffer is free for queue "
+                  << repr(queue.name) << '.' << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    const size_t   room     = receiveBufferSize(queue.msgsize) -
+                              NUMBERS_MAX_SIZE - 1;
+    const timespec deadline = deadlineAfter(PROBE_TIMEOUT_MILLISECONDS);
+    const unsigned long long processId = getpid();
+
+    for (;;) {
+        char              *bufferBegin = received.buffer;
+        char              *msgBegin    = bufferBegin + NUMBERS_MAX_SIZE;
+        std::vector<char>  assembled;
+        std::vector<char>  unpacked;
+        unsigned           priority;
+        ssize_t            msgSize;
+
+        // A message passed over goes before the rest of its bundle.
+        size_t heldBefore;
+        {
+            Lock lock(queue.unbundlingMutex, shared.consumerThreadExists);
+            heldBefore = queue.unbundling.size();
+        }
+
+        switch (const int rc = receiveWhole(bufferBegin,
+                                            msgBegin,
+                                            msgSize,
+                                            priority,
+                                            assembled,
+                                            unpacked,
+                                            room,
+                                            queue,
+                                            &deadline)) {
+          case 0:
+            break;
+          case FAIL_TIMEOUT:
+            return 0;
+          default:
+            return rc;
+        }
+
+        if (msgSize == -1) {
+            const int error = errno;
+            if (error == EINTR)
+                continue;
+
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Failed to receive a \"probe\" marker: "
+                      << strerror(error) << std::endl;
+            return FAIL_RECEIVE;
+        }
+
+        if (size_t(msgSize) != PROBE_MARKER_SIZE ||
+            memcmp(msgBegin, PROBE_MAGIC, sizeof PROBE_MAGIC))
+        {
+            holdMessage(queue, heldBefore, priority, msgBegin, msgSize);
+            passedOver = true;
+            continue;
+        }
+
+        unsigned long long fields[3];  // process, sequence, time sent
+        memcpy(fields, msgBegin + sizeof PROBE_MAGIC, sizeof fields);
+        if (fields[0] != processId || fields[1] != sequence)
+            continue;  // another's
+
+        probeStats.record(Stats::TRANSIT, (long long)(fields[2]));
+        shared.stats.record(Stats::TRANSIT, (long long)(fields[2]));
+        arrived = true;
+        return 0;
+    }
+}
+
+int probeHandler(Command& command, Shared& shared)
+    // Send the number of markers given by the specified 'command' through
+    // its queue at the highest priority, one at a time, receiving each back
+    // before sending the next, and write out how many were sent and came
+    // back, how long they took to pass through the queue, and how long the
+    // whole command took.  In the text protocol, the response is "probe"
+    // (and the handle, if '--multi') followed by "<name>=<value>" pairs on
+    // one line; in the binary protocol, the pairs are the payload, and the
+    // header's length is theirs.  A marker is sent and received as any other
+    // message is (e.g. compressed, with '--compress'), and its transit time
+    // is measured with 'CLOCK_MONOTONIC' from just before it's sent until
+    // it's received, so it doesn't include standard input and output.  If
+    // the queue can't be probed, or other messages arrive in the meantime
+    // (which are put back), then the response is "refused" and the reason
+    // instead of the pairs (in the binary protocol, it has priority 1, and
+    // the reason is the payload).  Return zero on success, including then,
+    // or a nonzero value otherwise.
+{
+    const long long startedAt = Stats::now();
+
+    unsigned count;
+    if (const int rc = readCount(count, command, shared))
+        return rc;
+
+    Queue&  queue = *command.queue;
+    mq_attr attributes;
+    if (mq_getattr(queue.descriptor, &attributes)) {
+        const int error = errno;
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to get the attributes of queue "
+                  << repr(queue.name) << ": " << strerror(error) << std::endl;
+        return 1;
+    }
+
+    // The reactor would have to stop serving everything else to wait for a
+    // marker, so it doesn't probe.
+    const char *refusal =
+        shared.options.reactor
+            ? "reactor"
+        : !queue.receivePool || !queue.openForWriting
+            ? "access"
+        : queue.consumerThreadExists || queue.consuming
+            ? "consuming"
+        : queue.partlySent || (queue.pending && queue.pending->bytes())
+            ? "pending"
+        : attributes.mq_curmsgs || !queue.unbundling.empty()
+            ? "nonempty"
+        : queue.maxPayloadSize < PROBE_MARKER_SIZE
+            ? "msgsize"
+            : 0;
+
+    // With '--bundle-usec', each marker is a bundle of its own.
+    char        marker[MAX_BUNDLE_HEADER_SIZE + PROBE_MARKER_SIZE];
+    char *const body = shared.options.bundle
+                           ? encodeBundleHeader(marker, PROBE_MARKER_SIZE)
+                           : marker;
+    memcpy(body, PROBE_MAGIC, sizeof PROBE_MAGIC);
+
+    Command probe(command);
+    probe.payload  = marker;
+    probe.length   = body + PROBE_MARKER_SIZE - marker;
+    probe.priority = sysconf(_SC_MQ_PRIO_MAX) - 1;
+
+    Stats    probeStats;
+    unsigned sent    = 0;
+    unsigned arrived = 0;
+    for (; !refusal && sent < count; ++sent) {
+        const unsigned long long sequence  = queue.probeMarkers;
+        const unsigned long long fields[3] = {
+            (unsigned long long)(getpid()),
+            sequence,
+            (unsigned long long)(Stats::now())
+        };
+        memcpy(body + sizeof PROBE_MAGIC, fields, sizeof fields);
+
+        const timespec deadline = deadlineAfter(PROBE_TIMEOUT_MILLISECONDS);
+        const int      rc       =
+            sendMessage(probe, "probe", shared, &deadline);
+        if (rc == FAIL_TIMEOUT)
+            break;  // the queue stayed full
+
+        if (rc)
+            return rc;
+
+        // A marker given up on is discarded if it arrives later.
+        bool      came;
+        bool      passedOver  = false;
+        const int awaitResult = awaitMarker(queue,
+                                            sequence,
+                                            probeStats,
+                                            came,
+                                            passedOver);
+        queue.strayMarkers += !came;
+        ++queue.probeMarkers;
+
+        if (awaitResult || passedOver) {
+            const int putBackResult = putBackUnbundled(queue);
+            if (awaitResult || putBackResult)
+                return awaitResult ? awaitResult : putBackResult;
+
+            refusal = "traffic";
+        }
+
+        arrived += came;
+    }
+
+    std::string response;
+    try {
+        std::string line;
+        if (refusal) {
+            line = refusal;
+        }
+        else {
+            char field[80];
+            snprintf(field, sizeof field, "sent=%u received=%u transit_ns=",
+                     sent,
+                     arrived);
+            line = field;
+            probeStats.formatHistogram(line, Stats::TRANSIT);
+            snprintf(field, sizeof field, " elapsed_ns=%lld",
+                     Stats::now() - startedAt);
+            line += field;
+        }
+
+        if (shared.options.binary) {
+            char header[HEADER_SIZE];
+            encodeHeader(header,
+                         OP_PROBED,
+                         command.handle,
+                         refusal != 0,
+                         line.size());
+            response.assign(header, sizeof header);
+            response += line;
+        }
+        else {
+            response = "probe ";
+            if (shared.options.multi) {
+                char handle[16];
+                snprintf(handle, sizeof handle, "%u ", command.handle);
+                response += handle;
+            }
+            if (refusal)
+                response += "refused ";
+            response += line;
+            response += '\n';
+        }
+    }
+    catch (const std::bad_alloc&) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "Failed to allocate memory for \"probe\" response."
+                  << std::endl;
+        return FAIL_ALLOC;
+    }
+
+    return writeOutput(response.data(), response.size(), shared);
+}
+
+int openDescriptor(OpenedQueue&     opened,
+                   const Options&   options,
+                   pthread_mutex_t& stderrMutex,
+                   bool             locking)
+    // Open the message queue named by the specified 'options', as they
+    // specify, and load its descriptor and attributes into the specified
+    // 'opened'.  Hold the specified 'stderrMutex' while writing to standard
+    // error if the specified 'locking' is 'true'.  Return zero on success or
+    // a nonzero value otherwise.
+{
+    const mqd_t descriptor = openQueue(options);
+    if (descriptor == mqd_t(-1)) {
+        const int error = errno;
+        Lock lock(stderrMutex, locking);
+        std::cerr << "Unable to open queue named " << repr(options.queueName)
+                  << ": " << strerror(error) << std::endl;
+        return error;
+    }
+
+    mq_attr attributes;
+    if (const int rc = mq_getattr(descriptor, &attributes)) {
+        const int error = errno;
+        mq_close(descriptor);
+        Lock lock(stderrMutex, locking);
+        std::cerr << "Unable to get queue attributes initially: "
+                  << strerror(error) << std::endl;
+        return rc;
+    }
+
+    if (options.debug) {
+        Lock lock(stderrMutex, locking);
+        std::cerr << "Got the following attributes for message queue "
+                  << repr(options.queueName) << ": "
+                     " mq_maxmsg="  << attributes.mq_maxmsg
+                  << " mq_msgsize=" << attributes.mq_msgsize
+                  << " mq_curmsgs=" << attributes.mq_curmsgs << std::endl;
+    }
+
+    opened.descriptor = descriptor;
+    opened.attributes = attributes;
+    return 0;
+}
+
+int openHandle(unsigned           handle,
+               const Options&     options,
+               Shared&            shared,
+               const OpenedQueue *alreadyOpened = 0)
+    // Open the message queue named by the specified 'options', as they
+    // specify, and serve it as the specified 'handle'.  If the optionally
+    // specified 'alreadyOpened' is not null, serve the queue it has opened
+    // instead, as though 'options' had just opened it.  Return zero on
+    // success or a nonzero value otherwise.
+{
+    if (findQueue(shared, handle)) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "A queue is already open having handle " << handle
+                  << '.' << std::endl;
+        return 1;
+    }
+
+    OpenedQueue opened;
+    if (alreadyOpened)
+        opened = *alreadyOpened;
+    else if (const int rc = openDescriptor(opened,
+                                           options,
+                                           shared.stderrMutex,
+                                           shared.consumerThreadExists))
+    {
+        return rc;
+    }
+
+    const mqd_t    descriptor = opened.descriptor;
+    const mq_attr& attributes = opened.attributes;
+
+    // With '--shm', every message received must fit in the ring.
+    if (shared.sharedMemory && options.operation != Options::WRITE_ONLY &&
+        size_t(attributes.mq_msgsize) > shared.sharedMemory->ringCapacity())
+    {
+        mq_close(descriptor);
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The maximum message size of queue "
+                  << repr(options.queueName) << ", " << attributes.mq_msgsize
+                  << " bytes, is larger than the shared memory ring, which "
+                     "holds at most " << shared.sharedMemory->ringCapacity()
+                  << " bytes." << std::endl;
+        return 1;
+    }
+
+    // With '--fragment', every message has a fragment header and some of
+    // the message.
+    if (options.fragmentBytes &&
+        size_t(attributes.mq_msgsize) <= FRAGMENT_HEADER_SIZE)
+    {
+        mq_close(descriptor);
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The maximum message size of queue "
+                  << repr(options.queueName) << ", " << attributes.mq_msgsize
+                  << " bytes, leaves no room for fragments, which have a "
+                  << FRAGMENT_HEADER_SIZE << " byte header." << std::endl;
+        return 1;
+    }
+
+    // With '--compress', the byte that says whether a message is compressed
+    // is part of what's sent (and fragmented).
+    const size_t maxSentSize    = options.fragmentBytes
+                                ? options.fragmentBytes
+                                : attributes.mq_msgsize;
+    const size_t maxMessageSize = maxSentSize - options.compress;
+
+    if (handle >= shared.queues.size())
+        shared.queues.resize(handle + 1);
+
+    // With '--spool' but without '--pending', only the disk limits it.
+    const bool keepsPending =
+        (options.pendingBytes || !options.spoolDirectory.empty()) &&
+        options.operation != Options::READ_ONLY;
+    Pending *const pending =
+        keepsPending
+            ? new Pending(options.pendingBytes
+                              ? options.pendingBytes
+                              : std::numeric_limits<size_t>::max(),
+                          maxMessageSize,
+                          options.spoolDirectory.empty()
+                              ? 0
+                              : new Spool(options.spoolDirectory,
+                                          maxMessageSize))
+            : 0;
+
+    BufferPool *const receivePool =
+        options.operation != Options::WRITE_ONLY
+            ? new BufferPool(receiveBufferSize(attributes.mq_msgsize),
+                             RECEIVE_BUFFERS,
+                             options.hugePages)
+            : 0;
+
+    Reassembler *const reassembler =
+        options.fragmentBytes && options.operation != Options::WRITE_ONLY
+            ? new Reassembler(NUMBERS_MAX_SIZE,  // room for the prefix
+                              1,                 // and for a newline
+                              maxSentSize,
+                              MAX_PARTIAL_MESSAGES)
+            : 0;
+
+    shared.queues[handle] = new Queue(handle,
+                                      options.queueName,
+                                      descriptor,
+                                      attributes.mq_msgsize,
+                                      options.fragmentBytes,
+                                      options.compress,
+                                      options.bundle,
+                                      options.operation !=
+                                          Options::READ_ONLY,
+                                      pending,
+                                      receivePool,
+                                      reassembler,
+                                      shared);
+    return 0;
+}
+
+// Bits of the flags of an "open" command in the binary protocol.  In the text
+// protocol, they are the letters 'r', 'w', 'o', and 'c', respectively.
+const unsigned OPEN_FLAG_READ   = 1,  // as '--read'
+               OPEN_FLAG_WRITE  = 2,  // as '--write'
+               OPEN_FLAG_OPEN   = 4,  // as '--open'
+               OPEN_FLAG_CREATE = 8;  // as '--create'
+
+int openHandler(Command& command, Shared& shared)
+    // Open another queue as the handle in the specified 'command'.  In the
+    // text protocol, the queue's name and flags follow the handle, e.g.
+    // "open 3 /jobs rwo"; in the binary protocol, the name is the payload and
+    // the flags are the priority.  The flags work like their command line
+    // counterparts, and the rest of the options are from the command line.
+{
+    if (!shared.options.multi) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The \"open\" command requires --multi." << std::endl;
+        return 1;
+    }
+
+    std::string name;
+    unsigned    flags = 0;
+    if (shared.options.binary) {
+        const char *nameBegin;
+        int         rc = 0;
+        if (command.length > NAME_MAX ||
+            (rc = command.input.bytes(nameBegin, command.length)))
+        {
+            if (rc == Input::INPUT_AGAIN)
+                return INCOMPLETE;
+
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read the " << command.length << " byte "
+                         "queue name from \"open\" command." << std::endl;
+            return 1;
+        }
+
+        name.assign(nameBegin, command.length);
+        flags = command.priority;
+    }
+    else {
+        const char *begin;
+        size_t      size;
+        int         rc = command.input.token(begin, size);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+        if (rc) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read the queue name from \"open\" "
+                         "command." << std::endl;
+            return 1;
+        }
+
+        name.assign(begin, size);  // before 'begin' is invalidated
+
+        rc = command.input.token(begin, size);
+        if (rc == Input::INPUT_AGAIN)
+            return INCOMPLETE;
+        for (const char *letter = begin; !rc && letter != begin + size;
+             ++letter)
+        {
+            switch (*letter) {
+              case 'r': flags |= OPEN_FLAG_READ;   break;
+              case 'w': flags |= OPEN_FLAG_WRITE;  break;
+              case 'o': flags |= OPEN_FLAG_OPEN;   break;
+              case 'c': flags |= OPEN_FLAG_CREATE; break;
+              default: rc = Input::INPUT_INVALID;
+            }
+        }
+        if (rc) {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to read valid flags from \"open\" command."
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    const bool read   = flags & OPEN_FLAG_READ,
+               write  = flags & OPEN_FLAG_WRITE,
+               open   = flags & OPEN_FLAG_OPEN,
+               create = flags & OPEN_FLAG_CREATE;
+    if (!(read || write) || !(open || create)) {
+        Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+        std::cerr << "The flags of \"open\" command must include read and/or "
+                     "write, and open and/or create." << std::endl;
+        return 1;
+    }
+
+    Options options(shared.options);
+    options.queueName = name;
+    options.operation = read && write ? Options::READ_WRITE
+                                      : read ? Options::READ_ONLY
+                                             : Options::WRITE_ONLY;
+    options.open      = open && create ? Options::OPEN_CREATE
+                                       : open ? Options::OPEN_ONLY
+                                              : Options::CREATE_ONLY;
+
+    if (const int rc = openHandle(command.handle, options, shared))
+        return rc;
+
+    return respond(OP_OPENED, command.handle, 0, 0, shared);
+}
+
+int closeHandler(Command& command, Shared& shared)
+{
+    // Send the bundles first, since they might become pending messages.
+    int result = shared.options.bundle ? sendBundles(command, shared, false)
+                                       : 0;
+
+    // With a "timeout", pending messages are sent only until it passes.  A
+    // sender thread that's already waiting for room is woken up with
+    // 'SIGUSR1' (see 'consumeHandler') to see the deadline, and again every
+    // so often in case it was about to wait when the first signal came.
+    const bool     timed    = command.opcode == OP_CLOSE && command.timed;
+    const timespec deadline = deadlineAfter(command.milliseconds);
+    if (timed) {
+        struct sigaction doNothing = {};
+        doNothing.sa_handler = &noOpSignalHandler;
+        sigaction(SIGUSR1, &doNothing, 0);
+    }
+
+    Lock stoppedLock(shared.stoppedMutex, shared.consumerThreadExists);
+
+    shared.stopped = true;
+    pthread_cond_broadcast(&shared.creditCondition);  // no more are coming
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue)
+            continue;
+
+        if (queue->senderThreadExists) {
+            // Send whatever is still pending before closing the queue.
+            queue->pending->close();
+            void *failed = 0;
+            if (timed) {
+                queue->drainDeadline = deadline;
+                __atomic_store_n(&queue->drainTimed, true, __ATOMIC_RELEASE);
+                timespec retry = deadline;
+                for (;;) {
+                    pthread_kill(queue->senderThread, SIGUSR1);
+                    if (pthread_timedjoin_np(queue->senderThread,
+                                             &failed,
+                                             &retry) != ETIMEDOUT)
+                    {
+                        break;
+                    }
+
+                    retry = deadlineAfter(10);
+                }
+            }
+            else {
+                pthread_join(queue->senderThread, &failed);
+            }
+            queue->senderThreadExists = false;
+            if (failed && !result)
+                result = 1;  // already reported
+        }
+
+        if (const int rc = mq_close(queue->descriptor)) {
+            const int error = errno;
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to close the message queue "
+                      << repr(queue->name) << ": " << strerror(error)
+                      << std::endl;
+            if (!result)
+                result = rc;
+        }
+
+        if (queue->consumerThreadExists) {
+            pthread_kill(queue->consumerThread, SIGUSR1);  // and ignore rcode
+        }
+    }
+
+    return result;
+}
+
+// --------------
+// thread drivers
+// --------------
+
+void tuneThread(const char *thread, int cpu, int priority, Shared& shared)
+    // Pin the calling thread, called the specified 'thread' in diagnostics,
+    // to the specified 'cpu' unless it is -1, and give it the 'SCHED_FIFO'
+    // scheduling policy at the specified 'priority' unless it is zero.  Say
+    // so on standard error if either is not permitted, but carry on without.
+{
+    if (cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (const int error = pthread_setaffinity_np(pthread_self(),
+                                                     sizeof cpus,
+                                                     &cpus))
+        {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to run the " << thread << " on CPU " << cpu
+                      << ": " << strerror(error) << std::endl;
+        }
+    }
+
+    if (priority) {
+        sched_param parameters = {};
+        parameters.sched_priority = priority;
+        if (const int error = pthread_setschedparam(pthread_self(),
+                                                    SCHED_FIFO,
+                                                    &parameters))
+        {
+            Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+            std::cerr << "Unable to run the " << thread
+                      << " with realtime priority " << priority << ": "
+                      << strerror(error) << std::endl;
+        }
+    }
+}
+
+int pollReceive(Queue& queue, Shared& shared, const timespec *deadline)
+    // Receive a message from the specified 'queue' for "consume", as
+    // 'doReceive' does, but without waiting in 'mq_receive' for one to
+    // arrive: try again and again until one has, sleeping '--busy-poll'
+    // microseconds in between, or with zero, only letting other threads on
+    // the CPU run.  Return 'FAIL_TIMEOUT' if the specified 'deadline'
+    // ('CLOCK_REALTIME') is not null and passes first, or
+    // 'FAIL_INTERRUPTED_OR_CLOSED' if "close" is issued first.
+{
+    const long     microseconds = shared.options.busyPollMicroseconds;
+    const timespec backoff      = { microseconds / 1000000,
+                                    microseconds % 1000000 * 1000 };
+
+    for (;;) {
+        const int rc = doReceive(queue, shared, true, &DONT_WAIT);
+        if (rc != FAIL_TIMEOUT)
+            return rc;
+
+        if (deadline) {
+            timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (!isBefore(now, *deadline))
+                return FAIL_TIMEOUT;
+        }
+
+        {
+            Lock lock(shared.stoppedMutex);
+            if (shared.stopped)
+                return FAIL_INTERRUPTED_OR_CLOSED;
+        }
+
+        if (microseconds)
+            nanosleep(&backoff, 0);
+        else
+            sched_yield();
+    }
+}
+
+void *consume(void *data)
+    // Receive messages from a POSIX message queue and print the messages to
+    // standard output (or to the '--output-fd' workers), each prefixed by its
+    // priority and length.  'data' must be a pointer to the 'Queue' object.
+{
+    Queue&  queue  = *static_cast<Queue*>(data);
+    Shared& shared = queue.shared;
+
+    // The thread otherwise has whatever '--cpu' and '--realtime' gave the
+    // thread that started it.
+    tuneThread("consumer thread", shared.options.consumerCpu, 0, shared);
+
+    for (;;) {
+        // With credits, wait for one before taking any message, so that
+        // messages stay in the queue (in priority order) until the user is
+        // ready for them, and take no more than there are credits.
+        unsigned long long allowed = shared.options.batch;
+        {
+            Lock lock(shared.stoppedMutex);
+            while (!hasCredit(queue) && !shared.stopped) {
+                pthread_cond_wait(&shared.creditCondition,
+                                  &shared.stoppedMutex);
+            }
+
+            if (!hasCredit(queue)) {
+                // "close" was issued.
+                lock.release();
+                flushOutput(shared);  // failure is reported
+                return 0;
+            }
+
+            if (queue.credited && queue.credits < allowed)
+                allowed = queue.credits;
+        }
+
+        // Wait for a message (with '--busy-poll', by polling), and then take
+        // those already behind it in the queue, up to the batch limit,
+        // without waiting.  Write out the batch once the queue is empty or
+        // the limit is reached.  With a "timeout", stop if no message
+        // arrives in time.
+        timespec idleDeadline;
+        if (queue.consumeTimed)
+            idleDeadline = deadlineAfter(queue.consumeMilliseconds);
+
+        const timespec *const idle = queue.consumeTimed ? &idleDeadline : 0;
+
+        int rc = shared.options.busyPoll
+                     ? pollReceive(queue, shared, idle)
+                     : doReceive(queue, shared, true, idle);
+        if (rc == FAIL_TIMEOUT) {
+            rc = respond(OP_TIMEDOUT, queue.handle, OP_CONSUME, 0, shared);
+            flushOutput(shared);  // failure is reported
+
+            Lock lock(shared.stoppedMutex);
+            queue.consumerIdle = true;
+            return rc ? data : 0;
+        }
+
+        unsigned long long received = rc == 0;
+        while (rc == 0 && received < allowed) {
+            rc = doReceive(queue, shared, true, &DONT_WAIT);
+            received += rc == 0;
+        }
+
+        if (received) {
+            Lock lock(shared.stoppedMutex);
+            if (queue.credited)
+                queue.credits -= std::min(received, queue.credits);
+        }
+
+        if (rc == 0 || rc == FAIL_TIMEOUT)
+            rc = flushOutput(shared);
+
+        if (rc == FAIL_INTERRUPTED_OR_CLOSED) {
+            Lock lock(shared.stoppedMutex);
+            if (shared.stopped) {
+                flushOutput(shared);  // failure is reported
+                if (shared.options.debug) {
+                    Lock lock(shared.stderrMutex);
+                    std::cerr << "Consumer thread is finishing." << std::endl;
+                }
+                return 0;  // we're done
+            }
+
+            // otherwise, go around again
+        }
+        else if (rc) {
+            flushOutput(shared);  // failure is reported
+            return data;  // an error occurred (reported in 'doReceive').
+                          // Return 'data' just because it's non-zero.
+        }
+    }
+}
+
+void *sendPending(void *data)
+    // Send the pending messages of a queue, in order (or, with '--spool', in
+    // priority order), waiting for room in the queue as necessary, until its
+    // pending messages are closed and none remain.  Write out "ready"
+    // whenever they are no longer busy.  'data' must be a pointer to the
+    // 'Queue' object.
+{
+    Queue&      queue  = *static_cast<Queue*>(data);
+    Shared&     shared = queue.shared;
+    std::string buffer;
+
+    try {
+        buffer.resize(queue.maxMessageSize);
+    }
+    catch (const std::bad_alloc&) {
+        queue.pending->close();
+        Lock lock(shared.stderrMutex);
+        std::cerr << "Failed to allocate memory for sending pending messages."
+                  << std::endl;
+        return data;
+    }
+
+    for (;;) {
+        unsigned priority;
+        size_t   size;
+        const int rc = queue.pending->take(priority, &buffer[0], size, 0);
+        if (rc == Pending::PENDING_CLOSED)
+            return 0;  // we're done
+
+        for (;;) {
+            // Once "close" has a "timeout", wait for room only until then.
+            const timespec *const deadline =
+                __atomic_load_n(&queue.drainTimed, __ATOMIC_ACQUIRE)
+                    ? &queue.drainDeadline
+                    : 0;
+            if (!sendToQueue(queue, &buffer[0], size, priority, deadline))
+                break;
+
+            const int error = errno;
+            if (error == EINTR)
+                continue;
+
+            if (error == ETIMEDOUT && deadline) {
+                reportUnsent(queue, shared);
+                return data;
+            }
+
+            queue.pending->close();  // so that nothing more is kept
+            Lock lock(shared.stderrMutex);
+            std::cerr << "Unable to send pending message: " << strerror(error)
+                      << std::endl;
+            return data;  // an error occurred. Return 'data' just because
+                          // it's non-zero.
+        }
+
+        if (queue.pending->pop() == Pending::PENDING_READY) {
+            // Let the user know right away.
+            if (respond(OP_READY, queue.handle, 0, 0, shared) ||
+                flushOutput(shared))
+            {
+                queue.pending->close();
+                return data;  // failure is reported
+            }
+        }
+    }
+}
+
+int reportUnknownCommand(const Command& command, Shared& shared)
+    // Report to stderr that the specified 'command' is not recognized, and
+    // return a nonzero value.
+{
+    Lock lock(shared.stderrMutex, shared.consumerThreadExists);
+    if (shared.options.binary)
+        std::cerr << "Unknown command opcode " << command.opcode;
+    else
+        std::cerr << "Unknown command "
+                  << repr(std::string(command.name, command.nameSize));
+    std::cerr << std::endl;
+    return 1;
+}
+
+int handleCommands(Command& command, Shared& shared)
+    // Read commands from standard input and handle each in turn, blocking as
+    // necessary, until "close", the end of input, or an error.  Return zero
+    // on success or a nonzero value otherwise.
+{
+    for (;;) {
+        const int readResult = readCommand(command, shared);
+        if (readResult == READ_EOF)
+            return 0;
+
+        if (readResult == READ_ERROR)
+            return readResult;
+
+        int rc;
+        switch (command.opcode) {
+          case OP_SEND:    rc = sendHandler(command, shared);    break;
+          case OP_SENDV:   rc = sendvHandler(command, shared);   break;
+          case OP_RECEIVE: rc = receiveHandler(command, shared); break;
+          case OP_CONSUME: rc = consumeHandler(command, shared); break;
+          case OP_COUNT:   rc = countHandler(command, shared);   break;
+          case OP_MSGSIZE: rc = msgsizeHandler(command, shared); break;
+          case OP_MAXMSG:  rc = maxmsgHandler(command, shared);  break;
+          case OP_OPEN:    rc = openHandler(command, shared);    break;
+          case OP_STATS:   rc = statsHandler(command, shared);   break;
+          case OP_CREDIT:  rc = creditHandler(command, shared);  break;
+          case OP_PROBE:   rc = probeHandler(command, shared);   break;
+          case OP_CLOSE:
+            return 0;  // "close" is handled at the end.
+          default:
+            return reportUnknownCommand(command, shared);
+        }
+
+        if (rc)
+            return rc;
+    }
+}
+
+// -------
+// reactor
+// -------
+
+// With the '--reactor' option, 'mq' runs on one thread that waits with
+// 'epoll' for standard input, standard output, and the message queues
+// themselves (on Linux, an 'mqd_t' is a file descriptor), rather than on a
+// main thread that blocks on each command plus a consumer thread per queue
+// that blocks in 'mq_receive'.  No mutex or signal is needed, a full queue
+// doesn't hold up "consume" output, and shutdown is deterministic: after
+// "close" (or the end of input) nothing more is received, and 'mq' returns
+// once all of its output is written.
+
+const size_t MAX_OUTPUT_BACKLOG = 1 << 20;
+    // Stop reading commands and receiving messages while at least this many
+    // bytes of output are waiting for standard output to become writable.
+    // In the threaded engine, this is how much a writer thread may fall
+    // behind before the threads writing to it wait.
+
+// The signals that end 'mq' by default and can be caught, after which
+// 'NonblockingGuard' must still restore the flags that it changed.
+const int TERMINATING_SIGNALS[] = { SIGHUP, SIGINT, SIGPIPE, SIGTERM };
+const size_t NUM_TERMINATING_SIGNALS =
+    sizeof TERMINATING_SIGNALS / sizeof TERMINATING_SIGNALS[0];
+
+// The descriptors of the 'NonblockingGuard' that exists, if any, and their
+// original flags, for 'restoreFlagsAndDie'.
+const int *guardedFds    = 0;
+const int *guardedFlags  = 0;
+size_t     guardedCount  = 0;
+
+extern "C" void restoreFlagsAndDie(int signal)
+    // Restore the original flags of the guarded descriptors, and then end
+    // the process with the specified 'signal', as if it weren't caught.
+{
+    for (size_t i = 0; i < guardedCount; ++i) {
+        if (guardedFlags[i] != -1)
+            fcntl(guardedFds[i], F_SETFL, guardedFlags[i]);
+    }
+
+    struct sigaction defaultAction = {};
+    defaultAction.sa_handler = SIG_DFL;
+    sigaction(signal, &defaultAction, 0);
+    raise(signal);
+}
+
+class NonblockingGuard {
+    // Set 'O_NONBLOCK' on file descriptors for the lifetime of this object,
+    // and then restore their original flags, also if a signal that ends the
+    // process is caught first (though 'SIGKILL' can't be).  The flags belong
+    // to open file descriptions, which 'mq' may share with other processes,
+    // e.g. standard input with the shell that started it, and which would
+    // find them nonblocking otherwise.  At most one 'NonblockingGuard' may
+    // exist at a time.
+
+    std::vector<int> fds;
+    std::vector<int> originalFlags;
+    struct sigaction originalActions[NUM_TERMINATING_SIGNALS];
+
+    NonblockingGuard(const NonblockingGuard&);             // not copyable
+    NonblockingGuard& operator=(const NonblockingGuard&);  // not assignable
+
+  public:
+    explicit NonblockingGuard(const std::vector<int>& fds)
+    : fds(fds)
+    {
+        for (size_t i = 0; i < fds.size(); ++i)
+            originalFlags.push_back(fcntl(fds[i], F_GETFL));
+
+        // The handler sees the descriptors only once they're complete.
+        guardedFds   = &this->fds[0];
+        guardedFlags = &originalFlags[0];
+        guardedCount = fds.size();
+
+        struct sigaction restore = {};
+        restore.sa_handler = &restoreFlagsAndDie;
+        for (size_t i = 0; i < NUM_TERMINATING_SIGNALS; ++i) {
+            sigaction(TERMINATING_SIGNALS[i], 0, &originalActions[i]);
+
+            // A signal that is ignored doesn't end the process.
+            if (originalActions[i].sa_handler == SIG_DFL)
+                sigaction(TERMINATING_SIGNALS[i], &restore, 0);
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (originalFlags[i] != -1)
+                fcntl(fds[i], F_SETFL, originalFlags[i] | O_NONBLOCK);
+        }
+    }
+
+    ~NonblockingGuard()
+    {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (originalFlags[i] != -1)
+                fcntl(fds[i], F_SETFL, originalFlags[i]);
+        }
+
+        for (size_t i = 0; i < NUM_TERMINATING_SIGNALS; ++i)
+            sigaction(TERMINATING_SIGNALS[i], &originalActions[i], 0);
+
+        guardedCount = 0;
+    }
+};
+
+class Reactor {
+    // 'Reactor' is the state of the '--reactor' event loop.  Commands are
+    // executed in order.  A command that must wait (a "send" to a full queue,
+    // or a "receive" from an empty one) holds up the commands after it, but
+    // not "consume" or output.  The queue that such a command waits on is
+    // 'command.queue'.  With '--pending', a "send" waits only if the queue's
+    // pending messages are full, and pending messages are sent whenever their
+    // queue has room, regardless of the commands.  A "timeout" on a command
+    // that waits is kept as 'deadline'.
+
+    enum State {
+        READY,               // executing commands
+        WAITING_TO_SEND,     // the current message awaits room in the queue
+        WAITING_TO_RECEIVE,  // a "receive" awaits a message
+        CLOSING              // no more commands; finishing output
+    };
+
+    // 'registered' value for a file descriptor that 'epoll' doesn't support,
+    // e.g. a regular file, which is always ready.
+    enum { UNPOLLABLE = -1 };
+
+    struct Worker {
+        // An '--output-fd', which is written to without blocking, as standard
+        // output is, while the 'Reactor' runs.  'output' is the corresponding
+        // element of 'Shared::workers'.
+        Output *output;
+        int     fd;
+        bool    ready;
+        int     registered;
+    };
+
+    Command&           command;
+    Shared&            shared;
+    const int          inputFd;
+    const int          outputFd;
+    int                epollFd;
+    State              state;
+    unsigned           sendvRemaining;  // messages left in current "sendv"
+    unsigned           sendvSent;
+    unsigned long long sendvBytes;
+    std::string        pendingMessage;  // copy of the one being sent
+    timespec           deadline;        // of a timed command that waits
+    bool               resuming;        // rereading a "send" that waited
+    bool               expired;         // the "send" being reread timed out
+
+    // Whether standard input and output are ready, as far as we know, i.e.
+    // have not said "try again" since 'epoll' last said that they were ready.
+    // The same is kept for each queue in its 'Queue'.
+    bool inputReady;
+    bool outputReady;
+
+    // The events registered with 'epoll' for standard input and output.
+    int inputRegistered;
+    int outputRegistered;
+
+    std::vector<Worker> workers;
+
+    Reactor(const Reactor&);             // not copyable
+    Reactor& operator=(const Reactor&);  // not assignable
+
+    int runCommands();
+        // Execute commands from standard input until one must wait, or
+        // until there isn't a complete command available.  Return zero on
+        // success or a nonzero value if an error occurred (which will have
+        // been reported).  This and the functions below have the same
+        // contract.
+
+    int runCommand();
+        // Read and execute one command, or return 'INCOMPLETE'.
+
+    int sendRecord();
+        // Read and send the next message of a "sendv", or return
+        // 'INCOMPLETE'.
+
+    int trySend(const char *commandName, bool& sent);
+        // Send (or keep pending, or with '--bundle-usec', add to its queue's
+        // bundle) the message in 'command' without waiting, and load into the
+        // specified 'sent' whether it was.  If the queue (or its pending
+        // messages) is full, then arrange to read the message again once it
+        // isn't.
+
+    int sendNow(const Command& message, const char *commandName);
+        // Send (or keep pending) the specified 'message' without waiting.
+        // Return zero on success, 'FAIL_TIMEOUT' if the queue (or its
+        // pending messages) is full, or another nonzero value otherwise.
+
+    int sendBundles();
+        // Send the bundle of each queue that is due ('--bundle-usec'),
+        // unless the queue (or its pending messages) is full.
+
+    bool bundleDue(const Queue& queue) const;
+        // Return whether the specified 'queue' has a bundle that is due to
+        // be sent, which every bundle is once closing, or while a "receive"
+        // waits (since the message it awaits might be in one).
+
+    int sendPending();
+        // Send the pending messages of each queue until none remain or the
+        // queue is full.
+
+    bool keeping() const;
+        // Return whether any queue has pending messages, or a bundle.
+
+    bool drainTimed() const;
+        // Return whether "close" had a "timeout", and some queue still has
+        // pending messages, which are discarded once it passes.
+
+    bool partlySent() const;
+        // Return whether some fragments of the message of the "send" that is
+        // waiting have been sent ('--fragment'), in which case the rest must
+        // be sent, and so it can't time out.
+
+    int expire();
+        // Give up on whatever has a "timeout" that has passed.
+
+    bool nextDeadline(timespec& when) const;
+        // Load into the specified 'when' the earliest deadline of a
+        // "timeout" that could pass, and return 'true', or return 'false' if
+        // there is none.
+
+    bool mayDrain() const;
+        // Return whether messages may be received for "consume" now, which
+        // is until "close" or, if messages are pending then, until they are
+        // sent, in case they're bound for a queue that is being consumed.
+
+    size_t drainLimit() const;
+        // Return the number of bytes of output waiting to be written at
+        // which to stop receiving messages for "consume".
+
+    size_t consumeBacklog() const;
+        // Return the number of bytes of output waiting to be written that
+        // counts against 'drainLimit': that of standard output, or the most
+        // that any '--output-fd' worker has, since the next message might go
+        // to any of them.
+
+    int flushWorkers();
+        // Write what output each '--output-fd' worker that is ready has
+        // waiting.
+
+    bool hasRoom(const Queue& queue);
+        // Return whether a message received from the specified 'queue' would
+        // have room, which it always does unless '--shm'.
+
+    int receive();
+        // Receive a message for "receive" without waiting, or arrange to try
+        // again once a message is available (and has room).
+
+    int drain();
+        // Receive messages for "consume" from each queue that is being
+        // consumed, until the queue is empty or the batch limit is reached.
+
+    int wait();
+        // Wait for any file descriptor to become ready for what we'd do with
+        // it next.  Don't wait if there is something to do already.
+
+    int watch(int fd, int& registered, int wanted);
+        // Make the specified 'wanted' events be those that 'epoll' reports
+        // for the specified 'fd', where 'registered' holds the events that
+        // are currently registered for 'fd'.
+
+  public:
+    Reactor(Command& command, Shared& shared);
+
+    ~Reactor();
+
+    int run();
+        // Run the event loop until "close", the end of input, or an error.
+        // Return zero on success or a nonzero value otherwise.
+};
+
+Reactor::Reactor(Command& command, Shared& shared)
+: command(command)
+, shared(shared)
+, inputFd(fileno(stdin))
+, outputFd(fileno(stdout))
+, epollFd(epoll_create1(EPOLL_CLOEXEC))
+, state(READY)
+, sendvRemaining(0)
+, sendvSent(0)
+, sendvBytes(0)
+, deadline()
+, resuming(false)
+, expired(false)
+, inputReady(true)
+, outputReady(true)
+, inputRegistered(0)
+, outputRegistered(0)
+{
+    workers.resize(shared.workers.size());
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker& worker = workers[i];
+        worker.output     = shared.workers[i];
+        worker.fd         = shared.options.outputFds[i];
+        worker.ready      = true;
+        worker.registered = 0;
+    }
+}
+
+Reactor::~Reactor()
+{
+    if (epollFd != -1)
+        close(epollFd);
+}
+
+int Reactor::run()
+{
+    if (epollFd == -1) {
+        std::cerr << "Unable to create epoll instance: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+
+    for (;;) {
+        if (const int rc = sendPending())
+            return rc;
+
+        if (state == WAITING_TO_SEND && command.queue->writable) {
+            state    = READY;  // the message will be read again, and sent
+            resuming = true;
+        }
+
+        if (state == WAITING_TO_RECEIVE && command.queue->readable) {
+            if (const int rc = receive())
+                return rc;
+        }
+
+        if (const int rc = expire())
+            return rc;
+
+        if (state == READY && inputReady) {
+            if (const int rc = runCommands())
+                return rc;
+        }
+
+        if (const int rc = sendBundles())
+            return rc;
+
+        if (mayDrain()) {
+            if (const int rc = drain())
+                return rc;
+        }
+
+        if (outputReady && shared.output.backlog()) {
+            if (const int rc = flushOutput(shared.output, shared))
+                return rc;
+
+            outputReady = !shared.output.backlog();
+        }
+
+        if (const int rc = flushWorkers())
+            return rc;
+
+        if (state == CLOSING && !shared.output.backlog() &&
+            !consumeBacklog() && !keeping())
+        {
+            return 0;
+        }
+
+        if (const int rc = wait())
+            return rc;
+    }
+}
+
+int Reactor::runCommands()
+{
+    while (state == READY &&
+           shared.output.backlog() < MAX_OUTPUT_BACKLOG)
+    {
+        command.input.setMark();
+
+        const int rc = sendvRemaining ? sendRecord() : runCommand();
+        if (rc == INCOMPLETE) {
+            command.input.resetToMark();
+            inputReady = false;
+            return 0;
+        }
+
+        if (rc)
+            return rc;
+    }
+
+    command.input.clearMark();
+    return 0;
+}
+
+int Reactor::runCommand()
+{
+    switch (const int rc = readCommand(command, shared)) {
+      case READ_OK:
+        break;
+      case READ_EOF:
+        state = CLOSING;
+        return 0;
+      default:
+        return rc;
+    }
+
+    switch (command.opcode) {
+      case OP_SEND: {
+          // In the binary protocol, the command header is also the message
+          // header.
+          int rc;
+          if ((!shared.options.binary &&
+               (rc = readMessageHeader(command, "send", shared))) ||
+              (rc = readPayload(command, shared)))
+          {
+              return rc;
+          }
+
+          bool sent;
+          if ((rc = trySend("send", sent)) || !sent)
+              return rc;
+
+          return respond(OP_ACK,
+                         command.handle,
+                         command.priority,
+                         command.length,
+                         shared);
+      }
+      case OP_SENDV: {
+          if (const int rc = readCount(sendvRemaining, command, shared))
+              return rc;
+
+          sendvSent  = 0;
+          sendvBytes = 0;
+          return sendvRemaining
+              ? 0
+              : respond(OP_ACKV, command.handle, 0, 0, shared);
+      }
+      case OP_RECEIVE:
+        if (command.timed)
+            deadline = deadlineAfter(command.milliseconds);
+        return receive();
+      case OP_CONSUME: {
+          if (const int rc = readCredits(command, false, shared))
+              return rc;
+
+          Queue& queue = *command.queue;
+          addCredits(queue, command.length, shared);
+          queue.consuming           = true;
+          queue.consumeTimed        = command.timed;
+          queue.consumeMilliseconds = command.milliseconds;
+          if (command.timed)
+              queue.consumeDeadline = deadlineAfter(command.milliseconds);
+          return 0;
+      }
+      case OP_COUNT:
+        return countHandler(command, shared);
+      case OP_MSGSIZE:
+        return msgsizeHandler(command, shared);
+      case OP_MAXMSG:
+        return maxmsgHandler(command, shared);
+      case OP_OPEN:
+        return openHandler(command, shared);
+      case OP_STATS:
+        return statsHandler(command, shared);
+      case OP_CREDIT:
+        return creditHandler(command, shared);
+      case OP_PROBE:
+        return probeHandler(command, shared);
+      case OP_CLOSE:
+        state = CLOSING;
+        if (command.timed)
+            deadline = deadlineAfter(command.milliseconds);
+        return 0;
+      default:
+        return reportUnknownCommand(command, shared);
+    }
+}
+
+int Reactor::sendRecord()
+{
+    int  rc;
+    bool sent = false;
+    if ((rc = readMessageHeader(command, "sendv", shared)) ||
+        (rc = readPayload(command, shared))                ||
+        (rc = trySend("sendv", sent)))
+    {
+        if (rc == INCOMPLETE)
+            return rc;
+
+        // Acknowledge the messages that were sent before the failure.
+        sendvRemaining = 0;
+        respond(OP_ACKV, command.handle, sendvSent, sendvBytes, shared);
+        return rc;
+    }
+
+    if (!sent)
+        return 0;
+
+    ++sendvSent;
+    sendvBytes += command.length;
+    if (--sendvRemaining)
+        return 0;
+
+    return respond(OP_ACKV, command.handle, sendvSent, sendvBytes, shared);
+}
+
+int Reactor::trySend(const char *commandName, bool& sent)
+{
+    // The deadline of a "send" that waited stays as it was when the message
+    // was first read.
+    if (command.timed && !resuming)
+        deadline = deadlineAfter(command.milliseconds);
+    resuming = false;
+
+    if (expired) {
+        expired = false;
+        sent    = false;  // and never will be
+        return respond(OP_TIMEDOUT, command.handle, OP_SEND, 0, shared);
+    }
+
+    // With '--bundle-usec', the message joins its queue's bundle, which
+    // might have to be sent first to make room.
+    Queue& queue = *command.queue;
+    int    rc    = 0;
+    if (!shared.options.bundle)
+        rc = sendNow(command, commandName);
+    else {
+        if (!fitsBundle(queue, command)) {
+            Command bundled(command);
+            loadBundle(bundled, queue);
+            if (!(rc = sendNow(bundled, commandName)))
+                queue.bundleSize = 0;
+        }
+
+        if (!rc)
+            addToBundle(queue, command);
+    }
+
+    sent = rc == 0;
+    if (rc != FAIL_TIMEOUT)
+        return rc;
+
+    // The queue (or its pending messages) is full.  Go back to the beginning
+    // of the message, so that it is read again (and then sent) once there's
+    // room.
+    command.input.resetToMark();
+    state = WAITING_TO_SEND;
+    return 0;
+}
+
+int Reactor::sendNow(const Command& message, const char *commandName)
+{
+    // A message can't skip ahead of those already pending.
+    Queue&     queue  = *message.queue;
+    const bool behind = queue.pending && queue.pending->bytes();
+    int        rc     = FAIL_TIMEOUT;
+    if (!behind) {
+        rc = sendMessage(message, commandName, shared, &DONT_WAIT);
+        if (rc == FAIL_TIMEOUT)
+            queue.writable = false;
+    }
+
+    // Only what remains of a message that's partly sent could be kept, so
+    // it's sent the rest of the way instead.
+    if (rc == FAIL_TIMEOUT && queue.pending && !queue.partlySent)
+        rc = keepPending(message, shared, &DONT_WAIT);
+
+    return rc;
+}
+
+int Reactor::sendBundles()
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue || !bundleDue(*queue) ||
+            (!queue->writable && !queue->pending))
+        {
+            continue;
+        }
+
+        Command bundled(command);
+        loadBundle(bundled, *queue);
+        const int rc = sendNow(bundled, "send");
+        if (rc == FAIL_TIMEOUT)
+            continue;  // until there's room
+
+        if (rc)
+            return rc;
+
+        queue->bundleSize = 0;
+
+        // Now there's room for the message that's waiting, if any.
+        if (state == WAITING_TO_SEND && queue == command.queue) {
+            state    = READY;
+            resuming = true;
+        }
+    }
+
+    return 0;
+}
+
+bool Reactor::bundleDue(const Queue& queue) const
+{
+    if (!queue.bundleSize)
+        return false;
+
+    if (state == CLOSING || state == WAITING_TO_RECEIVE)
+        return true;
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return !isBefore(now, queue.bundleDeadline);
+}
+
+int Reactor::sendPending()
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue || !queue->pending || !queue->writable)
+            continue;
+
+        pendingMessage.resize(queue->maxMessageSize);
+        char *const data = &pendingMessage[0];
+
+        unsigned priority;
+        size_t   size;
+        while (!queue->pending->take(priority, data, size, &DONT_WAIT)) {
+            if (sendToQueue(*queue, data, size, priority, &DONT_WAIT))
+            {
+                const int error = errno;
+                if (error == ETIMEDOUT) {
+                    queue->writable = false;
+                    break;
+                }
+
+                if (error == EINTR)
+                    continue;
+
+                std::cerr << "Unable to send pending message: "
+                          << strerror(error) << std::endl;
+                return 3;
+            }
+
+            // Now there's room for the message that's waiting, if any.
+            if (state == WAITING_TO_SEND && queue == command.queue) {
+                state    = READY;
+                resuming = true;
+            }
+
+            if (queue->pending->pop() == Pending::PENDING_READY) {
+                const int rc = respond(OP_READY, queue->handle, 0, 0, shared);
+                if (rc)
+                    return rc;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int Reactor::expire()
+{
+    timespec earliest;
+    if (!nextDeadline(earliest))
+        return 0;
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (isBefore(now, earliest))
+        return 0;
+
+    if (drainTimed() && !isBefore(now, deadline)) {
+        for (size_t i = 0; i < shared.queues.size(); ++i) {
+            const Queue *const queue = shared.queues[i];
+            if (queue && queue->pending && queue->pending->bytes())
+                reportUnsent(*queue, shared);
+        }
+
+        return 1;
+    }
+
+    if (command.timed && !isBefore(now, deadline) && !partlySent()) {
+        if (state == WAITING_TO_SEND) {
+            // Read the message again, but then drop it (see 'trySend').
+            state    = READY;
+            resuming = true;
+            expired  = true;
+        }
+        else if (state == WAITING_TO_RECEIVE) {
+            state = READY;
+            const int rc =
+                respond(OP_TIMEDOUT, command.handle, OP_RECEIVE, 0, shared);
+            if (rc)
+                return rc;
+        }
+    }
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (queue && queue->consuming && queue->consumeTimed &&
+            hasCredit(*queue) && !queue->readable &&
+            !isBefore(now, queue->consumeDeadline))
+        {
+            queue->consuming = false;
+            const int rc =
+                respond(OP_TIMEDOUT, queue->handle, OP_CONSUME, 0, shared);
+            if (rc)
+                return rc;
+        }
+    }
+
+    return 0;
+}
+
+bool Reactor::nextDeadline(timespec& when) const
+{
+    bool found = false;
+    if ((command.timed &&
+         (state == WAITING_TO_SEND || state == WAITING_TO_RECEIVE) &&
+         !partlySent()) ||
+        drainTimed())
+    {
+        when  = deadline;
+        found = true;
+    }
+
+    // A queue that's readable isn't idle, and neither is one whose
+    // "consume" is out of credits.
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        const Queue *const queue = shared.queues[i];
+        if (queue && queue->consuming && queue->consumeTimed &&
+            hasCredit(*queue) && !queue->readable &&
+            (!found || isBefore(queue->consumeDeadline, when)))
+        {
+            when  = queue->consumeDeadline;
+            found = true;
+        }
+
+        // With '--bundle-usec', a bundle is sent once it's due.
+        if (queue && queue->bundleSize &&
+            (!found || isBefore(queue->bundleDeadline, when)))
+        {
+            when  = queue->bundleDeadline;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+bool Reactor::mayDrain() const
+{
+    return state == READY || state == WAITING_TO_SEND ||
+           (state == CLOSING && keeping());
+}
+
+size_t Reactor::drainLimit() const
+{
+    // With '--splice', messages are received only while standard output has
+    // room for them, since otherwise they'd be copied into the backlog
+    // rather than spliced.
+    return shared.splicePool ? 1 : MAX_OUTPUT_BACKLOG;
+}
+
+size_t Reactor::consumeBacklog() const
+{
+    if (workers.empty())
+        return shared.output.backlog();
+
+    size_t most = 0;
+    for (size_t i = 0; i < workers.size(); ++i)
+        most = std::max(most, workers[i].output->backlog());
+
+    return most;
+}
+
+int Reactor::flushWorkers()
+{
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker& worker = workers[i];
+        if (!worker.ready || !worker.output->backlog())
+            continue;
+
+        if (const int rc = flushOutput(*worker.output, shared))
+            return rc;
+
+        worker.ready = !worker.output->backlog();
+    }
+
+    return 0;
+}
+
+bool Reactor::partlySent() const
+{
+    // A queue's pending messages are sent before any "send" to it, so the
+    // message partly sent is pending, if any are.
+    if (state != WAITING_TO_SEND)
+        return false;
+
+    const Queue& queue = *command.queue;
+    return queue.partlySent && !(queue.pending && queue.pending->bytes());
+}
+
+bool Reactor::drainTimed() const
+{
+    if (state != CLOSING || !command.timed)
+        return false;
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        const Queue *const queue = shared.queues[i];
+        if (queue && queue->pending && queue->pending->bytes())
+            return true;
+    }
+
+    return false;
+}
+
+bool Reactor::keeping() const
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        const Queue *const queue = shared.queues[i];
+        if (queue &&
+            ((queue->pending && queue->pending->bytes()) || queue->bundleSize))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Reactor::hasRoom(const Queue& queue)
+{
+    return !shared.sharedMemory || shared.sharedMemory->reserve(queue.msgsize);
+}
+
+int Reactor::receive()
+{
+    if (!hasRoom(*command.queue)) {
+        state = WAITING_TO_RECEIVE;
+        return 0;
+    }
+
+    const int rc = doReceive(*command.queue, shared, false, &DONT_WAIT);
+    switch (rc) {
+      case 0:
+        state = READY;
+        return 0;
+      case FAIL_TIMEOUT:
+        command.queue->readable = false;
+        // fall through
+      case FAIL_INTERRUPTED_OR_CLOSED:
+        state = WAITING_TO_RECEIVE;
+        return 0;
+      default:
+        return rc;
+    }
+}
+
+int Reactor::drain()
+{
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue || !queue->consuming)
+            continue;
+
+        bool received = false;
+        for (long count = 0;
+             queue->readable && hasCredit(*queue) &&
+                 count < shared.options.batch;
+             ++count)
+        {
+            if (consumeBacklog() >= drainLimit() || !hasRoom(*queue))
+                break;
+
+            const int rc = doReceive(*queue, shared, true, &DONT_WAIT);
+            if (rc == 0) {
+                received = true;
+                if (queue->credited)
+                    --queue->credits;
+            }
+            else if (rc == FAIL_TIMEOUT)
+                queue->readable = false;
+            else if (rc != FAIL_INTERRUPTED_OR_CLOSED)
+                return rc;
+        }
+
+        // A "consume" with a "timeout" has until then to get another message.
+        if (received && queue->consumeTimed) {
+            queue->consumeDeadline =
+                deadlineAfter(queue->consumeMilliseconds);
+        }
+    }
+
+    return 0;
+}
+
+int Reactor::wait()
+{
+    const size_t backlog    = shared.output.backlog();
+    const bool   backlogged = backlog >= MAX_OUTPUT_BACKLOG;
+    const bool   draining   = consumeBacklog() < drainLimit() && mayDrain();
+
+    // Is there something to do without waiting?
+    bool busy = (state == READY && inputReady && !backlogged)             ||
+                (state == WAITING_TO_SEND && command.queue->writable)     ||
+                (outputReady && backlog);
+
+    // A message that's waiting for room in the shared memory ring ('--shm')
+    // is waiting for the user, who doesn't say when there's room.
+    bool crowded = false;
+
+    const bool wantInput  = state == READY && !inputReady && !backlogged;
+    const bool wantOutput = !outputReady && backlog;
+
+    int rc;
+    if ((rc = watch(inputFd,
+                    inputRegistered,
+                    wantInput ? int(EPOLLIN) : 0)) ||
+        (rc = watch(outputFd,
+                    outputRegistered,
+                    wantOutput ? int(EPOLLOUT) : 0)))
+    {
+        return rc;
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker&    worker  = workers[i];
+        const bool waiting = worker.output->backlog() != 0;
+
+        busy = busy || (worker.ready && waiting);
+        if ((rc = watch(worker.fd,
+                        worker.registered,
+                        !worker.ready && waiting ? int(EPOLLOUT) : 0)))
+        {
+            return rc;
+        }
+    }
+
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        Queue *const queue = shared.queues[i];
+        if (!queue)
+            continue;
+
+        const bool waitedOn   = queue == command.queue;
+        const bool receiving  = (waitedOn && state == WAITING_TO_RECEIVE) ||
+                                (draining && queue->consuming &&
+                                 hasCredit(*queue));
+        const bool sending    = (waitedOn && state == WAITING_TO_SEND) ||
+                                (queue->pending && queue->pending->bytes()) ||
+                                bundleDue(*queue);
+        const bool wantIn     = receiving && !queue->readable;
+        const bool wantOut    = sending && !queue->writable;
+
+        const bool roomy      = !receiving || !queue->readable ||
+                                hasRoom(*queue);
+
+        busy    = busy || (receiving && queue->readable && roomy) ||
+                          (sending && queue->writable);
+        crowded = crowded || !roomy;
+
+        if ((rc = watch(queue->descriptor,
+                        queue->registered,
+                        (wantIn  ? int(EPOLLIN)  : 0) |
+                            (wantOut ? int(EPOLLOUT) : 0))))
+        {
+            return rc;
+        }
+    }
+
+    // If nothing is to be done now, then wait until the next "timeout" (in
+    // milliseconds, rounded up), if any, or until it's time to look for room
+    // again.
+    int      timeout = busy ? 0 : crowded ? int(ROOM_POLL_MILLISECONDS) : -1;
+    timespec when;
+    if (!busy && nextDeadline(when)) {
+        timeout = millisecondsUntil(when);
+        if (crowded && timeout > ROOM_POLL_MILLISECONDS)
+            timeout = ROOM_POLL_MILLISECONDS;
+    }
+
+    epoll_event events[64];
+    const int   numEvents = epoll_wait(epollFd,
+                                       events,
+                                       sizeof events / sizeof events[0],
+                                       timeout);
+    if (numEvents == -1) {
+        if (errno == EINTR)
+            return 0;
+
+        std::cerr << "Unable to wait for events: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+
+    for (const epoll_event *event = events; event != events + numEvents;
+         ++event)
+    {
+        const int fd = event->data.fd;
+        if (fd == inputFd) {
+            inputReady = true;  // including errors and hangups, which 'read'
+                                // will then report
+            continue;
+        }
+
+        if (fd == outputFd) {
+            outputReady = true;  // likewise
+            continue;
+        }
+
+        Worker *worker = 0;
+        for (size_t i = 0; !worker && i < workers.size(); ++i) {
+            if (workers[i].fd == fd)
+                worker = &workers[i];
+        }
+
+        if (worker) {
+            worker->ready = true;  // likewise
+            continue;
+        }
+
+        // There are few enough queues that a linear search is fine.
+        Queue *queue = 0;
+        for (size_t i = 0; !queue && i < shared.queues.size(); ++i) {
+            if (shared.queues[i] && shared.queues[i]->descriptor == fd)
+                queue = shared.queues[i];
+        }
+
+        assert(queue);
+        if (event->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            queue->readable = true;
+        if (event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            queue->writable = true;
+    }
+
+    return 0;
+}
+
+int Reactor::watch(int fd, int& registered, int wanted)
+{
+    if (registered == wanted || registered == UNPOLLABLE)
+        return 0;
+
+    // Descriptors that aren't wanted are removed rather than left with no
+    // events, because otherwise 'epoll' would still report their hangups.
+    epoll_event event = {};
+    event.events  = wanted;
+    event.data.fd = fd;
+
+    const int operation = !wanted     ? EPOLL_CTL_DEL
+                        : !registered ? EPOLL_CTL_ADD
+                                      : EPOLL_CTL_MOD;
+
+    if (epoll_ctl(epollFd, operation, fd, &event)) {
+        if (errno == EPERM && operation == EPOLL_CTL_ADD) {
+            // 'fd' is something like a regular file, which is always ready.
+            registered = UNPOLLABLE;
+            return 0;
+        }
+
+        std::cerr << "Unable to watch file descriptor " << fd << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    registered = wanted;
+    return 0;
+}
+
+int react(Command& command, Shared& shared)
+    // Serve commands from standard input using a 'Reactor'.  Return zero on
+    // success or a nonzero value otherwise.
+{
+    // Standard input and output, and each '--output-fd', are read and
+    // written without blocking.
+    std::vector<int> fds;
+    fds.push_back(fileno(stdin));
+    fds.push_back(fileno(stdout));
+    fds.insert(fds.end(),
+               shared.options.outputFds.begin(),
+               shared.options.outputFds.end());
+    const NonblockingGuard guard(fds);
+
+    Reactor reactor(command, shared);
+    return reactor.run();
+}
+
+int serve(const Options& options, const std::vector<OpenedQueue>& opened)
+    // Serve commands from standard input as the specified 'options' say,
+    // using the queues in the specified 'opened', in the order of their
+    // handles, rather than opening them.  Return zero on success or a
+    // nonzero value otherwise.
+{
+    Output output(fileno(stdout),
+                  options.flushBytes,
+                  options.flushMicroseconds);
+    Shared shared(output, options);
+    if (options.sharedMemoryFd != -1)
+        shared.sharedMemory = new SharedMemory(options.sharedMemoryFd);
+
+    // Threads started from here on start out as this one is.
+    tuneThread("main thread", options.cpu, options.realtimePriority, shared);
+
+    // Each '--output-fd' is written to through its own 'Output', buffered
+    // like standard output.
+    shared.workers.reserve(options.outputFds.size());
+    for (size_t i = 0; i < options.outputFds.size(); ++i) {
+        const int fd = options.outputFds[i];
+        if (fd == fileno(stdin) || fd == fileno(stdout) ||
+            fcntl(fd, F_GETFL) == -1)
+        {
+            std::cerr << "Output file descriptor " << fd
+                      << " is not open or is standard input or output."
+                      << std::endl;
+            return 1;
+        }
+
+        shared.workers.push_back(new Output(fd,
+                                            options.flushBytes,
+                                            options.flushMicroseconds));
+        shared.workers.back()->setStats(&shared.stats);
+    }
+
+    class ThreadJoinGuard {
+        const std::vector<Queue*>& queues;
+
+      public:
+        explicit ThreadJoinGuard(const std::vector<Queue*>& queues)
+        : queues(queues)
+        {}
+
+        ~ThreadJoinGuard() {
+            join();
+        }
+
+        void join() {
+            for (size_t i = 0; i < queues.size(); ++i) {
+                if (queues[i] && queues[i]->consumerThreadExists) {
+                    pthread_join(queues[i]->consumerThread, 0);
+                    queues[i]->consumerThreadExists = false;
+                }
+            }
+        }
+    };
+
+    // If any "consumer" threads end up getting created, make sure we join()
+    // them before leaving this function. 
+    ThreadJoinGuard threadJoinGuard(shared.queues);
+
+    // The queue named last on the command line has handle 0, and those named
+    // by '--queue' options follow it.
+    Options queueOptions(options);
+    for (size_t i = 0; i <= options.moreQueueNames.size(); ++i) {
+        if (i > MAX_HANDLE) {
+            std::cerr << "Too many queues. At most " << MAX_HANDLE + 1
+                      << " may be open." << std::endl;
+            return 1;
+        }
+
+        if (i)
+            queueOptions.queueName = options.moreQueueNames[i - 1];
+
+        if (const int rc = openHandle(i,
+                                      queueOptions,
+                                      shared,
+                                      i < opened.size() ? &opened[i] : 0))
+        {
+            return rc;
+        }
+    }
+
+    // With '--splice', there are enough pooled buffers for the pipe to hold
+    // as many as it can while one more is being received for each queue
+    // (and for "receive").  Each buffer has room for a message from any
+    // queue open so far, and its newline.
+    if (options.spliceBytes && !shared.sharedMemory && output.pipeCapacity())
+    {
+        size_t largest = 0;
+        for (size_t i = 0; i < shared.queues.size(); ++i) {
+            if (size_t(shared.queues[i]->msgsize) > largest)
+                largest = shared.queues[i]->msgsize;
+        }
+
+        const size_t bufferSize = largest + 1;
+        shared.splicePool =
+            new BufferPool(bufferSize,
+                           output.pipeCapacity() / bufferSize + 2 +
+                               shared.queues.size());
+    }
+
+    // With '--mlock', what has been allocated so far, such as the receive
+    // buffers, stays in memory.  Not what is mapped later, though, such as
+    // the stacks of threads, which would count against the limit in full.
+    if (options.lockMemory && mlockall(MCL_CURRENT)) {
+        std::cerr << "Unable to lock mq's memory: " << strerror(errno)
+                  << std::endl;
+    }
+
+    // In the threaded engine, standard output and each '--output-fd' are
+    // written by a writer thread of their own, so that no thread waits for a
+    // slow reader while it holds a command or a message (e.g. "ack" behind a
+    // consumer's write).  Not with '--splice', though, since the writer
+    // would have to copy what is spliced.
+    if (!options.reactor && !shared.splicePool) {
+        if (output.startWriter(MAX_OUTPUT_BACKLOG)) {
+            std::cerr << "Unable to start writing output: "
+                      << strerror(output.error()) << std::endl;
+            return 1;
+        }
+
+        for (size_t i = 0; i < shared.workers.size(); ++i) {
+            if (shared.workers[i]->startWriter(MAX_OUTPUT_BACKLOG)) {
+                std::cerr << "Unable to start writing output: "
+                          << strerror(shared.workers[i]->error())
+                          << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // The command most recently read from standard input.  Its buffer is used
+    // as a temporary place to put messages received on demand.
+    Input   input(fileno(stdin));
+    Command command(input);
+    ReadHookData readHookData = { command, shared };
+    if (!options.reactor)
+        input.setReadHook(&beforeRead, &readHookData);
+
+    const int commandResult = options.reactor
+                            ? react(command, shared)
+                            : handleCommands(command, shared);
+
+    const int flushResult = flushOutput(shared);
+    const int closeResult = closeHandler(command, shared);
+
+    // Only once the consumer threads are done and the writer threads have
+    // written everything queued for them is it known whether all of the
+    // output was written.
+    threadJoinGuard.join();
+
+    // Messages kept from bundles are no longer in the queue, and would be
+    // lost if they weren't put back.
+    int putBackResult = 0;
+    for (size_t i = 0; i < shared.queues.size(); ++i) {
+        if (shared.queues[i] && putBackUnbundled(*shared.queues[i]))
+            putBackResult = 1;
+    }
+
+    const int writeError  = stopWriters(shared);
+    const int writeResult = writeError ? FAIL_WRITE : 0;
+    if (writeError && !commandResult && !flushResult) {
+        std::cerr << "Failed to write output: " << strerror(writeError)
+                  << std::endl;
+    }
+
+    return commandResult ? commandResult
+                         : flushResult ? flushResult
+                         : closeResult ? closeResult
+                         : putBackResult ? putBackResult : writeResult;
+}
+
+int broker(const Options& options)
+    // Open the queues that the specified 'options' name, and then serve each
+    // client that connects to the '--listen' socket from a child process of
+    // its own, whose standard input and output are the connection, as if it
+    // were an 'mq' started with 'options' that found the queues open.  Only
+    // a failure ends the loop.  Return the child's result in a child, or a
+    // nonzero value in this process.
+{
+    pthread_mutex_t          stderrMutex = PTHREAD_MUTEX_INITIALIZER;
+    const bool               locking     = false;  // no threads here
+    std::vector<OpenedQueue> opened;
+
+    Options queueOptions(options);
+    for (size_t i = 0;
+         i <= options.moreQueueNames.size() && i <= MAX_HANDLE;
+         ++i)
+    {
+        if (i)
+            queueOptions.queueName = options.moreQueueNames[i - 1];
+
+        opened.push_back(OpenedQueue());
+        if (const int rc = openDescriptor(opened.back(),
+                                          queueOptions,
+                                          stderrMutex,
+                                          locking))
+        {
+            return rc;
+        }
+    }
+
+    Listener listener(options.listenPath);
+
+    // Children are reaped as they exit.
+    struct sigaction reap = {};
+    reap.sa_handler = SIG_IGN;
+    sigaction(SIGCHLD, &reap, 0);
+
+    for (;;) {
+        int connection;
+        if (const int error = listener.accept(connection)) {
+            std::cerr << "Unable to accept a connection on "
+                      << repr(options.listenPath) << ": " << strerror(error)
+                      << std::endl;
+            return error;
+        }
+
+        const pid_t child = fork();
+        if (child == 0) {
+            listener.close();
+
+            struct sigaction defaultAction = {};
+            defaultAction.sa_handler = SIG_DFL;
+            sigaction(SIGCHLD, &defaultAction, 0);
+
+            if (dup2(connection, fileno(stdin))  == -1 ||
+                dup2(connection, fileno(stdout)) == -1)
+            {
+                std::cerr << "Unable to serve a connection: "
+                          << strerror(errno) << std::endl;
+                return 1;
+            }
+
+            close(connection);
+            if (options.debug)
+                std::cerr << "Serving a client in process " << getpid()
+                          << std::endl;
+
+            return serve(options, opened);
+        }
+
+        // A client that can't be served is dropped, but the others aren't.
+        if (child == -1) {
+            std::cerr << "Unable to fork to serve a connection: "
+                      << strerror(errno) << std::endl;
+        }
+
+        close(connection);
+    }
+}
+
+// ----
+// main
+// ----
+
+int main(int argc, char *argv[]) try {
+    if (const int rc = checkArgs(argc, argv))
+        return rc;
+
+    const Options options = parseOptions(argc, argv);
+
+    if (options.unlink) {
+        if (mq_unlink(options.queueName.c_str()) == -1) {
+            std::cerr << "Unable to unlink queue " << repr(options.queueName)
+                      << ": " << strerror(errno) << '\n';
+            return errno;
+        }
+        return 0;
+    }
+
+    if (!options.listenPath.empty())
+        return broker(options);
+
+    return serve(options, std::vector<OpenedQueue>());
+}
+catch (const std::exception& error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
+}
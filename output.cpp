@@ -0,0 +1,730 @@
+
+#include "output.h"
+
+// POSIX
+#include <errno.h>     // errno, EINTR, EAGAIN, ENOMEM
+#include <fcntl.h>     // vmsplice, SPLICE_F_GIFT, F_GETPIPE_SZ
+#include <poll.h>      // poll, POLLOUT
+#include <sched.h>     // sched_yield
+#include <sys/ioctl.h> // ioctl, FIONREAD
+#include <sys/stat.h>  // fstat, S_ISFIFO
+
+// Standard C
+#include <stddef.h>    // offsetof
+#include <stdlib.h>    // malloc, free
+#include <string.h>    // memcpy
+
+// Standard C++
+#include <algorithm>   // std::copy
+#include <cassert>
+#include <new>         // std::bad_alloc
+
+#include "stats.h"
+
+namespace {
+
+class MutexGuard {
+    pthread_mutex_t& mutex;
+
+    MutexGuard(const MutexGuard&);             // not copyable
+    MutexGuard& operator=(const MutexGuard&);  // not assignable
+
+  public:
+    explicit MutexGuard(pthread_mutex_t& mutex)
+    : mutex(mutex)
+    {
+        pthread_mutex_lock(&mutex);
+    }
+
+    ~MutexGuard()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+long long microsecondsSince(const timespec& then)
+    // Return the number of microseconds elapsed on 'CLOCK_REALTIME' since the
+    // specified 'then'.
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (now.tv_sec - then.tv_sec) * 1000000LL +
+           (now.tv_nsec - then.tv_nsec) / 1000;
+}
+
+long long monotonicNanoseconds()
+    // Return the current 'CLOCK_MONOTONIC' time in nanoseconds.
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+iovec *advance(iovec *next, iovec *last, size_t written)
+    // Skip the vectors in the range '[next, last)' that the specified
+    // 'written' bytes cover completely, advance into the one that they cover
+    // partially, if any, and return the first vector that is not complete.
+{
+    while (next != last && written >= next->iov_len) {
+        written -= next->iov_len;
+        ++next;
+    }
+
+    if (written) {
+        next->iov_base = static_cast<char*>(next->iov_base) + written;
+        next->iov_len -= written;
+    }
+
+    return next;
+}
+
+struct Chunk {
+    // Output queued for the writer thread: 'size' bytes at 'bytes'.  A chunk
+    // is allocated with room for all of its bytes.
+    MpscNode node;  // first, so that a node is its chunk
+    size_t   size;
+    char     bytes[1];
+};
+
+extern "C" void *runOutputWriter(void *output)
+    // Run the writer thread of the 'Output' at the specified 'output'.
+{
+    static_cast<Output*>(output)->runWriter();
+    return 0;
+}
+
+}  // close unnamed namespace
+
+Output::Output(int fileDescriptor, size_t flushBytes, long flushMicroseconds)
+: fd(fileDescriptor)
+, pending(flushBytes ? static_cast<char*>(malloc(flushBytes)) : 0)
+, pendingSize(0)
+, capacity(flushBytes)
+, flushBytes(flushBytes)
+, flushMicroseconds(flushMicroseconds)
+, lastError(0)
+, capacityOfPipe(0)
+, bytesWritten(0)
+, stats(0)
+, writerRunning(false)
+, maxQueuedBytes(0)
+, queuedBytes(0)
+, queuedSince(0)
+, flushWanted(0)
+, writerSleeping(0)
+, stopping(0)
+, roomWaiters(0)
+{
+    if (flushBytes && !pending)
+        throw std::bad_alloc();
+
+    struct stat status;
+    if (!fstat(fd, &status) && S_ISFIFO(status.st_mode)) {
+        const int pipeSize = fcntl(fd, F_GETPIPE_SZ);
+        if (pipeSize > 0)
+            capacityOfPipe = pipeSize;
+    }
+
+    pthread_mutex_init(&mutex, 0);
+
+    // The writer's timed waits are on the same clock as 'queuedSince'.
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&writerCondition, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+
+    pthread_cond_init(&roomCondition, 0);
+}
+
+Output::~Output()
+{
+    stopWriter();
+
+    pthread_cond_destroy(&roomCondition);
+    pthread_cond_destroy(&writerCondition);
+    pthread_mutex_destroy(&mutex);
+    free(pending);
+}
+
+int Output::startWriter(size_t maxBacklog)
+{
+    assert(!writerRunning);
+
+    if (flush())
+        return 1;
+
+    maxQueuedBytes = maxBacklog;
+    stopping       = 0;
+
+    if (const int rc = pthread_create(&writerThread,
+                                      0,
+                                      &runOutputWriter,
+                                      this))
+    {
+        lastError = rc;
+        return 1;
+    }
+
+    writerRunning = true;
+    return 0;
+}
+
+void Output::stopWriter()
+{
+    if (!writerRunning)
+        return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    {
+        MutexGuard guard(mutex);
+        pthread_cond_signal(&writerCondition);
+    }
+
+    pthread_join(writerThread, 0);
+    writerRunning = false;
+}
+
+void Output::runWriter()
+{
+    enum { MAX_CHUNKS = 64 };
+
+    for (;;) {
+        {
+            MutexGuard guard(mutex);
+
+            // A producer that makes output due after this sees that the
+            // writer is asleep, and wakes it (see 'wakeWriter').
+            __atomic_store_n(&writerSleeping, 1, __ATOMIC_SEQ_CST);
+
+            timespec when;
+            while (!dueLocked(when)) {
+                if (when.tv_sec || when.tv_nsec)
+                    pthread_cond_timedwait(&writerCondition, &mutex, &when);
+                else
+                    pthread_cond_wait(&writerCondition, &mutex);
+            }
+
+            __atomic_store_n(&writerSleeping, 0, __ATOMIC_SEQ_CST);
+        }
+
+        // A flush wanted from now on gets another round.
+        __atomic_store_n(&flushWanted, 0, __ATOMIC_SEQ_CST);
+
+        size_t remaining = __atomic_load_n(&queuedBytes, __ATOMIC_SEQ_CST);
+        if (!remaining && __atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+            return;
+
+        // Write what is queued now, a batch of chunks per 'writev'.  Bytes
+        // are counted in 'queuedBytes' before their chunk is pushed, so a
+        // chunk that can't be popped yet is still being pushed.
+        while (remaining) {
+            Chunk  *batch[MAX_CHUNKS];
+            iovec   vectors[MAX_CHUNKS];
+            int     count = 0;
+            size_t  size  = 0;
+            while (count < MAX_CHUNKS && size < remaining) {
+                MpscNode *const node = chunks.pop();
+                if (!node) {
+                    if (count)
+                        break;  // write what there is
+
+                    sched_yield();
+                    continue;
+                }
+
+                Chunk *const chunk = reinterpret_cast<Chunk*>(node);
+                batch[count]            = chunk;
+                vectors[count].iov_base = chunk->bytes;
+                vectors[count].iov_len  = chunk->size;
+                ++count;
+                size += chunk->size;
+            }
+
+            // After a failure, the rest is discarded, since the output is
+            // broken anyway.
+            writeChunks(vectors, vectors + count);
+
+            for (int i = 0; i < count; ++i)
+                free(batch[i]);
+
+            __atomic_fetch_sub(&queuedBytes, size, __ATOMIC_SEQ_CST);
+            remaining = size < remaining ? remaining - size : 0;
+
+            MutexGuard guard(mutex);
+            if (roomWaiters)
+                pthread_cond_broadcast(&roomCondition);
+        }
+    }
+}
+
+bool Output::dueLocked(timespec& when)
+{
+    when.tv_sec  = 0;
+    when.tv_nsec = 0;
+
+    if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST) ||
+        __atomic_load_n(&flushWanted, __ATOMIC_SEQ_CST))
+    {
+        return true;
+    }
+
+    const size_t queued = __atomic_load_n(&queuedBytes, __ATOMIC_SEQ_CST);
+    if (!queued)
+        return false;
+
+    if (queued >= flushBytes)
+        return true;
+
+    if (!flushMicroseconds)
+        return false;  // until 'flush'
+
+    const long long dueAt = __atomic_load_n(&queuedSince, __ATOMIC_RELAXED) +
+                            flushMicroseconds * 1000LL;
+    if (monotonicNanoseconds() >= dueAt)
+        return true;
+
+    when.tv_sec  = dueAt / 1000000000;
+    when.tv_nsec = dueAt % 1000000000;
+    return false;
+}
+
+void Output::wakeWriter()
+{
+    if (!__atomic_load_n(&writerSleeping, __ATOMIC_SEQ_CST))
+        return;
+
+    MutexGuard guard(mutex);
+    pthread_cond_signal(&writerCondition);
+}
+
+int Output::enqueue(const iovec *parts, int count)
+{
+    if (__atomic_load_n(&lastError, __ATOMIC_RELAXED))
+        return 1;
+
+    size_t size = 0;
+    for (const iovec *part = parts; part != parts + count; ++part)
+        size += part->iov_len;
+
+    if (!size)
+        return 0;
+
+    Chunk *const chunk =
+        static_cast<Chunk*>(malloc(offsetof(Chunk, bytes) + size));
+    if (!chunk) {
+        MutexGuard guard(mutex);
+        lastError = ENOMEM;
+        return 1;
+    }
+
+    chunk->size = size;
+    char *next  = chunk->bytes;
+    for (const iovec *part = parts; part != parts + count; ++part) {
+        memcpy(next, part->iov_base, part->iov_len);
+        next += part->iov_len;
+    }
+
+    const size_t before =
+        __atomic_fetch_add(&queuedBytes, size, __ATOMIC_SEQ_CST);
+    if (!before) {
+        __atomic_store_n(&queuedSince,
+                         monotonicNanoseconds(),
+                         __ATOMIC_RELAXED);
+    }
+
+    chunks.push(&chunk->node);
+
+    // The writer needs waking if the output is now due, or if it might be
+    // waiting with no deadline for output that now has one.
+    const size_t after = before + size;
+    if (after >= flushBytes || (!before && flushMicroseconds))
+        wakeWriter();
+
+    if (after > maxQueuedBytes) {
+        // The writer has fallen too far behind, so wait for it.
+        MutexGuard guard(mutex);
+        ++roomWaiters;
+        __atomic_store_n(&flushWanted, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&writerCondition);
+        while (!lastError &&
+               __atomic_load_n(&queuedBytes, __ATOMIC_SEQ_CST) >
+                   maxQueuedBytes)
+        {
+            pthread_cond_wait(&roomCondition, &mutex);
+        }
+        --roomWaiters;
+    }
+
+    return 0;
+}
+
+int Output::writeChunks(iovec *next, iovec *last)
+{
+    while (next != last) {
+        if (__atomic_load_n(&lastError, __ATOMIC_RELAXED))
+            return 1;
+
+        const long long startedAt = stats ? Stats::now() : 0;
+        const ssize_t   rc        = writev(fd, next, int(last - next));
+        if (stats)
+            stats->record(Stats::WRITE, startedAt);
+
+        if (rc == -1) {
+            const int error = errno;
+            if (error == EINTR) {
+                if (stats)
+                    stats->add(Stats::INTERRUPTED);
+                continue;
+            }
+
+            if (error == EAGAIN || error == EWOULDBLOCK) {
+                // The file descriptor is nonblocking after all, so wait for
+                // it to have room.
+                if (stats)
+                    stats->add(Stats::PARTIAL_WRITES);
+
+                pollfd room = {};
+                room.fd     = fd;
+                room.events = POLLOUT;
+                poll(&room, 1, -1);
+                continue;
+            }
+
+            MutexGuard guard(mutex);
+            lastError = error;
+            return 1;
+        }
+
+        {
+            MutexGuard guard(mutex);
+            bytesWritten += rc;
+        }
+
+        next = advance(next, last, rc);
+        if (stats && next != last)
+            stats->add(Stats::PARTIAL_WRITES);
+    }
+
+    return 0;
+}
+
+int Output::writeLocked(const iovec *parts, int count)
+{
+    enum { MAX_PARTS = 16 };
+    assert(count <= MAX_PARTS);
+
+    iovec vectors[MAX_PARTS + 1];  // "+ 1" for the pending bytes
+    int   numVectors = 0;
+
+    if (pendingSize) {
+        vectors[numVectors].iov_base = pending;
+        vectors[numVectors].iov_len  = pendingSize;
+        ++numVectors;
+    }
+
+    for (const iovec *part = parts; part != parts + count; ++part) {
+        if (part->iov_len)
+            vectors[numVectors++] = *part;
+    }
+
+    // Whatever happens, the pending bytes are no longer pending (unless they
+    // are kept again below).  If the write fails, then the output is broken
+    // anyway.
+    const bool wasPending = pendingSize;
+    pendingSize = 0;
+
+    iovec       *next = vectors;
+    iovec *const last = vectors + numVectors;
+    while (next != last) {
+        const long long startedAt = stats ? Stats::now() : 0;
+        const ssize_t   rc        = writev(fd, next, int(last - next));
+        if (stats)
+            stats->record(Stats::WRITE, startedAt);
+
+        if (rc == -1) {
+            if (errno == EINTR) {
+                // interrupted by signal before writing. Retry.
+                if (stats)
+                    stats->add(Stats::INTERRUPTED);
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The file descriptor is nonblocking and full.  Keep what
+                // wasn't written, to write later.
+                if (stats)
+                    stats->add(Stats::PARTIAL_WRITES);
+                if (!wasPending)
+                    clock_gettime(CLOCK_REALTIME, &pendingSince);
+
+                return keepLocked(next, last);
+            }
+
+            lastError = errno;
+            return 1;
+        }
+
+        bytesWritten += rc;
+
+        next = advance(next, last, rc);
+        if (stats && next != last)
+            stats->add(Stats::PARTIAL_WRITES);
+    }
+
+    return 0;
+}
+
+int Output::keepLocked(iovec *first, iovec *last)
+{
+    size_t size = 0;
+    for (const iovec *vector = first; vector != last; ++vector)
+        size += vector->iov_len;
+
+    char   *buffer      = pending;
+    size_t  newCapacity = capacity;
+    if (size > capacity) {
+        newCapacity = capacity * 2 > size ? capacity * 2 : size;
+        buffer      = static_cast<char*>(malloc(newCapacity));
+        if (!buffer) {
+            lastError = ENOMEM;
+            return 1;
+        }
+    }
+
+    // 'memmove', since the first vector might be the tail of 'pending'.
+    size_t offset = 0;
+    for (const iovec *vector = first; vector != last; ++vector) {
+        memmove(buffer + offset, vector->iov_base, vector->iov_len);
+        offset += vector->iov_len;
+    }
+
+    if (buffer != pending) {
+        free(pending);
+        pending  = buffer;
+        capacity = newCapacity;
+    }
+
+    pendingSize = size;
+    return 0;
+}
+
+int Output::write(const char *data, size_t size)
+{
+    iovec part;
+    part.iov_base = const_cast<char*>(data);
+    part.iov_len  = size;
+
+    return write(&part, 1);
+}
+
+int Output::write(const iovec *parts, int count)
+{
+    if (writerRunning)
+        return enqueue(parts, count);
+
+    size_t size = 0;
+    for (const iovec *part = parts; part != parts + count; ++part)
+        size += part->iov_len;
+
+    MutexGuard guard(mutex);
+
+    if (pendingSize + size > flushBytes) {
+        // This doesn't fit in the buffer, so write it (without copying it)
+        // along with whatever is already pending.
+        return writeLocked(parts, count);
+    }
+
+    if (pendingSize == 0)
+        clock_gettime(CLOCK_REALTIME, &pendingSince);
+
+    for (const iovec *part = parts; part != parts + count; ++part) {
+        memcpy(pending + pendingSize, part->iov_base, part->iov_len);
+        pendingSize += part->iov_len;
+    }
+
+    if (pendingSize >= flushBytes ||
+        (flushMicroseconds &&
+         microsecondsSince(pendingSince) >= flushMicroseconds))
+    {
+        return writeLocked(0, 0);
+    }
+
+    return 0;
+}
+
+int Output::splice(const iovec       *parts,
+                   int                count,
+                   const char        *data,
+                   size_t             size,
+                   unsigned long long& end)
+{
+    iovec gift;
+    gift.iov_base = const_cast<char*>(data);
+    gift.iov_len  = size;
+
+    enum { MAX_PARTS = 16 };
+    assert(count < MAX_PARTS);
+
+    if (writerRunning) {
+        // 'data' is copied into the writer's queue, and so isn't referred
+        // to after.
+        iovec all[MAX_PARTS];
+        std::copy(parts, parts + count, all);
+        all[count] = gift;
+
+        end = 0;
+        return enqueue(all, count + 1);
+    }
+
+    MutexGuard guard(mutex);
+
+    if (!capacityOfPipe) {
+        // There's nothing to splice into, so write 'data' along with the
+        // rest.
+        iovec all[MAX_PARTS];
+        std::copy(parts, parts + count, all);
+        all[count] = gift;
+
+        const int rc = writeLocked(all, count + 1);
+        end = bytesWritten + pendingSize;
+        return rc;
+    }
+
+    // Whatever goes before 'data' must be written first.
+    if (const int rc = writeLocked(parts, count))
+        return rc;
+
+    // If the pipe is full and nonblocking, then what's left of 'data' is
+    // kept (copied) along with whatever else couldn't be written.
+    while (gift.iov_len && !pendingSize) {
+        const long long startedAt = stats ? Stats::now() : 0;
+        const ssize_t   rc        = vmsplice(fd, &gift, 1, SPLICE_F_GIFT);
+        if (stats)
+            stats->record(Stats::WRITE, startedAt);
+
+        if (rc == -1) {
+            if (errno == EINTR) {
+                if (stats)
+                    stats->add(Stats::INTERRUPTED);
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (stats)
+                    stats->add(Stats::PARTIAL_WRITES);
+                clock_gettime(CLOCK_REALTIME, &pendingSince);
+                break;
+            }
+
+            lastError = errno;
+            return 1;
+        }
+
+        bytesWritten += rc;
+        gift.iov_base = static_cast<char*>(gift.iov_base) + rc;
+        gift.iov_len -= rc;
+        if (stats && gift.iov_len)
+            stats->add(Stats::PARTIAL_WRITES);
+    }
+
+    end = bytesWritten;
+    if (!gift.iov_len)
+        return 0;
+
+    // Keep the pending bytes (if any) and then the rest of 'data'.
+    iovec rest[2];
+    int   numRest = 0;
+    if (pendingSize) {
+        rest[numRest].iov_base = pending;
+        rest[numRest].iov_len  = pendingSize;
+        ++numRest;
+    }
+    rest[numRest++] = gift;
+
+    end = bytesWritten + pendingSize + gift.iov_len;
+    return keepLocked(rest, rest + numRest);
+}
+
+void Output::setStats(Stats *newStats)
+{
+    MutexGuard guard(mutex);
+
+    stats = newStats;
+}
+
+size_t Output::pipeCapacity() const
+{
+    return capacityOfPipe;
+}
+
+size_t Output::unread() const
+{
+    // Linux answers 'FIONREAD' for either end of a pipe.
+    int bytes;
+    if (!capacityOfPipe || ioctl(fd, FIONREAD, &bytes) == -1 || bytes < 0)
+        return 0;
+
+    return bytes;
+}
+
+unsigned long long Output::written()
+{
+    MutexGuard guard(mutex);
+
+    return bytesWritten;
+}
+
+int Output::flush()
+{
+    if (writerRunning) {
+        __atomic_store_n(&flushWanted, 1, __ATOMIC_SEQ_CST);
+        wakeWriter();
+        return __atomic_load_n(&lastError, __ATOMIC_RELAXED) != 0;
+    }
+
+    MutexGuard guard(mutex);
+
+    if (pendingSize == 0)
+        return 0;
+
+    return writeLocked(0, 0);
+}
+
+size_t Output::backlog()
+{
+    if (writerRunning)
+        return __atomic_load_n(&queuedBytes, __ATOMIC_SEQ_CST);
+
+    MutexGuard guard(mutex);
+
+    return pendingSize;
+}
+
+bool Output::deadline(timespec& when)
+{
+    if (writerRunning)
+        return false;
+
+    MutexGuard guard(mutex);
+
+    if (pendingSize == 0)
+        return false;
+
+    when = pendingSince;
+    when.tv_sec  += flushMicroseconds / 1000000;
+    when.tv_nsec += flushMicroseconds % 1000000 * 1000;
+    if (when.tv_nsec >= 1000000000) {
+        when.tv_nsec -= 1000000000;
+        ++when.tv_sec;
+    }
+
+    return true;
+}
+
+int Output::error() const
+{
+    return lastError;
+}
@@ -0,0 +1,214 @@
+#ifndef INCLUDED_OUTPUT
+#define INCLUDED_OUTPUT
+
+// POSIX
+#include <pthread.h>  // pthread_mutex_t
+#include <sys/uio.h>  // iovec
+#include <time.h>     // timespec
+
+// Standard C
+#include <stddef.h>   // size_t
+
+#include "mpsc.h"
+
+class Stats;
+
+class Output {
+    // 'Output' is the one path by which responses and messages reach a file
+    // descriptor.  Writes smaller than the flush threshold are appended to a
+    // pending buffer instead of being written immediately, and the pending
+    // bytes go out together with the next write that crosses the threshold,
+    // as one 'writev'.  A thread that is about to block (e.g. in 'mq_receive'
+    // or 'read') should first wait no longer than 'deadline' and then
+    // 'flush', so that pending output is never older than the configured
+    // latency while the thread waits.  All member functions are thread-safe.
+    //
+    // If the file descriptor is nonblocking, then whatever could not be
+    // written is kept in the pending buffer (which grows as necessary), and
+    // 'backlog' says how much that is.
+    //
+    // If the file descriptor is a pipe, then 'splice' can hand memory to it
+    // with 'vmsplice' instead of copying it.  The pipe then refers to that
+    // memory until the bytes are read out of it, which is certain only once
+    // 'pipeCapacity' more bytes have been written after them.
+    //
+    // If 'setStats' is given a 'Stats', then each 'writev' and 'vmsplice' is
+    // timed, and retries and partial writes are counted.
+    //
+    // Once 'startWriter' is called, the file descriptor is written only by a
+    // writer thread that belongs to this object, so that a thread with output
+    // never waits for the file descriptor.  'write' then copies the output
+    // into a chunk and pushes it onto a lock-free queue, which the writer
+    // drains (as one 'writev' per batch of chunks) once the flush threshold
+    // is crossed, the output is 'flushMicroseconds' old, or 'flush' is
+    // called.  Only when more than the writer's maximum backlog is queued
+    // does 'write' wait, for the writer to catch up.
+
+    int              fd;
+    pthread_mutex_t  mutex;
+    char            *pending;         // buffered bytes not yet written
+    size_t           pendingSize;
+    size_t           capacity;        // of 'pending', at least 'flushBytes'
+    size_t           flushBytes;
+    long             flushMicroseconds;
+    timespec         pendingSince;    // 'CLOCK_REALTIME' of oldest pending
+    int              lastError;
+    size_t           capacityOfPipe;  // or zero if 'fd' isn't a pipe
+    unsigned long long bytesWritten;  // not counting 'pending'
+    Stats           *stats;           // or null
+
+    // The writer thread's state.  'queuedBytes', 'queuedSince' (on
+    // 'CLOCK_MONOTONIC', in nanoseconds), 'flushWanted', 'writerSleeping',
+    // and 'stopping' are accessed atomically.  The writer waits on
+    // 'writerCondition', and a full 'write' waits on 'roomCondition', both
+    // with 'mutex'.
+    MpscQueue        chunks;
+    bool             writerRunning;
+    pthread_t        writerThread;
+    pthread_cond_t   writerCondition;
+    pthread_cond_t   roomCondition;
+    size_t           maxQueuedBytes;
+    size_t           queuedBytes;
+    long long        queuedSince;
+    int              flushWanted;
+    int              writerSleeping;
+    int              stopping;
+    unsigned         roomWaiters;     // guarded by 'mutex'
+
+    Output(const Output&);             // not copyable
+    Output& operator=(const Output&);  // not assignable
+
+    int writeLocked(const iovec *parts, int count);
+        // Write the pending bytes followed by the specified 'count' 'parts'
+        // until all are written, and then empty the pending buffer.  Return
+        // zero on success or a nonzero value otherwise.  The behavior is
+        // undefined unless 'mutex' is held.
+
+    int keepLocked(iovec *first, iovec *last);
+        // Make the bytes in the range of vectors '[first, last)' the pending
+        // bytes, growing the pending buffer if necessary.  Return zero on
+        // success or a nonzero value if memory cannot be allocated.  The
+        // behavior is undefined unless 'mutex' is held, and unless only
+        // 'first' might refer to the pending buffer.
+
+    int enqueue(const iovec *parts, int count);
+        // Copy the specified 'count' 'parts' into a chunk for the writer
+        // thread, and wake the writer if the chunk makes output due.  Return
+        // zero on success or a nonzero value otherwise.
+
+    bool dueLocked(timespec& when);
+        // Return whether the writer thread has output to write now, or
+        // should stop.  If not, and output is queued that will be due at a
+        // certain time, load that time ('CLOCK_MONOTONIC') into the specified
+        // 'when'; otherwise, set 'when' to zero.  The behavior is undefined
+        // unless 'mutex' is held.
+
+    void wakeWriter();
+        // Wake the writer thread if it is waiting.
+
+    int writeChunks(iovec *first, iovec *last);
+        // Write the range of vectors '[first, last)' from the writer thread,
+        // waiting for the file descriptor as necessary.  Return zero on
+        // success or a nonzero value otherwise.
+
+  public:
+    Output(int fileDescriptor, size_t flushBytes, long flushMicroseconds);
+        // Create an 'Output' that writes to the specified 'fileDescriptor',
+        // buffering up to the specified 'flushBytes' bytes for no longer than
+        // the specified 'flushMicroseconds' while more output might follow.
+        // If 'flushBytes' is zero, every write goes straight to the file
+        // descriptor.  Throw 'std::bad_alloc' if the buffer cannot be
+        // allocated.
+
+    ~Output();
+        // Destroy this object, after stopping the writer thread, if any.
+        // Note that pending bytes are not flushed, except that the writer
+        // thread writes whatever is queued for it before it stops.
+
+    int startWriter(size_t maxBacklog);
+        // Start the writer thread, after writing any pending bytes.  From
+        // now on, 'write' waits only while more than the specified
+        // 'maxBacklog' bytes are queued for the writer.  Return zero on
+        // success or a nonzero value otherwise.  The behavior is undefined
+        // if the writer thread is already running, or if any other thread is
+        // using this object.
+
+    void stopWriter();
+        // Wait for the writer thread, if it is running, to write everything
+        // queued for it, and then stop it.  The behavior is undefined if any
+        // other thread is using this object.
+
+    void runWriter();
+        // Write queued chunks until 'stopWriter'.  This is the body of the
+        // writer thread, and is public only so that the thread's entry point
+        // can call it.
+
+    int write(const char *data, size_t size);
+        // Write the specified 'size' bytes at the specified 'data', either
+        // now or by buffering them.  Return zero on success or a nonzero
+        // value otherwise, in which case 'error()' describes the failure.
+
+    int write(const iovec *parts, int count);
+        // Write the specified 'count' 'parts', in order, as a single unit
+        // that will not be interleaved with other writes.  Return zero on
+        // success or a nonzero value otherwise.
+
+    int splice(const iovec       *parts,
+               int                count,
+               const char        *data,
+               size_t             size,
+               unsigned long long& end);
+        // Write the specified 'count' 'parts' as 'write' does, and then the
+        // specified 'size' bytes at the specified 'data', as a single unit.
+        // If the file descriptor is a pipe, then 'data' is given to the pipe
+        // by 'vmsplice' rather than copied into it, and so must not be
+        // modified until the pipe is done with it (see 'pipeCapacity').  Load
+        // into the specified 'end' the value of 'written()' just after the
+        // last byte of 'data'.  Return zero on success or a nonzero value
+        // otherwise.  Note that 'data' is gifted ('SPLICE_F_GIFT') to the
+        // pipe, which is most effective if 'data' is page-aligned.  While the
+        // writer thread is running, 'data' is copied as by 'write' instead,
+        // and 'end' is zero, since 'data' is then not referred to after.
+
+    void setStats(Stats *stats);
+        // Count and time writes in the specified 'stats' from now on, or
+        // stop if 'stats' is null.  The behavior is undefined unless 'stats'
+        // outlives this object (or the next 'setStats').
+
+    size_t pipeCapacity() const;
+        // Return the capacity in bytes of the pipe that is the file
+        // descriptor, or zero if it isn't a pipe.  Bytes given to the pipe
+        // are no longer referred to by it once this many more bytes have
+        // been written after them (unless the reader of the pipe splices
+        // them elsewhere rather than reading them).
+
+    size_t unread() const;
+        // Return the number of bytes written to the pipe that is the file
+        // descriptor that its reader has not read yet, or zero if the file
+        // descriptor isn't a pipe.
+
+    unsigned long long written();
+        // Return the number of bytes written to the file descriptor so far,
+        // not counting those that are pending.
+
+    int flush();
+        // Write any pending bytes now, or have the writer thread write them
+        // without waiting for it to do so, if it is running.  Return zero on
+        // success or a nonzero value otherwise.
+
+    size_t backlog();
+        // Return the number of bytes that are pending (or queued for the
+        // writer thread).
+
+    bool deadline(timespec& when);
+        // If there are pending bytes, load into the specified 'when' the
+        // 'CLOCK_REALTIME' time by which they should be written, and return
+        // 'true'.  Otherwise, return 'false'.  Always return 'false' while
+        // the writer thread is running, since it keeps time itself.
+
+    int error() const;
+        // Return the 'errno' value of the most recent failed write, or zero
+        // if none has failed.
+};
+
+#endif
@@ -0,0 +1,200 @@
+
+#include "pending.h"
+
+#include "spool.h"
+
+// POSIX
+#include <errno.h>   // ETIMEDOUT, errno
+
+// Standard C
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy, memmove
+
+// Standard C++
+#include <cassert>
+#include <new>       // std::bad_alloc
+
+namespace {
+
+class MutexGuard {
+    pthread_mutex_t& mutex;
+
+    MutexGuard(const MutexGuard&);             // not copyable
+    MutexGuard& operator=(const MutexGuard&);  // not assignable
+
+  public:
+    explicit MutexGuard(pthread_mutex_t& mutex)
+    : mutex(mutex)
+    {
+        pthread_mutex_lock(&mutex);
+    }
+
+    ~MutexGuard()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+}  // close unnamed namespace
+
+const size_t Pending::RECORD_OVERHEAD;
+
+Pending::Pending(size_t limit, size_t maxMessageSize, Spool *spool)
+: buffer(0)
+, spool(spool)
+, capacity(limit > RECORD_OVERHEAD + maxMessageSize
+               ? limit
+               : RECORD_OVERHEAD + maxMessageSize)
+, limit(limit)
+, begin(0)
+, end(0)
+, busy(false)
+, closed(false)
+{
+    if (!spool) {
+        buffer = static_cast<char*>(malloc(capacity));
+        if (!buffer)
+            throw std::bad_alloc();
+    }
+
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&changed, 0);
+}
+
+Pending::~Pending()
+{
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&mutex);
+    free(buffer);
+    delete spool;
+}
+
+size_t Pending::storedBytes() const
+{
+    return spool ? spool->bytes() : end - begin;
+}
+
+int Pending::push(unsigned        priority,
+                  const char     *data,
+                  size_t          size,
+                  const timespec *deadline)
+{
+    const size_t recordSize = spool ? Spool::recordSize(size)
+                                    : RECORD_OVERHEAD + size;
+    assert(spool || recordSize <= capacity);
+
+    MutexGuard guard(mutex);
+
+    // There's room if the message is within the limit, or if it's the only
+    // one.
+    while (!closed && storedBytes() && storedBytes() + recordSize > limit) {
+        const int rc = deadline
+                     ? pthread_cond_timedwait(&changed, &mutex, deadline)
+                     : pthread_cond_wait(&changed, &mutex);
+        if (rc == ETIMEDOUT)
+            return PENDING_TIMEOUT;
+    }
+
+    if (closed)
+        return PENDING_CLOSED;
+
+    if (spool) {
+        if (const int error = spool->append(priority, data, size)) {
+            errno = error;
+            return PENDING_ERROR;
+        }
+    }
+    else if (end + recordSize > capacity) {
+        memmove(buffer, buffer + begin, end - begin);
+        end  -= begin;
+        begin = 0;
+    }
+
+    if (!spool) {
+        memcpy(buffer + end, &priority, sizeof priority);
+        memcpy(buffer + end + sizeof priority, &size, sizeof size);
+        memcpy(buffer + end + RECORD_OVERHEAD, data, size);
+        end += recordSize;
+    }
+
+    pthread_cond_broadcast(&changed);
+
+    if (!busy && storedBytes() >= limit / 2) {
+        busy = true;
+        return PENDING_BUSY;
+    }
+
+    return PENDING_OK;
+}
+
+int Pending::take(unsigned&       priority,
+                  char           *data,
+                  size_t&         size,
+                  const timespec *deadline)
+{
+    MutexGuard guard(mutex);
+
+    while (!closed && !storedBytes()) {
+        const int rc = deadline
+                     ? pthread_cond_timedwait(&changed, &mutex, deadline)
+                     : pthread_cond_wait(&changed, &mutex);
+        if (rc == ETIMEDOUT)
+            return PENDING_TIMEOUT;
+    }
+
+    if (!storedBytes())
+        return PENDING_CLOSED;
+
+    if (spool) {
+        const char *stored;
+        spool->front(priority, stored, size);
+        memcpy(data, stored, size);
+        return PENDING_OK;
+    }
+
+    memcpy(&priority, buffer + begin, sizeof priority);
+    memcpy(&size, buffer + begin + sizeof priority, sizeof size);
+    memcpy(data, buffer + begin + RECORD_OVERHEAD, size);
+    return PENDING_OK;
+}
+
+int Pending::pop()
+{
+    MutexGuard guard(mutex);
+
+    assert(storedBytes());
+
+    if (spool)
+        spool->pop();
+    else {
+        size_t size;
+        memcpy(&size, buffer + begin + sizeof(unsigned), sizeof size);
+        begin += RECORD_OVERHEAD + size;
+        if (begin == end)
+            begin = end = 0;
+    }
+
+    pthread_cond_broadcast(&changed);
+
+    if (busy && !storedBytes()) {
+        busy = false;
+        return PENDING_READY;
+    }
+
+    return PENDING_OK;
+}
+
+void Pending::close()
+{
+    MutexGuard guard(mutex);
+
+    closed = true;
+    pthread_cond_broadcast(&changed);
+}
+
+size_t Pending::bytes()
+{
+    MutexGuard guard(mutex);
+
+    return storedBytes();
+}
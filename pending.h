@@ -0,0 +1,116 @@
+#ifndef INCLUDED_PENDING
+#define INCLUDED_PENDING
+
+// POSIX
+#include <pthread.h>  // pthread_mutex_t, pthread_cond_t
+#include <time.h>     // timespec
+
+// Standard C
+#include <stddef.h>   // size_t
+
+class Spool;
+
+class Pending {
+    // 'Pending' is a bounded first-in-first-out store of messages that are
+    // waiting for room in a message queue.  Messages are copied into one
+    // buffer that is reused, and that is compacted rather than grown.  A
+    // message is taken by copying it out, and is removed only by 'pop', so
+    // that the order of messages is kept even while one is being sent.  All
+    // member functions are thread-safe, and 'push' and 'take' can wait for
+    // each other.
+    //
+    // Alternatively, the messages can be kept in a 'Spool' on disk instead of
+    // in memory, in which case they are taken in priority order (highest
+    // first) rather than first in, first out.
+    //
+    // 'Pending' is "busy" from when the pending bytes reach half of the limit
+    // until there are none again.  'push' and 'pop' say when that changes, so
+    // that the user can be told to slow down, and then that it may speed up.
+
+    pthread_mutex_t  mutex;
+    pthread_cond_t   changed;   // signaled whenever messages come or go
+    char            *buffer;    // unless 'spool'
+    Spool           *spool;     // owned, or null
+    size_t           capacity;
+    size_t           limit;     // of stored bytes; see 'push'
+    size_t           begin;     // offset of the oldest message's record
+    size_t           end;       // offset one past the newest message's record
+    bool             busy;
+    bool             closed;
+
+    Pending(const Pending&);             // not copyable
+    Pending& operator=(const Pending&);  // not assignable
+
+    size_t storedBytes() const;
+        // Return the bytes stored.  The behavior is undefined unless 'mutex'
+        // is locked.
+
+  public:
+    // Return values of the member functions.  Note that 'PENDING_OK' is zero.
+    enum {
+        PENDING_OK,
+        PENDING_BUSY,     // 'push' succeeded, and made this object busy
+        PENDING_READY,    // 'pop' succeeded, and made this object not busy
+        PENDING_TIMEOUT,  // the deadline passed while full (or empty)
+        PENDING_CLOSED,   // 'close' was called (and, for 'take', it's empty)
+        PENDING_ERROR     // the spool failed to store the message; see 'errno'
+    };
+
+    // Bytes of bookkeeping stored with each message, in addition to its size.
+    static const size_t RECORD_OVERHEAD = sizeof(unsigned) + sizeof(size_t);
+
+    Pending(size_t limit, size_t maxMessageSize, Spool *spool = 0);
+        // Create a 'Pending' that stores no more than the specified 'limit'
+        // bytes, where each message counts as its size plus
+        // 'RECORD_OVERHEAD', except that one message of up to the specified
+        // 'maxMessageSize' bytes can always be stored.  If the optionally
+        // specified 'spool' is not null, then store the messages in it
+        // instead, where each counts as its 'Spool::recordSize', and take
+        // ownership of it.  Throw 'std::bad_alloc' if the buffer cannot be
+        // allocated.
+
+    ~Pending();
+
+    int push(unsigned        priority,
+             const char     *data,
+             size_t          size,
+             const timespec *deadline);
+        // Store the message having the specified 'priority' and the specified
+        // 'size' bytes at the specified 'data', waiting while there isn't
+        // room, until the specified 'deadline' ('CLOCK_REALTIME') if it isn't
+        // null.  Return 'PENDING_OK' or 'PENDING_BUSY' on success,
+        // 'PENDING_TIMEOUT' if the deadline passes first, 'PENDING_CLOSED' if
+        // this object is closed, or 'PENDING_ERROR' (and set 'errno') if the
+        // spool fails.  The behavior is undefined unless 'size' is at most
+        // the maximum message size.
+
+    int take(unsigned&       priority,
+             char           *data,
+             size_t&         size,
+             const timespec *deadline);
+        // Copy the oldest (or, with a spool, the highest priority) message to
+        // the specified 'data', and load its priority and size into the
+        // specified 'priority' and 'size', waiting while there are no
+        // messages, until the specified 'deadline' ('CLOCK_REALTIME') if it
+        // isn't null.  The message is not removed, and is the one copied
+        // again until 'pop', even if one of higher priority is stored.
+        // Return 'PENDING_OK' on success, 'PENDING_TIMEOUT' if the deadline
+        // passes first, or 'PENDING_CLOSED' if this object is closed and
+        // empty.  The behavior is undefined unless 'data' has room for the
+        // maximum message size.
+
+    int pop();
+        // Remove the message that 'take' copied.  Return 'PENDING_READY' if
+        // that made this object not busy, or 'PENDING_OK' otherwise.  The
+        // behavior is undefined unless 'take' succeeded since the last 'pop'.
+
+    void close();
+        // Refuse any further 'push', and let 'take' return once there are no
+        // more messages.
+
+    size_t bytes();
+        // Return the number of bytes stored, including 'RECORD_OVERHEAD' (or
+        // as 'Spool::recordSize' counts them).
+};
+
+#endif
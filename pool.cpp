@@ -0,0 +1,126 @@
+
+#include "pool.h"
+
+// POSIX
+#include <sys/mman.h>  // mmap, munmap
+#include <unistd.h>    // sysconf
+
+// Standard C++
+#include <cassert>
+#include <new>         // std::bad_alloc
+
+namespace {
+
+class MutexGuard {
+    pthread_mutex_t& mutex;
+
+    MutexGuard(const MutexGuard&);             // not copyable
+    MutexGuard& operator=(const MutexGuard&);  // not assignable
+
+  public:
+    explicit MutexGuard(pthread_mutex_t& mutex)
+    : mutex(mutex)
+    {
+        pthread_mutex_lock(&mutex);
+    }
+
+    ~MutexGuard()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+// the default huge page size on x86-64 (and on arm64 with 4K pages)
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+}  // close unnamed namespace
+
+BufferPool::BufferPool(size_t bufferSize, size_t count, bool hugePages)
+: buffers(0)
+, size(0)
+, mapped(0)
+, next(0)
+{
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size   = (bufferSize + pageSize - 1) / pageSize * pageSize;
+    mapped = size * count;
+
+    // 'mmap' rather than 'malloc', so that the buffers begin on page
+    // boundaries.  Huge pages are available only if the system has reserved
+    // some, so fall back to ordinary pages.
+    void *address = MAP_FAILED;
+    if (hugePages) {
+        const size_t hugeMapped =
+            (mapped + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        address = mmap(0,
+                       hugeMapped,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                       -1,
+                       0);
+        if (address != MAP_FAILED)
+            mapped = hugeMapped;
+    }
+
+    if (address == MAP_FAILED) {
+        address = mmap(0,
+                       mapped,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+    }
+
+    if (address == MAP_FAILED)
+        throw std::bad_alloc();
+
+    buffers = static_cast<char*>(address);
+
+    const Slot unused = { false, 0 };
+    slots.assign(count, unused);
+
+    pthread_mutex_init(&mutex, 0);
+}
+
+BufferPool::~BufferPool()
+{
+    pthread_mutex_destroy(&mutex);
+    munmap(buffers, mapped);
+}
+
+size_t BufferPool::bufferSize() const
+{
+    return size;
+}
+
+char *BufferPool::acquire(unsigned long long written)
+{
+    MutexGuard guard(mutex);
+
+    // Look at the slots in rotation, starting after the one most recently
+    // handed out, since it's the least recently handed out that is most
+    // likely to be reusable.
+    for (size_t i = 0; i < slots.size(); ++i) {
+        const size_t index = (next + i) % slots.size();
+        Slot&        slot  = slots[index];
+        if (!slot.inUse && slot.reusableAt <= written) {
+            slot.inUse = true;
+            next       = (index + 1) % slots.size();
+            return buffers + index * size;
+        }
+    }
+
+    return 0;
+}
+
+void BufferPool::release(char *buffer, unsigned long long reusableAt)
+{
+    assert(buffer >= buffers && buffer < buffers + mapped);
+
+    MutexGuard guard(mutex);
+
+    Slot& slot      = slots[(buffer - buffers) / size];
+    slot.inUse      = false;
+    slot.reusableAt = reusableAt;
+}
@@ -0,0 +1,66 @@
+#ifndef INCLUDED_POOL
+#define INCLUDED_POOL
+
+// POSIX
+#include <pthread.h>  // pthread_mutex_t
+
+// Standard C
+#include <stddef.h>   // size_t
+
+// Standard C++
+#include <vector>
+
+class BufferPool {
+    // 'BufferPool' is a fixed number of page-aligned buffers of the same
+    // size, allocated together once, and handed out in rotation.  A buffer
+    // that is given back may still be in use by the kernel, e.g. when its
+    // pages were spliced into a pipe by 'vmsplice', and so it is not handed
+    // out again until the user says that the output has moved far enough
+    // past it.  The output's progress is measured in bytes written so far,
+    // and so a buffer's reuse is delayed until that count reaches a given
+    // value.  The buffers are never initialized by this class; their
+    // contents are whatever the user last left in them.  All member
+    // functions are thread-safe.
+
+    struct Slot {
+        bool               inUse;
+        unsigned long long reusableAt;  // in bytes written
+    };
+
+    pthread_mutex_t    mutex;
+    char              *buffers;
+    size_t             size;     // of each buffer
+    size_t             mapped;   // bytes of all of the buffers
+    std::vector<Slot>  slots;
+    size_t             next;     // slot at which to look first
+
+    BufferPool(const BufferPool&);             // not copyable
+    BufferPool& operator=(const BufferPool&);  // not assignable
+
+  public:
+    BufferPool(size_t bufferSize, size_t count, bool hugePages = false);
+        // Create a 'BufferPool' of the specified 'count' buffers, each of at
+        // least the specified 'bufferSize' bytes, rounded up to a whole
+        // number of pages.  If the optionally specified 'hugePages' is
+        // 'true', then allocate the buffers from huge pages if possible, and
+        // otherwise from ordinary pages.  Throw 'std::bad_alloc' if the
+        // buffers cannot be allocated.
+
+    ~BufferPool();
+
+    size_t bufferSize() const;
+        // Return the size of each buffer.
+
+    char *acquire(unsigned long long written);
+        // Return a buffer that is neither in use nor waiting for the output
+        // to reach more than the specified 'written' bytes, or null if there
+        // is none.  The buffer is in use until 'release'.
+
+    void release(char *buffer, unsigned long long reusableAt);
+        // Give back the specified 'buffer', which was returned by 'acquire',
+        // to be reused once the output has written at least the specified
+        // 'reusableAt' bytes (e.g. zero, if the buffer is not referred to
+        // elsewhere).
+};
+
+#endif
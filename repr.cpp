@@ -46,7 +46,7 @@ std::string repr(const std::string& input)
               result.append("\\x");
               char buffer[3];  // two hex digits and the null terminator
               const int rc =
-                  snprintf(buffer, sizeof buffer, "%.2x", (unsigned int)ch);
+                  snprintf(buffer, sizeof buffer, "%.2x", (unsigned char)ch);
               assert(rc == 2);
               result.append(buffer);
           }
@@ -0,0 +1,133 @@
+
+#include "shm.h"
+
+// POSIX
+#include <errno.h>     // errno
+#include <sys/mman.h>  // mmap, munmap
+#include <sys/stat.h>  // fstat
+
+// Standard C
+#include <string.h>    // strerror
+
+// Standard C++
+#include <cassert>
+#include <sstream>
+#include <stdexcept>   // std::runtime_error
+
+const size_t SharedMemory::HEADER_BYTES;
+
+SharedMemory::SharedMemory(int fileDescriptor)
+: base(0)
+, size(0)
+, ringBegin(0)
+, ringSize(0)
+, head(0)
+, tail(0)
+, reserved(0)
+, released(0)
+{
+    struct stat status;
+    if (fstat(fileDescriptor, &status)) {
+        std::ostringstream message;
+        message << "Unable to examine shared memory file descriptor "
+                << fileDescriptor << ": " << strerror(errno);
+        throw std::runtime_error(message.str());
+    }
+
+    size      = status.st_size;
+    ringBegin = size / 2;
+    ringSize  = size - ringBegin;
+    if (ringBegin <= HEADER_BYTES) {
+        std::ostringstream message;
+        message << "Shared memory of " << size << " bytes is too small. It "
+                   "must be larger than " << 2 * HEADER_BYTES + 1 << " bytes.";
+        throw std::runtime_error(message.str());
+    }
+
+    void *const address = mmap(0,
+                               size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED,
+                               fileDescriptor,
+                               0);
+    if (address == MAP_FAILED) {
+        std::ostringstream message;
+        message << "Unable to map shared memory file descriptor "
+                << fileDescriptor << ": " << strerror(errno);
+        throw std::runtime_error(message.str());
+    }
+
+    base = static_cast<char*>(address);
+}
+
+SharedMemory::~SharedMemory()
+{
+    munmap(base, size);
+}
+
+const char *SharedMemory::userBytes(unsigned long long offset,
+                                    unsigned long long count) const
+{
+    if (offset < HEADER_BYTES || offset > ringBegin ||
+        count > ringBegin - offset)
+    {
+        return 0;
+    }
+
+    return base + offset;
+}
+
+size_t SharedMemory::ringCapacity() const
+{
+    return ringSize;
+}
+
+char *SharedMemory::reserve(size_t count)
+{
+    // The user may have released messages since we last looked.  A count
+    // that goes backward or beyond the messages in the ring can only be a
+    // mistake, and is ignored.
+    const unsigned long long releasedNow =
+        __atomic_load_n(reinterpret_cast<unsigned long long*>(base),
+                        __ATOMIC_ACQUIRE);
+    if (releasedNow > released && releasedNow - released <= ends.size()) {
+        for (; released != releasedNow; ++released) {
+            tail = ends.front();
+            ends.pop_front();
+        }
+    }
+
+    if (count > ringSize)
+        return 0;
+
+    if (ends.empty())
+        head = tail = 0;  // start again at the beginning
+
+    // The message goes after the newest one, or else at the beginning of the
+    // ring, but never past the oldest one.  Note that if 'head == tail' and
+    // there are messages, then the ring is full.
+    if (ends.empty())
+        reserved = 0;
+    else if (head > tail && head + count <= ringSize)
+        reserved = head;
+    else if (head > tail && count <= tail)
+        reserved = 0;
+    else if (head < tail && head + count <= tail)
+        reserved = head;
+    else
+        return 0;
+
+    return base + ringBegin + reserved;
+}
+
+unsigned long long SharedMemory::commit(size_t count)
+{
+    assert(reserved + count <= ringSize);
+
+    head = reserved + count;
+    if (head == ringSize)
+        head = 0;
+
+    ends.push_back(head);
+    return ringBegin + reserved;
+}
@@ -0,0 +1,81 @@
+#ifndef INCLUDED_SHM
+#define INCLUDED_SHM
+
+// Standard C
+#include <stddef.h>  // size_t
+
+// Standard C++
+#include <deque>
+
+class SharedMemory {
+    // 'SharedMemory' is a file (typically a 'memfd') that is mapped both into
+    // this process and into the user's, so that message payloads can pass
+    // between them without going through standard input and output.  The
+    // file is divided into three parts:
+    //
+    //: o a 'HEADER_BYTES' byte header, of which the first eight bytes are the
+    //:   "released" count (see below), a native-endian unsigned integer that
+    //:   only the user writes,
+    //: o the user's part, which is the rest of the first half of the file,
+    //:   where the user puts messages to be sent, and
+    //: o the ring, which is the second half of the file (starting at half of
+    //:   the file's size, rounded down), where received messages are put.
+    //
+    // Messages are put in the ring in order, each in contiguous bytes, and
+    // wrapping around to the beginning of the ring when a message won't fit
+    // at the end.  The user frees the space of the messages that it is done
+    // with, in the same order, by storing into the released count the number
+    // of messages that it has been done with so far.  Offsets are from the
+    // beginning of the file.
+    //
+    // This class is not thread-safe.
+
+    char               *base;
+    size_t              size;
+    size_t              ringBegin;     // offset of the ring in the file
+    size_t              ringSize;
+    // Positions in the ring, relative to 'ringBegin'.
+    size_t              head;          // just past the newest message
+    size_t              tail;          // the oldest unreleased message
+    size_t              reserved;      // where 'reserve' would put one
+    std::deque<size_t>  ends;          // just past each unreleased message
+
+    unsigned long long  released;      // released count as last loaded
+
+    SharedMemory(const SharedMemory&);             // not copyable
+    SharedMemory& operator=(const SharedMemory&);  // not assignable
+
+  public:
+    // Bytes at the beginning of the file that are not for messages.
+    static const size_t HEADER_BYTES = 64;
+
+    explicit SharedMemory(int fileDescriptor);
+        // Create a 'SharedMemory' that maps the whole of the file open as the
+        // specified 'fileDescriptor'.  Throw 'std::runtime_error' if the file
+        // cannot be mapped, or if it is too small to be divided as described
+        // above.  Note that the file descriptor is not closed.
+
+    ~SharedMemory();
+
+    const char *userBytes(unsigned long long offset,
+                          unsigned long long count) const;
+        // Return a pointer to the specified 'count' bytes at the specified
+        // 'offset', or null unless they are within the user's part.
+
+    size_t ringCapacity() const;
+        // Return the size of the largest message that the ring can hold.
+
+    char *reserve(size_t count);
+        // Return a pointer to the specified 'count' contiguous free bytes at
+        // which the next message would go, or null if the ring doesn't have
+        // room for them (even counting what the user has since released).
+        // The bytes remain free until 'commit'.
+
+    unsigned long long commit(size_t count);
+        // Put into the ring the message of the specified 'count' bytes that
+        // is at the pointer most recently returned by 'reserve', and return
+        // the message's offset.  The behavior is undefined unless 'count' is
+        // at most the 'count' that was passed to 'reserve'.
+};
+
+#endif
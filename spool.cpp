@@ -0,0 +1,200 @@
+#include "spool.h"
+
+// POSIX
+#include <errno.h>     // errno
+#include <fcntl.h>     // posix_fallocate
+#include <sys/mman.h>  // mmap, munmap
+#include <unistd.h>    // close, unlink, sysconf
+
+// Standard C
+#include <stdlib.h>    // mkstemp
+#include <string.h>    // memcpy
+
+// Standard C++
+#include <algorithm>   // std::find, std::max
+#include <cassert>
+
+namespace {
+
+// Segments are at least this big, so that few files are created.
+const size_t MIN_SEGMENT_SIZE = 4 * 1024 * 1024;
+
+// Records begin at multiples of this, so that their headers are aligned.
+const size_t RECORD_ALIGNMENT = 8;
+
+struct RecordHeader {
+    unsigned           priority;
+    unsigned           reserved;
+    unsigned long long size;
+};
+
+}  // close unnamed namespace
+
+const size_t Spool::RECORD_OVERHEAD;
+
+size_t Spool::recordSize(size_t messageSize)
+{
+    return (RECORD_OVERHEAD + messageSize + RECORD_ALIGNMENT - 1) /
+           RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+}
+
+Spool::Spool(const std::string& directory, size_t maxMessageSize)
+: directory(directory)
+, segmentSize(0)
+, spare(0)
+, hasCurrent(false)
+, stored(0)
+{
+    assert(sizeof(RecordHeader) == RECORD_OVERHEAD);
+
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t wanted   = std::max(MIN_SEGMENT_SIZE,
+                                     recordSize(maxMessageSize));
+    segmentSize = (wanted + pageSize - 1) / pageSize * pageSize;
+
+    current.segment = 0;
+    current.offset  = 0;
+}
+
+Spool::~Spool()
+{
+    if (spare)
+        segments.push_back(spare);
+
+    for (std::vector<Segment*>::iterator it = segments.begin();
+         it != segments.end();
+         ++it)
+    {
+        munmap((*it)->base, segmentSize);
+        delete *it;
+    }
+}
+
+int Spool::addSegment()
+{
+    if (spare) {
+        segments.push_back(spare);
+        spare = 0;
+        return 0;
+    }
+
+    std::string path = directory + "/mq-spool-XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd == -1)
+        return errno;
+
+    // Nobody else needs the file, and it mustn't outlive this process.
+    unlink(path.c_str());
+
+    if (const int error = posix_fallocate(fd, 0, segmentSize)) {
+        close(fd);
+        return error;
+    }
+
+    void *const address =
+        mmap(0, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int error = errno;
+    close(fd);  // the mapping keeps the file
+    if (address == MAP_FAILED)
+        return error;
+
+    Segment *const segment = new Segment();
+    segment->base = static_cast<char*>(address);
+    segment->used = 0;
+    segment->live = 0;
+    segments.push_back(segment);
+    return 0;
+}
+
+void Spool::release(Segment *segment)
+{
+    assert(segment->live == 0);
+
+    segment->used = 0;
+
+    // The segment being appended to stays, empty.
+    if (segment == segments.back())
+        return;
+
+    segments.erase(std::find(segments.begin(), segments.end(), segment));
+    if (!spare) {
+        spare = segment;
+        return;
+    }
+
+    munmap(segment->base, segmentSize);
+    delete segment;
+}
+
+int Spool::append(unsigned priority, const char *data, size_t size)
+{
+    const size_t total = recordSize(size);
+    assert(total <= segmentSize);
+
+    if (segments.empty() || segments.back()->used + total > segmentSize) {
+        if (const int error = addSegment())
+            return error;
+    }
+
+    Segment *const segment = segments.back();
+
+    RecordHeader header;
+    header.priority = priority;
+    header.reserved = 0;
+    header.size     = size;
+
+    char *const record = segment->base + segment->used;
+    memcpy(record, &header, sizeof header);
+    memcpy(record + sizeof header, data, size);
+
+    const Record entry = { segment, segment->used };
+    index[priority].push_back(entry);
+
+    segment->used += total;
+    ++segment->live;
+    stored += total;
+    return 0;
+}
+
+bool Spool::front(unsigned& priority, const char *&data, size_t& size)
+{
+    if (!hasCurrent) {
+        if (index.empty())
+            return false;
+
+        const Index::iterator highest = index.begin();
+        current = highest->second.front();
+        highest->second.pop_front();
+        if (highest->second.empty())
+            index.erase(highest);
+
+        hasCurrent = true;
+    }
+
+    const char *const record = current.segment->base + current.offset;
+    RecordHeader      header;
+    memcpy(&header, record, sizeof header);
+
+    priority = header.priority;
+    data     = record + sizeof header;
+    size     = header.size;
+    return true;
+}
+
+void Spool::pop()
+{
+    assert(hasCurrent);
+
+    RecordHeader header;
+    memcpy(&header, current.segment->base + current.offset, sizeof header);
+
+    stored    -= recordSize(header.size);
+    hasCurrent = false;
+    if (--current.segment->live == 0)
+        release(current.segment);
+}
+
+size_t Spool::bytes() const
+{
+    return stored;
+}
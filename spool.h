@@ -0,0 +1,103 @@
+#ifndef INCLUDED_SPOOL
+#define INCLUDED_SPOOL
+
+// Standard C
+#include <stddef.h>  // size_t
+
+// Standard C++
+#include <deque>
+#include <functional>  // std::greater
+#include <map>
+#include <string>
+#include <vector>
+
+class Spool {
+    // 'Spool' stores messages in a log of memory-mapped files ("segments")
+    // in a directory, and gives them back in priority order, highest first,
+    // and in the order they were stored among messages of equal priority, as
+    // a message queue would.  Each segment is appended to until it's full,
+    // and is removed once every message in it has been taken, except that
+    // one emptied segment is kept for reuse.  The files are unlinked as soon
+    // as they are created, so that nothing is left behind however the
+    // process ends; the directory only says which file system holds them.
+    // Space for a segment is allocated when it is created, so that a full
+    // file system is an error from 'append' rather than a signal later.
+    //
+    // A message is taken by 'front' and removed only by 'pop', so that it
+    // can be sent (or tried again) after it's taken.  Until then, 'front'
+    // keeps returning the same message, even if one of higher priority is
+    // appended.  'Spool' is not thread-safe.
+
+    struct Segment {
+        char   *base;
+        size_t  used;  // bytes appended
+        size_t  live;  // messages not yet popped
+    };
+
+    struct Record {
+        Segment *segment;
+        size_t   offset;
+    };
+
+    typedef std::map<unsigned, std::deque<Record>, std::greater<unsigned> >
+                                                                   Index;
+
+    std::string            directory;
+    size_t                 segmentSize;
+    std::vector<Segment*>  segments;  // owned, oldest first
+    Segment               *spare;     // owned, emptied, or null
+    Index                  index;     // by priority, highest first
+    Record                 current;   // the message 'front' returned
+    bool                   hasCurrent;
+    size_t                 stored;    // bytes of records not yet popped
+
+    Spool(const Spool&);             // not copyable
+    Spool& operator=(const Spool&);  // not assignable
+
+    int addSegment();
+        // Make a new (or the spare) segment the one appended to.  Return zero
+        // on success or an 'errno' value otherwise.
+
+    void release(Segment *segment);
+        // Remove the specified 'segment', which has no messages left, keeping
+        // it as the spare if there isn't one.
+
+  public:
+    // Bytes that a segment has for each message, in addition to the message.
+    static const size_t RECORD_OVERHEAD = 16;
+
+    static size_t recordSize(size_t messageSize);
+        // Return the bytes that a segment has for a message of the specified
+        // 'messageSize' bytes.
+
+    Spool(const std::string& directory, size_t maxMessageSize);
+        // Create an empty 'Spool' whose segments are files in the specified
+        // 'directory', and which stores messages of up to the specified
+        // 'maxMessageSize' bytes.  No file is created until the first
+        // 'append'.
+
+    ~Spool();
+
+    int append(unsigned priority, const char *data, size_t size);
+        // Store the message having the specified 'priority' and the specified
+        // 'size' bytes at the specified 'data'.  Return zero on success or an
+        // 'errno' value otherwise.  The behavior is undefined unless 'size'
+        // is at most the maximum message size.
+
+    bool front(unsigned& priority, const char *&data, size_t& size);
+        // Load the priority, the address, and the size of the message that
+        // is to be taken next into the specified 'priority', 'data', and
+        // 'size', and return 'true', or return 'false' if there are no
+        // messages.  The message stays where it is until 'pop', and is the
+        // one returned until then.
+
+    void pop();
+        // Remove the message that 'front' returned.  The behavior is
+        // undefined unless 'front' returned 'true' since the last 'pop'.
+
+    size_t bytes() const;
+        // Return the bytes of the records of the messages stored, i.e. the
+        // sum of 'recordSize' of their sizes.
+};
+
+#endif
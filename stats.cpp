@@ -0,0 +1,117 @@
+
+#include "stats.h"
+
+// POSIX
+#include <time.h>   // clock_gettime
+
+// Standard C
+#include <stdio.h>  // snprintf
+
+// Standard C++
+#include <cassert>
+
+namespace {
+
+const char *const COUNTER_NAMES[Stats::NUM_COUNTERS] = {
+    "sent",
+    "sent_bytes",
+    "received",
+    "received_bytes",
+    "interrupted",
+    "stalled",
+    "partial_writes"
+};
+
+const char *const TIMER_NAMES[Stats::NUM_TIMERS] = {
+    "send_ns",
+    "receive_ns",
+    "write_ns",
+    "transit_ns"
+};
+
+int bucketOf(unsigned long long nanoseconds)
+    // Return the histogram bucket that counts the specified 'nanoseconds'.
+{
+    // One more than the index of the highest set bit, or zero if none is.
+    return nanoseconds ? 64 - __builtin_clzll(nanoseconds) : 0;
+}
+
+}  // close unnamed namespace
+
+Stats::Stats()
+{
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+        counters[i] = 0;
+
+    for (int i = 0; i < NUM_TIMERS; ++i) {
+        for (int j = 0; j < NUM_BUCKETS; ++j)
+            buckets[i][j] = 0;
+    }
+}
+
+long long Stats::now()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void Stats::add(Counter counter, unsigned long long amount)
+{
+    assert(counter >= 0 && counter < NUM_COUNTERS);
+    __atomic_fetch_add(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+void Stats::record(Timer timer, long long startedAt)
+{
+    assert(timer >= 0 && timer < NUM_TIMERS);
+
+    const long long elapsed = now() - startedAt;
+    int             bucket  = bucketOf(elapsed > 0 ? elapsed : 0);
+    if (bucket >= NUM_BUCKETS)
+        bucket = NUM_BUCKETS - 1;
+
+    __atomic_fetch_add(&buckets[timer][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void Stats::formatHistogram(std::string& value, Timer timer) const
+{
+    assert(timer >= 0 && timer < NUM_TIMERS);
+
+    char field[64];
+    bool first = true;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+        const unsigned long long count =
+            __atomic_load_n(&buckets[timer][i], __ATOMIC_RELAXED);
+        if (!count)
+            continue;
+
+        snprintf(field, sizeof field, "%s%llu:%llu",
+                 first ? "" : ",",
+                 1ULL << i,
+                 count);
+        value += field;
+        first = false;
+    }
+}
+
+void Stats::format(std::string& line) const
+{
+    line.clear();
+
+    char field[64];
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        snprintf(field, sizeof field, "%s%s=%llu",
+                 i ? " " : "",
+                 COUNTER_NAMES[i],
+                 __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+        line += field;
+    }
+
+    for (int i = 0; i < NUM_TIMERS; ++i) {
+        line += ' ';
+        line += TIMER_NAMES[i];
+        line += '=';
+        formatHistogram(line, Timer(i));
+    }
+}
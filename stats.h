@@ -0,0 +1,78 @@
+#ifndef INCLUDED_STATS
+#define INCLUDED_STATS
+
+// Standard C
+#include <stddef.h>  // size_t
+
+// Standard C++
+#include <string>
+
+class Stats {
+    // 'Stats' is a set of counters and latency histograms that are cheap
+    // enough to update on every message.  Each update is a single relaxed
+    // atomic addition, so no lock is taken, and a snapshot taken while
+    // updates are happening is consistent per number but not across numbers.
+    // A histogram has a bucket per power of two nanoseconds: bucket zero
+    // counts durations of zero, and bucket 'i' (for 'i > 0') counts durations
+    // of at least '2^(i-1)' but less than '2^i' nanoseconds.  All member
+    // functions are thread-safe.
+
+  public:
+    enum Counter {
+        SENT,            // messages put in a queue
+        SENT_BYTES,
+        RECEIVED,        // messages taken from a queue
+        RECEIVED_BYTES,
+        INTERRUPTED,     // system calls retried after 'EINTR'
+        STALLED,         // sends that found the queue full
+        PARTIAL_WRITES,  // writes to stdout that wrote less than asked
+        NUM_COUNTERS
+    };
+
+    enum Timer {
+        SEND,            // 'mq_send' and 'mq_timedsend'
+        RECEIVE,         // 'mq_receive' and 'mq_timedreceive'
+        WRITE,           // 'writev' and 'vmsplice' to stdout
+        TRANSIT,         // "probe" markers, from being sent to received
+        NUM_TIMERS
+    };
+
+    enum { NUM_BUCKETS = 64 };
+
+  private:
+    unsigned long long counters[NUM_COUNTERS];
+    unsigned long long buckets[NUM_TIMERS][NUM_BUCKETS];
+
+    Stats(const Stats&);             // not copyable
+    Stats& operator=(const Stats&);  // not assignable
+
+  public:
+    Stats();
+        // Create a 'Stats' having all counters and buckets zero.
+
+    static long long now();
+        // Return the current 'CLOCK_MONOTONIC' time in nanoseconds, as the
+        // start of a duration to be passed to 'record'.
+
+    void add(Counter counter, unsigned long long amount = 1);
+        // Add the optionally specified 'amount' to the specified 'counter'.
+
+    void record(Timer timer, long long startedAt);
+        // Count, in the histogram of the specified 'timer', the duration
+        // from the specified 'startedAt' (as returned by 'now') until now.
+
+    void formatHistogram(std::string& value, Timer timer) const;
+        // Append to the specified 'value' a snapshot of the histogram of the
+        // specified 'timer', as a comma-separated list of "<bound>:<count>"
+        // for each nonzero bucket, '<bound>' being the bucket's exclusive
+        // upper bound in nanoseconds.  Append nothing if all buckets are
+        // zero.
+
+    void format(std::string& line) const;
+        // Load into the specified 'line' a snapshot of all counters and
+        // histograms, as space-separated "<name>=<value>" pairs, where the
+        // value of a histogram is as 'formatHistogram' appends it.  There is
+        // no trailing newline.
+};
+
+#endif